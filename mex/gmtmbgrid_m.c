@@ -151,70 +151,82 @@ struct GRD_HEADER {
 }; 
 
 int verbose = FALSE;
-static int npoints=0;			/* Number of data points */
-static int nx=0;			/* Number of nodes in x-dir. */
-static int ny=0;			/* Number of nodes in y-dir. (Final grid) */
-static int mx = 0;
-static int my = 0;
-static int ij_sw_corner, ij_se_corner, ij_nw_corner, ij_ne_corner;
-static int block_nx;			/* Number of nodes in x-dir for a given grid factor */
-static int block_ny;			/* Number of nodes in y-dir for a given grid factor */
-static int max_iterations=250;		/* Max iter per call to iterate */
-static int total_iterations = 0;
-static int grid, old_grid;		/* Node spacings  */
-static int grid_east;
-static int n_fact = 0;			/* Number of factors in common (ny-1, nx-1) */
-static int factors[32];		/* Array of common factors */
-static int n_empty;			/* No of unconstrained nodes at initialization  */
-static int set_low = 0;		/* 0 unconstrained,1 = by min data value, 2 = by user value */
-static int set_high = 0;		/* 0 unconstrained,1 = by max data value, 2 = by user value */
-static int constrained = FALSE;	/* TRUE if set_low or set_high is TRUE */
-static double low_limit, high_limit;	/* Constrains on range of solution */
-static double xmin, xmax, ymin, ymax;	/* minmax coordinates */
-static float *lower, *upper;		/* arrays for minmax values, if set */
-static double xinc, yinc;		/* Size of each grid cell (final size) */
-static double grid_xinc, grid_yinc;	/* size of each grid cell for a given grid factor */
-static double r_xinc, r_yinc, r_grid_xinc, r_grid_yinc;	/* Reciprocals  */
-static double converge_limit = 0.0;	/* Convergence limit */
-static double radius = 0.0;			/* Search radius for initializing grid  */
-static double	tension = 0.0;
-static double	boundary_tension = 0.0;
-static double	interior_tension = 0.0;
-static double	a0_const_1, a0_const_2;	/* Constants for off grid point equation  */
-static double	e_2, e_m2, one_plus_e2;
-static double	eps_p2, eps_m2, two_plus_ep2, two_plus_em2;
-static double	x_edge_const, y_edge_const;
-static double	epsilon = 1.0;
-static double	z_mean;
-static double	z_scale = 1.0;		/* Root mean square range of z after removing planar trend  */
-static double	r_z_scale = 1.0;	/* reciprocal of z_scale  */
-static double	plane_c0, plane_c1, plane_c2;	/* Coefficients of best fitting plane to data  */
-static double small;			/* Let data point coincide with node if distance < small */
-static float *u;			/* Pointer to grid array */
-static char *iu;			/* Pointer to grid info array */
+struct SURFACE_CTX {		/* Everything about one mb_surface() call. Nothing is shared between two of them */
+	int npoints;			/* Number of data points */
+	int nx;				/* Number of nodes in x-dir. */
+	int ny;				/* Number of nodes in y-dir. (Final grid) */
+	int mx;
+	int my;
+	int ij_sw_corner, ij_se_corner, ij_nw_corner, ij_ne_corner;
+	int block_nx;			/* Number of nodes in x-dir for a given grid factor */
+	int block_ny;			/* Number of nodes in y-dir for a given grid factor */
+	int max_iterations;		/* Max iter per call to iterate */
+	int total_iterations;
+	int grid, old_grid;		/* Node spacings  */
+	int grid_east;
+	int n_fact;			/* Number of factors in common (ny-1, nx-1) */
+	int factors[32];		/* Array of common factors */
+	int verbose;
+	int n_empty;			/* No of unconstrained nodes at initialization  */
+	int set_low;			/* 0 unconstrained,1 = by min data value, 2 = by user value */
+	int set_high;			/* 0 unconstrained,1 = by max data value, 2 = by user value */
+	int constrained;		/* TRUE if set_low or set_high is TRUE */
+	double low_limit, high_limit;	/* Constrains on range of solution */
+	double xmin, xmax, ymin, ymax;	/* minmax coordinates */
+	float *lower, *upper;		/* arrays for minmax values, if set */
+	double xinc, yinc;		/* Size of each grid cell (final size) */
+	double grid_xinc, grid_yinc;	/* size of each grid cell for a given grid factor */
+	double r_xinc, r_yinc, r_grid_xinc, r_grid_yinc;	/* Reciprocals  */
+	double converge_limit;		/* Convergence limit */
+	double radius;			/* Search radius for initializing grid  */
+	double	tension;
+	double	boundary_tension;
+	double	interior_tension;
+	double	a0_const_1, a0_const_2;	/* Constants for off grid point equation  */
+	double	e_2, e_m2, one_plus_e2;
+	double	eps_p2, eps_m2, two_plus_ep2, two_plus_em2;
+	double	x_edge_const, y_edge_const;
+	double	epsilon;
+	double	z_mean;
+	double	z_scale;		/* Root mean square range of z after removing planar trend  */
+	double	r_z_scale;		/* reciprocal of z_scale  */
+	double	plane_c0, plane_c1, plane_c2;	/* Coefficients of best fitting plane to data  */
+	double	small;			/* Let data point coincide with node if distance < small */
+	double	relax_old, relax_new;	/* Coefficients for relaxation factor to speed up convergence */
+	double	coeff[2][12];		/* Coefficients for 12 nearby points, constrained and unconstrained  */
+	int	offset[25][12];		/* Indices of 12 nearby points in 25 cases of edge conditions  */
+	float	*u;			/* Pointer to grid array */
+	char	*iu;			/* Pointer to grid info array */
+	struct SURFACE_DATA *data;	/* Data point and index to node it currently constrains  */
+	struct SURFACE_BRIGGS *briggs;	/* Coefficients in Taylor series for Laplacian(z) a la I. C. Briggs (1974)  */
+};
+
 static char mode_type[2] = {'I','D'};	/* D means include data points when iterating
 				 	* I means just interpolate from larger grid */
 
-static int	offset[25][12];		/* Indices of 12 nearby points in 25 cases of edge conditions  */
-static double	coeff[2][12];		/* Coefficients for 12 nearby points, constrained and unconstrained  */
-
-static double relax_old, relax_new = 1.4;	/* Coefficients for relaxation factor to speed up convergence */
-
+/* qsort gives no way to pass the context to compare_points, so it is set right before each sort */
+static struct SURFACE_CTX *C_sort;
+#if HAVE_OPENMP
+#pragma omp threadprivate(C_sort)
+#endif
 
 int mb_zgrid(float *z, int *nx, int *ny, float *x1, float *y1, float *dx, float *dy, float *xyz, 
 		int *n, float *zpij, int *knxt, int *imnew, float *cay, int *nrng);
 int mb_surface(int verbose, int ndat, float *xdat, float *ydat, float *zdat,
 		double xxmin, double xxmax, double yymin, double yymax, double xxinc, double yyinc,
 		double ttension, float *sgrid);
-int read_data(int ndat, float *xdat, float *ydat, float *zdat);
+int read_data(struct SURFACE_CTX *C, int ndat, float *xdat, float *ydat, float *zdat);
 int gcd_euclid(int a, int b);	/* Finds the greatest common divisor  */
-int get_prime_factors(int n, int *f), iterate(int mode);
+int get_prime_factors(int n, int *f), iterate(struct SURFACE_CTX *C, int mode);
 int compare_points (const void *point_1v, const void *point_2v);
-void set_grid_parameters(void), throw_away_unusables(void), remove_planar_trend(void), rescale_z_values(void);
-void load_constraints(char *low, char *high), smart_divide(void), set_offset(void), set_index(void), initialize_grid(void), set_coefficients(void);
-void find_nearest_point(void), fill_in_forecast(void), check_errors(void), replace_planar_trend(void);
-void new_initialize_grid(void);
-void get_output(float *sgrid);
+void set_grid_parameters(struct SURFACE_CTX *C), throw_away_unusables(struct SURFACE_CTX *C);
+void remove_planar_trend(struct SURFACE_CTX *C), rescale_z_values(struct SURFACE_CTX *C);
+void load_constraints(struct SURFACE_CTX *C, char *low, char *high), smart_divide(struct SURFACE_CTX *C);
+void set_offset(struct SURFACE_CTX *C), set_index(struct SURFACE_CTX *C), initialize_grid(struct SURFACE_CTX *C);
+void set_coefficients(struct SURFACE_CTX *C), find_nearest_point(struct SURFACE_CTX *C);
+void fill_in_forecast(struct SURFACE_CTX *C), check_errors(struct SURFACE_CTX *C), replace_planar_trend(struct SURFACE_CTX *C);
+void new_initialize_grid(struct SURFACE_CTX *C);
+void get_output(struct SURFACE_CTX *C, float *sgrid);
 
 int decode_R (char *item, double *w, double *e, double *s, double *n);
 int check_region (double w, double e, double s, double n);
@@ -225,8 +237,6 @@ int GMT_strtok (const char *string, const char *sep, int *pos, char *token);
 void GMT_RI_prepare (struct GRD_HEADER *h);
 
 struct GRD_HEADER h;
-static struct SURFACE_DATA *data;	/* Data point and index to node it currently constrains  */
-static struct SURFACE_BRIGGS *briggs;	/* Coefficients in Taylor series for Laplacian(z) a la I. C. Briggs (1974)  */
 
 int GMT_inc_code[2] = {0, 0};
 
@@ -257,6 +267,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 	int	grdrasterid = 0;
 
 	/* grid variables */
+	double	tension = 0.0;
 	double	wbnd[4], xx, yy, xx2, factor, weight, zmin, zmax, zclip;
 	int	gxdim, gydim, offx, offy, xtradim;
 	double	*grid = NULL, *norm = NULL;
@@ -1792,38 +1803,46 @@ int mb_surface(int verbose, int ndat, float *xdat, float *ydat, float *zdat,
 	/* int	size_query = FALSE; */
 	int	serror = FALSE;
 	char	low[100], high[100];
+	struct SURFACE_CTX ctx, *C = &ctx;
+
+	memset ((void *)C, 0, sizeof (struct SURFACE_CTX));
+	C->max_iterations = 250;
+	C->epsilon = 1.0;
+	C->z_scale = C->r_z_scale = 1.0;
+	C->relax_new = 1.4;
+	C->verbose = verbose;
 
 	/* copy parameters */
-	xmin = xxmin;
-	xmax = xxmax;
-	ymin = yymin;
-	ymax = yymax;
-	xinc = xxinc;
-	yinc = yyinc;
-	tension = ttension;
-	total_iterations = 0;
+	C->xmin = xxmin;
+	C->xmax = xxmax;
+	C->ymin = yymin;
+	C->ymax = yymax;
+	C->xinc = xxinc;
+	C->yinc = yyinc;
+	C->tension = ttension;
+	C->total_iterations = 0;
 
 	/* New in v4.3:  Default to unconstrained:  */
-	set_low = set_high = 0; 
+	C->set_low = C->set_high = 0; 
 	
-	if (xmin >= xmax || ymin >= ymax) serror = TRUE;
-	if (xinc <= 0.0 || yinc <= 0.0) serror = TRUE;
+	if (C->xmin >= C->xmax || C->ymin >= C->ymax) serror = TRUE;
+	if (C->xinc <= 0.0 || C->yinc <= 0.0) serror = TRUE;
 
-	if (tension != 0.0) {
-		boundary_tension = tension;
-		interior_tension = tension;
+	if (C->tension != 0.0) {
+		C->boundary_tension = C->tension;
+		C->interior_tension = C->tension;
 	}
-	relax_old = 1.0 - relax_new;
+	C->relax_old = 1.0 - C->relax_new;
 
-	nx = irint((xmax - xmin)/xinc) + 1;
-	ny = irint((ymax - ymin)/yinc) + 1;
-	mx = nx + 4;
-	my = ny + 4;
-	r_xinc = 1.0 / xinc;
-	r_yinc = 1.0 / yinc;
+	C->nx = irint((C->xmax - C->xmin)/C->xinc) + 1;
+	C->ny = irint((C->ymax - C->ymin)/C->yinc) + 1;
+	C->mx = C->nx + 4;
+	C->my = C->ny + 4;
+	C->r_xinc = 1.0 / C->xinc;
+	C->r_yinc = 1.0 / C->yinc;
 
 	/* New stuff here for v4.3:  Check out the grid dimensions:  */
-	grid = gcd_euclid(nx-1, ny-1);
+	C->grid = gcd_euclid(C->nx-1, C->ny-1);
 
 	/*
 	if (gmtdefs.verbose || size_query || grid == 1) fprintf (stderr, "W: %.3lf E: %.3lf S: %.3lf N: %.3lf nx: %d ny: %d\n",
@@ -1837,148 +1856,148 @@ int mb_surface(int verbose, int ndat, float *xdat, float *ydat, float *zdat,
 		away data that can't be used in end game, constraining
 		size of briggs->b[6] structure.  */
 	
-	grid = 1;
-	set_grid_parameters();
-	read_data(ndat,xdat,ydat,zdat);
-	throw_away_unusables();
-	remove_planar_trend();
-	rescale_z_values();
-	load_constraints(low, high);
+	C->grid = 1;
+	set_grid_parameters(C);
+	read_data(C, ndat,xdat,ydat,zdat);
+	throw_away_unusables(C);
+	remove_planar_trend(C);
+	rescale_z_values(C);
+	load_constraints(C, low, high);
 	
 	/* Set up factors and reset grid to first value  */
 	
-	grid = gcd_euclid(nx-1, ny-1);
-	n_fact = get_prime_factors(grid, factors);
-	set_grid_parameters();
-	while ( block_nx < 4 || block_ny < 4 ) {
-		smart_divide();
-		set_grid_parameters();
-	}
-	set_offset();
-	set_index();
+	C->grid = gcd_euclid(C->nx-1, C->ny-1);
+	C->n_fact = get_prime_factors(C->grid, C->factors);
+	set_grid_parameters(C);
+	while ( C->block_nx < 4 || C->block_ny < 4 ) {
+		smart_divide(C);
+		set_grid_parameters(C);
+	}
+	set_offset(C);
+	set_index(C);
 	/* Now the data are ready to go for the first iteration.  */
 
 	/* Allocate more space  */
 	
-	briggs = (struct SURFACE_BRIGGS *) mxCalloc ((size_t)npoints, sizeof(struct SURFACE_BRIGGS));
-	iu = (char *) mxCalloc ((size_t)(mx * my), sizeof(char));
-	u = (float *) mxCalloc ((size_t)(mx * my), sizeof(float));
+	C->briggs = (struct SURFACE_BRIGGS *) mxCalloc ((size_t)C->npoints, sizeof(struct SURFACE_BRIGGS));
+	C->iu = (char *) mxCalloc ((size_t)(C->mx * C->my), sizeof(char));
+	C->u = (float *) mxCalloc ((size_t)(C->mx * C->my), sizeof(float));
 
-	if (radius > 0) initialize_grid(); /* Fill in nodes with a weighted avg in a search radius  */
+	if (C->radius > 0) initialize_grid(C); /* Fill in nodes with a weighted avg in a search radius  */
 
 	if (verbose) mexPrintf("Grid\tMode\tIteration\tMax Change\tConv Limit\tTotal Iterations\n");
 	
-	set_coefficients();
+	set_coefficients(C);
 	
-	old_grid = grid;
-	find_nearest_point ();
-	iterate (1);
+	C->old_grid = C->grid;
+	find_nearest_point (C);
+	iterate (C, 1);
 	 
-	while (grid > 1) {
-		smart_divide ();
-		set_grid_parameters();
-		set_offset();
-		set_index ();
-		fill_in_forecast ();
-		iterate(0);
-		old_grid = grid;
-		find_nearest_point ();
-		iterate (1);
+	while (C->grid > 1) {
+		smart_divide (C);
+		set_grid_parameters(C);
+		set_offset(C);
+		set_index (C);
+		fill_in_forecast (C);
+		iterate(C, 0);
+		C->old_grid = C->grid;
+		find_nearest_point (C);
+		iterate (C, 1);
 	}
 	
-	if (verbose) check_errors ();
+	if (verbose) check_errors (C);
 
-	replace_planar_trend();
+	replace_planar_trend(C);
 
-	get_output(sgrid);
+	get_output(C, sgrid);
 
-	mxFree ((void *) data);
-	mxFree ((void *) briggs);
-	mxFree ((void *) iu);
-	mxFree ((void *) u);
-	if (set_low) mxFree ((void *)lower);
-	if (set_high) mxFree ((void *)upper);
+	mxFree ((void *) C->data);
+	mxFree ((void *) C->briggs);
+	mxFree ((void *) C->iu);
+	mxFree ((void *) C->u);
+	if (C->set_low) mxFree ((void *) C->lower);
+	if (C->set_high) mxFree ((void *) C->upper);
 
 	return(0);
 }
 
-void	set_coefficients() {
+void	set_coefficients(struct SURFACE_CTX *C) {
 
 	double	e_4, loose, a0;
 	
-	loose = 1.0 - interior_tension;
-	e_2 = epsilon * epsilon;
-	e_4 = e_2 * e_2;
-	eps_p2 = e_2;
-	eps_m2 = 1.0/e_2;
-	one_plus_e2 = 1.0 + e_2;
-	two_plus_ep2 = 2.0 + 2.0*eps_p2;
-	two_plus_em2 = 2.0 + 2.0*eps_m2;
+	loose = 1.0 - C->interior_tension;
+	C->e_2 = C->epsilon * C->epsilon;
+	e_4 = C->e_2 * C->e_2;
+	C->eps_p2 = C->e_2;
+	C->eps_m2 = 1.0/C->e_2;
+	C->one_plus_e2 = 1.0 + C->e_2;
+	C->two_plus_ep2 = 2.0 + 2.0*C->eps_p2;
+	C->two_plus_em2 = 2.0 + 2.0*C->eps_m2;
 	
-	x_edge_const = 4 * one_plus_e2 - 2 * (interior_tension / loose);
-	e_m2 = 1.0 / e_2;
-	y_edge_const = 4 * (1.0 + e_m2) - 2 * (interior_tension * e_m2 / loose);
+	C->x_edge_const = 4 * C->one_plus_e2 - 2 * (C->interior_tension / loose);
+	C->e_m2 = 1.0 / C->e_2;
+	C->y_edge_const = 4 * (1.0 + C->e_m2) - 2 * (C->interior_tension * C->e_m2 / loose);
 
 	
-	a0 = 1.0 / ( (6 * e_4 * loose + 10 * e_2 * loose + 8 * loose - 2 * one_plus_e2) + 4*interior_tension*one_plus_e2);
-	a0_const_1 = 2 * loose * (1.0 + e_4);
-	a0_const_2 = 2.0 - interior_tension + 2 * loose * e_2;
+	a0 = 1.0 / ( (6 * e_4 * loose + 10 * C->e_2 * loose + 8 * loose - 2 * C->one_plus_e2) + 4*C->interior_tension*C->one_plus_e2);
+	C->a0_const_1 = 2 * loose * (1.0 + e_4);
+	C->a0_const_2 = 2.0 - C->interior_tension + 2 * loose * C->e_2;
 	
-	coeff[1][4] = coeff[1][7] = -loose;
-	coeff[1][0] = coeff[1][11] = -loose * e_4;
-	coeff[0][4] = coeff[0][7] = -loose * a0;
-	coeff[0][0] = coeff[0][11] = -loose * e_4 * a0;
-	coeff[1][5] = coeff[1][6] = 2 * loose * one_plus_e2;
-	coeff[0][5] = coeff[0][6] = (2 * coeff[1][5] + interior_tension) * a0;
-	coeff[1][2] = coeff[1][9] = coeff[1][5] * e_2;
-	coeff[0][2] = coeff[0][9] = coeff[0][5] * e_2;
-	coeff[1][1] = coeff[1][3] = coeff[1][8] = coeff[1][10] = -2 * loose * e_2;
-	coeff[0][1] = coeff[0][3] = coeff[0][8] = coeff[0][10] = coeff[1][1] * a0;
+	C->coeff[1][4] = C->coeff[1][7] = -loose;
+	C->coeff[1][0] = C->coeff[1][11] = -loose * e_4;
+	C->coeff[0][4] = C->coeff[0][7] = -loose * a0;
+	C->coeff[0][0] = C->coeff[0][11] = -loose * e_4 * a0;
+	C->coeff[1][5] = C->coeff[1][6] = 2 * loose * C->one_plus_e2;
+	C->coeff[0][5] = C->coeff[0][6] = (2 * C->coeff[1][5] + C->interior_tension) * a0;
+	C->coeff[1][2] = C->coeff[1][9] = C->coeff[1][5] * C->e_2;
+	C->coeff[0][2] = C->coeff[0][9] = C->coeff[0][5] * C->e_2;
+	C->coeff[1][1] = C->coeff[1][3] = C->coeff[1][8] = C->coeff[1][10] = -2 * loose * C->e_2;
+	C->coeff[0][1] = C->coeff[0][3] = C->coeff[0][8] = C->coeff[0][10] = C->coeff[1][1] * a0;
 	
-	e_2 *= 2;		/* We will need these in boundary conditions  */
-	e_m2 *= 2;
+	C->e_2 *= 2;		/* We will need these in boundary conditions  */
+	C->e_m2 *= 2;
 	
-	ij_sw_corner = 2 * my + 2;			/*  Corners of array of actual data  */
-	ij_se_corner = ij_sw_corner + (nx - 1) * my;
-	ij_nw_corner = ij_sw_corner + (ny - 1);
-	ij_ne_corner = ij_se_corner + (ny - 1);
+	C->ij_sw_corner = 2 * C->my + 2;			/*  Corners of array of actual data  */
+	C->ij_se_corner = C->ij_sw_corner + (C->nx - 1) * C->my;
+	C->ij_nw_corner = C->ij_sw_corner + (C->ny - 1);
+	C->ij_ne_corner = C->ij_se_corner + (C->ny - 1);
 
 }
 
-void	set_offset() {
+void	set_offset(struct SURFACE_CTX *C) {
 
 	int	add_w[5], add_e[5], add_s[5], add_n[5], add_w2[5], add_e2[5], add_s2[5], add_n2[5];
 	int	i, j, kase;
 	
-	add_w[0] = -my; add_w[1] = add_w[2] = add_w[3] = add_w[4] = -grid_east;
-	add_w2[0] = -2 * my;  add_w2[1] = -my - grid_east;  add_w2[2] = add_w2[3] = add_w2[4] = -2 * grid_east;
-	add_e[4] = my; add_e[0] = add_e[1] = add_e[2] = add_e[3] = grid_east;
-	add_e2[4] = 2 * my;  add_e2[3] = my + grid_east;  add_e2[2] = add_e2[1] = add_e2[0] = 2 * grid_east;
+	add_w[0] = -C->my; add_w[1] = add_w[2] = add_w[3] = add_w[4] = -C->grid_east;
+	add_w2[0] = -2 * C->my;  add_w2[1] = -C->my - C->grid_east;  add_w2[2] = add_w2[3] = add_w2[4] = -2 * C->grid_east;
+	add_e[4] = C->my; add_e[0] = add_e[1] = add_e[2] = add_e[3] = C->grid_east;
+	add_e2[4] = 2 * C->my;  add_e2[3] = C->my + C->grid_east;  add_e2[2] = add_e2[1] = add_e2[0] = 2 * C->grid_east;
 
-	add_n[4] = 1; add_n[3] = add_n[2] = add_n[1] = add_n[0] = grid;
-	add_n2[4] = 2;  add_n2[3] = grid + 1;  add_n2[2] = add_n2[1] = add_n2[0] = 2 * grid;
-	add_s[0] = -1; add_s[1] = add_s[2] = add_s[3] = add_s[4] = -grid;
-	add_s2[0] = -2;  add_s2[1] = -grid - 1;  add_s2[2] = add_s2[3] = add_s2[4] = -2 * grid;
+	add_n[4] = 1; add_n[3] = add_n[2] = add_n[1] = add_n[0] = C->grid;
+	add_n2[4] = 2;  add_n2[3] = C->grid + 1;  add_n2[2] = add_n2[1] = add_n2[0] = 2 * C->grid;
+	add_s[0] = -1; add_s[1] = add_s[2] = add_s[3] = add_s[4] = -C->grid;
+	add_s2[0] = -2;  add_s2[1] = -C->grid - 1;  add_s2[2] = add_s2[3] = add_s2[4] = -2 * C->grid;
 
 	for (i = 0, kase = 0; i < 5; i++) {
 		for (j = 0; j < 5; j++, kase++) {
-			offset[kase][0] = add_n2[j];
-			offset[kase][1] = add_n[j] + add_w[i];
-			offset[kase][2] = add_n[j];
-			offset[kase][3] = add_n[j] + add_e[i];
-			offset[kase][4] = add_w2[i];
-			offset[kase][5] = add_w[i];
-			offset[kase][6] = add_e[i];
-			offset[kase][7] = add_e2[i];
-			offset[kase][8] = add_s[j] + add_w[i];
-			offset[kase][9] = add_s[j];
-			offset[kase][10] = add_s[j] + add_e[i];
-			offset[kase][11] = add_s2[j];
+			C->offset[kase][0] = add_n2[j];
+			C->offset[kase][1] = add_n[j] + add_w[i];
+			C->offset[kase][2] = add_n[j];
+			C->offset[kase][3] = add_n[j] + add_e[i];
+			C->offset[kase][4] = add_w2[i];
+			C->offset[kase][5] = add_w[i];
+			C->offset[kase][6] = add_e[i];
+			C->offset[kase][7] = add_e2[i];
+			C->offset[kase][8] = add_s[j] + add_w[i];
+			C->offset[kase][9] = add_s[j];
+			C->offset[kase][10] = add_s[j] + add_e[i];
+			C->offset[kase][11] = add_s2[j];
 		}
 	}
 }
 
-void fill_in_forecast () {
+void fill_in_forecast (struct SURFACE_CTX *C) {
 
 	/* Fills in bilinear estimates into new node locations
 	   after grid is divided.   
@@ -1990,69 +2009,69 @@ void fill_in_forecast () {
 	double old_size;
 	
 		
-	old_size = 1.0 / (double)old_grid;
+	old_size = 1.0 / (double)C->old_grid;
 
 	/* first do from southwest corner */
 	
-	for (i = 0; i < nx-1; i += old_grid) {
+	for (i = 0; i < C->nx-1; i += C->old_grid) {
 		
-		for (j = 0; j < ny-1; j += old_grid) {
+		for (j = 0; j < C->ny-1; j += C->old_grid) {
 			
 			/* get indices of bilinear square */
-			index_0 = ij_sw_corner + i * my + j;
-			index_1 = index_0 + old_grid * my;
-			index_2 = index_1 + old_grid;
-			index_3 = index_0 + old_grid;
+			index_0 = C->ij_sw_corner + i * C->my + j;
+			index_1 = index_0 + C->old_grid * C->my;
+			index_2 = index_1 + C->old_grid;
+			index_3 = index_0 + C->old_grid;
 			
 			/* get coefficients */
-			a0 = u[index_0];
-			a1 = u[index_1] - a0;
-			a2 = u[index_3] - a0;
-			a3 = u[index_2] - a0 - a1 - a2;
+			a0 = C->u[index_0];
+			a1 = C->u[index_1] - a0;
+			a2 = C->u[index_3] - a0;
+			a3 = C->u[index_2] - a0 - a1 - a2;
 			
 			/* find all possible new fill ins */
 			
-			for (ii = i;  ii < i + old_grid; ii += grid) {
+			for (ii = i;  ii < i + C->old_grid; ii += C->grid) {
 				delta_x = (ii - i) * old_size;
-				for (jj = j;  jj < j + old_grid; jj += grid) {
-					index_new = ij_sw_corner + ii * my + jj;
+				for (jj = j;  jj < j + C->old_grid; jj += C->grid) {
+					index_new = C->ij_sw_corner + ii * C->my + jj;
 					if (index_new == index_0) continue;
 					delta_y = (jj - j) * old_size;
-					u[index_new] = (float)(a0 + a1 * delta_x + delta_y * ( a2 + a3 * delta_x));
-					iu[index_new] = 0;
+					C->u[index_new] = (float)(a0 + a1 * delta_x + delta_y * ( a2 + a3 * delta_x));
+					C->iu[index_new] = 0;
 				}
 			}
-			iu[index_0] = 5;
+			C->iu[index_0] = 5;
 		}
 	}
 	
 	/* now do linear guess along east edge */
 	
-	for (j = 0; j < (ny-1); j += old_grid) {
-		index_0 = ij_se_corner + j;
-		index_3 = index_0 + old_grid;
-		for (jj = j;  jj < j + old_grid; jj += grid) {
-			index_new = ij_se_corner + jj;
+	for (j = 0; j < (C->ny-1); j += C->old_grid) {
+		index_0 = C->ij_se_corner + j;
+		index_3 = index_0 + C->old_grid;
+		for (jj = j;  jj < j + C->old_grid; jj += C->grid) {
+			index_new = C->ij_se_corner + jj;
 			delta_y = (jj - j) * old_size;
-			u[index_new] = u[index_0] + (float)(delta_y * (u[index_3] - u[index_0]));
-			iu[index_new] = 0;
+			C->u[index_new] = C->u[index_0] + (float)(delta_y * (C->u[index_3] - C->u[index_0]));
+			C->iu[index_new] = 0;
 		}
-		iu[index_0] = 5;
+		C->iu[index_0] = 5;
 	}
 	/* now do linear guess along north edge */
-	for (i = 0; i < (nx-1); i += old_grid) {
-		index_0 = ij_nw_corner + i * my;
-		index_1 = index_0 + old_grid * my;
-		for (ii = i;  ii < i + old_grid; ii += grid) {
-			index_new = ij_nw_corner + ii * my;
+	for (i = 0; i < (C->nx-1); i += C->old_grid) {
+		index_0 = C->ij_nw_corner + i * C->my;
+		index_1 = index_0 + C->old_grid * C->my;
+		for (ii = i;  ii < i + C->old_grid; ii += C->grid) {
+			index_new = C->ij_nw_corner + ii * C->my;
 			delta_x = (ii - i) * old_size;
-			u[index_new] = u[index_0] + (float)(delta_x * (u[index_1] - u[index_0]));
-			iu[index_new] = 0;
+			C->u[index_new] = C->u[index_0] + (float)(delta_x * (C->u[index_1] - C->u[index_0]));
+			C->iu[index_new] = 0;
 		}
-		iu[index_0] = 5;
+		C->iu[index_0] = 5;
 	}
 	/* now set northeast corner to fixed and we're done */
-	iu[ij_ne_corner] = 5;
+	C->iu[C->ij_ne_corner] = 5;
 }
 
 int compare_points (const void *point_1v, const void *point_2v) {
@@ -2075,10 +2094,10 @@ int compare_points (const void *point_1v, const void *point_2v) {
 	else if (index_1 == OUTSIDE)
 		return (0);
 	else {	/* Points are in same grid cell, find the one who is nearest to grid point */
-		block_i = point_1->index/block_ny;
-		block_j = point_1->index%block_ny;
-		x0 = xmin + block_i * grid_xinc;
-		y0 = ymin + block_j * grid_yinc;
+		block_i = point_1->index/C_sort->block_ny;
+		block_j = point_1->index%C_sort->block_ny;
+		x0 = C_sort->xmin + block_i * C_sort->grid_xinc;
+		y0 = C_sort->ymin + block_j * C_sort->grid_yinc;
 		dist_1 = (point_1->x - x0) * (point_1->x - x0) + (point_1->y - y0) * (point_1->y - y0);
 		dist_2 = (point_2->x - x0) * (point_2->x - x0) + (point_2->y - y0) * (point_2->y - y0);
 		if (dist_1 < dist_2)
@@ -2090,92 +2109,93 @@ int compare_points (const void *point_1v, const void *point_2v) {
 	}
 }
 
-void smart_divide () {
+void smart_divide (struct SURFACE_CTX *C) {
 		/* Divide grid by its largest prime factor */
-	grid /= factors[n_fact - 1];
-	n_fact--;
+	C->grid /= C->factors[C->n_fact - 1];
+	C->n_fact--;
 }
 
-void set_index () {
+void set_index (struct SURFACE_CTX *C) {
 		/* recomputes data[k].index for new value of grid,
 		   sorts data on index and radii, and throws away
 		   data which are now outside the useable limits. */
 	int i, j, k, k_skipped = 0;
 
-	for (k = 0; k < npoints; k++) {
-		i = (int)floor(((data[k].x-xmin)*r_grid_xinc) + 0.5);
-		j = (int)floor(((data[k].y-ymin)*r_grid_yinc) + 0.5);
-		if (i < 0 || i >= block_nx || j < 0 || j >= block_ny) {
-			data[k].index = OUTSIDE;
+	for (k = 0; k < C->npoints; k++) {
+		i = (int)floor(((C->data[k].x-C->xmin)*C->r_grid_xinc) + 0.5);
+		j = (int)floor(((C->data[k].y-C->ymin)*C->r_grid_yinc) + 0.5);
+		if (i < 0 || i >= C->block_nx || j < 0 || j >= C->block_ny) {
+			C->data[k].index = OUTSIDE;
 			k_skipped++;
 		}
 		else
-			data[k].index = i * block_ny + j;
+			C->data[k].index = i * C->block_ny + j;
 	}
 	
-	qsort ((char *)data, npoints, sizeof (struct SURFACE_DATA), compare_points);
+	C_sort = C;
+	qsort ((char *)C->data, C->npoints, sizeof (struct SURFACE_DATA), compare_points);
 	
-	npoints -= k_skipped;
+	C->npoints -= k_skipped;
 	
 }
 
-void find_nearest_point() {
+void find_nearest_point(struct SURFACE_CTX *C) {
 	int i, j, k, last_index, block_i, block_j, iu_index, briggs_index;
 	double x0, y0, dx, dy, xys, xy1, btemp;
 	double b0, b1, b2, b3, b4, b5;
 	
 	last_index = -1;
-	small = 0.05 * ((grid_xinc < grid_yinc) ? grid_xinc : grid_yinc);
+	C->small = 0.05 * ((C->grid_xinc < C->grid_yinc) ? C->grid_xinc : C->grid_yinc);
 
-	for (i = 0; i < nx; i += grid)	/* Reset grid info */
-		for (j = 0; j < ny; j += grid)
-			iu[ij_sw_corner + i*my + j] = 0;
+	for (i = 0; i < C->nx; i += C->grid)	/* Reset grid info */
+		for (j = 0; j < C->ny; j += C->grid)
+			C->iu[C->ij_sw_corner + i*C->my + j] = 0;
 	
 	briggs_index = 0;
-	for (k = 0; k < npoints; k++) {	/* Find constraining value  */
-		if (data[k].index != last_index) {
-			block_i = data[k].index/block_ny;
-			block_j = data[k].index%block_ny;
-			last_index = data[k].index;
-	 		iu_index = ij_sw_corner + (block_i * my + block_j) * grid;
-	 		x0 = xmin + block_i*grid_xinc;
-	 		y0 = ymin + block_j*grid_yinc;
-	 		dx = (data[k].x - x0)*r_grid_xinc;
-	 		dy = (data[k].y - y0)*r_grid_yinc;
-	 		if (fabs(dx) < small && fabs(dy) < small) {
-	 			iu[iu_index] = 5;
-	 			u[iu_index] = data[k].z;
+	for (k = 0; k < C->npoints; k++) {	/* Find constraining value  */
+		if (C->data[k].index != last_index) {
+			block_i = C->data[k].index/C->block_ny;
+			block_j = C->data[k].index%C->block_ny;
+			last_index = C->data[k].index;
+	 		iu_index = C->ij_sw_corner + (block_i * C->my + block_j) * C->grid;
+	 		x0 = C->xmin + block_i*C->grid_xinc;
+	 		y0 = C->ymin + block_j*C->grid_yinc;
+	 		dx = (C->data[k].x - x0)*C->r_grid_xinc;
+	 		dy = (C->data[k].y - y0)*C->r_grid_yinc;
+	 		if (fabs(dx) < C->small && fabs(dy) < C->small) {
+	 			C->iu[iu_index] = 5;
+	 			C->u[iu_index] = C->data[k].z;
 	 		}
 	 		else {
 	 			if (dx >= 0.0) {
 	 				if (dy >= 0.0)
-	 					iu[iu_index] = 1;
+	 					C->iu[iu_index] = 1;
 	 				else
-	 					iu[iu_index] = 4;
+	 					C->iu[iu_index] = 4;
 	 			}
 	 			else {
 	 				if (dy >= 0.0)
-	 					iu[iu_index] = 2;
+	 					C->iu[iu_index] = 2;
 	 				else
-	 					iu[iu_index] = 3;
+	 					C->iu[iu_index] = 3;
 	 			}
 	 			dx = fabs(dx);
 	 			dy = fabs(dy);
-	 			btemp = 2 * one_plus_e2 / ( (dx + dy) * (1.0 + dx + dy) );
+	 			btemp = 2 * C->one_plus_e2 / ( (dx + dy) * (1.0 + dx + dy) );
 	 			b0 = 1.0 - 0.5 * (dx + (dx * dx)) * btemp;
-	 			b3 = 0.5 * (e_2 - (dy + (dy * dy)) * btemp);
+	 			b3 = 0.5 * (C->e_2 - (dy + (dy * dy)) * btemp);
 	 			xys = 1.0 + dx + dy;
 	 			xy1 = 1.0 / xys;
-	 			b1 = (e_2 * xys - 4 * dy) * xy1;
+	 			b1 = (C->e_2 * xys - 4 * dy) * xy1;
 	 			b2 = 2 * (dy - dx + 1.0) * xy1;
 	 			b4 = b0 + b1 + b2 + b3 + btemp;
-	 			b5 = btemp * data[k].z;
-	 			briggs[briggs_index].b[0] = b0;
-	 			briggs[briggs_index].b[1] = b1;
-	 			briggs[briggs_index].b[2] = b2;
-	 			briggs[briggs_index].b[3] = b3;
-	 			briggs[briggs_index].b[4] = b4;
-	 			briggs[briggs_index].b[5] = b5;
+	 			b5 = btemp * C->data[k].z;
+	 			C->briggs[briggs_index].b[0] = b0;
+	 			C->briggs[briggs_index].b[1] = b1;
+	 			C->briggs[briggs_index].b[2] = b2;
+	 			C->briggs[briggs_index].b[3] = b3;
+	 			C->briggs[briggs_index].b[4] = b4;
+	 			C->briggs[briggs_index].b[5] = b5;
 	 			briggs_index++;
 	 		}
 	 	}
@@ -2183,17 +2203,17 @@ void find_nearest_point() {
 }
 
 						
-void set_grid_parameters() {			
-	block_ny = (ny - 1) / grid + 1;
-	block_nx = (nx - 1) / grid + 1;
-	grid_xinc = grid * xinc;
-	grid_yinc = grid * yinc;
-	grid_east = grid * my;
-	r_grid_xinc = 1.0 / grid_xinc;
-	r_grid_yinc = 1.0 / grid_yinc;
+void set_grid_parameters(struct SURFACE_CTX *C) {			
+	C->block_ny = (C->ny - 1) / C->grid + 1;
+	C->block_nx = (C->nx - 1) / C->grid + 1;
+	C->grid_xinc = C->grid * C->xinc;
+	C->grid_yinc = C->grid * C->yinc;
+	C->grid_east = C->grid * C->my;
+	C->r_grid_xinc = 1.0 / C->grid_xinc;
+	C->r_grid_yinc = 1.0 / C->grid_yinc;
 }
 
-void initialize_grid() {
+void initialize_grid(struct SURFACE_CTX *C) {
 	/*
 	 * For the initial gridsize, compute weighted averages of data inside the search radius
 	 * and assign the values to u[i,j] where i,j are multiples of gridsize.
@@ -2201,53 +2221,53 @@ void initialize_grid() {
 	 int	irad, jrad, i, j, imin, imax, jmin, jmax, index_1, index_2, k, ki, kj, k_index;
 	 double	r, rfact, sum_w, sum_zw, weight, x0, y0;
 
-	 irad = (int)ceil(radius/grid_xinc);
-	 jrad = (int)ceil(radius/grid_yinc);
-	 rfact = -4.5/(radius*radius);
+	 irad = (int)ceil(C->radius/C->grid_xinc);
+	 jrad = (int)ceil(C->radius/C->grid_yinc);
+	 rfact = -4.5/(C->radius*C->radius);
 	 
-	 for (i = 0; i < block_nx; i ++ ) {
-	 	x0 = xmin + i*grid_xinc;
-	 	for (j = 0; j < block_ny; j ++ ) {
-	 		y0 = ymin + j*grid_yinc;
+	 for (i = 0; i < C->block_nx; i ++ ) {
+	 	x0 = C->xmin + i*C->grid_xinc;
+	 	for (j = 0; j < C->block_ny; j ++ ) {
+	 		y0 = C->ymin + j*C->grid_yinc;
 	 		imin = i - irad;
 	 		if (imin < 0) imin = 0;
 	 		imax = i + irad;
-	 		if (imax >= block_nx) imax = block_nx - 1;
+	 		if (imax >= C->block_nx) imax = C->block_nx - 1;
 	 		jmin = j - jrad;
 	 		if (jmin < 0) jmin = 0;
 	 		jmax = j + jrad;
-	 		if (jmax >= block_ny) jmax = block_ny - 1;
-	 		index_1 = imin*block_ny + jmin;
-	 		index_2 = imax*block_ny + jmax + 1;
+	 		if (jmax >= C->block_ny) jmax = C->block_ny - 1;
+	 		index_1 = imin*C->block_ny + jmin;
+	 		index_2 = imax*C->block_ny + jmax + 1;
 	 		sum_w = sum_zw = 0.0;
 	 		k = 0;
-	 		while (k < npoints && data[k].index < index_1) k++;
-	 		for (ki = imin; k < npoints && ki <= imax && data[k].index < index_2; ki++) {
-	 			for (kj = jmin; k < npoints && kj <= jmax && data[k].index < index_2; kj++) {
-	 				k_index = ki*block_ny + kj;
-	 				while (k < npoints && data[k].index < k_index) k++;
-	 				while (k < npoints && data[k].index == k_index) {
-	 					r = (data[k].x-x0)*(data[k].x-x0) + (data[k].y-y0)*(data[k].y-y0);
+	 		while (k < C->npoints && C->data[k].index < index_1) k++;
+	 		for (ki = imin; k < C->npoints && ki <= imax && C->data[k].index < index_2; ki++) {
+	 			for (kj = jmin; k < C->npoints && kj <= jmax && C->data[k].index < index_2; kj++) {
+	 				k_index = ki*C->block_ny + kj;
+	 				while (k < C->npoints && C->data[k].index < k_index) k++;
+	 				while (k < C->npoints && C->data[k].index == k_index) {
+	 					r = (C->data[k].x-x0)*(C->data[k].x-x0) + (C->data[k].y-y0)*(C->data[k].y-y0);
 	 					weight = exp (rfact*r);
 	 					sum_w += weight;
-	 					sum_zw += weight*data[k].z;
+	 					sum_zw += weight*C->data[k].z;
 	 					k++;
 	 				}
 	 			}
 	 		}
 	 		if (sum_w == 0.0) {
 	 			mexPrintf ("surface: Warning: no data inside search radius at: %.8g %.8g\n", x0, y0);
-	 			u[ij_sw_corner + (i * my + j) * grid] = (float)z_mean;
+	 			C->u[C->ij_sw_corner + (i * C->my + j) * C->grid] = (float)C->z_mean;
 	 		}
 	 		else {
-	 			u[ij_sw_corner + (i*my+j)*grid] = (float)(sum_zw/sum_w);
+	 			C->u[C->ij_sw_corner + (i*C->my+j)*C->grid] = (float)(sum_zw/sum_w);
 	 		}
 		}
 	}
 }
 
 
-void new_initialize_grid(void) {
+void new_initialize_grid(struct SURFACE_CTX *C) {
 	/*
 	 * For the initial gridsize, load constrained nodes with weighted avg of their data;
 	 * and then do something with the unconstrained ones.
@@ -2255,59 +2275,59 @@ void new_initialize_grid(void) {
 	 int	k, k_index, u_index, block_i, block_j;
 	 double	sum_w, sum_zw, weight, x0, y0, dx, dy, dx_scale, dy_scale;
 
-	dx_scale = 4.0 / grid_xinc;
-	dy_scale = 4.0 / grid_yinc;
-	n_empty = block_ny * block_nx;
+	dx_scale = 4.0 / C->grid_xinc;
+	dy_scale = 4.0 / C->grid_yinc;
+	C->n_empty = C->block_ny * C->block_nx;
 	k = 0;
-	while (k < npoints) {
-		block_i = data[k].index / block_ny;
-		block_j = data[k].index % block_ny;
-		x0 = xmin + block_i*grid_xinc;
-		y0 = ymin + block_j*grid_yinc;
-		u_index = ij_sw_corner + (block_i*my + block_j) * grid;
-		k_index = data[k].index;
+	while (k < C->npoints) {
+		block_i = C->data[k].index / C->block_ny;
+		block_j = C->data[k].index % C->block_ny;
+		x0 = C->xmin + block_i*C->grid_xinc;
+		y0 = C->ymin + block_j*C->grid_yinc;
+		u_index = C->ij_sw_corner + (block_i*C->my + block_j) * C->grid;
+		k_index = C->data[k].index;
 		
-		dy = (data[k].y - y0) * dy_scale;
-		dx = (data[k].x - x0) * dx_scale;
+		dy = (C->data[k].y - y0) * dy_scale;
+		dx = (C->data[k].x - x0) * dx_scale;
 		sum_w = 1.0 / (1.0 + dx*dx + dy*dy);
-		sum_zw = data[k].z * sum_w;
+		sum_zw = C->data[k].z * sum_w;
 		k++;
 
-		while (k < npoints && data[k].index == k_index) {
+		while (k < C->npoints && C->data[k].index == k_index) {
 			
-			dy = (data[k].y - y0) * dy_scale;
-			dx = (data[k].x - x0) * dx_scale;
+			dy = (C->data[k].y - y0) * dy_scale;
+			dx = (C->data[k].x - x0) * dx_scale;
 			weight = 1.0 / (1.0 + dx*dx + dy*dy);
-			sum_zw += data[k].z * weight;
+			sum_zw += C->data[k].z * weight;
 			sum_w += weight;
-			sum_zw += weight*data[k].z;
+			sum_zw += weight*C->data[k].z;
 			k++;
 	 	}
-	 	u[u_index] = (float)(sum_zw/sum_w);
-	 	iu[u_index] = 5;
-	 	n_empty--;
+	 	C->u[u_index] = (float)(sum_zw/sum_w);
+	 	C->iu[u_index] = 5;
+	 	C->n_empty--;
 	 }
 }
 
 /* This function rewritten by D.W. Caress 5/3/94 */
-int read_data(int ndat, float *xdat, float *ydat, float *zdat) {
+int read_data(struct SURFACE_CTX *C, int ndat, float *xdat, float *ydat, float *zdat) {
 
 	int	i, j, k, kmax, kmin, idat;
 	double	zmin = 1.0e38, zmax = -1.0e38;
 
-	data = (struct SURFACE_DATA *) mxCalloc ((size_t)ndat, sizeof(struct SURFACE_DATA));
+	C->data = (struct SURFACE_DATA *) mxCalloc ((size_t)ndat, sizeof(struct SURFACE_DATA));
 	
 	/* Read in xyz data and computes index no and store it in a structure */
 	k = 0;
-	z_mean = 0;
+	C->z_mean = 0;
 	for (idat = 0; idat < ndat; idat++) {
-		i = (int)floor(((xdat[idat]-xmin)*r_grid_xinc) + 0.5);
-		j = (int)floor(((ydat[idat]-ymin)*r_grid_yinc) + 0.5);
-		if (i >= 0 && i < block_nx && j >= 0 && j < block_ny) {
-			data[k].index = i * block_ny + j;
-			data[k].x = xdat[idat];
-			data[k].y = ydat[idat];
-			data[k].z = zdat[idat];
+		i = (int)floor(((xdat[idat]-C->xmin)*C->r_grid_xinc) + 0.5);
+		j = (int)floor(((ydat[idat]-C->ymin)*C->r_grid_yinc) + 0.5);
+		if (i >= 0 && i < C->block_nx && j >= 0 && j < C->block_ny) {
+			C->data[k].index = i * C->block_ny + j;
+			C->data[k].x = xdat[idat];
+			C->data[k].y = ydat[idat];
+			C->data[k].z = zdat[idat];
 			if (zmin > zdat[idat]) {
 				zmin = zdat[idat];
 				kmin = k;
@@ -2317,33 +2337,33 @@ int read_data(int ndat, float *xdat, float *ydat, float *zdat) {
 				kmax = k;
 			}
 			k++;
-			z_mean += zdat[idat];
+			C->z_mean += zdat[idat];
 		}
 	}
 
-	npoints = k;
-	z_mean /= k;
-	if( converge_limit == 0.0 ) {
-		converge_limit = 0.001 * z_scale; /* c_l = 1 ppt of L2 scale */
+	C->npoints = k;
+	C->z_mean /= k;
+	if( C->converge_limit == 0.0 ) {
+		C->converge_limit = 0.001 * C->z_scale; /* c_l = 1 ppt of L2 scale */
 	}
-	if (verbose) {
+	if (C->verbose) {
 		mexPrintf("surface: Minimum value of your dataset x,y,z at: %g %g %g\n",
-			data[kmin].x, data[kmin].y, data[kmin].z);
+			C->data[kmin].x, C->data[kmin].y, C->data[kmin].z);
 		mexPrintf("surface: Maximum value of your dataset x,y,z at: %g %g %g\n",
-			data[kmax].x, data[kmax].y, data[kmax].z);
+			C->data[kmax].x, C->data[kmax].y, C->data[kmax].z);
 	}
 	
-	if (set_low == 1)
-		low_limit = data[kmin].z;
-	else if (set_low == 2 && low_limit > data[kmin].z) {
+	if (C->set_low == 1)
+		C->low_limit = C->data[kmin].z;
+	else if (C->set_low == 2 && C->low_limit > C->data[kmin].z) {
 	/*	low_limit = data[kmin].z;	*/
 		/*
 		fprintf (stderr, "surface: Warning:  Your lower value is > than min data value.\n");
 		*/
 	}
-	if (set_high == 1)
-		high_limit = data[kmax].z;
-	else if (set_high == 2 && high_limit < data[kmax].z) {
+	if (C->set_high == 1)
+		C->high_limit = C->data[kmax].z;
+	else if (C->set_high == 2 && C->high_limit < C->data[kmax].z) {
 	/*	high_limit = data[kmax].z;	*/
 		/*
 		fprintf (stderr, "surface: Warning:  Your upper value is < than max data value.\n");
@@ -2353,31 +2373,31 @@ int read_data(int ndat, float *xdat, float *ydat, float *zdat) {
 }
 
 /* this function rewritten from write_output() by D.W. Caress 5/3/94 */
-void get_output(float *sgrid) {
+void get_output(struct SURFACE_CTX *C, float *sgrid) {
 	
 	int	index, i, j;
 
-	index = ij_sw_corner;
-	for(i = 0; i < nx; i++, index += my) 
-		for (j = 0; j < ny; j++) 
-			sgrid[j*nx+i] = u[index + ny - j - 1];
+	index = C->ij_sw_corner;
+	for(i = 0; i < C->nx; i++, index += C->my) 
+		for (j = 0; j < C->ny; j++) 
+			sgrid[j*C->nx+i] = C->u[index + C->ny - j - 1];
 }
 	
-int	iterate(int mode) {
+int	iterate(struct SURFACE_CTX *C, int mode) {
 
 	int	i, j, k, ij, kase, briggs_index, ij_v2;
 	int	x_case, y_case, x_w_case, x_e_case, y_s_case, y_n_case;
 	int	iteration_count = 0;
 	
-	double	current_limit = converge_limit / grid;
+	double	current_limit = C->converge_limit / C->grid;
 	double	change, max_change = 0.0, busum, sum_ij;
 	double	b0, b1, b2, b3, b4, b5;
 	
-	double	x_0_const = 4.0 * (1.0 - boundary_tension) / (2.0 - boundary_tension);
-	double	x_1_const = (3 * boundary_tension - 2.0) / (2.0 - boundary_tension);
-	double	y_denom = 2 * epsilon * (1.0 - boundary_tension) + boundary_tension;
-	double	y_0_const = 4 * epsilon * (1.0 - boundary_tension) / y_denom;
-	double	y_1_const = (boundary_tension - 2 * epsilon * (1.0 - boundary_tension) ) / y_denom;
+	double	x_0_const = 4.0 * (1.0 - C->boundary_tension) / (2.0 - C->boundary_tension);
+	double	x_1_const = (3 * C->boundary_tension - 2.0) / (2.0 - C->boundary_tension);
+	double	y_denom = 2 * C->epsilon * (1.0 - C->boundary_tension) + C->boundary_tension;
+	double	y_0_const = 4 * C->epsilon * (1.0 - C->boundary_tension) / y_denom;
+	double	y_1_const = (C->boundary_tension - 2 * C->epsilon * (1.0 - C->boundary_tension) ) / y_denom;
 
 	do {
 		briggs_index = 0;	/* Reset the constraint table stack pointer  */
@@ -2391,49 +2411,49 @@ int	iterate(int mode) {
 		
 		
 		
-		for (i = 0; i < nx; i += grid) {
+		for (i = 0; i < C->nx; i += C->grid) {
 			/* set d2[]/dy2 = 0 on south side:  */
-			ij = ij_sw_corner + i * my;
+			ij = C->ij_sw_corner + i * C->my;
 			/* u[ij - 1] = 2 * u[ij] - u[ij + grid];  */
-			u[ij - 1] = (float)(y_0_const * u[ij] + y_1_const * u[ij + grid]);
+			C->u[ij - 1] = (float)(y_0_const * C->u[ij] + y_1_const * C->u[ij + C->grid]);
 			/* set d2[]/dy2 = 0 on north side:  */
-			ij = ij_nw_corner + i * my;
+			ij = C->ij_nw_corner + i * C->my;
 			/* u[ij + 1] = 2 * u[ij] - u[ij - grid];  */
-			u[ij + 1] = (float)(y_0_const * u[ij] + y_1_const * u[ij - grid]);
+			C->u[ij + 1] = (float)(y_0_const * C->u[ij] + y_1_const * C->u[ij - C->grid]);
 			
 		}
 		
-		for (j = 0; j < ny; j += grid) {
+		for (j = 0; j < C->ny; j += C->grid) {
 			/* set d2[]/dx2 = 0 on west side:  */
-			ij = ij_sw_corner + j;
+			ij = C->ij_sw_corner + j;
 			/* u[ij - my] = 2 * u[ij] - u[ij + grid_east];  */
-			u[ij - my] = (float)(x_1_const * u[ij + grid_east] + x_0_const * u[ij]);
+			C->u[ij - C->my] = (float)(x_1_const * C->u[ij + C->grid_east] + x_0_const * C->u[ij]);
 			/* set d2[]/dx2 = 0 on east side:  */
-			ij = ij_se_corner + j;
+			ij = C->ij_se_corner + j;
 			/* u[ij + my] = 2 * u[ij] - u[ij - grid_east];  */
-			u[ij + my] = (float)(x_1_const * u[ij - grid_east] + x_0_const * u[ij]);
+			C->u[ij + C->my] = (float)(x_1_const * C->u[ij - C->grid_east] + x_0_const * C->u[ij]);
 		}
 			
 		/* Now set d2[]/dxdy = 0 at each corner:  */
 		
-		ij = ij_sw_corner;
-		u[ij - my - 1] = u[ij + grid_east - 1] + u[ij - my + grid] - u[ij + grid_east + grid];
+		ij = C->ij_sw_corner;
+		C->u[ij - C->my - 1] = C->u[ij + C->grid_east - 1] + C->u[ij - C->my + C->grid] - C->u[ij + C->grid_east + C->grid];
 				
-		ij = ij_nw_corner;
-		u[ij - my + 1] = u[ij + grid_east + 1] + u[ij - my - grid] - u[ij + grid_east - grid];
+		ij = C->ij_nw_corner;
+		C->u[ij - C->my + 1] = C->u[ij + C->grid_east + 1] + C->u[ij - C->my - C->grid] - C->u[ij + C->grid_east - C->grid];
 				
-		ij = ij_se_corner;
-		u[ij + my - 1] = u[ij - grid_east - 1] + u[ij + my + grid] - u[ij - grid_east + grid];
+		ij = C->ij_se_corner;
+		C->u[ij + C->my - 1] = C->u[ij - C->grid_east - 1] + C->u[ij + C->my + C->grid] - C->u[ij - C->grid_east + C->grid];
 				
-		ij = ij_ne_corner;
-		u[ij + my + 1] = u[ij - grid_east + 1] + u[ij + my - grid] - u[ij - grid_east - grid];
+		ij = C->ij_ne_corner;
+		C->u[ij + C->my + 1] = C->u[ij - C->grid_east + 1] + C->u[ij + C->my - C->grid] - C->u[ij - C->grid_east - C->grid];
 		
 		/* Now set (1-T)dC/dn + Tdu/dn = 0 at each edge :  */
 		/* New experiment:  only dC/dn = 0  */
 		
 		x_w_case = 0;
-		x_e_case = block_nx - 1;
-		for (i = 0; i < nx; i += grid, x_w_case++, x_e_case--) {
+		x_e_case = C->block_nx - 1;
+		for (i = 0; i < C->nx; i += C->grid, x_w_case++, x_e_case--) {
 		
 			if(x_w_case < 2)
 				x_case = x_w_case;
@@ -2444,25 +2464,25 @@ int	iterate(int mode) {
 				
 			/* South side :  */
 			kase = x_case * 5;
-			ij = ij_sw_corner + i * my;
-			u[ij + offset[kase][11]] = 
-				(float)(u[ij + offset[kase][0]] + eps_m2*(u[ij + offset[kase][1]] + u[ij + offset[kase][3]]
-					- u[ij + offset[kase][8]] - u[ij + offset[kase][10]])
-					+ two_plus_em2 * (u[ij + offset[kase][9]] - u[ij + offset[kase][2]]) );
+			ij = C->ij_sw_corner + i * C->my;
+			C->u[ij + C->offset[kase][11]] = 
+				(float)(C->u[ij + C->offset[kase][0]] + C->eps_m2*(C->u[ij + C->offset[kase][1]] + C->u[ij + C->offset[kase][3]]
+					- C->u[ij + C->offset[kase][8]] - C->u[ij + C->offset[kase][10]])
+					+ C->two_plus_em2 * (C->u[ij + C->offset[kase][9]] - C->u[ij + C->offset[kase][2]]) );
 				/*  + tense * eps_m2 * (u[ij + offset[kase][2]] - u[ij + offset[kase][9]]) / (1.0 - tense);  */
 			/* North side :  */
 			kase = x_case * 5 + 4;
-			ij = ij_nw_corner + i * my;
-			u[ij + offset[kase][0]] = 
-				-(float)(-u[ij + offset[kase][11]] + eps_m2 * (u[ij + offset[kase][1]] + u[ij + offset[kase][3]]
-					- u[ij + offset[kase][8]] - u[ij + offset[kase][10]])
-					+ two_plus_em2 * (u[ij + offset[kase][9]] - u[ij + offset[kase][2]]) );
+			ij = C->ij_nw_corner + i * C->my;
+			C->u[ij + C->offset[kase][0]] = 
+				-(float)(-C->u[ij + C->offset[kase][11]] + C->eps_m2 * (C->u[ij + C->offset[kase][1]] + C->u[ij + C->offset[kase][3]]
+					- C->u[ij + C->offset[kase][8]] - C->u[ij + C->offset[kase][10]])
+					+ C->two_plus_em2 * (C->u[ij + C->offset[kase][9]] - C->u[ij + C->offset[kase][2]]) );
 				/*  - tense * eps_m2 * (u[ij + offset[kase][2]] - u[ij + offset[kase][9]]) / (1.0 - tense);  */
 		}
 		
 		y_s_case = 0;
-		y_n_case = block_ny - 1;
-		for (j = 0; j < ny; j += grid, y_s_case++, y_n_case--) {
+		y_n_case = C->block_ny - 1;
+		for (j = 0; j < C->ny; j += C->grid, y_s_case++, y_n_case--) {
 				
 			if(y_s_case < 2)
 				y_case = y_s_case;
@@ -2473,19 +2493,19 @@ int	iterate(int mode) {
 			
 			/* West side :  */
 			kase = y_case;
-			ij = ij_sw_corner + j;
-			u[ij+offset[kase][4]] = 
-				u[ij + offset[kase][7]] + (float)(eps_p2 * (u[ij + offset[kase][3]] + u[ij + offset[kase][10]]
-				-u[ij + offset[kase][1]] - u[ij + offset[kase][8]])
-				+ two_plus_ep2 * (u[ij + offset[kase][5]] - u[ij + offset[kase][6]]));
+			ij = C->ij_sw_corner + j;
+			C->u[ij+C->offset[kase][4]] = 
+				C->u[ij + C->offset[kase][7]] + (float)(C->eps_p2 * (C->u[ij + C->offset[kase][3]] + C->u[ij + C->offset[kase][10]]
+				-C->u[ij + C->offset[kase][1]] - C->u[ij + C->offset[kase][8]])
+				+ C->two_plus_ep2 * (C->u[ij + C->offset[kase][5]] - C->u[ij + C->offset[kase][6]]));
 				/*  + tense * (u[ij + offset[kase][6]] - u[ij + offset[kase][5]]) / (1.0 - tense);  */
 			/* East side :  */
 			kase = 20 + y_case;
-			ij = ij_se_corner + j;
-			u[ij + offset[kase][7]] = 
-				- (float)(-u[ij + offset[kase][4]] + eps_p2 * (u[ij + offset[kase][3]] + u[ij + offset[kase][10]]
-				- u[ij + offset[kase][1]] - u[ij + offset[kase][8]])
-				+ two_plus_ep2 * (u[ij + offset[kase][5]] - u[ij + offset[kase][6]]) );
+			ij = C->ij_se_corner + j;
+			C->u[ij + C->offset[kase][7]] = 
+				- (float)(-C->u[ij + C->offset[kase][4]] + C->eps_p2 * (C->u[ij + C->offset[kase][3]] + C->u[ij + C->offset[kase][10]]
+				- C->u[ij + C->offset[kase][1]] - C->u[ij + C->offset[kase][8]])
+				+ C->two_plus_ep2 * (C->u[ij + C->offset[kase][5]] - C->u[ij + C->offset[kase][6]]) );
 				/*  - tense * (u[ij + offset[kase][6]] - u[ij + offset[kase][5]]) / (1.0 - tense);  */
 		}
 
@@ -2494,8 +2514,8 @@ int	iterate(int mode) {
 		/* That's it for the boundary points.  Now loop over all data  */
 		
 		x_w_case = 0;
-		x_e_case = block_nx - 1;
-		for (i = 0; i < nx; i += grid, x_w_case++, x_e_case--) {
+		x_e_case = C->block_nx - 1;
+		for (i = 0; i < C->nx; i += C->grid, x_w_case++, x_e_case--) {
 		
 			if(x_w_case < 2)
 				x_case = x_w_case;
@@ -2505,13 +2525,13 @@ int	iterate(int mode) {
 				x_case = 2;
 			
 			y_s_case = 0;
-			y_n_case = block_ny - 1;
+			y_n_case = C->block_ny - 1;
 			
-			ij = ij_sw_corner + i * my;
+			ij = C->ij_sw_corner + i * C->my;
 			
-			for (j = 0; j < ny; j += grid, ij += grid, y_s_case++, y_n_case--) {
+			for (j = 0; j < C->ny; j += C->grid, ij += C->grid, y_s_case++, y_n_case--) {
 	
-				if (iu[ij] == 5) continue;	/* Point is fixed  */
+				if (C->iu[ij] == 5) continue;	/* Point is fixed  */
 				
 				if(y_s_case < 2)
 					y_case = y_s_case;
@@ -2523,111 +2543,111 @@ int	iterate(int mode) {
 				kase = x_case * 5 + y_case;
 				sum_ij = 0.0;
 
-				if (iu[ij] == 0) {		/* Point is unconstrained  */
+				if (C->iu[ij] == 0) {		/* Point is unconstrained  */
 					for (k = 0; k < 12; k++) {
-						sum_ij += (u[ij + offset[kase][k]] * coeff[0][k]);
+						sum_ij += (C->u[ij + C->offset[kase][k]] * C->coeff[0][k]);
 					}
 				}
 				else {				/* Point is constrained  */
 				
-					b0 = briggs[briggs_index].b[0];
-					b1 = briggs[briggs_index].b[1];
-					b2 = briggs[briggs_index].b[2];
-					b3 = briggs[briggs_index].b[3];
-					b4 = briggs[briggs_index].b[4];
-					b5 = briggs[briggs_index].b[5];
+					b0 = C->briggs[briggs_index].b[0];
+					b1 = C->briggs[briggs_index].b[1];
+					b2 = C->briggs[briggs_index].b[2];
+					b3 = C->briggs[briggs_index].b[3];
+					b4 = C->briggs[briggs_index].b[4];
+					b5 = C->briggs[briggs_index].b[5];
 					briggs_index++;
-					if (iu[ij] < 3) {
-						if (iu[ij] == 1) {	/* Point is in quadrant 1  */
-							busum = b0 * u[ij + offset[kase][10]]
-								+ b1 * u[ij + offset[kase][9]]
-								+ b2 * u[ij + offset[kase][5]]
-								+ b3 * u[ij + offset[kase][1]];
+					if (C->iu[ij] < 3) {
+						if (C->iu[ij] == 1) {	/* Point is in quadrant 1  */
+							busum = b0 * C->u[ij + C->offset[kase][10]]
+								+ b1 * C->u[ij + C->offset[kase][9]]
+								+ b2 * C->u[ij + C->offset[kase][5]]
+								+ b3 * C->u[ij + C->offset[kase][1]];
 						}
 						else {			/* Point is in quadrant 2  */
-							busum = b0 * u[ij + offset[kase][8]]
-								+ b1 * u[ij + offset[kase][9]]
-								+ b2 * u[ij + offset[kase][6]]
-								+ b3 * u[ij + offset[kase][3]];
+							busum = b0 * C->u[ij + C->offset[kase][8]]
+								+ b1 * C->u[ij + C->offset[kase][9]]
+								+ b2 * C->u[ij + C->offset[kase][6]]
+								+ b3 * C->u[ij + C->offset[kase][3]];
 						}
 					}
 					else {
-						if (iu[ij] == 3) {	/* Point is in quadrant 3  */
-							busum = b0 * u[ij + offset[kase][1]]
-								+ b1 * u[ij + offset[kase][2]]
-								+ b2 * u[ij + offset[kase][6]]
-								+ b3 * u[ij + offset[kase][10]];
+						if (C->iu[ij] == 3) {	/* Point is in quadrant 3  */
+							busum = b0 * C->u[ij + C->offset[kase][1]]
+								+ b1 * C->u[ij + C->offset[kase][2]]
+								+ b2 * C->u[ij + C->offset[kase][6]]
+								+ b3 * C->u[ij + C->offset[kase][10]];
 						}
 						else {		/* Point is in quadrant 4  */
-							busum = b0 * u[ij + offset[kase][3]]
-								+ b1 * u[ij + offset[kase][2]]
-								+ b2 * u[ij + offset[kase][5]]
-								+ b3 * u[ij + offset[kase][8]];
+							busum = b0 * C->u[ij + C->offset[kase][3]]
+								+ b1 * C->u[ij + C->offset[kase][2]]
+								+ b2 * C->u[ij + C->offset[kase][5]]
+								+ b3 * C->u[ij + C->offset[kase][8]];
 						}
 					}
 					for (k = 0; k < 12; k++) {
-						sum_ij += (u[ij + offset[kase][k]] * coeff[1][k]);
+						sum_ij += (C->u[ij + C->offset[kase][k]] * C->coeff[1][k]);
 					}
-					sum_ij = (sum_ij + a0_const_2 * (busum + b5))
-						/ (a0_const_1 + a0_const_2 * b4);
+					sum_ij = (sum_ij + C->a0_const_2 * (busum + b5))
+						/ (C->a0_const_1 + C->a0_const_2 * b4);
 				}
 				
 				/* New relaxation here  */
-				sum_ij = u[ij] * relax_old + sum_ij * relax_new;
+				sum_ij = C->u[ij] * C->relax_old + sum_ij * C->relax_new;
 				
-				if (constrained) {	/* Must check limits.  Note lower/upper is v2 format and need ij_v2! */
-					ij_v2 = (ny - j - 1) * nx + i;
-					if (set_low /*&& !GMT_is_fnan((double)lower[ij_v2])*/ && sum_ij < lower[ij_v2])
-						sum_ij = lower[ij_v2];
-					else if (set_high /*&& !GMT_is_fnan((double)upper[ij_v2])*/ && sum_ij > upper[ij_v2])
-						sum_ij = upper[ij_v2];
+				if (C->constrained) {	/* Must check limits.  Note lower/upper is v2 format and need ij_v2! */
+					ij_v2 = (C->ny - j - 1) * C->nx + i;
+					if (C->set_low /*&& !GMT_is_fnan((double)lower[ij_v2])*/ && sum_ij < C->lower[ij_v2])
+						sum_ij = C->lower[ij_v2];
+					else if (C->set_high /*&& !GMT_is_fnan((double)upper[ij_v2])*/ && sum_ij > C->upper[ij_v2])
+						sum_ij = C->upper[ij_v2];
 				}
 					
-				change = fabs(sum_ij - u[ij]);
-				u[ij] = (float)sum_ij;
+				change = fabs(sum_ij - C->u[ij]);
+				C->u[ij] = (float)sum_ij;
 				if (change > max_change) max_change = change;
 			}
 		}
 		iteration_count++;
-		total_iterations++;
-		max_change *= z_scale;	/* Put max_change into z units  */
-		if (verbose > 1) 
-			mexPrintf("%4d\t%c\t%8d\t%10g\t%10g\t%10d\n", grid, mode_type[mode], 
-				iteration_count, max_change, current_limit, total_iterations);
+		C->total_iterations++;
+		max_change *= C->z_scale;	/* Put max_change into z units  */
+		if (C->verbose > 1) 
+			mexPrintf("%4d\t%c\t%8d\t%10g\t%10g\t%10d\n", C->grid, mode_type[mode], 
+				iteration_count, max_change, current_limit, C->total_iterations);
 
-	} while (max_change > current_limit && iteration_count < max_iterations);
+	} while (max_change > current_limit && iteration_count < C->max_iterations);
 	
-	if (verbose) mexPrintf("%4d\t%c\t%8d\t%10g\t%10g\t%10d\n",
-		grid, mode_type[mode], iteration_count, max_change, current_limit, total_iterations);
+	if (C->verbose) mexPrintf("%4d\t%c\t%8d\t%10g\t%10g\t%10d\n",
+		C->grid, mode_type[mode], iteration_count, max_change, current_limit, C->total_iterations);
 
 	return(iteration_count);
 }
 
-void check_errors () {
+void check_errors (struct SURFACE_CTX *C) {
 
 	int	i, j, k, ij, n_nodes, move_over[12];	/* move_over = offset[kase][12], but grid = 1 so move_over is easy  */
 	
 	double	x0, y0, dx, dy, mean_error, mean_squared_error, z_est, z_err, curvature, c;
 	double	du_dx, du_dy, d2u_dx2, d2u_dxdy, d2u_dy2, d3u_dx3, d3u_dx2dy, d3u_dxdy2, d3u_dy3;
 	
-	double	x_0_const = 4.0 * (1.0 - boundary_tension) / (2.0 - boundary_tension);
-	double	x_1_const = (3 * boundary_tension - 2.0) / (2.0 - boundary_tension);
-	double	y_denom = 2 * epsilon * (1.0 - boundary_tension) + boundary_tension;
-	double	y_0_const = 4 * epsilon * (1.0 - boundary_tension) / y_denom;
-	double	y_1_const = (boundary_tension - 2 * epsilon * (1.0 - boundary_tension) ) / y_denom;
+	double	x_0_const = 4.0 * (1.0 - C->boundary_tension) / (2.0 - C->boundary_tension);
+	double	x_1_const = (3 * C->boundary_tension - 2.0) / (2.0 - C->boundary_tension);
+	double	y_denom = 2 * C->epsilon * (1.0 - C->boundary_tension) + C->boundary_tension;
+	double	y_0_const = 4 * C->epsilon * (1.0 - C->boundary_tension) / y_denom;
+	double	y_1_const = (C->boundary_tension - 2 * C->epsilon * (1.0 - C->boundary_tension) ) / y_denom;
 	
 	
 	move_over[0] = 2;
-	move_over[1] = 1 - my;
+	move_over[1] = 1 - C->my;
 	move_over[2] = 1;
-	move_over[3] = 1 + my;
-	move_over[4] = -2 * my;
-	move_over[5] = -my;
-	move_over[6] = my;
-	move_over[7] = 2 * my;
-	move_over[8] = -1 - my;
+	move_over[3] = 1 + C->my;
+	move_over[4] = -2 * C->my;
+	move_over[5] = -C->my;
+	move_over[6] = C->my;
+	move_over[7] = 2 * C->my;
+	move_over[8] = -1 - C->my;
 	move_over[9] = -1;
-	move_over[10] = -1 + my;
+	move_over[10] = -1 + C->my;
 	move_over[11] = -2;
 
 	mean_error = 0;
@@ -2635,121 +2655,121 @@ void check_errors () {
 	
 	/* First update the boundary values  */
 
-	for (i = 0; i < nx; i ++) {
-		ij = ij_sw_corner + i * my;
-		u[ij - 1] = (float)(y_0_const * u[ij] + y_1_const * u[ij + 1]);
-		ij = ij_nw_corner + i * my;
-		u[ij + 1] = (float)(y_0_const * u[ij] + y_1_const * u[ij - 1]);
+	for (i = 0; i < C->nx; i ++) {
+		ij = C->ij_sw_corner + i * C->my;
+		C->u[ij - 1] = (float)(y_0_const * C->u[ij] + y_1_const * C->u[ij + 1]);
+		ij = C->ij_nw_corner + i * C->my;
+		C->u[ij + 1] = (float)(y_0_const * C->u[ij] + y_1_const * C->u[ij - 1]);
 	}
 
-	for (j = 0; j < ny; j ++) {
-		ij = ij_sw_corner + j;
-		u[ij - my] = (float)(x_1_const * u[ij + my] + x_0_const * u[ij]);
-		ij = ij_se_corner + j;
-		u[ij + my] = (float)(x_1_const * u[ij - my] + x_0_const * u[ij]);
+	for (j = 0; j < C->ny; j ++) {
+		ij = C->ij_sw_corner + j;
+		C->u[ij - C->my] = (float)(x_1_const * C->u[ij + C->my] + x_0_const * C->u[ij]);
+		ij = C->ij_se_corner + j;
+		C->u[ij + C->my] = (float)(x_1_const * C->u[ij - C->my] + x_0_const * C->u[ij]);
 	}
 
-	ij = ij_sw_corner;
-	u[ij - my - 1] = u[ij + my - 1] + u[ij - my + 1] - u[ij + my + 1];
-	ij = ij_nw_corner;
-	u[ij - my + 1] = u[ij + my + 1] + u[ij - my - 1] - u[ij + my - 1];
-	ij = ij_se_corner;
-	u[ij + my - 1] = u[ij - my - 1] + u[ij + my + 1] - u[ij - my + 1];
-	ij = ij_ne_corner;
-	u[ij + my + 1] = u[ij - my + 1] + u[ij + my - 1] - u[ij - my - 1];
+	ij = C->ij_sw_corner;
+	C->u[ij - C->my - 1] = C->u[ij + C->my - 1] + C->u[ij - C->my + 1] - C->u[ij + C->my + 1];
+	ij = C->ij_nw_corner;
+	C->u[ij - C->my + 1] = C->u[ij + C->my + 1] + C->u[ij - C->my - 1] - C->u[ij + C->my - 1];
+	ij = C->ij_se_corner;
+	C->u[ij + C->my - 1] = C->u[ij - C->my - 1] + C->u[ij + C->my + 1] - C->u[ij - C->my + 1];
+	ij = C->ij_ne_corner;
+	C->u[ij + C->my + 1] = C->u[ij - C->my + 1] + C->u[ij + C->my - 1] - C->u[ij - C->my - 1];
 
-	for (i = 0; i < nx; i ++) {
+	for (i = 0; i < C->nx; i ++) {
 				
-		ij = ij_sw_corner + i * my;
-		u[ij + move_over[11]] = 
-			(float)(u[ij + move_over[0]] + eps_m2*(u[ij + move_over[1]] + u[ij + move_over[3]]
-				- u[ij + move_over[8]] - u[ij + move_over[10]])
-				+ two_plus_em2 * (u[ij + move_over[9]] - u[ij + move_over[2]]) );
+		ij = C->ij_sw_corner + i * C->my;
+		C->u[ij + move_over[11]] = 
+			(float)(C->u[ij + move_over[0]] + C->eps_m2*(C->u[ij + move_over[1]] + C->u[ij + move_over[3]]
+				- C->u[ij + move_over[8]] - C->u[ij + move_over[10]])
+				+ C->two_plus_em2 * (C->u[ij + move_over[9]] - C->u[ij + move_over[2]]) );
 					
-		ij = ij_nw_corner + i * my;
-		u[ij + move_over[0]] = 
-			-(float)(-u[ij + move_over[11]] + eps_m2 * (u[ij + move_over[1]] + u[ij + move_over[3]]
-				- u[ij + move_over[8]] - u[ij + move_over[10]])
-				+ two_plus_em2 * (u[ij + move_over[9]] - u[ij + move_over[2]]) );
+		ij = C->ij_nw_corner + i * C->my;
+		C->u[ij + move_over[0]] = 
+			-(float)(-C->u[ij + move_over[11]] + C->eps_m2 * (C->u[ij + move_over[1]] + C->u[ij + move_over[3]]
+				- C->u[ij + move_over[8]] - C->u[ij + move_over[10]])
+				+ C->two_plus_em2 * (C->u[ij + move_over[9]] - C->u[ij + move_over[2]]) );
 	}
 		
-	for (j = 0; j < ny; j ++) {
+	for (j = 0; j < C->ny; j ++) {
 			
-		ij = ij_sw_corner + j;
-		u[ij+move_over[4]] = 
-			u[ij + move_over[7]] + (float)(eps_p2 * (u[ij + move_over[3]] + u[ij + move_over[10]]
-			-u[ij + move_over[1]] - u[ij + move_over[8]])
-			+ two_plus_ep2 * (u[ij + move_over[5]] - u[ij + move_over[6]]));
+		ij = C->ij_sw_corner + j;
+		C->u[ij+move_over[4]] = 
+			C->u[ij + move_over[7]] + (float)(C->eps_p2 * (C->u[ij + move_over[3]] + C->u[ij + move_over[10]]
+			-C->u[ij + move_over[1]] - C->u[ij + move_over[8]])
+			+ C->two_plus_ep2 * (C->u[ij + move_over[5]] - C->u[ij + move_over[6]]));
 				
-		ij = ij_se_corner + j;
-		u[ij + move_over[7]] = 
-			- (float)(-u[ij + move_over[4]] + eps_p2 * (u[ij + move_over[3]] + u[ij + move_over[10]]
-			- u[ij + move_over[1]] - u[ij + move_over[8]])
-			+ two_plus_ep2 * (u[ij + move_over[5]] - u[ij + move_over[6]]) );
+		ij = C->ij_se_corner + j;
+		C->u[ij + move_over[7]] = 
+			- (float)(-C->u[ij + move_over[4]] + C->eps_p2 * (C->u[ij + move_over[3]] + C->u[ij + move_over[10]]
+			- C->u[ij + move_over[1]] - C->u[ij + move_over[8]])
+			+ C->two_plus_ep2 * (C->u[ij + move_over[5]] - C->u[ij + move_over[6]]) );
 	}
 
 	/* That resets the boundary values.  Now we can test all data.  
 		Note that this loop checks all values, even though only nearest were used.  */
 	
-	for (k = 0; k < npoints; k++) {
-		i = data[k].index/ny;
-		j = data[k].index%ny;
-	 	ij = ij_sw_corner + i * my + j;
-	 	if ( iu[ij] == 5 ) continue;
-	 	x0 = xmin + i*xinc;
-	 	y0 = ymin + j*yinc;
-	 	dx = (data[k].x - x0)*r_xinc;
-	 	dy = (data[k].y - y0)*r_yinc;
+	for (k = 0; k < C->npoints; k++) {
+		i = C->data[k].index/C->ny;
+		j = C->data[k].index%C->ny;
+	 	ij = C->ij_sw_corner + i * C->my + j;
+	 	if ( C->iu[ij] == 5 ) continue;
+	 	x0 = C->xmin + i*C->xinc;
+	 	y0 = C->ymin + j*C->yinc;
+	 	dx = (C->data[k].x - x0)*C->r_xinc;
+	 	dy = (C->data[k].y - y0)*C->r_yinc;
  
-	 	du_dx = 0.5 * (u[ij + move_over[6]] - u[ij + move_over[5]]);
-	 	du_dy = 0.5 * (u[ij + move_over[2]] - u[ij + move_over[9]]);
-	 	d2u_dx2 = u[ij + move_over[6]] + u[ij + move_over[5]] - 2 * u[ij];
-	 	d2u_dy2 = u[ij + move_over[2]] + u[ij + move_over[9]] - 2 * u[ij];
-	 	d2u_dxdy = 0.25 * (u[ij + move_over[3]] - u[ij + move_over[1]]
-	 			- u[ij + move_over[10]] + u[ij + move_over[8]]);
-	 	d3u_dx3 = 0.5 * ( u[ij + move_over[7]] - 2 * u[ij + move_over[6]]
-	 				+ 2 * u[ij + move_over[5]] - u[ij + move_over[4]]);
-	 	d3u_dy3 = 0.5 * ( u[ij + move_over[0]] - 2 * u[ij + move_over[2]]
-	 				+ 2 * u[ij + move_over[9]] - u[ij + move_over[11]]);
-	 	d3u_dx2dy = 0.5 * ( ( u[ij + move_over[3]] + u[ij + move_over[1]] - 2 * u[ij + move_over[2]] )
-	 				- ( u[ij + move_over[10]] + u[ij + move_over[8]] - 2 * u[ij + move_over[9]] ) );
-	 	d3u_dxdy2 = 0.5 * ( ( u[ij + move_over[3]] + u[ij + move_over[10]] - 2 * u[ij + move_over[6]] )
-	 				- ( u[ij + move_over[1]] + u[ij + move_over[8]] - 2 * u[ij + move_over[5]] ) );
+	 	du_dx = 0.5 * (C->u[ij + move_over[6]] - C->u[ij + move_over[5]]);
+	 	du_dy = 0.5 * (C->u[ij + move_over[2]] - C->u[ij + move_over[9]]);
+	 	d2u_dx2 = C->u[ij + move_over[6]] + C->u[ij + move_over[5]] - 2 * C->u[ij];
+	 	d2u_dy2 = C->u[ij + move_over[2]] + C->u[ij + move_over[9]] - 2 * C->u[ij];
+	 	d2u_dxdy = 0.25 * (C->u[ij + move_over[3]] - C->u[ij + move_over[1]]
+	 			- C->u[ij + move_over[10]] + C->u[ij + move_over[8]]);
+	 	d3u_dx3 = 0.5 * ( C->u[ij + move_over[7]] - 2 * C->u[ij + move_over[6]]
+	 				+ 2 * C->u[ij + move_over[5]] - C->u[ij + move_over[4]]);
+	 	d3u_dy3 = 0.5 * ( C->u[ij + move_over[0]] - 2 * C->u[ij + move_over[2]]
+	 				+ 2 * C->u[ij + move_over[9]] - C->u[ij + move_over[11]]);
+	 	d3u_dx2dy = 0.5 * ( ( C->u[ij + move_over[3]] + C->u[ij + move_over[1]] - 2 * C->u[ij + move_over[2]] )
+	 				- ( C->u[ij + move_over[10]] + C->u[ij + move_over[8]] - 2 * C->u[ij + move_over[9]] ) );
+	 	d3u_dxdy2 = 0.5 * ( ( C->u[ij + move_over[3]] + C->u[ij + move_over[10]] - 2 * C->u[ij + move_over[6]] )
+	 				- ( C->u[ij + move_over[1]] + C->u[ij + move_over[8]] - 2 * C->u[ij + move_over[5]] ) );
 
 	 	/* 3rd order Taylor approx:  */
 	 		
-	 	z_est = u[ij] + dx * (du_dx +  dx * ( (0.5 * d2u_dx2) + dx * (d3u_dx3 / 6.0) ) )
+	 	z_est = C->u[ij] + dx * (du_dx +  dx * ( (0.5 * d2u_dx2) + dx * (d3u_dx3 / 6.0) ) )
 				+ dy * (du_dy +  dy * ( (0.5 * d2u_dy2) + dy * (d3u_dy3 / 6.0) ) )
 	 			+ dx * dy * (d2u_dxdy) + (0.5 * dx * d3u_dx2dy) + (0.5 * dy * d3u_dxdy2);
 	 		
-	 	z_err = z_est - data[k].z;
+	 	z_err = z_est - C->data[k].z;
 	 	mean_error += z_err;
 	 	mean_squared_error += (z_err * z_err);
 	 }
-	 mean_error /= npoints;
-	 mean_squared_error = sqrt( mean_squared_error / npoints);
+	 mean_error /= C->npoints;
+	 mean_squared_error = sqrt( mean_squared_error / C->npoints);
 	 
 	 curvature = 0.0;
-	 n_nodes = nx * ny;
+	 n_nodes = C->nx * C->ny;
 	 
-	 for (i = 0; i < nx; i++) {
-	 	for (j = 0; j < ny; j++) {
-	 		ij = ij_sw_corner + i * my + j;
-	 		c = u[ij + move_over[6]] + u[ij + move_over[5]]
-	 			+ u[ij + move_over[2]] + u[ij + move_over[9]] - 4.0 * u[ij + move_over[6]];
+	 for (i = 0; i < C->nx; i++) {
+	 	for (j = 0; j < C->ny; j++) {
+	 		ij = C->ij_sw_corner + i * C->my + j;
+	 		c = C->u[ij + move_over[6]] + C->u[ij + move_over[5]]
+	 			+ C->u[ij + move_over[2]] + C->u[ij + move_over[9]] - 4.0 * C->u[ij + move_over[6]];
 			curvature += (c * c);
 		}
 	}
 
-	if (verbose) {
+	if (C->verbose) {
 		mexPrintf("\nSpline interpolation fit information:\n");
 		mexPrintf("Data points   nodes    mean error     rms error     curvature\n");
 		mexPrintf("%9d %9d   %10g   %10g  %10g\n",
-			npoints, n_nodes, mean_error, mean_squared_error, curvature);
+			C->npoints, n_nodes, mean_error, mean_squared_error, curvature);
 	}
  }
 
-void	remove_planar_trend() {
+void	remove_planar_trend(struct SURFACE_CTX *C) {
 
 	int	i;
 	double	a, b, c, d, xx, yy, zz;
@@ -2757,11 +2777,11 @@ void	remove_planar_trend() {
 	
 	sx = sy = sz = sxx = sxy = sxz = syy = syz = 0.0;
 	
-	for (i = 0; i < npoints; i++) {
+	for (i = 0; i < C->npoints; i++) {
 
-		xx = (data[i].x - xmin) * r_xinc;
-		yy = (data[i].y - ymin) * r_yinc;
-		zz = data[i].z;
+		xx = (C->data[i].x - C->xmin) * C->r_xinc;
+		yy = (C->data[i].y - C->ymin) * C->r_yinc;
+		zz = C->data[i].z;
 		
 		sx += xx;
 		sy += yy;
@@ -2773,43 +2793,43 @@ void	remove_planar_trend() {
 		syz +=(yy * zz);
 	}
 	
-	d = npoints*sxx*syy + 2*sx*sy*sxy - npoints*sxy*sxy - sx*sx*syy - sy*sy*sxx;
+	d = C->npoints*sxx*syy + 2*sx*sy*sxy - C->npoints*sxy*sxy - sx*sx*syy - sy*sy*sxx;
 	
 	if (d == 0.0) {
-		plane_c0 = plane_c1 = plane_c2 = 0.0;
+		C->plane_c0 = C->plane_c1 = C->plane_c2 = 0.0;
 		return;
 	}
 	
 	a = sz*sxx*syy + sx*sxy*syz + sy*sxy*sxz - sz*sxy*sxy - sx*sxz*syy - sy*syz*sxx;
-	b = npoints*sxz*syy + sz*sy*sxy + sy*sx*syz - npoints*sxy*syz - sz*sx*syy - sy*sy*sxz;
-	c = npoints*sxx*syz + sx*sy*sxz + sz*sx*sxy - npoints*sxy*sxz - sx*sx*syz - sz*sy*sxx;
+	b = C->npoints*sxz*syy + sz*sy*sxy + sy*sx*syz - C->npoints*sxy*syz - sz*sx*syy - sy*sy*sxz;
+	c = C->npoints*sxx*syz + sx*sy*sxz + sz*sx*sxy - C->npoints*sxy*sxz - sx*sx*syz - sz*sy*sxx;
 
-	plane_c0 = a / d;
-	plane_c1 = b / d;
-	plane_c2 = c / d;
+	C->plane_c0 = a / d;
+	C->plane_c1 = b / d;
+	C->plane_c2 = c / d;
 
-	for (i = 0; i < npoints; i++) {
+	for (i = 0; i < C->npoints; i++) {
 
-		xx = (data[i].x - xmin) * r_xinc;
-		yy = (data[i].y - ymin) * r_yinc;
+		xx = (C->data[i].x - C->xmin) * C->r_xinc;
+		yy = (C->data[i].y - C->ymin) * C->r_yinc;
 		
-		data[i].z -= (float)(plane_c0 + plane_c1 * xx + plane_c2 * yy);
+		C->data[i].z -= (float)(C->plane_c0 + C->plane_c1 * xx + C->plane_c2 * yy);
 	}
 
 }
 
-void	replace_planar_trend() {
+void	replace_planar_trend(struct SURFACE_CTX *C) {
 	int	i, j, ij;
 
-	 for (i = 0; i < nx; i++) {
-	 	for (j = 0; j < ny; j++) {
-	 		ij = ij_sw_corner + i * my + j;
-	 		u[ij] = (float)((u[ij] * z_scale) + (plane_c0 + plane_c1 * i + plane_c2 * j));
+	 for (i = 0; i < C->nx; i++) {
+	 	for (j = 0; j < C->ny; j++) {
+	 		ij = C->ij_sw_corner + i * C->my + j;
+	 		C->u[ij] = (float)((C->u[ij] * C->z_scale) + (C->plane_c0 + C->plane_c1 * i + C->plane_c2 * j));
 		}
 	}
 }
 
-void	throw_away_unusables() {
+void	throw_away_unusables(struct SURFACE_CTX *C) {
 	/* This is a new routine to eliminate data which will become
 		unusable on the final iteration, when grid = 1.
 		It assumes grid = 1 and set_grid_parameters has been
@@ -2825,53 +2845,55 @@ void	throw_away_unusables() {
 	
 	/* Sort the data  */
 	
-	qsort ((char *)data, npoints, sizeof (struct SURFACE_DATA), compare_points);
+	C_sort = C;
+	qsort ((char *)C->data, C->npoints, sizeof (struct SURFACE_DATA), compare_points);
 	
 	/* If more than one datum is indexed to same node, only the first should be kept.
 		Mark the additional ones as OUTSIDE
 	*/
 	last_index = -1;
 	n_outside = 0;
-	for (k = 0; k < npoints; k++) {
-		if (data[k].index == last_index) {
-			data[k].index = OUTSIDE;
+	for (k = 0; k < C->npoints; k++) {
+		if (C->data[k].index == last_index) {
+			C->data[k].index = OUTSIDE;
 			n_outside++;
 		}
 		else {
-			last_index = data[k].index;
+			last_index = C->data[k].index;
 		}
 	}
 	/* Sort again; this time the OUTSIDE points will be thrown away  */
 	
-	qsort ((char *)data, npoints, sizeof (struct SURFACE_DATA), compare_points);
-	npoints -= n_outside;
-	data = (struct SURFACE_DATA *) mxCalloc ((size_t)npoints, sizeof(struct SURFACE_DATA));
-	if (verbose && (n_outside)) {
+	C_sort = C;
+	qsort ((char *)C->data, C->npoints, sizeof (struct SURFACE_DATA), compare_points);
+	C->npoints -= n_outside;
+	C->data = (struct SURFACE_DATA *) mxRealloc ((void *)C->data, (size_t)C->npoints * sizeof(struct SURFACE_DATA));
+	if (C->verbose && (n_outside)) {
 		mexPrintf("surface: %d unusable points were supplied; these will be ignored.\n", n_outside);
 		mexPrintf("\tYou should have pre-processed the data with blockmean or blockmedian.\n");
 	}
 
 }
 
-void	rescale_z_values() {
+void	rescale_z_values(struct SURFACE_CTX *C) {
 	int	i;
 	double	ssz = 0.0;
 
-	for (i = 0; i < npoints; i++) {
-		ssz += (data[i].z * data[i].z);
+	for (i = 0; i < C->npoints; i++) {
+		ssz += (C->data[i].z * C->data[i].z);
 	}
 	
 	/* Set z_scale = rms(z):  */
 	
-	z_scale = sqrt(ssz / npoints);
-	r_z_scale = 1.0 / z_scale;
+	C->z_scale = sqrt(ssz / C->npoints);
+	C->r_z_scale = 1.0 / C->z_scale;
 
-	for (i = 0; i < npoints; i++) {
-		data[i].z *= (float)r_z_scale;
+	for (i = 0; i < C->npoints; i++) {
+		C->data[i].z *= (float)C->r_z_scale;
 	}
 }
 
-void load_constraints (char *low, char *high) {
+void load_constraints (struct SURFACE_CTX *C, char *low, char *high) {
 	int i, j, ij;
 	/* int n_trimmed;*/
 	double yy;
@@ -2879,36 +2901,36 @@ void load_constraints (char *low, char *high) {
 	
 	/* Load lower/upper limits, verify range, deplane, and rescale */
 	
-	if (set_low > 0) {
-		lower = (float *) mxCalloc ((size_t)(nx * ny), sizeof (float));
-		if (set_low < 3)
-			for (i = 0; i < nx * ny; i++) lower[i] = (float)low_limit;
+	if (C->set_low > 0) {
+		C->lower = (float *) mxCalloc ((size_t)(C->nx * C->ny), sizeof (float));
+		if (C->set_low < 3)
+			for (i = 0; i < C->nx * C->ny; i++) C->lower[i] = (float)C->low_limit;
 
 			
-		for (j = ij = 0; j < ny; j++) {
-			yy = ny - j - 1;
-			for (i = 0; i < nx; i++, ij++) {
+		for (j = ij = 0; j < C->ny; j++) {
+			yy = C->ny - j - 1;
+			for (i = 0; i < C->nx; i++, ij++) {
 				/*if (GMT_is_fnan ((double)lower[ij])) continue;*/
-				lower[ij] -= (float)(plane_c0 + plane_c1 * i + plane_c2 * yy);
-				lower[ij] *= (float)r_z_scale;
+				C->lower[ij] -= (float)(C->plane_c0 + C->plane_c1 * i + C->plane_c2 * yy);
+				C->lower[ij] *= (float)C->r_z_scale;
 			}
 		}
-		constrained = TRUE;
+		C->constrained = TRUE;
 	}
-	if (set_high > 0) {
-		upper = (float *) mxCalloc ((size_t)(nx * ny), sizeof (float));
-		if (set_high < 3)
-			for (i = 0; i < nx * ny; i++) upper[i] = (float)high_limit;
+	if (C->set_high > 0) {
+		C->upper = (float *) mxCalloc ((size_t)(C->nx * C->ny), sizeof (float));
+		if (C->set_high < 3)
+			for (i = 0; i < C->nx * C->ny; i++) C->upper[i] = (float)C->high_limit;
 
-		for (j = ij = 0; j < ny; j++) {
-			yy = ny - j - 1;
-			for (i = 0; i < nx; i++, ij++) {
+		for (j = ij = 0; j < C->ny; j++) {
+			yy = C->ny - j - 1;
+			for (i = 0; i < C->nx; i++, ij++) {
 				/*if (GMT_is_fnan ((double)upper[ij])) continue;*/
-				upper[ij] -= (float)(plane_c0 + plane_c1 * i + plane_c2 * yy);
-				upper[ij] *= (float)r_z_scale;
+				C->upper[ij] -= (float)(C->plane_c0 + C->plane_c1 * i + C->plane_c2 * yy);
+				C->upper[ij] *= (float)C->r_z_scale;
 			}
 		}
-		constrained = TRUE;
+		C->constrained = TRUE;
 	}
 }
 
@@ -2941,6 +2963,7 @@ double	guess_surface_time(int nx, int ny) {
 	int	gcd;		/* Current value of the gcd  */
 	int	nxg, nyg;	/* Current value of the grid dimensions  */
 	int	nfactors;	/* Number of prime factors of current gcd  */
+	int	factors[32];	/* Array of common factors */
 	int	factor;		/* Currently used factor  */
 	/* Doubles are used below, even though the values will be integers,
 		because the multiplications might reach sizes of O(n**3)  */
@@ -55,6 +55,15 @@ static char prog_id[] = "$Id: nswing.c 9936 2016-11-17 17:57:28Z j $";
  *     C:\programs\compa_libs\netcdf_GIT\compileds\VC12_64\lib\netcdf.lib /DI_AM_C 
  *     /DHAVE_NETCDF /nologo /D_CRT_SECURE_NO_WARNINGS /fp:precise /Ox
  *
+ * Add /Qopenmp /DHAVE_OPENMP (or -fopenmp -DHAVE_OPENMP with gcc) to split the rows of the
+ * mass, moment, open boundary and upscale loops among threads (see -j option). Nested grids that
+ * share the same parent then run concurrently, each on its own thread.
+ * Add -DSINGLE_PRECISION to store the simulation state arrays in floats (half the memory). Cell
+ * computations are still done in doubles. Use -W to compare its max level with the double build.
+ * The branch free loops of the -s option need the compiler's vectorizer (-O3 with gcc). gcc also
+ * needs -fno-trapping-math, otherwise the floating point compares keep those loops scalar.
+ * The background writer (-b option) uses Windows threads or pthreads (add -pthread on old glibc).
+ *
  *	Rewritten in C, mexified, added number options, etc... By
  *	Joaquim Luis - 2013
  *
@@ -120,6 +129,50 @@ union {uint64_t i; double d;} loc_nan = {0x7ff8000000000000};
 
 #if HAVE_OPENMP
 #include <omp.h>
+#	undef DO_MULTI_THREAD	/* Rows are already split among all threads. Don't also split M & N moments */
+#endif
+
+/* Minimal mutex/condition/thread layer for the background writer (-b option) */
+#if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+	typedef HANDLE             aw_thread_t;
+	typedef CRITICAL_SECTION   aw_mutex_t;
+	typedef CONDITION_VARIABLE aw_cond_t;
+#	define aw_lock(m)          EnterCriticalSection(m)
+#	define aw_unlock(m)        LeaveCriticalSection(m)
+#	define aw_wait(c, m)       SleepConditionVariableCS(c, m, INFINITE)
+#	define aw_wake(c)          WakeAllConditionVariable(c)
+#else
+#	include <pthread.h>
+	typedef pthread_t          aw_thread_t;
+	typedef pthread_mutex_t    aw_mutex_t;
+	typedef pthread_cond_t     aw_cond_t;
+#	define aw_lock(m)          pthread_mutex_lock(m)
+#	define aw_unlock(m)        pthread_mutex_unlock(m)
+#	define aw_wait(c, m)       pthread_cond_wait(c, m)
+#	define aw_wake(c)          pthread_cond_broadcast(c)
+#endif
+
+/* The strips of a domain decomposed run (-d option) are processes started with fork(). They share an anonymous
+   memory mapping and wait for each other on a counter in it. So only the stand-alone POSIX build (gcc or clang).
+   The runs of the benchmark (-Y option) are started with fork() too. */
+#if defined(I_AM_C) && !(defined(WIN32) || defined(_WIN32) || defined(_WIN64))
+#	define HAVE_STRIPS
+#	include <sys/mman.h>
+#	include <sys/wait.h>
+#	include <sys/stat.h>
+#	include <sys/resource.h>
+#	include <unistd.h>
+#	include <fcntl.h>
+#	include <errno.h>
+#	include <sched.h>
+#endif
+
+#ifdef _MSC_VER		/* Checkpoint and tracers files may be larger than 2 GB */
+#	define fseek64 _fseeki64
+#	define ftell64 _ftelli64
+#else
+#	define fseek64 fseeko
+#	define ftell64 ftello
 #endif
 
 #define	FALSE	0
@@ -153,7 +206,42 @@ union {uint64_t i; double d;} loc_nan = {0x7ff8000000000000};
 static double EPS4 = EPS4_;		/* Kinda trick to be able to change EPS4 via a command line option */
 
 #define MAXRUNUP -50 	/* Do not waste time computing flood above this altitude */
+#define ACTIVE_HALO 3	/* Max number of cells that a perturbation can travel in one step (mass + moment stencils) */
+/* Rows of the neighbour strips kept by each strip (-d option). Enough to hide the rows next to the strip borders
+   where the level 0 moment functions use the linear model ('jupe' rows, 10 in geographic and 5 in cartesian) */
+#define STRIP_HALO 10
 #define V_LIMIT   20	/* Upper limit of maximum velocity */
+#define TILE_BYTES 262144	/* Default -k band size. About what the arrays of a band of rows may take in a L2 cache */
+#define AW_SLOTS  16	/* Max number of writes queued in the background writer */
+#define AW_GRD     0	/* Kinds of queued writes: a Surfer binary grid, */
+#define AW_NC_FLT  1	/* a nc_put_vara_float() */
+#define AW_NC_DBL  2	/* a nc_put_vara_double() */
+#define AW_CKP     3	/* and a checkpoint file */
+#define MAX_LEVEL  1	/* What update_maxs() updates: the max level, */
+#define MAX_SPEED  2	/* the max velocity, */
+#define MAX_ENERGY 4	/* the max energy */
+#define MAX_POWER  8	/* or the max power */
+#define CKP_ALIGN 4096	/* The arrays of a checkpoint file start at multiples of this, so each can be memory-mapped */
+#define BENCH_DIR "nswing_bench"	/* Where the benchmark (-Y option) writes its grids and runs them */
+#define PH_ACTIVE    0	/* Phases of the main loop timed by the -P option. Active region tracking, */
+#define PH_MASS      1	/* mass conservation, */
+#define PH_OPENB     2	/* open boundary or wave maker, */
+#define PH_EDGES     3	/* edge_communication() of the nested grids, */
+#define PH_MOMENT    4	/* moment conservation (and replicate()), */
+#define PH_UPSCALE   5	/* upscale of the nested grids, */
+#define PH_UPDATE    6	/* update of eta and fluxes, */
+#define PH_MAX       7	/* update of the max level, velocity, energy or power, */
+#define PH_MAREGS    8	/* maregraphs, */
+#define PH_TRACERS   9	/* tracers, */
+#define PH_GRIDS    10	/* writing of grids, */
+#define PH_NETCDF   11	/* writing of netCDF slices */
+#define PH_CKP      12	/* writing of checkpoints */
+#define PH_TILED    13	/* the fused mass, openb, max level and moment sweeps of the -k option */
+#define PH_HALO     14	/* and the exchange of halo rows between strips (-d option) */
+#define N_PHASES    15
+#define TM_TIC(nest) (((nest)->tm) ? tm_clock() : 0)
+#define TM_TOC(nest,ph,lev,t0,cells) {if ((nest)->tm) tm_add((nest)->tm, ph, lev, t0, (double)(cells));}
+#define STRIP_RANK(nest) (((nest)->strip) ? (nest)->strip->rank : 0)	/* Only strip 0 writes files and prints */
 
 #define CNULL	((char *)NULL)
 #define Loc_copysign(x,y) ((y) < 0.0 ? -fabs(x) : fabs(x))
@@ -172,15 +260,66 @@ static double EPS4 = EPS4_;		/* Kinda trick to be able to change EPS4 via a comm
 #	define irint(x) ((int)rint(x))
 #endif
 
+#ifdef SINGLE_PRECISION		/* Type of the simulation state arrays (eta, fluxes, depths, velocities and bathymetry) */
+	typedef float  real;
+#else
+	typedef double real;
+#endif
+
+#if defined(_MSC_VER) || defined(__GNUC__)	/* Tell the vectorizer that the moment arrays do not overlap */
+#	define RESTRICT __restrict
+#else
+#	define RESTRICT
+#endif
+
 #define ijs(i,j,n) ((i) + (j)*n)
 #define ijc(i,j) ((i) + (j)*n_ptmar)
 #define ij_grd(col,row,hdr) ((col) + (row)*hdr.nx)
+/* Interior wet-wet (case b3/d3) cells with enough water to use the full non-linear scheme. Those are computed
+   by the branch free loops of the moment functions (-s option), the others fall back to the cases cascade.
+   The same macro is used in both loops so that each cell is computed once and only once. The (double) casts
+   reproduce the double locals used by the spherical functions. */
+#define WETWET_M(ij) ((bat[ij] > MAXRUNUP) & (htotal_d[ij] > EPS5) & (htotal_d[ij+1] > EPS5) &\
+	(-bat[ij+1] < etad[ij]) & (-bat[ij] < etad[ij+1]) &\
+	((htotal_d[ij] + htotal_d[ij+1]) * 0.5 >= EPS5) &\
+	((htotal_d[ij] + htotal_d[ij+1]) * 0.5 >= EPS4) &\
+	((htotal_d[ij] + htotal_a[ij] + htotal_d[ij+1] + htotal_a[ij+1]) * 0.25 > EPS5) &\
+	((htotal_d[ij] + htotal_a[ij] + htotal_d[ij+1] + htotal_a[ij+1]) * 0.25 >= EPS4))
+#define WETWET_N(ij) ((bat[ij] > MAXRUNUP) & (htotal_d[ij] > EPS5) & (htotal_d[ij+rp1] > EPS5) &\
+	(-bat[ij+rp1] < etad[ij]) & (-bat[ij] < etad[ij+rp1]) &\
+	((htotal_d[ij] + htotal_d[ij+rp1]) * 0.5 >= EPS5) &\
+	((htotal_d[ij] + htotal_d[ij+rp1]) * 0.5 >= EPS4) &\
+	((htotal_d[ij] + htotal_a[ij] + htotal_d[ij+rp1] + htotal_a[ij+rp1]) * 0.25 > EPS5) &\
+	((htotal_d[ij] + htotal_a[ij] + htotal_d[ij+rp1] + htotal_a[ij+rp1]) * 0.25 >= EPS4))
+#define WETWET_SP_M(ij) ((bat[ij] > MAXRUNUP) & (htotal_d[ij] > EPS5) & (htotal_d[ij+1] > EPS5) &\
+	(-bat[ij+1] < etad[ij]) & (-bat[ij] < etad[ij+1]) &\
+	(((double)htotal_d[ij] + htotal_d[ij+1]) * 0.5 >= EPS5) &\
+	(((double)htotal_d[ij] + htotal_a[ij] + htotal_d[ij+1] + htotal_a[ij+1]) * 0.25 > EPS5) &\
+	(((double)htotal_d[ij] + htotal_a[ij] + htotal_d[ij+1] + htotal_a[ij+1]) * 0.25 >= EPS3))
+#define WETWET_SP_N(ij) ((bat[ij] > MAXRUNUP) & (htotal_d[ij] > EPS5) & (htotal_d[ij+rp1] > EPS5) &\
+	(-bat[ij+rp1] < etad[ij]) & (-bat[ij] < etad[ij+rp1]) &\
+	(((double)htotal_d[ij] + htotal_d[ij+rp1]) * 0.5 >= EPS5) &\
+	(((double)htotal_d[ij] + htotal_a[ij] + htotal_d[ij+rp1] + htotal_a[ij+rp1]) * 0.25 > EPS5) &\
+	(((double)htotal_d[ij] + htotal_a[ij] + htotal_d[ij+rp1] + htotal_a[ij+rp1]) * 0.25 >= EPS3))
+
+/* Restrict the [c0, c1[ columns interval of this row to the active region (only tracked at level 0) */
+#define ACTIVE_COLS(nest,lev,row,c0,c1) if ((lev) == 0 && (nest)->act_on) {\
+	c0 = MAX(c0, (nest)->act_lo[row]);	c1 = MIN(c1, (nest)->act_hi[row] + 1); }
 
 typedef void (*PFV) ();		/* PFV declares a pointer to a function returning void */
 
-struct tracers {        /* For tracers (oranges) */
-	double *x;          /* x coordinate */
-	double *y;          /* y coordinate */
+struct tracers {        /* Pool of Lagrangian tracers (oranges). One array per coordinate, only the current positions */
+	int     n;          /* Number of tracers */
+	int     decim;      /* Write the positions every decim cycles */
+	int     ncid;       /* netCDF ragged array file, or -1 for the ASCII table */
+	int     ids[4];     /* netCDF ids of time, trajectory index, x and y */
+	size_t  n_obs;      /* Positions already in the netCDF file (length of its 'obs' dimension) */
+	int     *cell;      /* Linear index of the LowerLeft corner of the cell of each tracer, or -1 when outside */
+	int     *idx;       /* Scratch of n for the ragged array records */
+	double  *x;         /* x coordinates */
+	double  *y;         /* y coordinates */
+	double  *buf;       /* Scratch of 3*n for the ragged array records */
+	FILE    *fp;        /* ASCII table, one line per written cycle */
 };
 
 struct srf_header {     /* Surfer file hdr structure */
@@ -212,11 +351,102 @@ struct grd_header {     /* Generic grid hdr structure */
 	double lat_min4Coriolis;	/* PRECISA SOLUCAO. POR AGORA SERA Cte = 0 */
 };
 
+struct aw_job {                /* One write queued in the background writer */
+	int    kind;               /* AW_GRD, AW_NC_FLT or AW_NC_DBL */
+	int    ncid, varid;        /* netCDF file and variable */
+	unsigned int nx, ny;       /* Size of the grid (only the sub-region that is written) */
+	size_t start[4], count[4]; /* netCDF hyperslab */
+	size_t nbytes;             /* Size of the data buffer */
+	double x_min, y_min, x_inc, y_inc;
+	char   name[256];          /* Grid file name */
+	void  *data;               /* Copy of the values to write. Freed by the writer */
+};
+
+struct async_writer {          /* Writes the output files in a thread of its own (-b option) */
+	int    head, tail, n_jobs; /* Ring of queued jobs. The solver adds at tail and the writer takes from head */
+	int    quit;               /* Tells the writer to return once the queue is empty */
+	int    status, err_kind;   /* First error met by the writer and the kind of job that failed */
+	char   err_name[256];      /* Name of the grid that failed */
+	unsigned int n_waits;      /* Number of times the solver had to wait for room in the queue */
+	size_t budget, in_use;     /* Max and current number of bytes held by the queued jobs */
+	struct aw_job job[AW_SLOTS];
+	aw_thread_t thread;
+	aw_mutex_t  mutex;
+	aw_cond_t   has_job, has_room;
+};
+
+struct ckp_header {            /* Header of a checkpoint file (-K option) */
+	char     id[8];            /* "NSWCKP2" */
+	int      real_size;        /* sizeof(real) of the build that wrote it */
+	int      n_levels;         /* Base grid plus the nested ones */
+	int      nx[10], ny[10], parent[10];
+	int      isGeog;
+	int      k;                /* Cycle to compute next */
+	int      n_blocks;         /* Number of arrays. Their offsets and sizes (uint64) follow this header */
+	int      n_oranges, n_mareg;
+	int      bnc_done;         /* If true, the boundary condition file was already consumed */
+	unsigned int count_maregs_timeout, count_time_maregs_timeout;
+	double   dt, time_h, run_jump_time;
+	double   n_active, n_cells;
+	int64_t  maregs_pos;       /* Position in the ASCII maregraphs file, or -1 */
+	int64_t  oranges_pos;      /* Position in the ASCII tracers file or records in the netCDF one, or -1 */
+	uint64_t n_bytes;          /* Size of the whole file. Used to detect truncated ones */
+};
+
+struct ckp_block {             /* One array of the simulation state */
+	void  *p;
+	size_t n;                  /* Its size in bytes */
+};
+
+struct phase_timers {          /* Accumulated wall clock times of the main loop phases (-P option) */
+	double secs[N_PHASES][10];     /* Per phase and grid */
+	double calls[N_PHASES][10];
+	double cells[N_PHASES][10];    /* Number of processed cells */
+};
+
+struct ens_source {            /* One source of an ensemble run (-Fe option) */
+	double p[9];               /* dip, azim, rake, slip, length, width, top depth, x, y. As in -F (km) */
+	char  *grid;               /* Or the name of an initial condition grid (then p[] is not used) */
+};
+
+struct okada_fault {           /* One fault, or subfault of a finite fault model, of deform_faults() */
+	double length, width, top_depth;	/* In meters */
+	double strike, dip, rake, slip;     /* In degrees and meters */
+	double x, y;                        /* Beginning of the fault trace */
+	/* The rest is set by deform_faults() */
+	double f_length2, h1, h2, ds, dd, sn_th, cs_th, sn_dip, cs_dip, tg_dip, x2_0, x2_c, cut2;
+	double lon0, t_c1, t_c2, t_c3, t_c4, t_e2, t_M0;	/* Its TM projection (geographic grids) */
+};
+
+struct strip_shm {             /* Head of the memory shared by the strips of a domain decomposed run (-d option) */
+	volatile int n_in, gen;    /* Strips that reached the barrier and number of times it was crossed */
+	volatile int failed;       /* Set when one of the processes died. The others then give up */
+};
+
+struct strip_ctx {             /* One strip of rows of level 0, computed by a process of its own (-d option) */
+	int    n, rank;            /* Number of strips and the one of this process */
+	int    row0;               /* Row of the whole grid that is the first row of this strip */
+	int    n_rows;             /* Rows of this strip, counting the halo rows of its neighbours */
+	int    own0, own1;         /* Local rows [own0, own1[ that are computed by this strip */
+	int    n_mar;              /* Max number of maregraphs */
+	int    parity;             /* Mailboxes used in this step. They alternate between steps */
+	int    ppid, *pid;         /* Process id of strip 0 and, in strip 0, those of the others */
+	size_t box_len;            /* Number of values in a mailbox */
+	real  *box;                /* Mailboxes with the border rows of each strip. 2 sides * 2 parities per strip */
+	real  *mar;                /* Values of the maregraphs collected by strip_maregs() */
+	unsigned int *mar_ij;      /* 0, 1, 2, ... To index the above */
+	float *img;                /* The whole grid collected by strip_gather() (or NULL if no grids are written) */
+	size_t map_len;            /* Size of the shared memory */
+	struct strip_shm *shm;
+	struct grd_header g;       /* Header of the whole level 0 grid */
+};
+
 struct nestContainer {         /* Container for the nestings */
 	int    do_upscale;         /* If false, do not upscale the parent grid */
 	int    do_long_beach;      /* If true, compute a mask with ones over the "dryed beach" */
 	int    do_short_beach;     /* If true, compute a mask with ones over the "innundated beach" */
 	int    do_linear;          /* If true, use linear approximation */
+	int    do_simd;            /* If true, do the interior wet-wet cells of the moment functions in a branch free loop */
 	int    do_max_level;       /* If true, inform nestify() on the need to update max level at every inner iteration */
 	int    do_max_velocity;    /* If true, inform nestify() on the need to update max velocity at each inner iteration */
 	int    do_Coriolis;        /* If true, compute the Coriolis effect */
@@ -225,15 +455,27 @@ struct nestContainer {         /* Container for the nestings */
 	int    out_momentum;       /* To know if save the momentum in the 3D netCDF grid. Mutually exclusive with out_velocity_x|y */
 	int    isGeog;             /* 0 == Cartesian, otherwise Geographic coordinates */
 	int    writeLevel;         /* Store info about which level is (if) to be writen [0] */
+	int    act_on;             /* If true, mass & moment of level 0 only compute the cells of the active region */
+	int   *act_lo, *act_hi;    /* First and last column of the active region in each row of level 0 */
+	struct async_writer *aw;   /* Background writer of the output files, or NULL to write them right away */
+	struct phase_timers *tm;   /* Timings of the main loop phases (-P option), or NULL */
+	struct strip_ctx *strip;   /* The strip of level 0 computed by this process (-d option), or NULL */
+	int    nc_deflate;         /* Deflate level of the slices of the 3D netCDF files (-z option). 0 for none */
+	int    nc_quant;           /* Lossy compression of those slices. 'b' bit rounding, 'p' packing in integers or 0 for none */
+	int    nc_chunk[2];        /* Rows and columns of the chunks of a slice */
+	int    nc_clipped;         /* Number of values outside the range of the 'p' packing */
+	double nc_err;             /* Largest error of the lossy compression, in the units of each variable */
 	int    bnc_pos_nPts;       /* Number of points in a external boundary condition file */
 	int    bnc_var_nTimes;     /* Number of time steps in the external boundary condition file */
 	int    bnc_border[4];      /* Each will be set to TRUE if boundary condition on that border W->0, S->1, E->2, N->3 */
 	int    level[10];          /* 0 Will mean base level, others the nesting level */
+	int    parent[10];         /* Index of the parent grid (-1 for the base). Several grids may share the same parent */
+	int    ad_copy[10];        /* If true, the next update() of this grid copies the 'd' arrays instead of swapping them */
 	int    LLrow[10], LLcol[10], ULrow[10], ULcol[10], URrow[10], URcol[10], LRrow[10], LRcol[10];
 	int    incRatio[10];
 	short  *long_beach[10];    /* Mask arrays for storing the "dry beaches" */
 	short  *short_beach[10];   /* Mask arrays for storing the "dry beaches" */
-	float  *work, *wmax;       /* Auxiliary pointers (not direcly allocated) to compute max level of nested grids */
+	float  *wmax;              /* Auxiliary pointer (not direcly allocated) to compute max level of nested grids */
 	float  *vmax;              /* Pointer to array storing the max velocity */
 	double run_jump_time;      /* Time to hold before letting the nested grids start to iterate */
 	double lat_min4Coriolis;   /* South latitute when computing the Coriolis effect on a cartesian grid */
@@ -241,12 +483,12 @@ struct nestContainer {         /* Container for the nestings */
 	double manning[10];        /* Manning coefficient. Set to zero if no friction */
 	double LLx[10], LLy[10], ULx[10], ULy[10], URx[10], URy[10], LRx[10], LRy[10];
 	double dt[10];                             /* Time step at current level               */
-	double *bat[10];                           /* Bathymetry of current level              */
-	double *fluxm_a[10],  *fluxm_d[10];        /* t-1/2 & t+1/2 fluxes arrays along X      */
-	double *fluxn_a[10],  *fluxn_d[10];        /* t-1/2 & t+1/2 fluxes arrays along Y      */
-	double *htotal_a[10], *htotal_d[10];       /* t-1/2 & t+1/2 total water depth         */
-	double *vex[10],  *vey[10];                /* X,Y velocity components                  */
-	double *etaa[10], *etad[10];               /* t-1/2 & t+1/2 water height (eta) arrays */
+	real   *bat[10];                           /* Bathymetry of current level              */
+	real   *fluxm_a[10],  *fluxm_d[10];        /* t-1/2 & t+1/2 fluxes arrays along X      */
+	real   *fluxn_a[10],  *fluxn_d[10];        /* t-1/2 & t+1/2 fluxes arrays along Y      */
+	real   *htotal_a[10], *htotal_d[10];       /* t-1/2 & t+1/2 total water depth         */
+	real   *vex[10],  *vey[10];                /* X,Y velocity components                  */
+	real   *etaa[10], *etad[10];               /* t-1/2 & t+1/2 water height (eta) arrays */
 	double *edge_col[10], *edge_colTmp[10];
 	double *edge_row[10], *edge_rowTmp[10];
 	double *edge_col_P[10], *edge_col_Ptmp[10];
@@ -275,15 +517,64 @@ int  read_grd_info_ascii(char *file, struct srf_header *hdr);
 int  read_header_bin (FILE *fp, struct srf_header *hdr);
 int  write_grd_bin(char *name, double x_min, double y_min, double x_inc, double y_inc, unsigned int i_start, 
                    unsigned int j_start, unsigned int i_end, unsigned int j_end, unsigned int nX, float *work);
-int  read_grd_ascii (char *file, struct srf_header *hdr, double *work, int sign);
-int  read_grd_bin(char *file, struct srf_header *hdr, double *work, int sign);
+int  compare_grids(char *name, unsigned int i_start, unsigned int j_start, unsigned int i_end, unsigned int j_end,
+                   unsigned int nX, float *work);
+int  write_srf(char *name, double x_min, double y_min, double x_inc, double y_inc, unsigned int i_start,
+               unsigned int j_start, unsigned int i_end, unsigned int j_end, unsigned int nX, float *work);
+int  put_grd(struct async_writer *aw, char *name, double x_min, double y_min, double x_inc, double y_inc,
+             unsigned int i_start, unsigned int j_start, unsigned int i_end, unsigned int j_end, unsigned int nX, float *work);
+int  aw_start(struct async_writer *aw, size_t budget);
+void aw_stop(struct async_writer *aw);
+void aw_flush(struct async_writer *aw);
+void aw_run(struct async_writer *aw);
+void aw_report(int status, int kind, char *name);
+struct aw_job *aw_job_new(struct async_writer *aw, int kind, size_t nbytes);
+void aw_job_submit(struct async_writer *aw);
+int  ckp_blocks(struct nestContainer *nest, int n_levels, int k, float *wmax, float *vmax, struct tracers *oranges,
+                int n_oranges, double *maregs_timeout, unsigned int n_times, float *maregs_array, unsigned int n_vals,
+                struct ckp_block *b);
+size_t ckp_size(int n_blocks, struct ckp_block *b);
+void ckp_image(char *buf, struct ckp_header *h, struct ckp_block *b, int n_blocks);
+int  ckp_save(struct async_writer *aw, char *name, struct ckp_header *h, struct ckp_block *b, int n_blocks);
+int  ckp_open(char *name, struct ckp_header *h, FILE **fp);
+int  ckp_match(struct ckp_header *h, struct nestContainer *nest, int n_levels, int isGeog, double dt, int n_of_cycles);
+int  ckp_load(FILE *fp, struct ckp_header *h, struct ckp_block *b, int n_blocks);
+int  write_ckp(char *name, char *buf, size_t n_bytes);
+double tm_clock(void);
+int  strip_fork(struct strip_ctx *s, int n, struct srf_header hdr, double dx, double dy, int with_img, int n_mar);
+int  strip_end(struct strip_ctx *s);
+void strip_barrier(struct strip_ctx *s);
+void strip_exchange(struct nestContainer *nest);
+float *strip_gather(struct nestContainer *nest, float *work);
+unsigned int *strip_maregs(struct nestContainer *nest, unsigned int *lcum_p, int n_mareg, real **eta, real **htotal,
+                           real **vx, real **vy, real **bat);
+void tm_add(struct phase_timers *tm, int phase, int lev, double t0, double cells);
+int  tm_report(struct phase_timers *tm, struct nestContainer *nest, int nNg, double t_loop, char *fname);
+#ifdef HAVE_STRIPS
+double bench_bathy(int scn, double x, double y);
+int  bench_grid(char *name, int scn, struct grd_header *h, double Lx, double Ly);
+void bench_child(struct grd_header *p, struct grd_header *c, double fx0, double fx1, double fy0, double fy1, int r);
+int  bench_checksum(char *name, uint64_t *sum, double *z_max);
+double bench_json(char *buf, char *phase, char *key);
+int  bench_exec(char **args, char *dir, char *log, double *peak_mb);
+int  bench_ref(char *file, char *scn, int nx, char *path, char *prec, int cycles, double *mcps, char *sum);
+int  bench_run(char *prog, char *spec);
+#endif
+int  read_grd_ascii (char *file, struct srf_header *hdr, real *work, int sign);
+int  read_grd_ascii_rows(char *file, struct srf_header *hdr, real *work, int sign, int row0, int n_rows);
+int  read_grd_bin(char *file, struct srf_header *hdr, real *work, int sign);
+int  read_grd_bin_rows(char *file, struct srf_header *hdr, real *work, int sign, int row0, int n_rows);
 int  read_maregs(struct grd_header hdr, char *file, unsigned int *lcum_p, char *names[]);
 int  read_tracers(struct grd_header hdr, char *file, struct tracers *oranges);
+void advect_tracers(struct tracers *o, struct grd_header hdr, real *vx_for_oranges, real *vy_for_oranges,
+                    real *htotal, double dt);
+void write_tracers(struct nestContainer *nest, struct tracers *o, double t);
 int  count_n_maregs(char *file);
 int  decode_R(char *item, double *w, double *e, double *s, double *n);
 int  check_region(double w, double e, double s, double n);
 double ddmmss_to_degree (char *text);
-void openb(struct grd_header hdr, double *bat, double *fluxm_d, double *fluxn_d, double *etad, struct nestContainer *nest);
+void openb(struct grd_header hdr, real *bat, real *fluxm_d, real *fluxn_d, real *etad, struct nestContainer *nest);
+void openb_rows(struct grd_header hdr, real *bat, real *fluxm_d, real *fluxn_d, real *etad, struct nestContainer *nest, int row0, int row1);
 void wave_maker(struct nestContainer *nest);
 void wall_it(struct nestContainer *nest);
 void wall_two(struct nestContainer *nest, int ot1, int ot2, int in1, int in2);
@@ -291,24 +582,56 @@ int  initialize_nestum(struct nestContainer *nest, int isGeog, int lev);
 int  intp_lin (double *x, double *y, int n, int m, double *u, double *v);
 void inisp(struct nestContainer *nest);
 void inicart(struct nestContainer *nest);
-void interp_edges(struct nestContainer *nest, double *flux_L1, double *flux_L2, char *what, int lev, int i_time);
+double cfl_dt(struct nestContainer *nest, int lev, int isGeog, double courant);
+int  adapt_dt(struct nestContainer *nest, int nNg, int isGeog, double dt, double courant);
+void log_dt(FILE *fp, struct nestContainer *nest, int nNg, int cycle, double time_h, int n_sub);
+void interp_edges(struct nestContainer *nest, real *flux_L1, real *flux_L2, char *what, int lev, int i_time);
 void sanitize_nestContainer(struct nestContainer *nest);
-void nestify(struct nestContainer *nest, int nNg, int recursionLevel, int isGeog);
+void nestify(struct nestContainer *nest, int nNg, int lev, int isGeog);
+void nest_children(struct nestContainer *nest, int nNg, int lev, int isGeog);
 void resamplegrid(struct nestContainer *nest, int nNg);
 void edge_communication(struct nestContainer *nest, int lev, int i_time);
 void mass(struct nestContainer *nest, int lev);
+void mass_rows(struct nestContainer *nest, int lev, int row0, int row1);
 void mass_sp(struct nestContainer *nest, int lev);
+void mass_sp_rows(struct nestContainer *nest, int lev, int row0, int row1);
 void mass_conservation(struct nestContainer *nest, int isGeog, int m);
 void moment_conservation(struct nestContainer *nest, int isGeog, int m);
 void update(struct nestContainer *nest, int lev);
-void upscale(struct nestContainer *nest, double *out, int lev, int i_tsr);
-void upscale_(struct nestContainer *nest, double *out, int lev, int i_tsr);
+void zero_outside(real *flux, int row, int nx, int c0, int c1);
+double active_region(struct nestContainer *nest, int full);
+void tiled_step(struct nestContainer *nest, int isGeog, int tile, int do_openb, int do_max);
+void tiled_mass(struct nestContainer *nest, int isGeog, int row0, int row1, int do_openb, int do_max);
+void tiled_moment(struct nestContainer *nest, int isGeog, int row0, int row1);
+void upscale(struct nestContainer *nest, real *out, int lev, int i_tsr);
+void upscale_(struct nestContainer *nest, real *out, int lev, int i_tsr);
 void replicate(struct nestContainer *nest, int lev);
 void moment_M(struct nestContainer *nest, int lev);
+void moment_M_rows(struct nestContainer *nest, int lev, int row0, int row1);
+void moment_M_wet(real *RESTRICT fluxm_d, real *RESTRICT fluxm_a, real *RESTRICT fluxn_a, real *RESTRICT htotal_a, real *RESTRICT htotal_d,
+	real *RESTRICT etad, int ij0, int v0, int v1, int rm1, int rp1, int rm2, double dtdx, double dtdy, double cor, int do_cor);
 void moment_N(struct nestContainer *nest, int lev);
+void moment_N_rows(struct nestContainer *nest, int lev, int row0, int row1);
+void moment_N_wet(real *RESTRICT fluxn_d, real *RESTRICT fluxm_a, real *RESTRICT fluxn_a, real *RESTRICT htotal_a, real *RESTRICT htotal_d,
+	real *RESTRICT etad, int ij0, int v0, int v1, int rm1, int rp1, int rp2, double dtdx, double dtdy, double cor, int do_cor);
 void moment_sp_M(struct nestContainer *nest, int lev);
+void moment_sp_M_rows(struct nestContainer *nest, int lev, int row0, int row1);
+void moment_sp_M_wet(real *RESTRICT fluxm_d, real *RESTRICT fluxm_a, real *RESTRICT fluxn_a, real *RESTRICT htotal_a, real *RESTRICT htotal_d,
+	real *RESTRICT etad, int ij0, int v0, int v1, int rm1, int rp1, int rm2, double r0, double r2m, double r3m, double cor, int do_cor);
 void moment_sp_N(struct nestContainer *nest, int lev);
+void moment_sp_N_rows(struct nestContainer *nest, int lev, int row0, int row1);
+void moment_sp_N_wet(real *RESTRICT fluxn_d, real *RESTRICT fluxm_a, real *RESTRICT fluxn_a, real *RESTRICT htotal_a, real *RESTRICT htotal_d,
+	real *RESTRICT etad, int ij0, int v0, int v1, int rm1, int rp1, int rp2, double r0, double r2n, double r3n, double cor, int do_cor);
 void free_arrays(struct nestContainer *nest, int isGeog, int lev);
+int  read_ensemble(char *fname, struct ens_source **src);
+int  ens_worker_new(struct nestContainer *nest, struct nestContainer *w, int nNg);
+void ens_worker_free(struct nestContainer *w, int nNg);
+int  ens_start(struct nestContainer *w, int nNg, int isGeog, struct srf_header hdr_b, struct ens_source *src);
+void ens_run(struct nestContainer *w, int nNg, int isGeog, int n_of_cycles, int do_active, double run_jump_time,
+             unsigned int *lcum_p, int n_mareg, int cumint, float *maregs);
+int  run_ensemble(struct nestContainer *nest, int nNg, int isGeog, struct srf_header hdr_b, int n_of_cycles,
+                  int do_active, struct ens_source *src, int n_src, unsigned int *lcum_p, char *names[], int n_mareg,
+                  int cumint, char *out, char hist[]);
 int  check_paternity(struct nestContainer *nest);
 int  check_binning(double x0P, double x0D, double dxP, double dxD, double tol, double *suggest);
 int  read_bnc_file(struct nestContainer *nest, char *file);
@@ -318,20 +641,29 @@ void power(struct nestContainer *nest, float *work, int lev);
 void vtm (double lat0, double *t_c1, double *t_c2, double *t_c3, double *t_c4, double *t_e2, double *t_M0);
 void deform (struct srf_header hdr, double x_inc, double y_inc, int isGeog, double fault_length,
              double fault_width, double th, double dip, double rake, double d, double top_depth,
-             double xl, double yl, double *z);
+             double xl, double yl, real *z);
 void kaba_source(struct srf_header hdr, double x_inc, double y_inc, double x_min, double x_max,
-	             double y_min, double y_max, int type, double *z);
+	             double y_min, double y_max, int type, real *z);
 void tm (double lon, double lat, double *x, double *y, double central_meridian, double t_c1,
          double t_c2, double t_c3, double t_c4, double t_e2, double t_M0);
-double uscal(double x1, double x2, double x3, double c, double cc, double dp);
-double udcal(double x1, double x2, double x3, double c, double cc, double dp);
+void deform_faults(struct srf_header hdr, double x_inc, double y_inc, int isGeog, struct okada_fault *f, int n_f,
+                   double cut, real *z);
+int  read_faults(char *fname, struct okada_fault **f);
+double uscal(double x1, double x2, double x3, double c, double cc, double sn, double cs, double tg);
+double udcal(double x1, double x2, double x3, double c, double cc, double sn, double cs);
 unsigned int gmt_bcr_prep (struct grd_header hdr, double xx, double yy, double wx[], double wy[]);
-double GMT_get_bcr_z(double *grd, struct grd_header hdr, double xx, double yy);
-void update_max(struct nestContainer *nest);
-void update_max_velocity(struct nestContainer *nest);
+double GMT_get_bcr_z(real *grd, struct grd_header hdr, double xx, double yy);
+void update_maxs(struct nestContainer *nest, int settled, int what);
+void update_maxs_rows(struct nestContainer *nest, real *eta, real *eta_dry, real *htotal, int what, int row0, int row1);
 
 
 #ifdef HAVE_NETCDF
+void put_vara_float(struct async_writer *aw, int ncid, int varid, int ndims, size_t *start, size_t *count, float *work);
+void put_vara_double(struct async_writer *aw, int ncid, int varid, int ndims, size_t *start, size_t *count, double *work);
+void put_slice(struct nestContainer *nest, int ncid, int id, size_t *start, size_t *count, float *work, double *range);
+int  def_slice_var(struct nestContainer *nest, int ncid, char *name, int *dim3, unsigned int nx, unsigned int ny, int pack,
+                   float fill);
+void nc_quantize(struct nestContainer *nest, float *work, size_t n, int pack);
 void write_most_slice(struct nestContainer *nest, int *ncid_most, int *ids_most, unsigned int i_start,
                       unsigned int j_start, unsigned int i_end, unsigned int j_end, float *work, size_t *start,
                       size_t *count, double *slice_range, int isMost, int lev);
@@ -347,6 +679,9 @@ int write_maregs_nc(struct nestContainer *nest, char *fname, float *work, double
 int write_greens_nc(struct nestContainer *nest, char *fname, float *work, size_t *start, size_t *count,
                     double *t, unsigned int *lcum_p, char *names[], char hist[], int *ids, int n_maregs,
                     unsigned int n_times, int lev);
+int open_ensemble_nc(struct nestContainer *nest, char *fname, char hist[], int *ids, struct ens_source *src,
+                     int n_src, unsigned int *lcum_p, char *names[], int n_maregs, int n_times, double dt_mar, int lev);
+int open_tracers_nc(struct nestContainer *nest, struct tracers *o, char *fname, char hist[]);
 void err_trap_(int status);
 #endif
 
@@ -386,7 +721,7 @@ int main(int argc, char **argv) {
 	int     w_bin = TRUE, cumpt = FALSE, error = FALSE, do_2Dgrids = FALSE, do_maxs = FALSE;
 	int     out_energy = FALSE, max_energy = FALSE, out_power = FALSE, max_power = FALSE;
 	int     first_anuga_time = TRUE, out_sww = FALSE, out_most = FALSE, out_3D = FALSE;
-	int     surf_level = TRUE, max_level = FALSE, max_velocity = FALSE, water_depth = FALSE;
+	int     surf_level = TRUE, max_level = FALSE, max_velocity = FALSE, water_depth = FALSE, max_level_in;
 	int     do_Okada = FALSE;            /* For when one will compute the Okada deformation here */
 	int     do_Kaba = FALSE;             /* For when one will use prismatic sources */
 	int     do_tracers = FALSE;          /* For when doing Lagrangian tracers */
@@ -397,6 +732,25 @@ int main(int argc, char **argv) {
 	int     ncid, ncid_most[3], z_id = -1, ids[13], ids_ha[6], ids_ua[6], ids_va[6], ids_most[3];
 	int     ncid_3D[3], ids_z[10], ids_3D[3], ncid_Mar, ids_Mar[8];
 	int     n_of_cycles = 1010;          /* Default number of cycles to compute */
+	int     n_threads = 0;               /* Number of OpenMP threads. 0 means use the OpenMP default */
+	int     do_active = FALSE;           /* Compute only the active region of level 0 (-a option) */
+	int     report_active = FALSE;       /* Report the fraction of skipped cells at the end */
+	int     do_bgwrite = FALSE;          /* Write the output files in a background thread (-b option) */
+	int     tile_rows = 0;               /* Rows of the bands of the fused sweeps (-k option). -1 -> from TILE_BYTES */
+	int     tiled = FALSE;               /* If true, the current step is done by tiled_step() */
+	int     ckp_int = 0;                 /* Write a checkpoint every this number of cycles (-K option) */
+	int     do_restart = FALSE;          /* Resume from the checkpoint file if it exists (-K...+r) */
+	int     k_start = 0;                 /* First cycle of the main loop. Not 0 when resuming from a checkpoint */
+	int     n_ckp = 0;                   /* Number of arrays in a checkpoint */
+	int     n_ens = 0;                   /* Number of sources in an ensemble run (-Fe option) */
+	int     n_faults = 0;                /* Number of subfaults of a finite fault source (-Ff option) */
+	int     do_timing = FALSE;           /* Report the time spent in each phase of the main loop (-P option) */
+	int     n_strips = 0;                /* Number of strips of rows of level 0, each one a process (-d option) */
+	int     n_sub = 1, sub;              /* Steps of the base grid in a cycle. More than one with the adaptive dt */
+	int     mem_maregs = FALSE;          /* Return the maregraphs in the first output instead of a file (MEX) */
+	int     mem_grids = FALSE;           /* Return the -G grids in the second output instead of files (MEX) */
+	unsigned int n_mar_rows = 0, n_mem_mar = 0;  /* Rows of the returned maregraphs and how many are filled */
+	unsigned int n_grd_max = 0, n_mem_grd = 0;   /* Slices of the returned grids and how many are filled */
 	int     num_of_nestGrids = 0;        /* Number of nesting grids */
 	int     bat_in_input = FALSE, source_in_input = FALSE, write_grids = FALSE, isGeog = FALSE;
 	int     maregs_in_input = FALSE, out_momentum = FALSE, got_R = FALSE;
@@ -405,11 +759,12 @@ int main(int argc, char **argv) {
 	int     out_maregs_velocity = FALSE;
 	int     KbGridCols = 1, KbGridRows = 1; /* Number of rows & columns IF computing a grid of 'Kabas' */
 	int     cntKabas = 0;                /* Counter of the number of Kabas (prisms) already processed */
-	int     n_mareg, n_ptmar, n_oranges, pos_prhs;
-	unsigned int *lcum_p = NULL, lcum = 0, ij, nx, ny;
+	int     n_mareg = 0, n_ptmar = 0, n_oranges, pos_prhs;
+	unsigned int *lcum_p = NULL, *mar_ij, lcum = 0, ij, nx, ny;
 	unsigned int i_start, j_start, i_end, j_end, count_maregs_timeout = 0, count_time_maregs_timeout = 0;
 	size_t	start0 = 0, count0 = 1, len, start1_A[2] = {0,0}, count1_A[2];
 	size_t  start1_M[3] = {0,0,0}, count1_M[3], start_Mar[3] = {0,0,0}, count_Mar[2];
+	size_t  bg_budget = 0;               /* Max bytes of output queued in the background writer. 0 -> two saving steps */
 	char   *bathy   = NULL;              /* Name pointer for bathymetry file */
 	char   	hcum[256]   = "";            /* Name of the cumulative hight file */
 	char    maregs[256] = "";            /* Name of the maregraph positions file */
@@ -419,6 +774,16 @@ int main(int argc, char **argv) {
 	char   *fname3D  = NULL;             /* Name pointer for the 3D netCDF file */
 	char   *fonte    = NULL;             /* Name pointer for tsunami source file */
 	char   *bnc_file = NULL;             /* Name pointer for a boundary condition file */
+	char   *fname_maxRef = NULL;         /* Name pointer for a reference max level grid (validation, -W option) */
+	char   *ckp_name = NULL;             /* Name pointer for the checkpoint file */
+#ifdef HAVE_STRIPS
+	char   *bench_spec = NULL;           /* Sizes, cycles and modifiers of the benchmark (-Y option) */
+#endif
+	char   *dt_logname = NULL;           /* Name pointer for the history of the adaptive time step (-t...+l) */
+	char    ens_name[256] = "";          /* Name of the table of sources of an ensemble run (-Fe option) */
+	char    ens_out[256] = "";           /* Name of the output file (or stem) of an ensemble run */
+	char    faults_name[256] = "";       /* Name of the table of subfaults of a finite fault source (-Ff option) */
+	char    fname_timing[256] = "";      /* Name of the CSV or JSON file with the per phase timings (-P option) */
 	char    fname_mask_lbeach[256] = ""; /* Name pointer for the "long_beach" mask grid */
 	char    fname_mask_sbeach[256] = ""; /* Name pointer for the "short_beach" mask grid */
 	char    tracers_infile[256] = "", tracers_outfile[256] = "";	/* Names for in and out tracers files */
@@ -426,9 +791,10 @@ int main(int argc, char **argv) {
 	char    history[512] = {""};         /* To hold the full command call to be saved in nc files as History */
 	char   *pch;
 	char   *nesteds[10] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+	int     nest_level[10], n_nesteds = 0;	/* Nesting level of each nesteds[] grid, in the order given */
 	char    txt[128];                    /* Auxiliary variable */
 
-	float  *work = NULL, *workMax = NULL, *vmax = NULL, *wmax = NULL, *time_p = NULL;
+	float  *work = NULL, *vmax = NULL, *wmax = NULL, *time_p = NULL, *wout;
 	float   work_min = FLT_MAX, work_max = -FLT_MAX, *maregs_array = NULL, *maregs_array_t = NULL;
 	double *maregs_timeout = NULL, m_per_deg = 111317.1;
 	double *bat = NULL, *dep1 = NULL, *dep2 = NULL, *cum_p = NULL, *h = NULL;
@@ -437,28 +803,43 @@ int main(int argc, char **argv) {
 	double  time_jump = 0, time0, time_for_anuga, prc;
 	double  dt = 0;                     /* Time step for Base level grid */
 	double  dx, dy, ds, dtCFL, etam, one_100, t;
-	double *eta_for_maregs, *vx_for_maregs, *vy_for_maregs, *htotal_for_maregs, *fluxm_for_maregs, *fluxn_for_maregs;
-	double *vx_for_oranges, *vy_for_oranges, *fluxm_for_oranges, *fluxn_for_oranges, *htotal_for_oranges;	/* For tracers */
+	real   *eta_for_maregs, *vx_for_maregs, *vy_for_maregs, *htotal_for_maregs, *bat_for_maregs;
 	double  f_dip, f_azim, f_rake, f_slip, f_length, f_width, f_topDepth, x_epic, y_epic;	/* For Okada initial condition */
 	double  add_const = 0, time_h = 0;
+	double  n_active = 0, n_cells = 0;  /* Number of computed and total cells of level 0 (-ar option) */
+	double  cells0, cells_all = 0;      /* Number of computed cells of level 0 in this step and of all grids */
+	double  t0 = 0, t_loop = 0;         /* For the per phase timings (-P option) */
 	double  dxKb = 0, dyKb = 0;         /* Grid steps for when computing a grid of 'Kabas' */
+	double  fault_cut = 0;              /* Subfaults only deform nodes closer than this times their length (-Ff) */
+	double  courant = 0;                /* Courant number of the adaptive time step (-t<dt>+a). 0 -> fixed dt */
+	double  n_steps = 0, dt_prev[10];   /* Base grid steps and the previous time steps with the adaptive dt */
+	double *mar_t = NULL, *grd_t = NULL, *grd_head = NULL;	/* Times (and header) of the returned series and grids */
+	float  *mar_eta = NULL, *mar_vx = NULL, *mar_vy = NULL, *grd_z = NULL;
 	double  z_offset = 0;	/* To apply to bathymetry to simulate a tide */
 	double  manning[10] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};	/* Manning coefficients */
 
 	double  actual_range[6] = {1e30, -1e30, 1e30, -1e30, 1e30, -1e30};
 	float	stage_range[2], xmom_range[2], ymom_range[2], *tmp_slice;
 	struct	srf_header hdr_b, hdr_f, hdr_mM, hdr_mN;
-	struct	grd_header hdr;
+	struct	grd_header hdr, hdr_out;
 	struct  nestContainer nest;
-	struct  tracers *oranges;
-	FILE   *fp, *fp_oranges;
+	struct  async_writer aw;
+	struct  ckp_header ckp_hdr;
+	struct  ckp_block *ckp_blk = NULL;
+	struct  tracers oranges = {0, 1, -1};	/* No tracers, written at every cycle in an ASCII table */
+	struct  ens_source *ens = NULL;      /* The sources of an ensemble run */
+	struct  okada_fault *faults = NULL;  /* The subfaults of a finite fault source */
+	struct  strip_ctx strip;             /* This process strip of level 0 (-d option) */
+	FILE   *fp = NULL, *fp_ckp = NULL;
+	FILE   *fp_dtlog = NULL;            /* History of the adaptive time steps. NULL -> printed with mexPrintf */
 #ifdef I_AM_MEX
 	int     argc;
 	unsigned nm;
 	char   **argv, cmd[16] = "";
 	double  *head, *tmp, x_inc, y_inc, x, y;
 	double  *ptr_wb;                    /* Pointer to be used in the aguentabar */
-	mxArray *rhs[3];
+	mxArray *rhs[3], *mx_ptr;
+	mwSize  dims[3];
 #endif
 	clock_t tic;
 
@@ -538,8 +919,10 @@ int main(int argc, char **argv) {
 			nest.hdr[k+1].z_min = head[4];		nest.hdr[k+1].z_max = head[5];
 			nest.hdr[k+1].x_inc = head[7];		nest.hdr[k+1].y_inc = head[8];
 
+			nest.parent[k+1] = k;		/* The Matlab side only sends a chain of nested grids */
+
 			nm = nest.hdr[k+1].nx * nest.hdr[k+1].ny;
-			if ((nest.bat[k+1] = (double *)mxCalloc((size_t)nm, sizeof(double)) ) == NULL) 
+			if ((nest.bat[k+1] = (real *)mxCalloc((size_t)nm, sizeof(real)) ) == NULL) 
 				{no_sys_mem("(bat)", nm); Return(-1);}
 			for (i = 0; i < nest.hdr[k+1].ny; i++) {
 				for (j = 0; j < nest.hdr[k+1].nx; j++)
@@ -605,15 +988,70 @@ int main(int argc, char **argv) {
 	for (i = start_i; i < argc; i++) {
 		if (argv[i][0] == '-') {
 			switch (argv[i][1]) {
+				case 'a':	/* Active region tracking */
+					do_active = TRUE;
+					if (argv[i][2] == 'r') report_active = TRUE;
+					break;
+				case 'b':	/* Background writer */
+					do_bgwrite = TRUE;
+					if (argv[i][2])
+						bg_budget = (size_t)(atof(&argv[i][2]) * 1024 * 1024);
+					break;
 				case 'c':
 					add_const = atof(&argv[i][2]);
 					break;
+				case 'd':	/* Split level 0 in strips of rows, each computed by a process */
+					n_strips = atoi(&argv[i][2]);
+					break;
 				case 'e':
 					IamCompiled = TRUE;
 					break;
 				case 'f':	/* */
 					isGeog = TRUE;
 					break;
+				case 'k':	/* Fuse the mass and moment sweeps in bands of rows */
+					tile_rows = (argv[i][2]) ? atoi(&argv[i][2]) : -1;
+					if (tile_rows == 0) tile_rows = -1;
+					break;
+				case 'j':	/* Number of threads */
+					if (argv[i][2])
+						n_threads = atoi(&argv[i][2]);
+#if HAVE_OPENMP
+					else
+						n_threads = omp_get_num_procs();
+#endif
+					break;
+				case 's':	/* Branch free (vectorizable) loop for the interior wet-wet cells */
+					nest.do_simd = TRUE;
+					break;
+				case 'z':	/* Compression of the slices of the 3D netCDF files */
+					if (argv[i][2] >= '0' && argv[i][2] <= '9')
+						nest.nc_deflate = MIN(atoi(&argv[i][2]), 9);
+					pch = &argv[i][2];
+					while ((pch = strchr(pch, '+')) != NULL) {
+						pch++;
+						if (pch[0] == 'b' || pch[0] == 'p') {
+							nest.nc_quant = pch[0];
+							nest.nc_err = atof(&pch[1]);
+						}
+						else if (pch[0] == 'c') {
+							if ((n = sscanf(&pch[1], "%d/%d", &nest.nc_chunk[0], &nest.nc_chunk[1])) == 1)
+								nest.nc_chunk[1] = nest.nc_chunk[0];
+							if (n < 1 || nest.nc_chunk[0] < 1 || nest.nc_chunk[1] < 1) {
+								mexPrintf("NSWING: Error, -z option, bad chunk size in %s\n", argv[i]);
+								error++;
+							}
+						}
+						else {
+							mexPrintf("NSWING: Error, -z option, unknown modifier +%c\n", pch[0]);
+							error++;
+						}
+					}
+					if (nest.nc_quant && nest.nc_err <= 0) {
+						mexPrintf("NSWING: Error, -z option, the +b and +p modes need an error larger than zero\n");
+						error++;
+					}
+					break;
 				case 'n':	/* Write MOST files (*.nc) */
 					basename_most  = &argv[i][2];
 					out_most = TRUE;
@@ -659,7 +1097,35 @@ int main(int argc, char **argv) {
 					}
 					break;
 				case 'F':	/* Okada parameters to compute Initial condition */
-					if (argv[i][2] == 'k') {
+					if (argv[i][2] == 'e') {	/* -Fe<table>,<out>[+lev]. An ensemble of sources */
+						strncpy(ens_name, &argv[i][3], 255);
+						if ((pch = strstr(ens_name,",")) != NULL) {
+							strncpy(ens_out, &pch[1], 255);
+							pch[0] = '\0';
+						}
+						if ((pch = strstr(ens_out,"+")) != NULL) {
+							writeLevel = atoi(++pch);
+							if (writeLevel < 0) writeLevel = 0;
+							(--pch)[0] = '\0';		/* Hide the +lev from the output name */
+						}
+						if (!ens_name[0] || !ens_out[0]) {
+							mexPrintf("NSWING: Error, -Fe option, must provide the sources table and the output name.\n");
+							error++;
+						}
+					}
+					else if (argv[i][2] == 'f') {	/* -Ff<table>[+c<n>]. A finite fault model */
+						do_Okada = TRUE;
+						strncpy(faults_name, &argv[i][3], 255);
+						if ((pch = strstr(faults_name, "+c")) != NULL) {
+							fault_cut = atof(&pch[2]);
+							pch[0] = '\0';
+						}
+						if (!faults_name[0]) {
+							mexPrintf("NSWING: Error, -Ff option, must provide the subfaults table.\n");
+							error++;
+						}
+					}
+					else if (argv[i][2] == 'k') {
 						char *lost_str1 = NULL, *lost_str2 = NULL;
 						int   have_RC = FALSE;
 
@@ -772,6 +1238,17 @@ int main(int argc, char **argv) {
 						}
 					}
 					break;
+				case 'K':	/* Checkpoint file, interval and restart. -K<name>[,<int>][+r] */
+					ckp_name = &argv[i][2];
+					if ((pch = strstr(ckp_name, "+r")) != NULL) {
+						do_restart = TRUE;
+						pch[0] = '\0';
+					}
+					if ((pch = strchr(ckp_name, ',')) != NULL) {
+						ckp_int = atoi(&pch[1]);
+						pch[0] = '\0';
+					}
+					break;
 				case 'J':	/* Jumping options. Accept either -Jn, -J+m, -Jn+m or -Jn -J+m */
 					sscanf(&argv[i][2], "%s", str_tmp);
 					if ((pch = strstr(str_tmp,"+")) != NULL) {
@@ -789,14 +1266,22 @@ int main(int argc, char **argv) {
 					else {
 						sscanf(&argv[i][2], "%s", str_tmp);
 						if (str_tmp[strlen(str_tmp)-2] == '+') {	/* Output tracers file will be in netCDF */
+#ifdef HAVE_NETCDF
 							out_oranges_nc = TRUE;
+#else
+							mexPrintf("NSWING: Warning, -L option, no netCDF in this build. Tracers go to an ASCII file\n");
+#endif
 							str_tmp[strlen(str_tmp)-2] = '\0';
 						}
 						if ((pch = strstr(str_tmp,",")) != NULL) {
 							char *pch2;
 							pch[0] = '\0';
 							strcpy(tracers_infile, str_tmp);
-							strcpy(tracers_outfile, ++pch);		/* NEED TO TEST IF WE GOT A FNAME */
+							if ((pch2 = strstr(++pch, ",")) != NULL) {	/* Write only every <decim> cycles */
+								pch2[0] = '\0';
+								oranges.decim = atoi(++pch2);
+							}
+							strcpy(tracers_outfile, pch);		/* NEED TO TEST IF WE GOT A FNAME */
 						}
 						else {
 							mexPrintf("NSWING: Error, -L option, must provide at least the tracers file name\n");
@@ -834,10 +1319,12 @@ int main(int argc, char **argv) {
 						cumint = atoi(str_tmp);
 						strcpy(hcum, ++pch);
 					}
-					else { 
-						mexPrintf("NSWING: Error, -O option, must provide interval and output maregs file name\n");
-						error++;
-					}
+					else		/* Only valid when the maregraphs are returned in an output (checked below) */
+						cumint = atoi(str_tmp);
+					break;
+				case 'P':	/* Per phase timings and optional file to save them */
+					do_timing = TRUE;
+					if (argv[i][2]) strncpy(fname_timing, &argv[i][2], 255);
 					break;
 				case 'Q':	/* Vertical offset (simulate tide) */
 					if (argv[i][2])
@@ -891,6 +1378,11 @@ int main(int argc, char **argv) {
 				case 't':	/* Time step of simulation */ 
 					dt = atof(&argv[i][2]);
 					nest.dt[0] = dt;
+					if ((pch = strstr(&argv[i][2], "+a")) != NULL) {	/* Adaptive, with dt as the sync interval */
+						courant = (pch[2] && pch[2] != '+') ? atof(&pch[2]) : 0.5;
+						if (courant <= 0) courant = -1;		/* To be reported below */
+						if ((pch = strstr(pch, "+l")) != NULL) dt_logname = &pch[2];
+					}
 					break;
 				case 'T':	/* File with time interval (n steps), maregraph positions and optional output fname */
 					if (cumpt) {
@@ -963,9 +1455,18 @@ int main(int argc, char **argv) {
 				case 'V':
 					verbose = TRUE;
 					break;
-				case '1':
-					nesteds[0] = &argv[i][2];
+				case 'W':	/* Compare the max level grid with this one (e.g. computed by the other precision build) */
+					fname_maxRef = &argv[i][2];
+					break;
+				case 'Y':	/* Benchmark on synthetic scenarios. Nothing else of the command line is used */
+#ifdef HAVE_STRIPS
+					bench_spec = &argv[i][2];
+#else
+					mexPrintf("NSWING: Error, the benchmark (-Y option) is only available in the POSIX stand-alone build\n");
+					error++;
+#endif
 					break;
+				case '1':
 				case '2':
 				case '3':
 				case '4':
@@ -973,9 +1474,13 @@ int main(int argc, char **argv) {
 				case '6':
 				case '7':
 				case '8':
-				case '9':
-				case '10':
-					nesteds[atoi(&argv[i][1])-1] = &argv[i][2];
+				case '9':	/* Repeat the same level to have several grids nested in the same parent */
+					if (n_nesteds == 9) {
+						mexPrintf("NSWING: Too many nested grids (max is 9). Ignoring %s\n", &argv[i][2]);
+						break;
+					}
+					nest_level[n_nesteds] = argv[i][1] - '0';
+					nesteds[n_nesteds++]  = &argv[i][2];
 					break;
 				default:
 					mexPrintf("NSWING: Unknown option %s\n", argv[i]);
@@ -999,26 +1504,45 @@ int main(int argc, char **argv) {
 
 	if (argc <= 1 || error) {
 #ifdef LIMIT_DISCHARGE
-		mexPrintf("NSWING - A tsunami maker (%s)\t\t-- With DISCHARGE limit.\n\n", prog_id);
+		mexPrintf("NSWING - A tsunami maker (%s)\t\t-- With DISCHARGE limit.\n", prog_id);
 #else
-		mexPrintf("NSWING - A tsunami maker (%s)\n\n", prog_id);
+		mexPrintf("NSWING - A tsunami maker (%s)\n", prog_id);
+#endif
+#ifdef SINGLE_PRECISION
+		mexPrintf("\t\t\t\t\t\t\t-- With single precision state arrays.\n");
 #endif
+		mexPrintf("\n");
 
 #ifdef I_AM_MEX
+		mexPrintf("[maregs, grids] = ");
 		mexPrintf("nswing(bat,hdr_bat,deform,hdr_deform, [-1<bat_lev1>], [-2<bat_lev2>], [-3<...>] [maregs], [-G|Z<name>[+lev],<int>],\n");
 		mexPrintf("       [-A<fname.sww>], [-B<BCfile>], [-C], [-D], [-E[p][m][,decim]], [-Fdip/strike/rake/slip/length/width/topDepth/x_epic/y_epic],\n");
-		mexPrintf("       [-Fk[c]<w/e/s/n>], [-H], [-H<momentM,momentN>[,t]], [-J<time_jump>[+run_time_jump]], [-L[name1,name2]],,\n");
-		mexPrintf("       [-M[-|+[<maskname>]]], [-N<n_cycles>], [-R<w/e/s/n>], [-S[x|y|n][+m][+s]], [-O<int>,<outmaregs>],\n");
-		mexPrintf("       [-Q<z_offset>], [-S[x|y|n][+m][+s]], [-T<int>,<mareg>[,<outmaregs[+n]>]], [-X<manning0[,...]>] -t<dt> [-f]\n");
+		mexPrintf("       [-Fk[c]<w/e/s/n>], [-Fe<table>,<out>[+lev]], [-Ff<table>[+c<n>]], [-H], [-H<momentM,momentN>[,t]], [-J<time_jump>[+run_time_jump]], [-L[name1,name2[,decim][+n]]],,\n");
+		mexPrintf("       [-M[-|+[<maskname>]]], [-N<n_cycles>], [-R<w/e/s/n>], [-S[x|y|n][+m][+s]], [-O<int>[,<outmaregs>]],\n");
+		mexPrintf("       [-Q<z_offset>], [-S[x|y|n][+m][+s]], [-T<int>,<mareg>[,<outmaregs[+n]>]], [-X<manning0[,...]>] -t<dt>[+a[<courant>][+l<file>]] [-f] [-j[<n>]] [-a[r]] [-s] [-b[<MB>]]\n");
+		mexPrintf("       [-k[<rows>]] [-K<name>[,<int>][+r]] [-P[<file>]] [-z[<level>][+b|p<err>][+c<rows>[/<cols>]]]\n");
 #else
 		mexPrintf("nswing bathy.grd initial.grd [-1<bat_lev1>] [-2<bat_lev2>] [-3<...>] [-G|Z<name>[+lev],<int>] [-A<fname.sww>]\n");
 		mexPrintf("       [-B<BCfile>] [-C] [-D] [-E[p][m][,decim]] [-Fdip/strike/rake/slip/length/width/topDepth/x_epic/y_epic]\n"); 
-		mexPrintf("       [-Fk[c]<w/e/s/n>] [-H] [-H<momentM,momentN>[,t]] [-J<time_jump>[+run_time_jump]] [-L[name1,name2]]\n");
-		mexPrintf("       [-M[-|+[<maskname>]]] [-N<n_cycles>] [-R<w/e/s/n>] [-S[x|y|n][+m][+s]] [-T<int>,<mareg>[,<outmaregs[+n]>]]\n");
-		mexPrintf("       [-Q<z_offset>] [-X<manning0[,...]>] -t<dt> [-f]\n");
+		mexPrintf("       [-Fk[c]<w/e/s/n>] [-Fe<table>,<out>[+lev]] [-Ff<table>[+c<n>]] [-H] [-H<momentM,momentN>[,t]] [-J<time_jump>[+run_time_jump]]\n");
+		mexPrintf("       [-L[name1,name2[,decim][+n]]] [-M[-|+[<maskname>]]] [-N<n_cycles>] [-R<w/e/s/n>] [-S[x|y|n][+m][+s]] [-T<int>,<mareg>[,<outmaregs[+n]>]]\n");
+		mexPrintf("       [-Q<z_offset>] [-X<manning0[,...]>] -t<dt>[+a[<courant>][+l<file>]] [-f] [-j[<n>]] [-a[r]] [-s] [-b[<MB>]]\n");
+		mexPrintf("       [-k[<rows>]] [-K<name>[,<int>][+r]] [-P[<file>]] [-z[<level>][+b|p<err>][+c<rows>[/<cols>]]] [-d<n>]\n");
+		mexPrintf("nswing -Y[<n1>[/<n2>...]][,<cycles>][+s<fbh>][+j<n>][+o<file>][+r<file>][+k]\n");
 #endif
+		mexPrintf("\t-1<grid> ... -9<grid> Nested grids of level 1 to 9. Repeat a level to have several grids (e.g. a set\n");
+		mexPrintf("\t   of harbours) nested in the same parent. Each one is nested in the grid of the level above that contains it.\n");
+		mexPrintf("\t   Grids with the same parent may not overlap and, with OpenMP, they run on separate threads. The +lev of\n");
+		mexPrintf("\t   -G and -Z counts the grids by level and, within a level, by the order given (-1a -1b -2c -> c is 3).\n");
 		mexPrintf("\t-A <name> save result as a .SWW ANUGA format file\n");
+		mexPrintf("\t-a[r] Compute only the active region of the base grid, i.e. the cells reached by the wave front\n");
+		mexPrintf("\t   plus a halo. Results are identical, but early time steps of large grids are much cheaper.\n");
+		mexPrintf("\t   Append 'r' to report the fraction of skipped cells at the end.\n");
 		mexPrintf("\t-n basename for MOST triplet files (no extension)\n");
+		mexPrintf("\t-b[<MB>] Write the grids and netCDF slices of -G, -Z, -A and -n in a background thread, so that the\n");
+		mexPrintf("\t   solver does not wait for the disk. The solver only copies the (sub-region of the) output and goes on.\n");
+		mexPrintf("\t   <MB> is the memory that the queued outputs may hold (default is about two saving steps). When it is\n");
+		mexPrintf("\t   spent, the solver waits for the writer to catch up.\n");
 		mexPrintf("\t-B name of a BoundaryCondition ASCII file\n");
 		mexPrintf("\t-C Add Coriolis effect.\n");
 		mexPrintf("\t-D write grids with the total water depth. These grids will have wave height on ocean\n");
@@ -1038,6 +1562,16 @@ int main(int argc, char **argv) {
 		mexPrintf("\t-Fk.../dx[/dy]. Given the w/e/s/n region (Pixel registration) loop over the number of prisms\n");
 		mexPrintf("\t   obtained by dividing the regin in increments of dx/dy (if not given defaults dy = dx).\n");
 		mexPrintf("\t   The use of -Fk sets the output maregraph file to netCDF format, unless rows = cols = 1.\n");
+		mexPrintf("\t-Fe<table>,<out>[+lev] Run an ensemble of sources over the same bathymetry and nested grids. <table>\n");
+		mexPrintf("\t   has one source per line, either the 9 parameters of -F or the name of an initial condition grid.\n");
+		mexPrintf("\t   The grids are loaded only once and, with OpenMP, each thread runs one source at a time (-j sets\n");
+		mexPrintf("\t   their number, each one needs its own copy of the wave arrays). The max level of grid +lev and the\n");
+		mexPrintf("\t   -T maregraphs of each source go to the netCDF file <out>, along a 'source' dimension. Without\n");
+		mexPrintf("\t   netCDF support they go to <out>_0001.grd, <out>_0001.dat, ... Other outputs are not allowed.\n");
+		mexPrintf("\t-Ff<table>[+c<n>] Finite fault source. <table> has one subfault per line, with the 9 parameters of -F\n");
+		mexPrintf("\t   (separated by slashes, commas or blanks), and the initial condition is the sum of their deformations.\n");
+		mexPrintf("\t   With OpenMP the grid rows are shared by the -j threads. Append +c<n> to let each subfault deform\n");
+		mexPrintf("\t   only the nodes closer than <n> times its length (or width) to its center. Faster, but approximate.\n");
 		mexPrintf("\t-G <stem> write grids at the <int> intervals. Append file prefix. Files will be called <stem>#.grd\n");
 		mexPrintf("\t   When doing nested grids, append +lev to save that particular level (only one level is allowed)\n");
 		mexPrintf("\t-H write grids with the momentum. i.e velocity times water depth.\n");
@@ -1046,9 +1580,19 @@ int main(int argc, char **argv) {
 		mexPrintf("\t-J <time_jump> Do not write grids or maregraphs for times before time_jump in seconds.\n");
 		mexPrintf("\t   When doing nested grids, append +<time> to NOT start computations of nested grids before this\n");
 		mexPrintf("\t   time has elapsed. Any of these forms is allowed: -Jt1, -J+t2, -Jt1+t2 or -Jt1 -J+t2\n");
+		mexPrintf("\t-K <name>[,<int>][+r] Every <int> cycles save the complete state of the simulation (all nesting\n");
+		mexPrintf("\t   levels, max grids, tracers and maregraphs) in the binary checkpoint file <name>. It is written by\n");
+		mexPrintf("\t   the background writer (see -b), so the solver only pays for a memory copy. Append +r to resume\n");
+		mexPrintf("\t   from <name> when it exists (e.g. after the job was killed). Just rerun the same command. The\n");
+		mexPrintf("\t   resumed run gives the same results as an uninterrupted one, but the netCDF files of -Z, -n, -A and -L\n");
+		mexPrintf("\t   are recreated and only hold the steps computed after the restart. Not used with -Fk grids.\n");
 		mexPrintf("\t-L Use linear approximation in moment conservation equations (faster but less good).\n");
-		mexPrintf("\t-L <in_fname>,<out_fname> Do Lagragian tracers, where <in_fname> is the file name of the tracers\n");
-		mexPrintf("\t   initial position and <out_fname> the file name to hold the results.\n");
+		mexPrintf("\t-L <in_fname>,<out_fname>[,<decim>][+n] Do Lagragian tracers, where <in_fname> is the file name of the\n");
+		mexPrintf("\t   tracers initial position and <out_fname> the file name to hold the results. Each line of it has the\n");
+		mexPrintf("\t   time and the x,y of all tracers. Only the current positions are kept in memory, so this scales\n");
+		mexPrintf("\t   to millions of tracers (they are moved by the -j threads). Append ,<decim> to write only every\n");
+		mexPrintf("\t   <decim> cycles. Append +n to write instead a netCDF ragged array (CF trajectories) with only the\n");
+		mexPrintf("\t   tracers that are still inside the grid. Tracers that leave the grid stop there.\n");
 		mexPrintf("\t-M write a grid with the max water level. The file name is controled by the <name> in the -Z option,\n");
 		mexPrintf("\t   complemented with a '_max' prefix.\n");
 		mexPrintf("\t   Append a '-' to compute instead the maximum water retreat. The result is writen to a\n");
@@ -1059,8 +1603,13 @@ int main(int argc, char **argv) {
 		mexPrintf("\t   Note that if -Z was used the 'long' and 'short' beach arrays will be saved in the .nc file too.\n");
 		mexPrintf("\t-N number of cycles [Default 1010].\n");
 #ifdef I_AM_MEX
-		mexPrintf("\t-O <int>,<outfname> interval at which maregraphs are writen to the <outfname> maregraph file.\n");
+		mexPrintf("\t-O <int>[,<outfname>] interval at which maregraphs are writen to the <outfname> maregraph file,\n");
+		mexPrintf("\t   or to the first output.\n");
 #endif
+		mexPrintf("\t-P[<file>] Report at the end the wall clock time, number of calls and cells per second of each phase\n");
+		mexPrintf("\t   of the main loop (mass, moment, update, nesting edges, upscale, maxs, maregraphs, writers, ...), per\n");
+		mexPrintf("\t   grid. With <file> also save that table as CSV, or as JSON if the name ends in .json. With -b the\n");
+		mexPrintf("\t   writers time is only the time that the solver spent handing over the outputs.\n");
 		mexPrintf("\t-Q <z_offset> Apply a vertical offset to ALL bathymetry grids. Use it to simulate tide.\n");
 		mexPrintf("\t-R output grids only in the sub-region enclosed by <west/east/south/north>\n");
 		mexPrintf("\t-S write grids with the velocity. Grid names are appended with _U and _V sufixes.\n");
@@ -1076,31 +1625,111 @@ int main(int argc, char **argv) {
 #ifdef I_AM_MEX
 		mexPrintf("\t   Warning: this option cannot be used when maregraphs were transmitted in input.\n");
 #endif
+		mexPrintf("\t-W <ref_grid> Validation. Report the max and RMS differences between the max water level grid\n");
+		mexPrintf("\t   (requires -M) and <ref_grid>. Use it to compare a SINGLE_PRECISION build with the double one.\n");
 		mexPrintf("\t-X <maning0[,maning1[,...]][+<depth>]> Manning friction coefficients. If only one provided, use it for all\n");
 		mexPrintf("\t   nesting levels (if applyable), otherwise specify one for each nesting level separated by commas.\n");
 		mexPrintf("\t   Append +<depth> to only apply Manning at depths shallower than depth (pos up).\n");
 		mexPrintf("\t-Z Same as -G but saves result in a 3D netCDF file.\n");
-		mexPrintf("\t-t <dt> Time step for simulation.\n");
+		mexPrintf("\t-z[<level>][+b|p<err>][+c<rows>[/<cols>]] Compression of the slices of the -Z and -n files. They\n");
+		mexPrintf("\t   are stored in chunks of one slice and 128 x 128 cells (or <rows> x <cols>), so that the time\n");
+		mexPrintf("\t   series of a point is read without inflating whole slices, and deflated with <level> (default 4,\n");
+		mexPrintf("\t   0 for none). +b<err> rounds the values to multiples of a power of 2 not larger than 2*<err>\n");
+		mexPrintf("\t   (bit rounding), which makes them much more compressible. +p<err> stores the -Z slices in integers\n");
+		mexPrintf("\t   with a scale_factor of 2*<err> (fixed point), which compress even better. Both are lossy, with\n");
+		mexPrintf("\t   errors up to <err> in the units of each variable (cm and cm/s in the -n files, that use +b).\n");
+		mexPrintf("\t-t <dt>[+a[<courant>][+l<file>]] Time step for simulation. With +a the time step is adaptive and\n");
+		mexPrintf("\t   <dt> is only the length of a cycle (the unit of -N, -G, -T, ...), so that the outputs are still\n");
+		mexPrintf("\t   at exact times. At the start of each cycle the fastest signal, sqrt(g*h) plus the flow speed, of\n");
+		mexPrintf("\t   each grid is measured and the cycle is done in the fewest equal steps of the base grid, and\n");
+		mexPrintf("\t   each nested grid in the fewest steps of its parent, that keep the Courant number below\n");
+		mexPrintf("\t   <courant> (default 0.5). The time steps are printed each time they change, or written in\n");
+		mexPrintf("\t   <file> with +l. Not used with -d nor -Fe.\n");
 		mexPrintf("\t-f To use when grids are in geographical coordinates.\n");
+		mexPrintf("\t-j[<n>] Number of threads used to compute the grid rows. Without <n> use all available cores.\n");
+		mexPrintf("\t   Default is the OpenMP default (OMP_NUM_THREADS or all cores). Ignored if not built with OpenMP.\n");
+		mexPrintf("\t-s Compute the interior wet-wet cells of the momentum equations in a branch free loop that the\n");
+		mexPrintf("\t   compiler can vectorize (build with -O3 -fno-trapping-math). The other cells still go through\n");
+		mexPrintf("\t   the moving boundary cases. Results are the same as without -s (check with -W). Not used with -X\n");
+		mexPrintf("\t   nor for the nesting level whose velocities are written (-S+s).\n");
+		mexPrintf("\t-k[<rows>] Do the mass, open boundary, max level and moment sweeps of each step in bands of <rows>\n");
+		mexPrintf("\t   rows so that the band is still in cache when the next sweep reads it. Default is a band that\n");
+		mexPrintf("\t   fits in the L2 cache. Results are the same as without -k. Not used with nested grids nor in\n");
+		mexPrintf("\t   the steps that read the boundary condition file (-B).\n");
 #ifdef I_AM_MEX
 		mexPrintf("\t-e To be used from the Mirone stand-alone version.\n");
+		mexPrintf("\tOutputs: when requested, the maregraphs and the -G grids are returned instead of written to files.\n");
+		mexPrintf("\t   MAREGS is a struct with the times 't' (a column), the node coordinates 'x' and 'y' and 'eta' (single,\n");
+		mexPrintf("\t   one column per maregraph), plus 'vx' and 'vy' with -S+m. The <outmaregs> of -O is then not needed.\n");
+		mexPrintf("\t   GRIDS is a struct with the grid header 'head', the times 't' and the ny x nx x n_times array 'z'\n");
+		mexPrintf("\t   (single) of the grids saved every <int> cycles of -G, in the -R region. The -G name is ignored.\n");
 		return;
 #else
+		mexPrintf("\t-d<n> Split the base grid in <n> strips of rows, each computed by a process of its own (POSIX only).\n");
+		mexPrintf("\t   Neighbour strips swap their border rows after each step. Use -j to set the threads of each\n");
+		mexPrintf("\t   process. Results are the same as without -d. Not used with nested grids, -A, -B, -Fe, -Fk, -K,\n");
+		mexPrintf("\t   -L, -n nor beach masks.\n");
+		mexPrintf("\t-Y Benchmark (POSIX only). Generate synthetic scenarios with base grids of <n1>, <n2>, ... columns\n");
+		mexPrintf("\t   (default 256/1024) and an Okada source: a flat basin (f), a sloping beach with run-up (b) and a\n");
+		mexPrintf("\t   beach with a harbour in 3 nesting levels (h). Use +s to pick some of them (e.g. +sfh). Run each\n");
+		mexPrintf("\t   one for <cycles> cycles (default 200) with every kernel path (serial, -s, -k, -a, -d and -j) and\n");
+		mexPrintf("\t   print the cell updates per second of the main loop, the memory high-water mark and a checksum of\n");
+		mexPrintf("\t   the max level grid. +j sets the threads of the -j and -d paths (default all cores), which are only\n");
+		mexPrintf("\t   timed by OpenMP builds. +o saves the table as CSV and +r compares the speed and checksums with a\n");
+		mexPrintf("\t   table saved before. Build with and without SINGLE_PRECISION to time both. The grids and runs are in\n");
+		mexPrintf("\t   the directory %s, that is removed at the end unless +k is used. The exit status is the\n", BENCH_DIR);
+		mexPrintf("\t   number of runs that failed or whose checksum differs from the serial path or from the +r one.\n");
 		return error;
 #endif
 	}
 
+#ifdef HAVE_STRIPS
+	if (bench_spec)
+		return (bench_run(argv[0], bench_spec));
+#endif
+
 	do_maxs = (max_level || max_energy || max_power);
+	max_level_in = max_level;       /* Because max_level may be reset later when nesting */
+
+	if (ens_name[0]) {		/* The ensemble run writes only the max level and the maregraphs of each source */
+		if (do_Okada || do_Kaba || fonte || source_in_input || bnc_file || do_HotStart || write_grids || out_3D ||
+		    out_sww || out_most || ckp_name || do_tracers || fname_maxRef || max_energy || max_power || max_velocity ||
+		    out_energy || out_power || out_momentum || out_velocity || out_velocity_x || out_velocity_y ||
+		    out_velocity_r || nest.do_long_beach || nest.do_short_beach) {
+			mexPrintf("NSWING: Error, -Fe option only computes the max level and maregraphs of each source. It cannot\n");
+			mexPrintf("        be used with a source grid, -B, -E, -F, -G, -H, -K, -L, -S, -W, -Z, -A, -n nor beach masks.\n");
+			error++;
+		}
+		else if ((n_ens = read_ensemble(ens_name, &ens)) <= 0)
+			error++;
+		out_maregs_nc = FALSE;		/* The maregraphs go to the ensemble file */
+		if (do_timing) {
+			mexPrintf("NSWING: Warning, -P option is not used with -Fe. Ignoring it.\n");
+			do_timing = FALSE;
+		}
+		if (courant > 0) {
+			mexPrintf("NSWING: Warning, the adaptive time step (-t+a) is not used with -Fe. Ignoring it.\n");
+			courant = 0;
+		}
+	}
+
+	if (faults_name[0] && !error && (n_faults = read_faults(faults_name, &faults)) <= 0)
+		error++;
+
+	if (fname_maxRef && !max_level) {
+		mexPrintf("NSWING: Warning, -W option requires -M. Ignoring it.\n");
+		fname_maxRef = NULL;
+	}
 	do_2Dgrids = (write_grids || out_velocity || out_velocity_x || out_velocity_y || out_velocity_r || out_momentum
 	              || max_level || max_velocity || max_energy || out_power || max_power || nest.do_long_beach
 	              || nest.do_short_beach);
 
-	if (!(do_2Dgrids || out_sww || out_most || out_3D || cumpt)) {
+	if (!(do_2Dgrids || out_sww || out_most || out_3D || cumpt || ens_name[0])) {
 		mexPrintf("Nothing selected for output (grids, or maregraphs), exiting\n");
 		error++;
 	}
 
-	if (grn == 0 && !do_maxs && !cumpt) {
+	if (grn == 0 && !do_maxs && !cumpt && !ens_name[0]) {
 		mexPrintf("NSWING: Error, -G or -Z option. MUST provide saving interval\n");
 		error++;
 	}
@@ -1121,6 +1750,10 @@ int main(int argc, char **argv) {
 		mexPrintf("NSWING: Error -t option. Time step of simulation not provided or negative.\n");
 		error++;
 	}
+	if (courant < 0 || courant > 1) {
+		mexPrintf("NSWING: Error -t option. The Courant number of the adaptive time step must be in ]0 1].\n");
+		error++;
+	}
 
 	if (out_sww && fname_sww == NULL) {
 		mexPrintf("NSWING: Error -A option. Must provide a name for the .SWW file.\n");
@@ -1137,6 +1770,32 @@ int main(int argc, char **argv) {
 		nest.do_Coriolis = FALSE;
 	}
 
+#ifdef I_AM_MEX
+	if (nlhs > 2)
+		mexErrMsgTxt("NSWING: Error, there are at most two outputs, the maregraphs and the -G grids.");
+	/* With output arguments the maregraphs and the -G grids go to them instead of to the files */
+	mem_maregs = (nlhs >= 1 && cumpt && !do_Kaba && !ens_name[0]);
+	mem_grids  = (nlhs >= 2 && write_grids);
+	if (mem_maregs) out_maregs_nc = FALSE;
+	if (ckp_name && (mem_maregs || mem_grids)) {
+		mexPrintf("NSWING: Warning, -K option cannot resume the outputs returned to Matlab. Ignoring it.\n");
+		ckp_name = NULL;
+	}
+#endif
+
+	if (ckp_name && do_Kaba) {
+		mexPrintf("NSWING: Warning, -K option is not compatible with a grid of prisms (-Fk). Ignoring it.\n");
+		ckp_name = NULL;
+	}
+	if (ckp_name && do_restart) {	/* Only resume if a previous run left a checkpoint */
+		if ((j = ckp_open(ckp_name, &ckp_hdr, &fp_ckp)) < 0)
+			error++;
+		else if (j > 0)
+			do_restart = FALSE;
+	}
+	else
+		do_restart = FALSE;
+
 	if (cumpt) {		/* Deal with the several aspects of reading a maregraphs file */
 		if (cumint <= 0) {
 			mexPrintf("NSWING: error, -T or -O options imply a saving interval\n");
@@ -1146,7 +1805,11 @@ int main(int argc, char **argv) {
 			mexPrintf("NSWING: error, -T or -O options imply a maregs file\n");
 			Return(-1);
 		}
-		else if (!hcum || !strcmp(hcum, "")) {
+		else if (!mem_maregs && (!hcum || !strcmp(hcum, ""))) {
+			if (maregs_in_input) {
+				mexPrintf("NSWING: error, -O option must provide the output maregs file name (or request an output)\n");
+				Return(-1);
+			}
 			len = strlen(maregs) - 1;
 			while (maregs[len] != '.') len--;
 			if (len <= 0)
@@ -1159,7 +1822,9 @@ int main(int argc, char **argv) {
 		}
 
 		n_ptmar = n_of_cycles / cumint + 1;
-		if (!error && (fp = fopen (hcum, "w")) == NULL) {
+		/* When resuming, keep what the interrupted run wrote. Its end is overwritten from the checkpoint position */
+		if (!error && !ens_name[0] && !mem_maregs && (fp = fopen (hcum, (do_restart && !out_maregs_nc) ? "r+" : "w")) == NULL &&
+		    (fp = fopen (hcum, "w")) == NULL) {
 			mexPrintf("%s: Unable to create file %s - exiting\n", "nswing", hcum);
 			Return(-1);
 		}
@@ -1187,7 +1852,7 @@ int main(int argc, char **argv) {
 	if ((out_velocity || out_velocity_x || out_velocity_y || out_velocity_r) && (out_sww || out_most)) out_velocity = FALSE;
 
 	if (!bat_in_input && !source_in_input) {			/* If bathymetry & source where not given as arguments, load them */
-		if (!bathy || (!fonte && !bnc_file && !do_Okada && !do_Kaba)) {
+		if (!bathy || (!fonte && !bnc_file && !do_Okada && !do_Kaba && !ens_name[0])) {
 			mexPrintf("NSWING: error, bathymetry and/or source grids were not provided.\n"); 
 			Return(-1);
 		}
@@ -1198,7 +1863,7 @@ int main(int argc, char **argv) {
 			Return(-1);
 		}
 		
-		if (!do_Okada && !do_Kaba) {	/* Otherwise we will compute initial condition later down after arrays are allocated */
+		if (!do_Okada && !do_Kaba && !ens_name[0]) {	/* Otherwise we will compute initial condition later down after arrays are allocated */
 			if (!bnc_file) r_bin_f = read_grd_info_ascii(fonte, &hdr_f);	/* and check that both grids are compatible */
 			if (r_bin_f < 0) {
 				mexPrintf("NSWING: %s Invalid source grid. Possibly it is in the Surfer 7 format\n", fonte); 
@@ -1224,7 +1889,7 @@ int main(int argc, char **argv) {
 
 	dx = (hdr_b.x_max - hdr_b.x_min) / (hdr_b.nx - 1);
 	dy = (hdr_b.y_max - hdr_b.y_min) / (hdr_b.ny - 1);
-	if (!bnc_file && !do_Okada && !do_Kaba) {
+	if (!bnc_file && !do_Okada && !do_Kaba && !ens_name[0]) {
 		if (fabs(hdr_f.x_min - hdr_b.x_min) / dx > dx / 4 || fabs(hdr_f.x_max - hdr_b.x_max) / dx > dx / 4 ||
 			fabs(hdr_f.y_min - hdr_b.y_min) / dy > dy / 4 || fabs(hdr_f.y_max - hdr_b.y_max) / dy > dy / 4 ) {
 			mexPrintf("Bathymetry and source grids do not cover the same region\n"); 
@@ -1238,50 +1903,79 @@ int main(int argc, char **argv) {
 	ds = MIN(dx, dy);
 	if (isGeog) ds *= 111000;		/* Get it in metters */
 	dtCFL = ds / sqrt(fabs(hdr_b.z_min) * 9.8);
-	if (dt > dtCFL) {
+	if (courant == 0 && dt > dtCFL) {	/* With the adaptive time step dt is only the cycle length */
 		mexPrintf("NSWING: Error: dt is greater than dtCFL (%.3f). No way that this would work. Stopping here.\n", dtCFL); 
 		Return(-1);
 	}
-	else if (dt > (dtCFL / 2)*1.1)		/* With a margin of 10% before triggering the warning */
+	else if (courant == 0 && dt > (dtCFL / 2)*1.1)		/* With a margin of 10% before triggering the warning */
 		mexPrintf("NSWING: Warning: dt > dtCFL / 2 is normaly not good enough. "
 		                   "This may cause troubles. Consider using ~ %.3f\n", dtCFL/2); 
 
 	if (error) Return(-1);
 
+#if HAVE_OPENMP
+	if (n_threads > 0) omp_set_num_threads(n_threads);
+#else
+	if (n_threads > 1)
+		mexPrintf("NSWING: Warning, -j option ignored. This program was not built with OpenMP support.\n");
+#endif
+
 	if (n_arg_no_char == 0) {		/* Read the nesting grids (when we have them ofc) */
-		int r_bin;
+		int r_bin, lev, n, p, n_cand, slot_level[10];
 		double dx, dy;		/* Local variables to not interfere with the base level ones */
 		struct	srf_header hdr;
 
+		/* Grids are stored by increasing nesting level, so that parents always come before their children */
 		num_of_nestGrids = 0;
-		while (nesteds[num_of_nestGrids] != NULL) {
-			if ((r_bin = read_grd_info_ascii(nesteds[num_of_nestGrids], &hdr)) < 0) {
-				mexPrintf("NSWING: %s Invalid bathymetry grid. Possibly it is in the Surfer 7 format\n",
-					nesteds[num_of_nestGrids]); 
-				Return(-1);
-			}
-			if ((nest.bat[num_of_nestGrids+1] = (double *)mxCalloc((size_t)hdr.nx*(size_t)hdr.ny, sizeof(double)) ) == NULL) 
-				{no_sys_mem("(bat)", hdr.nx*hdr.ny); Return(-1);}
-
-			if (!r_bin) {
-				if (read_grd_ascii(nesteds[num_of_nestGrids], &hdr, nest.bat[num_of_nestGrids+1], -1))
+		slot_level[0] = 0;
+		for (lev = 1; lev <= 9; lev++) {
+			for (n = 0; n < n_nesteds; n++) {
+				if (nest_level[n] != lev) continue;
+				k = num_of_nestGrids + 1;
+				if ((r_bin = read_grd_info_ascii(nesteds[n], &hdr)) < 0) {
+					mexPrintf("NSWING: %s Invalid bathymetry grid. Possibly it is in the Surfer 7 format\n", nesteds[n]); 
 					Return(-1);
-			}
-			else {
-				if (read_grd_bin(nesteds[num_of_nestGrids], &hdr, nest.bat[num_of_nestGrids+1], -1))
+				}
+				if ((nest.bat[k] = (real *)mxCalloc((size_t)hdr.nx*(size_t)hdr.ny, sizeof(real)) ) == NULL) 
+					{no_sys_mem("(bat)", hdr.nx*hdr.ny); Return(-1);}
+
+				if (!r_bin) {
+					if (read_grd_ascii(nesteds[n], &hdr, nest.bat[k], -1))
+						Return(-1);
+				}
+				else {
+					if (read_grd_bin(nesteds[n], &hdr, nest.bat[k], -1))
+						Return(-1);
+				}
+
+				dx = (hdr.x_max - hdr.x_min) / (hdr.nx - 1);
+				dy = (hdr.y_max - hdr.y_min) / (hdr.ny - 1);
+				nest.hdr[k].nx = hdr.nx;
+				nest.hdr[k].ny = hdr.ny;
+				nest.hdr[k].nm = (unsigned int)hdr.nx * (unsigned int)hdr.ny;
+				nest.hdr[k].x_inc = dx;           nest.hdr[k].y_inc = dy;
+				nest.hdr[k].x_min = hdr.x_min;    nest.hdr[k].x_max = hdr.x_max;
+				nest.hdr[k].y_min = hdr.y_min;    nest.hdr[k].y_max = hdr.y_max;
+				nest.hdr[k].z_min = hdr.z_min;    nest.hdr[k].z_max = hdr.z_max;
+				slot_level[k] = lev;
+
+				/* The parent is the grid of the level above. When there are several, the one that contains this grid */
+				for (p = n_cand = 0; p < k; p++)
+					if (slot_level[p] == lev - 1) {n_cand++;	nest.parent[k] = p;}
+				if (n_cand > 1) {
+					for (p = 1, nest.parent[k] = -1; p < k && nest.parent[k] < 0; p++) {
+						if (slot_level[p] == lev - 1 &&
+						    hdr.x_min > nest.hdr[p].x_min && hdr.x_max < nest.hdr[p].x_max &&
+						    hdr.y_min > nest.hdr[p].y_min && hdr.y_max < nest.hdr[p].y_max)
+							nest.parent[k] = p;
+					}
+				}
+				if (nest.parent[k] < 0) {
+					mexPrintf("NSWING: The level %d grid %s is not inside any level %d grid\n", lev, nesteds[n], lev - 1);
 					Return(-1);
+				}
+				num_of_nestGrids++;
 			}
-
-			dx = (hdr.x_max - hdr.x_min) / (hdr.nx - 1);
-			dy = (hdr.y_max - hdr.y_min) / (hdr.ny - 1);
-			nest.hdr[num_of_nestGrids+1].nx = hdr.nx;
-			nest.hdr[num_of_nestGrids+1].ny = hdr.ny;
-			nest.hdr[num_of_nestGrids+1].nm = (unsigned int)hdr.nx * (unsigned int)hdr.ny;
-			nest.hdr[num_of_nestGrids+1].x_inc = dx;           nest.hdr[num_of_nestGrids+1].y_inc = dy;
-			nest.hdr[num_of_nestGrids+1].x_min = hdr.x_min;    nest.hdr[num_of_nestGrids+1].x_max = hdr.x_max;
-			nest.hdr[num_of_nestGrids+1].y_min = hdr.y_min;    nest.hdr[num_of_nestGrids+1].y_max = hdr.y_max;
-			nest.hdr[num_of_nestGrids+1].z_min = hdr.z_min;    nest.hdr[num_of_nestGrids+1].z_max = hdr.z_max;
-			num_of_nestGrids++;
 		}
 		do_nestum = (num_of_nestGrids) ? TRUE : FALSE;
 	}
@@ -1302,6 +1996,32 @@ int main(int argc, char **argv) {
 	for (k = 0; k < argc; k++) {		/* Build the History string (incomplete if AM_MEX) */
 		strcat(history, argv[k]);		strcat(history, " ");
 	}
+	/* -------- Split level 0 in strips of rows, each computed by a process of its own ---------- */
+	memset(&strip, 0, sizeof(struct strip_ctx));
+	if (n_strips > 1) {
+#ifdef HAVE_STRIPS
+		if (do_nestum || bnc_file || n_ens || do_Kaba || ckp_name || do_tracers || out_sww || out_most ||
+		    nest.do_long_beach || nest.do_short_beach || courant > 0) {
+			mexPrintf("NSWING: Warning, -d option cannot be used with nested grids, -A, -B, -Fe, -Fk, -K, -L, -n,\n");
+			mexPrintf("        beach masks nor the adaptive time step (-t+a). Ignoring it.\n");
+			n_strips = 0;
+		}
+#else
+		mexPrintf("NSWING: Warning, -d option is only for the stand-alone POSIX build. Ignoring it.\n");
+		n_strips = 0;
+#endif
+		n_strips = MIN(n_strips, hdr_b.ny / STRIP_HALO);	/* Each strip must own the rows that its neighbours keep */
+	}
+	if (n_strips > 1) {
+		if (strip_fork(&strip, n_strips, hdr_b, dx, dy, do_2Dgrids || out_3D, (cumpt) ? n_mareg : 0))
+			Return(-1);
+		nest.strip = &strip;
+		hdr_b.y_min += strip.row0 * dy;		hdr_b.ny = strip.n_rows;	/* From here on level 0 is this strip */
+		hdr_b.y_max  = hdr_b.y_min + (hdr_b.ny - 1) * dy;
+		if (strip.rank > 0)			/* Only the first strip talks */
+			verbose = do_timing = report_active = do_bgwrite = FALSE;
+	}
+
 	/* -------------- Allocate memory and initialize the 'nest' structure ------------------- */
 	nest.hdr[0].nx      = hdr_b.nx;		nest.hdr[0].ny = hdr_b.ny;
 	nest.hdr[0].nm      = (unsigned int)hdr_b.nx * (unsigned int)hdr_b.ny;
@@ -1321,10 +2041,7 @@ int main(int argc, char **argv) {
 	if ((do_maxs || (nest.long_beach || nest.short_beach)) && 
 		(wmax = (float *) mxCalloc((size_t)nest.hdr[writeLevel].nm, sizeof(float)) ) == NULL)
 		{no_sys_mem("(wmax)", nest.hdr[writeLevel].nm); Return(-1);}
-	if (max_energy || max_power && (workMax = (float *)mxCalloc((size_t)nest.hdr[writeLevel].nm, sizeof(float)) ) == NULL)
-		{no_sys_mem("(workMax)", nest.hdr[writeLevel].nm); Return(-1);}
-	/* Copy these pointers to use in update_max() */
-	nest.work = work;
+	/* Copy these pointers to use in update_maxs() */
 	nest.wmax = wmax;
 	if (max_velocity && (vmax = (float *)mxCalloc((size_t)nest.hdr[writeLevel].nm, sizeof(float)) ) == NULL)
 		{no_sys_mem("(vmax)", nest.hdr[writeLevel].nm); Return(-1);}
@@ -1343,38 +2060,53 @@ int main(int argc, char **argv) {
 		}
 	}
 	else {			/* If bathymetry & source where not given as arguments, load them */
-		if (!r_bin_b)					/* Read bathymetry */
-			read_grd_ascii(bathy, &hdr_b, nest.bat[0], -1);
+		if (!r_bin_b)					/* Read bathymetry (only the rows of this strip, if -d) */
+			read_grd_ascii_rows(bathy, &hdr_b, nest.bat[0], -1, strip.row0, strip.n_rows);
 		else
-			read_grd_bin(bathy, &hdr_b, nest.bat[0], -1);
-
-		if (bnc_file == NULL) {
-			if (do_Okada)				/* compute the initial condition */
-				deform(hdr_b, dx, dy, isGeog, f_length, f_width, f_azim, f_dip, f_rake, f_slip,
-				        f_topDepth, x_epic, y_epic, nest.etaa[0]);
+			read_grd_bin_rows(bathy, &hdr_b, nest.bat[0], -1, strip.row0, strip.n_rows);
+
+		if (bnc_file == NULL && !ens_name[0]) {	/* The ensemble sources are computed in run_ensemble() */
+			if (do_Okada) {				/* compute the initial condition */
+				struct srf_header hdr_g = hdr_b;
+				real *z = nest.etaa[0];
+				if (nest.strip) {		/* Over the whole grid, so that it is the same as without strips */
+					hdr_g.ny = strip.g.ny;		hdr_g.y_min = strip.g.y_min;		hdr_g.y_max = strip.g.y_max;
+					if ((z = (real *)mxCalloc((size_t)strip.g.nm, sizeof(real))) == NULL)
+						{no_sys_mem("(okada)", strip.g.nm); Return(-1);}
+				}
+				if (n_faults)
+					deform_faults(hdr_g, dx, dy, isGeog, faults, n_faults, fault_cut, z);
+				else
+					deform(hdr_g, dx, dy, isGeog, f_length, f_width, f_azim, f_dip, f_rake, f_slip,
+					        f_topDepth, x_epic, y_epic, z);
+				if (nest.strip) {
+					memcpy(nest.etaa[0], &z[(size_t)strip.row0 * hdr_b.nx], (size_t)nest.hdr[0].nm * sizeof(real));
+					mxFree(z);
+				}
+			}
 			else if (do_Kaba) {
 				kaba_source(hdr_b, dx, dy, kaba_xmin, kaba_xmax, kaba_ymin, kaba_ymax, do_Kaba, nest.etaa[0]);
 			}
 			else {
 				r_bin_b = read_grd_info_ascii(fonte, &hdr_f);	/* To know if bin or asc (but idiot, fun should do it all) */
 				if (r_bin_b)			/* Read source */
-					read_grd_bin(fonte, &hdr_f, nest.etaa[0], 1);
+					read_grd_bin_rows(fonte, &hdr_f, nest.etaa[0], 1, strip.row0, strip.n_rows);
 				else
-					read_grd_ascii(fonte, &hdr_f, nest.etaa[0], 1);
+					read_grd_ascii_rows(fonte, &hdr_f, nest.etaa[0], 1, strip.row0, strip.n_rows);
 			}
 		}
 	}
 
 	if (do_HotStart) {
 		if (!r_bin_mM)					/* Read moment M */
-			read_grd_ascii(fname_momentM, &hdr_mM, nest.fluxm_a[0], 1);
+			read_grd_ascii_rows(fname_momentM, &hdr_mM, nest.fluxm_a[0], 1, strip.row0, strip.n_rows);
 		else
-			read_grd_bin(fname_momentM, &hdr_mM, nest.fluxm_a[0], 1);
+			read_grd_bin_rows(fname_momentM, &hdr_mM, nest.fluxm_a[0], 1, strip.row0, strip.n_rows);
 
 		if (!r_bin_mN)					/* Read moment N */
-			read_grd_ascii(fname_momentN, &hdr_mN, nest.fluxn_a[0], 1);
+			read_grd_ascii_rows(fname_momentN, &hdr_mN, nest.fluxn_a[0], 1, strip.row0, strip.n_rows);
 		else
-			read_grd_bin(fname_momentN, &hdr_mN, nest.fluxn_a[0], 1);
+			read_grd_bin_rows(fname_momentN, &hdr_mN, nest.fluxn_a[0], 1, strip.row0, strip.n_rows);
 	}
 
 	hdr.nx = hdr_b.nx;          hdr.ny = hdr_b.ny;
@@ -1387,11 +2119,12 @@ int main(int argc, char **argv) {
 	hdr.doCoriolis = FALSE;
 
 	nest.hdr[0] = hdr;
+	hdr_out = (nest.strip) ? strip.g : nest.hdr[writeLevel];	/* The grid that is written. Whole if in strips */
 
 	if (cumpt && !maregs_in_input) {
 		lcum_p = (unsigned int *)mxCalloc((size_t)(1024), sizeof(unsigned int));	/* We wont ever use these many */
 		mareg_names = mxCalloc((size_t)(1024), sizeof(char *));
-		if ((n_mareg = read_maregs(nest.hdr[writeLevel], maregs, lcum_p, mareg_names)) < 1) {	/* Read maregraph locations */
+		if ((n_mareg = read_maregs(hdr_out, maregs, lcum_p, mareg_names)) < 1) {	/* Read maregraph locations */
 			mexPrintf("NSWING - WARNING: No maregraphs inside the (inner?) grid\n");
 			n_mareg = 0;
 			if (lcum_p) mxFree(lcum_p);
@@ -1402,27 +2135,34 @@ int main(int argc, char **argv) {
 
 	/* ------- If we have a tracers (oranges) file, time to load it ------------ */
 	if (do_tracers) {
-		if ((fp_oranges = fopen(tracers_outfile, "wt")) == NULL) {
-			mexPrintf("NSWING: Unable to open output tracers file %s - ignoring this option\n", tracers_outfile);
+		oranges.n = n_oranges;
+		oranges.decim = MAX(oranges.decim, 1);
+		oranges.x    = (double *)mxCalloc((size_t)n_oranges, sizeof(double));
+		oranges.y    = (double *)mxCalloc((size_t)n_oranges, sizeof(double));
+		oranges.cell = (int *)mxCalloc((size_t)n_oranges, sizeof(int));
+		if (!oranges.x || !oranges.y || !oranges.cell) {no_sys_mem("(oranges)", 3 * n_oranges); Return(-1);}
+		if ((n_oranges = oranges.n = read_tracers(nest.hdr[writeLevel], tracers_infile, &oranges)) < 1) {	/* Read orange locations */
+			mexPrintf("NSWING - WARNING: No tracers inside the (inner?) grid\n");
 			do_tracers = FALSE;
 		}
-		else {
-			oranges = (struct tracers *)mxCalloc((size_t)n_oranges, sizeof(struct tracers));
-			for (n = 0; n < n_oranges; n++) {
-				oranges[n].x = (double *)mxCalloc((size_t)(n_of_cycles), sizeof(double));
-				oranges[n].y = (double *)mxCalloc((size_t)(n_of_cycles), sizeof(double));
-			}
-			if ((n_oranges = read_tracers(nest.hdr[writeLevel], tracers_infile, oranges)) < 1) {	/* Read orange locations */
-				mexPrintf("NSWING - WARNING: No tracers inside the (inner?) grid\n");
-				for (n = 0; n < n_oranges; n++) {mxFree(oranges[n].x);		mxFree(oranges[n].y);}
+		else if (out_oranges_nc) {
+#ifdef HAVE_NETCDF
+			if ((oranges.buf = (double *)mxCalloc((size_t)(4 * n_oranges), sizeof(double))) == NULL)
+				{no_sys_mem("(oranges)", 4 * n_oranges); Return(-1);}
+			if ((oranges.ncid = open_tracers_nc(&nest, &oranges, tracers_outfile, history)) == -1)
 				do_tracers = FALSE;
-			}
-			/* Select which vx/vy will be used to compute the lagragian tracers */
-			vx_for_oranges     = nest.vex[writeLevel];
-			vy_for_oranges     = nest.vey[writeLevel];
-			fluxm_for_oranges  = nest.fluxm_d[writeLevel];
-			fluxn_for_oranges  = nest.fluxn_d[writeLevel];
-			htotal_for_oranges = nest.htotal_d[writeLevel];
+#endif
+		}
+		/* When resuming, keep what the interrupted run wrote. Its end is overwritten from the checkpoint position */
+		else if ((oranges.fp = fopen(tracers_outfile, (do_restart) ? "r+" : "w")) == NULL &&
+		         (oranges.fp = fopen(tracers_outfile, "w")) == NULL) {
+			mexPrintf("NSWING: Unable to open output tracers file %s - ignoring this option\n", tracers_outfile);
+			do_tracers = FALSE;
+		}
+		if (!do_tracers) {
+			mxFree(oranges.x);	mxFree(oranges.y);	mxFree(oranges.cell);
+			if (oranges.buf) mxFree(oranges.buf);
+			n_oranges = 0;
 		}
 	}
 
@@ -1469,19 +2209,19 @@ int main(int argc, char **argv) {
 	/* ----------------- Compute vars to use if write grids --------------------- */
 	if (!got_R && (do_2Dgrids || out_sww || out_most || out_3D) ) {	
 		/* Write grids over the whole region */
-		i_start = 0;            i_end = nest.hdr[writeLevel].nx;
-		j_start = 0;            j_end = nest.hdr[writeLevel].ny;
-		xMinOut = nest.hdr[writeLevel].x_min;	yMinOut = nest.hdr[writeLevel].y_min;
+		i_start = 0;            i_end = hdr_out.nx;
+		j_start = 0;            j_end = hdr_out.ny;
+		xMinOut = hdr_out.x_min;	yMinOut = hdr_out.y_min;
 	}
 	else if (got_R && (do_2Dgrids || out_sww || out_most || out_3D)) {	
 		/* Write grids in sub-region */
-		i_start = irint((dfXmin - nest.hdr[writeLevel].x_min) / nest.hdr[writeLevel].x_inc);
-		j_start = irint((dfYmin - nest.hdr[writeLevel].y_min) / nest.hdr[writeLevel].y_inc); 
-		i_end   = irint((dfXmax - nest.hdr[writeLevel].x_min) / nest.hdr[writeLevel].x_inc) + 1;
-		j_end   = irint((dfYmax - nest.hdr[writeLevel].y_min) / nest.hdr[writeLevel].y_inc) + 1;
+		i_start = irint((dfXmin - hdr_out.x_min) / hdr_out.x_inc);
+		j_start = irint((dfYmin - hdr_out.y_min) / hdr_out.y_inc); 
+		i_end   = irint((dfXmax - hdr_out.x_min) / hdr_out.x_inc) + 1;
+		j_end   = irint((dfYmax - hdr_out.y_min) / hdr_out.y_inc) + 1;
 		/* Adjustes xMin|yMin to lay on the closest grid node */
-		xMinOut = nest.hdr[writeLevel].x_min + nest.hdr[writeLevel].x_inc * i_start;
-		yMinOut = nest.hdr[writeLevel].y_min + nest.hdr[writeLevel].y_inc * j_start;
+		xMinOut = hdr_out.x_min + hdr_out.x_inc * i_start;
+		yMinOut = hdr_out.y_min + hdr_out.y_inc * j_start;
 	}
 	/* -------------------------------------------------------------------------- */
 
@@ -1540,12 +2280,16 @@ int main(int argc, char **argv) {
 			tmp_slice = (float *)mxMalloc(sizeof(float) * (nx * ny));   /* To use inside slice writing */ 
 	} 
 	else if (out_3D) {
-		nx = nest.hdr[writeLevel].nx;		ny = nest.hdr[writeLevel].ny;
-		ncid_3D[0] = open_most_nc(&nest, work, fname3D, "z", history, ids_z, nx, ny, xMinOut, yMinOut, FALSE, writeLevel);
-
-		if (ncid_3D[0] == -1) {
-			mexPrintf ("NSWING: failure to create netCDF file\n");
-			Return(-1);
+		nx = hdr_out.nx;		ny = hdr_out.ny;
+		for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++)	/* Change bathy sign back to pos up. Written right away */
+			work[ij] = (float)-nest.bat[writeLevel][ij];
+		if ((wout = strip_gather(&nest, work)) != NULL) {	/* Only the first strip writes */
+			ncid_3D[0] = open_most_nc(&nest, wout, fname3D, "z", history, ids_z, nx, ny, xMinOut, yMinOut, FALSE, writeLevel);
+
+			if (ncid_3D[0] == -1) {
+				mexPrintf ("NSWING: failure to create netCDF file\n");
+				Return(-1);
+			}
 		}
 		ids_3D[0] = ids_z[3];       /* ID of z vriable */
 		ids_3D[1] = ids_z[5];       /* ID of Vx vriable (only used when it exists) */
@@ -1571,14 +2315,7 @@ int main(int argc, char **argv) {
 		j_end = nest.hdr[writeLevel].ny;
 	}
 
-	if (cumpt) {               /* Select which etad/vx/vy will be used to output maregrapghs */
-		eta_for_maregs    = nest.etad[writeLevel];
-		vx_for_maregs     = nest.vex[writeLevel];
-		vy_for_maregs     = nest.vey[writeLevel];
-		fluxm_for_maregs  = nest.fluxm_d[writeLevel];
-		fluxn_for_maregs  = nest.fluxn_d[writeLevel];
-		htotal_for_maregs = nest.htotal_d[writeLevel];
-
+	if (cumpt) {
 		if (out_maregs_nc) {    /* Allocate an array to hold the maregraph data which will be written to a nc file at the end */
 			if ((maregs_array = (float *) mxCalloc((size_t)(n_ptmar * n_mareg), sizeof(float))) == NULL)
 				{no_sys_mem("(maregs_array)", n_ptmar * n_mareg); Return(-1);}
@@ -1600,16 +2337,17 @@ int main(int argc, char **argv) {
 	if (verbose) {
 		mexPrintf("\nNSWING: %s\n\n", prog_id);
 		mexPrintf("Layer 0  time step = %g\tx_min = %g\tx_max = %g\ty_min = %g\ty_max = %g\n",
-		          dt, hdr_b.x_min, hdr_b.x_max, hdr_b.y_min, hdr_b.y_max);
+		          dt, hdr_b.x_min, hdr_b.x_max, (nest.strip) ? strip.g.y_min : hdr_b.y_min,
+		          (nest.strip) ? strip.g.y_max : hdr_b.y_max);
 		if (do_nestum) {
 			for (k = 1; k <= num_of_nestGrids; k++) {
-				mexPrintf("Layer %d x_min = %g\tx_max = %g\ty_min = %g\ty_max = %g\n",
-				k, nest.LLx[k], nest.LRx[k], nest.LLy[k], nest.URy[k]);
+				mexPrintf("Layer %d (level %d, nested in layer %d) x_min = %g\tx_max = %g\ty_min = %g\ty_max = %g\n",
+				k, nest.level[k], nest.parent[k], nest.LLx[k], nest.LRx[k], nest.LLy[k], nest.URy[k]);
 				mexPrintf("Layer %d inserting index (one based) LL: (row,col) = %d\t%d\t\tUR: (row,col) = %d\t%d\n",
 				k, nest.LLrow[k]+2, nest.LLcol[k]+2, nest.URrow[k], nest.URcol[k]);
-				mexPrintf("\tTime step ratio to parent grid = %d\n", (int)(nest.dt[k-1] / nest.dt[k]));
+				mexPrintf("\tTime step ratio to parent grid = %d\n", (int)(nest.dt[nest.parent[k]] / nest.dt[k]));
 				if (k > 1)
-					mexPrintf("\t\tdt(parent) = %g\tdt(doughter) = %g\n", nest.dt[k-1], nest.dt[k]);
+					mexPrintf("\t\tdt(parent) = %g\tdt(doughter) = %g\n", nest.dt[nest.parent[k]], nest.dt[k]);
 			}
 		}
 		mexPrintf ("dtCFL = %.4f\tCourant number (sqrt(g*h)*dt / max(dx,dy)) = %g\n", dtCFL, 1/dtCFL * dt);
@@ -1628,10 +2366,19 @@ int main(int argc, char **argv) {
 		}
 		if (nest.do_linear)
 			mexPrintf("Using Linear approximation\n");
+		if (nest.do_simd)
+			mexPrintf("Using branch free loops for the wet-wet cells\n");
+#if HAVE_OPENMP
+		mexPrintf("Using %d threads\n", omp_get_max_threads());
+#endif
+		if (nest.strip)
+			mexPrintf("Computing the base grid in %d strips of rows, each one in a process\n", strip.n);
 		if (do_tracers)
 			mexPrintf("Computing tracers from file %s \n", tracers_infile);
 		if (do_Kaba)
 			mexPrintf("Computing a grid of prisms with size %d (rows) x %d (cols)\n", KbGridRows, KbGridCols);
+		if (n_ens)
+			mexPrintf("Computing an ensemble of %d sources\n", n_ens);
 		if (EPS4 != EPS4_)
 			mexPrintf("Using a modified EPS4 const of %g\n", EPS4);
 #ifdef LIMIT_DISCHARGE
@@ -1655,18 +2402,176 @@ int main(int argc, char **argv) {
 		max_velocity = FALSE;             /* Prevent the equivalent code in main loop to be executed */ 
 	}
 
+	if (do_active && bnc_file) {
+		mexPrintf("NSWING: Warning, -a option is not compatible with a boundary condition file. Ignoring it.\n");
+		do_active = FALSE;
+	}
+	if (tile_rows && do_nestum) {
+		mexPrintf("NSWING: Warning, -k option is only for runs without nested grids. Ignoring it.\n");
+		tile_rows = 0;
+	}
+	if (tile_rows < 0)			/* Rows whose arrays (about 12 of them) fit in TILE_BYTES */
+		tile_rows = MAX(4, (int)(TILE_BYTES / (12 * sizeof(real) * nest.hdr[0].nx)));
+	if (do_active) {	/* Second halves of act_lo, act_hi are used as scratch by active_region() */
+		if ((nest.act_lo = (int *)mxCalloc((size_t)(4 * nest.hdr[0].ny), sizeof(int)) ) == NULL)
+			{no_sys_mem("(act_lo)", 4 * nest.hdr[0].ny); Return(-1);}
+		nest.act_hi = &nest.act_lo[2 * nest.hdr[0].ny];
+	}
+
+	if (ckp_name) {		/* List the arrays of the simulation state. Their number does not change along the run */
+		n_ckp = ckp_blocks(&nest, num_of_nestGrids + 1, 0, wmax, vmax, &oranges, (do_tracers) ? n_oranges : 0,
+		                   maregs_timeout, 0, maregs_array, 0, NULL);
+		if ((ckp_blk = (struct ckp_block *)mxCalloc((size_t)n_ckp, sizeof(struct ckp_block))) == NULL)
+			{no_sys_mem("(ckp_blk)", n_ckp); Return(-1);}
+	}
+
+	if (do_restart) {	/* Continue from the state saved in the checkpoint */
+		if (ckp_match(&ckp_hdr, &nest, num_of_nestGrids + 1, isGeog, dt, n_of_cycles)) Return(-1);
+		if (ckp_hdr.n_oranges != ((do_tracers) ? n_oranges : 0) || ckp_hdr.n_mareg != ((maregs_timeout) ? n_mareg : 0) ||
+		    (maregs_timeout && ckp_hdr.count_time_maregs_timeout > (unsigned int)n_ptmar)) {
+			mexPrintf("NSWING: The checkpoint was written with other tracers or maregraphs (-L, -T)\n");
+			Return(-1);
+		}
+		ckp_blocks(&nest, num_of_nestGrids + 1, ckp_hdr.k, wmax, vmax, &oranges, (do_tracers) ? n_oranges : 0,
+		           maregs_timeout, ckp_hdr.count_time_maregs_timeout, maregs_array, ckp_hdr.count_maregs_timeout, ckp_blk);
+		if (ckp_load(fp_ckp, &ckp_hdr, ckp_blk, n_ckp)) Return(-1);
+		fclose(fp_ckp);
+
+		k_start = ckp_hdr.k;
+		nest.time_h = time_h = ckp_hdr.time_h;
+		nest.run_jump_time = ckp_hdr.run_jump_time;
+		n_active = ckp_hdr.n_active;		n_cells = ckp_hdr.n_cells;
+		count_maregs_timeout = ckp_hdr.count_maregs_timeout;
+		count_time_maregs_timeout = ckp_hdr.count_time_maregs_timeout;
+		if (ckp_hdr.bnc_done) bnc_file = NULL;
+		if (cumpt && !out_maregs_nc && ckp_hdr.maregs_pos >= 0) {
+			fseek(fp, 0, SEEK_END);
+			if (ftell(fp) < ckp_hdr.maregs_pos) {
+				mexPrintf("NSWING: Warning, maregraphs file %s is shorter than at the checkpoint time\n", hcum);
+			}
+			else
+				fseek(fp, (long)ckp_hdr.maregs_pos, SEEK_SET);
+		}
+		if (do_tracers && oranges.fp && ckp_hdr.oranges_pos >= 0) {
+			fseek64(oranges.fp, 0, SEEK_END);
+			if (ftell64(oranges.fp) < ckp_hdr.oranges_pos) {
+				mexPrintf("NSWING: Warning, tracers file %s is shorter than at the checkpoint time\n", tracers_outfile);
+			}
+			else
+				fseek64(oranges.fp, ckp_hdr.oranges_pos, SEEK_SET);
+		}
+		if (verbose)
+			mexPrintf("Resuming from checkpoint %s at cycle %d (time = %g)\n", ckp_name, k_start, time_h);
+	}
+
+	if ((do_bgwrite && grn && (write_grids || out_3D || out_most || out_sww)) || (ckp_name && ckp_int > 0)) {
+		if (bg_budget == 0) {	/* About two saving steps. Count the grids (or slices) written at each step */
+			n = write_grids * (1 + 2 * (out_momentum && !out_3D) + out_velocity_x + out_velocity_y) + out_3D * 3 +
+			    (out_sww || out_most) * 3;
+			bg_budget = 2 * (size_t)n * nest.hdr[writeLevel].nm * sizeof(float);
+		}
+		if (ckp_name && ckp_int > 0) {	/* Plus room for a checkpoint (its largest size, at the last cycle) */
+			ckp_blocks(&nest, num_of_nestGrids + 1, n_of_cycles, wmax, vmax, &oranges, (do_tracers) ? n_oranges : 0,
+			           maregs_timeout, n_ptmar, maregs_array, n_ptmar * n_mareg, ckp_blk);
+			bg_budget += ckp_size(n_ckp, ckp_blk);
+		}
+		if (aw_start(&aw, bg_budget)) {
+			mexPrintf("NSWING: Warning, could not start the background writer. Writing from the solver thread.\n");
+		}
+		else {
+			nest.aw = &aw;
+			if (verbose)
+				mexPrintf("Writing the output in a background thread (up to %g MB queued)\n", bg_budget / 1048576.0);
+		}
+	}
+
+	if (do_timing) {
+		if ((nest.tm = (struct phase_timers *)mxCalloc(1, sizeof(struct phase_timers))) == NULL)
+			{no_sys_mem("(phase_timers)", 1); Return(-1);}
+		for (n = 0; n <= num_of_nestGrids; n++) cells_all += nest.hdr[n].nm;
+	}
+
+	if (courant > 0 && dt_logname) {	/* When resuming, append to the history of the interrupted run */
+		if ((fp_dtlog = fopen(dt_logname, (k_start > 0) ? "a" : "w")) == NULL) {
+			mexPrintf("NSWING: Warning, could not open %s. Printing the time steps instead.\n", dt_logname);
+		}
+		else if (k_start == 0)
+			fprintf(fp_dtlog, "# time\tcycle\tsteps\tdt of each grid\n");
+	}
+
 	tic = clock();
+	t_loop = TM_TIC(&nest);
 
 	/* --------------------------------------------------------------------------------------- */
 	if (time_jump == 0) time_jump = -1; /* Trick to allow writing zero time grids when jump was not demanded */
 
 	one_100 = (double)(n_of_cycles) / 100.0;
 
+#ifdef I_AM_MEX
+	/* The outputs are allocated for all the saving steps, so that the main loop only copies into them */
+	if (mem_maregs) {
+		const char *fields[] = {"t", "x", "y", "eta", "vx", "vy"};
+		n_mar_rows = (n_of_cycles - 1) / cumint + 1;
+		plhs[0] = mxCreateStructMatrix(1, 1, (out_maregs_velocity) ? 6 : 4, fields);
+		mx_ptr = mxCreateDoubleMatrix(n_mar_rows, 1, mxREAL);		mar_t = mxGetPr(mx_ptr);
+		mxSetField(plhs[0], 0, "t", mx_ptr);
+		mx_ptr = mxCreateDoubleMatrix(1, n_mareg, mxREAL);			tmp = mxGetPr(mx_ptr);
+		for (n = 0; n < n_mareg; n++)		/* Coordinates of the grid nodes, as in the file header */
+			tmp[n] = nest.hdr[writeLevel].x_min + (lcum_p[n] % nest.hdr[writeLevel].nx) * nest.hdr[writeLevel].x_inc;
+		mxSetField(plhs[0], 0, "x", mx_ptr);
+		mx_ptr = mxCreateDoubleMatrix(1, n_mareg, mxREAL);			tmp = mxGetPr(mx_ptr);
+		for (n = 0; n < n_mareg; n++)
+			tmp[n] = nest.hdr[writeLevel].y_min + (lcum_p[n] / nest.hdr[writeLevel].nx) * nest.hdr[writeLevel].y_inc;
+		mxSetField(plhs[0], 0, "y", mx_ptr);
+		mx_ptr = mxCreateNumericMatrix(n_mar_rows, n_mareg, mxSINGLE_CLASS, mxREAL);
+		mar_eta = (float *)mxGetData(mx_ptr);
+		mxSetField(plhs[0], 0, "eta", mx_ptr);
+		if (out_maregs_velocity) {
+			mx_ptr = mxCreateNumericMatrix(n_mar_rows, n_mareg, mxSINGLE_CLASS, mxREAL);
+			mar_vx = (float *)mxGetData(mx_ptr);
+			mxSetField(plhs[0], 0, "vx", mx_ptr);
+			mx_ptr = mxCreateNumericMatrix(n_mar_rows, n_mareg, mxSINGLE_CLASS, mxREAL);
+			mar_vy = (float *)mxGetData(mx_ptr);
+			mxSetField(plhs[0], 0, "vy", mx_ptr);
+		}
+	}
+	else if (nlhs >= 1)
+		plhs[0] = mxCreateDoubleMatrix(0, 0, mxREAL);
+
+	if (mem_grids) {
+		const char *fields[] = {"head", "t", "z"};
+		for (k = 0, t = time_h; k < n_of_cycles; k++, t += dt)	/* Count the saving steps of the main loop */
+			if (t > time_jump && ((k % grn) == 0 || k == (n_of_cycles - 1))) n_grd_max++;
+		dims[0] = j_end - j_start;		dims[1] = i_end - i_start;		dims[2] = n_grd_max;
+		plhs[1] = mxCreateStructMatrix(1, 1, 3, fields);
+		mx_ptr = mxCreateDoubleMatrix(1, 9, mxREAL);				grd_head = mxGetPr(mx_ptr);
+		mxSetField(plhs[1], 0, "head", mx_ptr);
+		mx_ptr = mxCreateDoubleMatrix(1, n_grd_max, mxREAL);		grd_t = mxGetPr(mx_ptr);
+		mxSetField(plhs[1], 0, "t", mx_ptr);
+		mx_ptr = mxCreateNumericArray(3, dims, mxSINGLE_CLASS, mxREAL);
+		grd_z = (float *)mxGetData(mx_ptr);
+		mxSetField(plhs[1], 0, "z", mx_ptr);
+		grd_head[0] = xMinOut;		grd_head[1] = xMinOut + (dims[1] - 1) * dx;
+		grd_head[2] = yMinOut;		grd_head[3] = yMinOut + (dims[0] - 1) * dy;
+		grd_head[4] = FLT_MAX;		grd_head[5] = -FLT_MAX;		/* Updated with each grid */
+		grd_head[7] = dx;			grd_head[8] = dy;
+	}
+	else if (nlhs >= 2)
+		plhs[1] = mxCreateDoubleMatrix(0, 0, mxREAL);
+#endif
+
+	if (n_ens) {		/* All the sources of the ensemble in one go. They reuse the setup loaded above */
+		if (run_ensemble(&nest, num_of_nestGrids, isGeog, hdr_b, n_of_cycles, do_active, ens, n_ens, lcum_p,
+		                 mareg_names, (cumpt) ? n_mareg : 0, cumint, ens_out, history))
+			mexPrintf("NSWING: Error, the ensemble run did not complete\n");
+		goto EndEnsemble;
+	}
+
 LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop. Sorry but have to. */
 	/* --------------------------------------------------------------------------------------- */
 	/* Begin main iteration */
 	/* --------------------------------------------------------------------------------------- */
-	for (k = iprc = 0; k < n_of_cycles; k++) {
+	for (k = k_start, iprc = k_start * 100 / n_of_cycles; k < n_of_cycles; k++) {
 
 		if (k > iprc * one_100) {		/* Waitbars stuff */ 
 			prc = (double)iprc / 100.;
@@ -1682,53 +2587,141 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 				mexEvalString(cmd);
 			}
 #else
-			fprintf(stderr, "\t%d %%\r", iprc);
+			if (STRIP_RANK(&nest) == 0) fprintf(stderr, "\t%d %%\r", iprc);
 #endif
 		}
 
-		/* ------------------------------------------------------------------------------------ */
-		/* mass conservation */
-		/* ------------------------------------------------------------------------------------ */
-		if (isGeog == 0)
-			mass(&nest, 0);
-		else
-			mass_sp(&nest, 0);
-
-		/* ------------------------------------------------------------------------------------ */
-		/* Case of open boundary condition or wave maker */
-		/* ------------------------------------------------------------------------------------ */
-		if (bnc_file) {
-			/* When the next IF is TRUE it means the bnc file ended to be consumed, so following
-			   iterations will use the OPENB() function */
-			if (interp_bnc(&nest, time_h)) bnc_file = NULL;
-			wave_maker(&nest);   /* Boundary condition was already set (after reading bnc_file) */
+		if (courant > 0) {		/* Adaptive time step. The cycle of dt seconds is done in n_sub steps of the base grid */
+			memcpy(dt_prev, nest.dt, sizeof(dt_prev));
+			n_sub = adapt_dt(&nest, num_of_nestGrids, isGeog, dt, courant);
+			n_steps += n_sub;
+			if (k == k_start || memcmp(dt_prev, nest.dt, sizeof(dt_prev))) {
+				if (isGeog == 1) inisp(&nest);		/* Their coefficients have the time step in them */
+				else if (nest.do_Coriolis) inicart(&nest);
+				log_dt(fp_dtlog, &nest, num_of_nestGrids, k, time_h, n_sub);
+			}
 		}
-		else if (k)
-			openb(nest.hdr[0], nest.bat[0], nest.fluxm_d[0], nest.fluxn_d[0], nest.etad[0], &nest);
 
-		/* ------------------------------------------------------------------------------------ */
-		/* If Nested grids we have to do the nesting work */
-		/* ------------------------------------------------------------------------------------ */
-		if (do_nestum) nestify(&nest, num_of_nestGrids, 1, isGeog);
+		for (sub = 0; sub < n_sub; sub++) {
+			nest.time_h = time_h + sub * nest.dt[0];
+
+			/* ------------------------------------------------------------------------------------ */
+			/* Restrict the computations to the active region. First step is always done in full */
+			/* ------------------------------------------------------------------------------------ */
+			cells0 = nest.hdr[0].nm;
+			if (do_active) {
+				t0 = TM_TIC(&nest);
+				if ((nest.act_on = (k > 0 || sub > 0)))
+					cells0 = active_region(&nest, k + sub == 1 || (k == k_start && sub == 0));
+				n_active += cells0;
+				n_cells += nest.hdr[0].nm;
+				TM_TOC(&nest, PH_ACTIVE, 0, t0, nest.hdr[0].nm);
+			}
 
-		/* ------------------------------------------------------------------------------------ */
-		/* momentum conservation */
-		/* ------------------------------------------------------------------------------------ */
-		moment_conservation(&nest, isGeog, 0);
+			/* ------------------------------------------------------------------------------------ */
+			/* Mass, open boundary, max level and moment fused in bands of rows (-k option). But not */
+			/* the steps that use the boundary condition file, since wave_maker() is not done by rows */
+			/* ------------------------------------------------------------------------------------ */
+			if ((tiled = (tile_rows > 0 && bnc_file == NULL))) {
+				t0 = TM_TIC(&nest);
+				tiled_step(&nest, isGeog, tile_rows, k > 0 || sub > 0, max_level);
+				TM_TOC(&nest, PH_TILED, 0, t0, cells0);
+			}
+			else {
+				/* ------------------------------------------------------------------------------------ */
+				/* mass conservation */
+				/* ------------------------------------------------------------------------------------ */
+				t0 = TM_TIC(&nest);
+				if (isGeog == 0)
+					mass(&nest, 0);
+				else
+					mass_sp(&nest, 0);
+				TM_TOC(&nest, PH_MASS, 0, t0, cells0);
+
+				/* ------------------------------------------------------------------------------------ */
+				/* Case of open boundary condition or wave maker */
+				/* ------------------------------------------------------------------------------------ */
+				t0 = TM_TIC(&nest);
+				if (bnc_file) {
+					/* When the next IF is TRUE it means the bnc file ended to be consumed, so following
+					   iterations will use the OPENB() function */
+					if (interp_bnc(&nest, nest.time_h)) bnc_file = NULL;
+					wave_maker(&nest);   /* Boundary condition was already set (after reading bnc_file) */
+				}
+				else if (k || sub)
+					openb(nest.hdr[0], nest.bat[0], nest.fluxm_a[0], nest.fluxn_a[0], nest.etad[0], &nest);	/* Fluxes of previous step */
+				TM_TOC(&nest, PH_OPENB, 0, t0, 2 * (nest.hdr[0].nx + nest.hdr[0].ny));
+
+				/* ------------------------------------------------------------------------------------ */
+				/* If Nested grids we have to do the nesting work */
+				/* ------------------------------------------------------------------------------------ */
+				if (do_nestum) nest_children(&nest, num_of_nestGrids, 0, isGeog);
+
+				/* ------------------------------------------------------------------------------------ */
+				/* momentum conservation */
+				/* ------------------------------------------------------------------------------------ */
+				t0 = TM_TIC(&nest);
+				moment_conservation(&nest, isGeog, 0);
+				TM_TOC(&nest, PH_MOMENT, 0, t0, cells0);
+			}
 
-		/* ------------------------------------------------------------------------------------ */
-		/* update eta and fluxes */
-		/* ------------------------------------------------------------------------------------ */
-		update(&nest, 0);
+			/* ------------------------------------------------------------------------------------ */
+			/* update eta and fluxes */
+			/* ------------------------------------------------------------------------------------ */
+			t0 = TM_TIC(&nest);
+			update(&nest, 0);
+			TM_TOC(&nest, PH_UPDATE, 0, t0, nest.hdr[0].nm);
+
+			if (nest.strip) {		/* Get the halo rows from the neighbour strips */
+				t0 = TM_TIC(&nest);
+				strip_exchange(&nest);
+				TM_TOC(&nest, PH_HALO, 0, t0, 2 * STRIP_HALO * nest.hdr[0].nx);
+			}
+
+			if (sub < n_sub - 1) {	/* Max level and speed at the inner steps too. The last one is done below */
+				n = (max_level && !tiled) ? MAX_LEVEL : 0;
+				if (max_velocity) n |= MAX_SPEED;
+				if (n) update_maxs(&nest, TRUE, n);
+			}
+		}
 
 		/* ------------------------------------------------------------------------------------ */
 		/* If want time series at maregraph positions */
 		/* ------------------------------------------------------------------------------------ */
 		if (cumpt && (k % cumint == 0)) {
-			if (out_maregs_nc) {
+			t0 = TM_TIC(&nest);
+			eta_for_maregs    = nest.etaa[writeLevel];		/* The current state. update() swaps these pointers */
+			htotal_for_maregs = nest.htotal_a[writeLevel];
+			vx_for_maregs     = nest.vex[writeLevel];
+			vy_for_maregs     = nest.vey[writeLevel];
+			bat_for_maregs    = nest.bat[writeLevel];
+			mar_ij = lcum_p;
+			if (nest.strip)		/* The values are in the strips that own the maregraphs */
+				mar_ij = strip_maregs(&nest, lcum_p, n_mareg, &eta_for_maregs, &htotal_for_maregs, &vx_for_maregs,
+				                      &vy_for_maregs, (k == 0) ? &bat_for_maregs : NULL);
+			if (STRIP_RANK(&nest) > 0) {
+				/* Only the first strip writes them */
+			}
+			else if (mem_maregs) {		/* Straight into the output arrays (MEX), one column per maregraph */
+				if (n_mem_mar < n_mar_rows) {
+					mar_t[n_mem_mar] = time_h + dt/2;
+					for (ij = 0; ij < n_mareg; ij++)
+						mar_eta[n_mem_mar + ij * n_mar_rows] = (float)eta_for_maregs[mar_ij[ij]];
+					if (out_maregs_velocity) {
+						for (ij = 0; ij < n_mareg; ij++) {
+							if (htotal_for_maregs[mar_ij[ij]] > EPS2) {
+								mar_vx[n_mem_mar + ij * n_mar_rows] = (float)vx_for_maregs[mar_ij[ij]];
+								mar_vy[n_mem_mar + ij * n_mar_rows] = (float)vy_for_maregs[mar_ij[ij]];
+							}
+						}
+					}
+					n_mem_mar++;
+				}
+			}
+			else if (out_maregs_nc) {
 				maregs_timeout[count_time_maregs_timeout++] = time_h + dt/2;
 				for (ij = 0; ij < n_mareg; ij++)
-					maregs_array[count_maregs_timeout++] = (float)eta_for_maregs[lcum_p[ij]];
+					maregs_array[count_maregs_timeout++] = (float)eta_for_maregs[mar_ij[ij]];
 			}
 			else {
 				if (k == 0) {		/* Write also the maregraphs coordinates (at grid nodes) */
@@ -1749,7 +2742,7 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 						sprintf(t0, "%8s",  mareg_names[n]);
 						sprintf(t1, fmt, nest.hdr[writeLevel].x_min + ix * nest.hdr[writeLevel].x_inc);	/* Xs */
 						sprintf(t2, fmt, nest.hdr[writeLevel].y_min + iy * nest.hdr[writeLevel].y_inc);	/* Ys */
-						sprintf(t3, "\t%.1f", nest.bat[writeLevel][lcum_p[n]]); 	/* Zs (from grid) */
+						sprintf(t3, "\t%.1f", bat_for_maregs[mar_ij[n]]); 	/* Zs (from grid) */
 						strcat(txt[0], t0);		strcat(txt[1], t1);		strcat(txt[2], t2);		strcat(txt[3], t3);
 						strcat(txt_X, t1);		strcat(txt_Y, t2);
 					}
@@ -1761,90 +2754,57 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 				if (out_maregs_velocity) {
 					double vx, vy;
 					for (ij = 0; ij < n_mareg; ij++) {
-						if (htotal_for_maregs[lcum_p[ij]] > EPS2) {
-							vx = vx_for_maregs[lcum_p[ij]];
-							vy = vy_for_maregs[lcum_p[ij]];
+						if (htotal_for_maregs[mar_ij[ij]] > EPS2) {
+							vx = vx_for_maregs[mar_ij[ij]];
+							vy = vy_for_maregs[mar_ij[ij]];
 						}
 						else {vx = vy = 0;}
-						t = fabs(eta_for_maregs[lcum_p[ij]]) < EPS2 ? 0 : 90 - atan2(vy, vx) * R2D;
+						t = fabs(eta_for_maregs[mar_ij[ij]]) < EPS2 ? 0 : 90 - atan2(vy, vx) * R2D;
 						if (t < 0) t += 360;
-						fprintf (fp, "\t%.5f\t%.2f\t%.2f\t%.1f", eta_for_maregs[lcum_p[ij]], vx, vy, t);
+						fprintf (fp, "\t%.5f\t%.2f\t%.2f\t%.1f", eta_for_maregs[mar_ij[ij]], vx, vy, t);
 					}
 				}
 				else {
 					for (ij = 0; ij < n_mareg; ij++)
-						fprintf (fp, "\t%.5f", eta_for_maregs[lcum_p[ij]]);
+						fprintf (fp, "\t%.5f", eta_for_maregs[mar_ij[ij]]);
 				}
 				fprintf (fp, "\n");
 			}
+			TM_TOC(&nest, PH_MAREGS, writeLevel, t0, n_mareg);
 		}
 
-		if (do_tracers && k > 0) {
-			int n;
-			unsigned int ix, jy, itmp, ij_c;
-			double vx, vy, vx1, vx2, vy1, vy2, dx, dy;
-			double v_LLx, v_LLy, v_LRx, v_LRy, v_ULx, v_ULy, v_URx, v_URy;
-			for (n = 0; n < n_oranges; n++) {
-				ix = (int)((oranges[n].x[k-1] - nest.hdr[writeLevel].x_min) / nest.hdr[writeLevel].x_inc);
-				jy = (int)((oranges[n].y[k-1] - nest.hdr[writeLevel].y_min) / nest.hdr[writeLevel].y_inc);
-				dx = oranges[n].x[k-1] - (nest.hdr[writeLevel].x_min + ix * nest.hdr[writeLevel].x_inc);
-				dy = oranges[n].y[k-1] - (nest.hdr[writeLevel].y_min + jy * nest.hdr[writeLevel].y_inc);
-
-				ij_c = jy * nest.hdr[writeLevel].nx + ix;   /* Linear index LowerLeft cell corner */
-				if (htotal_for_oranges[ij_c] > EPS2 && htotal_for_oranges[ij_c + 1] > EPS2) {
-					v_LLx = vx_for_oranges[ij_c];		v_LLy = vy_for_oranges[ij_c];
-					v_LRx = vx_for_oranges[ij_c+1];		v_LRy = vy_for_oranges[ij_c+1];
-				}
-				else
-					v_LLx = v_LLy = v_LRx = v_LRy = 0;
-
-				ij_c += nest.hdr[writeLevel].nx;            /* Linear index UpperLeft cell corner */
-				if (htotal_for_oranges[ij_c] > EPS2 && htotal_for_oranges[ij_c + 1] > EPS2) {
-					v_ULx = vx_for_oranges[ij_c];		v_ULy = vy_for_oranges[ij_c];
-					v_URx = vx_for_oranges[ij_c+1];		v_URy = vy_for_oranges[ij_c+1];
-				}
-				else
-					v_ULx = v_ULy = v_URx = v_URy = 0;
-
-				dx /= nest.hdr[writeLevel].x_inc;		/* Resuse the dx,dy variables */
-				dy /= nest.hdr[writeLevel].y_inc;
-
-				vx1 = v_LLx + (v_LRx - v_LLx) * dx;		vx2 = v_ULx + (v_URx - v_ULx) * dx;
-				vy1 = v_LLy + (v_ULy - v_LLy) * dy;		vy2 = v_LRy + (v_URy - v_LRy) * dy;
-				vx  = vx1 + (vx2 - vx1) * dy;			vy  = vy1 + (vy2 - vy1) * dx;
-
-				oranges[n].x[k] = oranges[n].x[k-1] + vx * dt;
-				oranges[n].y[k] = oranges[n].y[k-1] + vy * dt;
-			}
+		if (do_tracers) {
+			t0 = TM_TIC(&nest);
+			if (k > 0)	/* update() swaps the htotal arrays, so take it at each step */
+				advect_tracers(&oranges, nest.hdr[writeLevel], nest.vex[writeLevel], nest.vey[writeLevel],
+				               nest.htotal_a[writeLevel], dt);
+			if ((k % oranges.decim) == 0 || k == (n_of_cycles - 1))
+				write_tracers(&nest, &oranges, k * dt);
+			TM_TOC(&nest, PH_TRACERS, writeLevel, t0, n_oranges);
 		}
 
 		/* ------------------------------------------------------------------------------------ */
 		/* -- This chunk deals with the cases where we compute something at every step
 		      but write only one grid at the end of all cycles
 		/* ------------------------------------------------------------------------------------ */
-		if (max_level)			/* Output max surface level. This is only executed when writing mother grid */
-			update_max(&nest);
-		else if (max_energy) {
-			if (k % decimate_max == 0) {
-				total_energy(&nest, workMax, writeLevel);
-				for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++)
-					if (wmax[ij] < workMax[ij]) wmax[ij] = workMax[ij];
-			}
+		t0 = TM_TIC(&nest);
+		n = 0;                  /* What goes into the one pass of update_maxs(). Only when writing mother grid */
+		if (max_level) {		/* Output max surface level */
+			if (!tiled) n = MAX_LEVEL;	/* Otherwise tiled_step() did it */
 		}
-		else if (max_power) {
-			if (k % decimate_max == 0) {
-				power(&nest, workMax, writeLevel);
-				for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++)
-					if (wmax[ij] < workMax[ij]) wmax[ij] = workMax[ij];
-			}
+		else if (max_energy || max_power) {
+			if (k % decimate_max == 0) n = (max_energy) ? MAX_ENERGY : MAX_POWER;
 		}
-		
-		if (max_velocity)       /* Output max velocity. This is only executed when writing mother grid */
-			update_max_velocity(&nest);
+		if (max_velocity)       /* Output max velocity */
+			n |= MAX_SPEED;
+		if (n) update_maxs(&nest, TRUE, n);
+		if (max_level || max_energy || max_power || max_velocity)
+			TM_TOC(&nest, PH_MAX, 0, t0, nest.hdr[writeLevel].nm);
 
 		if (k == (n_of_cycles - 1)) {   /* Last cycle: write wmax to file */
-			size_t len = strlen(stem) - 1;
+			size_t len = (stem[0]) ? strlen(stem) - 1 : 0;	/* The stem may be empty (-O only, or -G grids returned) */
 			while (stem[len] != '.' && len > 0) len--;
+			t0 = TM_TIC(&nest);
 			if (do_maxs) {              /* Deal with the case of 'only one of the maximums' */
 				if (len == 0) {                    /* No extension, add a "_max.grd" one */
 					strcpy(prenome, stem);
@@ -1856,8 +2816,12 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 					//strcat(prenome, &stem[len]);    /* Put back the given extension */
 				}
 
-				write_grd_bin(prenome, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end,
-				              nest.hdr[writeLevel].nx, wmax);
+				if ((wout = strip_gather(&nest, wmax)) != NULL) {	/* Only the first strip writes */
+					write_grd_bin(prenome, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end,
+					              nest.hdr[writeLevel].nx, wout);
+					if (fname_maxRef && max_level_in)
+						compare_grids(fname_maxRef, i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, wout);
+				}
 			}
 
 			if (nest.do_long_beach) {           /* In this case the calculations were done in mass() */
@@ -1885,20 +2849,23 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 					strcat(strncpy(prenome, stem, len), "_max_speed");
 					strcat(prenome, &stem[len]);        /* Put back the given extension */
 				}
-				write_grd_bin(prenome, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end,
-				              nest.hdr[writeLevel].nx, vmax);
+				if ((wout = strip_gather(&nest, vmax)) != NULL)
+					write_grd_bin(prenome, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end,
+					              nest.hdr[writeLevel].nx, wout);
 			}
+			TM_TOC(&nest, PH_GRIDS, writeLevel, t0, nest.hdr[writeLevel].nm);
 		}
 		/* -------------------------------------------------------------------------------- */
  
 		if (grn && time_h > time_jump && ((k % grn) == 0 || k == (n_of_cycles - 1)) ) {		/* If we are at a saving step */
+			t0 = TM_TIC(&nest);
 			if (surf_level) {
 				for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++)
-					work[ij] = (float)nest.etad[writeLevel][ij];
+					work[ij] = (float)nest.etaa[writeLevel][ij];
 			}
 			else if (water_depth) {
 				for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++) {
-					work[ij] = (float)nest.etad[writeLevel][ij];
+					work[ij] = (float)nest.etaa[writeLevel][ij];
 					if (nest.bat[writeLevel][ij] < 0) {
 						if ((work[ij] = (float)(nest.etaa[writeLevel][ij] + nest.bat[writeLevel][ij])) < 0)
 							work[ij] = 0;
@@ -1911,9 +2878,24 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 			else if (out_power)
 				power(&nest, work, writeLevel);
 
-			if (write_grids) {
+			if (mem_grids) {		/* Straight into the output array (MEX), by columns */
+				if (n_mem_grd < n_grd_max) {
+					float *z = &grd_z[(size_t)n_mem_grd * (i_end - i_start) * (j_end - j_start)];
+					grd_t[n_mem_grd++] = time_h;
+					for (i = i_start; i < i_end; i++) {
+						for (j = j_start; j < j_end; j++) {
+							*z = work[ijs(i,j,nest.hdr[writeLevel].nx)];
+							if (*z < grd_head[4]) grd_head[4] = *z;
+							if (*z > grd_head[5]) grd_head[5] = *z;
+							z++;
+						}
+					}
+				}
+			}
+			else if (write_grids) {
 				sprintf(prenome, "%s%05d.grd", stem, irint(time_h));
-				write_grd_bin(prenome, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, work);
+				if ((wout = strip_gather(&nest, work)) != NULL)
+					put_grd(nest.aw, prenome, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, wout);
 			}
 
 			if (out_momentum && !out_3D) {
@@ -1922,16 +2904,20 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 				else
 					sprintf(prenome, "%s%.5d", stem, irint(time_h) );
 
-				for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++) work[ij] = (float)nest.fluxm_d[writeLevel][ij];
+				for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++) work[ij] = (float)nest.fluxm_a[writeLevel][ij];
 
-				write_grd_bin(strcat(prenome,"_Uh.grd"), xMinOut, yMinOut, dx, dy, 
-				              i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, work);
+				strcat(prenome,"_Uh.grd");
+				if ((wout = strip_gather(&nest, work)) != NULL)
+					put_grd(nest.aw, prenome, xMinOut, yMinOut, dx, dy, 
+					                 i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, wout);
 
-				for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++) work[ij] = (float)nest.fluxn_d[writeLevel][ij];
+				for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++) work[ij] = (float)nest.fluxn_a[writeLevel][ij];
 
 				prenome[strlen(prenome) - 7] = '\0';	/* Remove the _Uh.grd' so that we can add '_Vh.grd' */
-				write_grd_bin(strcat(prenome,"_Vh.grd"), xMinOut, yMinOut, dx, dy, 
-				              i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, work);
+				strcat(prenome,"_Vh.grd");
+				if ((wout = strip_gather(&nest, work)) != NULL)
+					put_grd(nest.aw, prenome, xMinOut, yMinOut, dx, dy, 
+					                 i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, wout);
 			}
 
 			if (out_velocity && !out_3D) {
@@ -1939,35 +2925,41 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 
 				if (out_velocity_x) {
 					for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++) {
-						work[ij] = (nest.htotal_d[writeLevel][ij] > EPS2) ? (float)nest.vex[writeLevel][ij] : 0;
-						if (nest.htotal_d[writeLevel][ij] < 0.5 && fabs(work[ij]) >= V_LIMIT)	/* Clip above this combination */
+						work[ij] = (nest.htotal_a[writeLevel][ij] > EPS2) ? (float)nest.vex[writeLevel][ij] : 0;
+						if (nest.htotal_a[writeLevel][ij] < 0.5 && fabs(work[ij]) >= V_LIMIT)	/* Clip above this combination */
 							work[ij] = 0;
 					}
 
-					write_grd_bin(strcat(prenome,"_U.grd"), xMinOut + nest.hdr[writeLevel].x_inc/2, yMinOut,
-					              dx, dy, i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, work);
+					strcat(prenome,"_U.grd");
+					if ((wout = strip_gather(&nest, work)) != NULL)
+						put_grd(nest.aw, prenome, xMinOut + nest.hdr[writeLevel].x_inc/2, yMinOut,
+						                 dx, dy, i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, wout);
 					prenome[strlen(prenome)-6] = '\0';	/* Remove the _U.grd' so that we can add '_V.grd' */
 				}
 				if (out_velocity_y) {
 					for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++) {
-						work[ij] = (nest.htotal_d[writeLevel][ij] > EPS2) ? (float)nest.vey[writeLevel][ij] : 0;
-						if (nest.htotal_d[writeLevel][ij] < 0.5 && fabs(work[ij]) >= V_LIMIT)	/* Clip above this combination */
+						work[ij] = (nest.htotal_a[writeLevel][ij] > EPS2) ? (float)nest.vey[writeLevel][ij] : 0;
+						if (nest.htotal_a[writeLevel][ij] < 0.5 && fabs(work[ij]) >= V_LIMIT)	/* Clip above this combination */
 							work[ij] = 0;
 					}
 
-					write_grd_bin(strcat(prenome,"_V.grd"), xMinOut, yMinOut + nest.hdr[writeLevel].y_inc/2,
-					              dx, dy, i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, work);
+					strcat(prenome,"_V.grd");
+					if ((wout = strip_gather(&nest, work)) != NULL)
+						put_grd(nest.aw, prenome, xMinOut, yMinOut + nest.hdr[writeLevel].y_inc/2,
+						                 dx, dy, i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, wout);
 				}
 			}
+			TM_TOC(&nest, PH_GRIDS, writeLevel, t0, nest.hdr[writeLevel].nm);
 
 #ifdef HAVE_NETCDF
+			t0 = TM_TIC(&nest);
 			if (out_sww) {
 				if (first_anuga_time) {
 					time0 = time_h;
 					first_anuga_time = FALSE;
 				}
 				time_for_anuga = time_h - time0;	/* I think ANUGA wants time starting at zero */
-				err_trap (nc_put_vara_double (ncid, ids[6], &start0, &count0, &time_for_anuga));
+				put_vara_double(nest.aw, ncid, ids[6], 1, &start0, &count0, &time_for_anuga);
 
 				write_anuga_slice(&nest, ncid, ids[7], i_start, j_start, i_end, j_end, tmp_slice, start1_A, count1_A,
 				                  stage_range, 1, with_land, writeLevel);
@@ -1981,9 +2973,9 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 
 			if (out_most) {
 				/* Here we'll use the start0 computed above */
-				err_trap (nc_put_vara_double (ncid_most[0], ids_ha[4], &start0, &count0, &time_h));
-				err_trap (nc_put_vara_double (ncid_most[1], ids_ua[4], &start0, &count0, &time_h));
-				err_trap (nc_put_vara_double (ncid_most[2], ids_va[4], &start0, &count0, &time_h));
+				put_vara_double(nest.aw, ncid_most[0], ids_ha[4], 1, &start0, &count0, &time_h);
+				put_vara_double(nest.aw, ncid_most[1], ids_ua[4], 1, &start0, &count0, &time_h);
+				put_vara_double(nest.aw, ncid_most[2], ids_va[4], 1, &start0, &count0, &time_h);
 
 				write_most_slice(&nest, ncid_most, ids_most, i_start, j_start, i_end, j_end,
 				                 tmp_slice, start1_M, count1_M, actual_range, TRUE, writeLevel);
@@ -1991,20 +2983,61 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 			}
 			else if (out_3D) {
 				/* Here we'll use the start0 computed above */
-				err_trap(nc_put_vara_double(ncid_3D[0], ids_z[2], &start0, &count0, &time_h));
+				if (STRIP_RANK(&nest) == 0)
+					put_vara_double(nest.aw, ncid_3D[0], ids_z[2], 1, &start0, &count0, &time_h);
 				write_most_slice(&nest, ncid_3D, ids_3D, i_start, j_start, i_end, j_end,
 				                 work, start1_M, count1_M, actual_range, FALSE, writeLevel);
 				start1_M[0]++;		/* Increment for the next slice */
 			}
+			if (out_sww || out_most || out_3D)
+				TM_TOC(&nest, PH_NETCDF, writeLevel, t0, nest.hdr[writeLevel].nm);
 #endif
 
 			start0++;			/* Only used with netCDF formats */
 		}
 		time_h += dt;
 		nest.time_h = time_h;
+
+		if (ckp_name && ckp_int > 0 && ((k + 1) % ckp_int) == 0 && k < n_of_cycles - 1) {	/* Checkpoint */
+			t0 = TM_TIC(&nest);
+			memset(&ckp_hdr, 0, sizeof(struct ckp_header));
+			strcpy(ckp_hdr.id, "NSWCKP2");
+			ckp_hdr.real_size = (int)sizeof(real);
+			ckp_hdr.n_levels  = num_of_nestGrids + 1;
+			for (n = 0; n <= num_of_nestGrids; n++) {
+				ckp_hdr.nx[n] = nest.hdr[n].nx;		ckp_hdr.ny[n] = nest.hdr[n].ny;
+				ckp_hdr.parent[n] = nest.parent[n];
+			}
+			ckp_hdr.isGeog    = isGeog;
+			ckp_hdr.k         = k + 1;		/* The cycle that a resumed run starts with */
+			ckp_hdr.n_oranges = (do_tracers) ? n_oranges : 0;
+			ckp_hdr.n_mareg   = (maregs_timeout) ? n_mareg : 0;
+			ckp_hdr.bnc_done  = (nest.bnc_var_zTmp && !bnc_file);
+			ckp_hdr.count_maregs_timeout = count_maregs_timeout;
+			ckp_hdr.count_time_maregs_timeout = count_time_maregs_timeout;
+			ckp_hdr.dt = dt;				ckp_hdr.time_h = time_h;
+			ckp_hdr.run_jump_time = nest.run_jump_time;
+			ckp_hdr.n_active = n_active;	ckp_hdr.n_cells = n_cells;
+			ckp_hdr.maregs_pos = -1;
+			if (cumpt && !out_maregs_nc) {	/* So that the file has at least what the checkpoint knows of */
+				fflush(fp);
+				ckp_hdr.maregs_pos = ftell(fp);
+			}
+			ckp_hdr.oranges_pos = -1;
+			if (do_tracers && oranges.fp) {
+				fflush(oranges.fp);
+				ckp_hdr.oranges_pos = ftell64(oranges.fp);
+			}
+			ckp_blocks(&nest, num_of_nestGrids + 1, k + 1, wmax, vmax, &oranges, ckp_hdr.n_oranges, maregs_timeout,
+			           count_time_maregs_timeout, maregs_array, count_maregs_timeout, ckp_blk);
+			ckp_save(nest.aw, ckp_name, &ckp_hdr, ckp_blk, n_ckp);
+			TM_TOC(&nest, PH_CKP, 0, t0, cells_all);
+		}
 	}
 	/* ------------------------------- END MAIN LOOP --------------------------------------- */
 
+	if (nest.aw) aw_flush(nest.aw);	/* From here on the netCDF files are written by this thread only */
+
 #ifdef HAVE_NETCDF
 	if (out_sww) {          /* Uppdate range values and close SWW file */
 		err_trap(nc_put_var_float(ncid, ids[8], stage_range));
@@ -2018,7 +3051,7 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 		err_trap(nc_close(ncid_most[1]));
 		err_trap(nc_close(ncid_most[2]));
 	}
-	else if (out_3D) {      /* Uppdate range values and close 3D file */
+	else if (out_3D && STRIP_RANK(&nest) == 0) {      /* Uppdate range values and close 3D file */
 		err_trap(nc_put_att_double(ncid_3D[0], ids_z[3], "actual_range", NC_DOUBLE, 2U, actual_range));
 		if (out_velocity_x)
 			err_trap(nc_put_att_double(ncid_3D[0], ids_z[5], "actual_range", NC_DOUBLE, 2U, &actual_range[2]));
@@ -2055,7 +3088,7 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 
 	if (out_sww || out_most) mxFree ((void *)tmp_slice);
 
-	if (out_maregs_nc) {    /* Write the maregs in a netCDF file */
+	if (out_maregs_nc && STRIP_RANK(&nest) == 0) {    /* Write the maregs in a netCDF file */
 		if (do_Kaba) {
 			int    k, kp, km, nKabas, RC[2];
 			size_t strt, cnt, row, col;
@@ -2094,13 +3127,14 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 				count_maregs_timeout = 0;	count_time_maregs_timeout = 0;	nest.time_h = time_h = 0;
 				for (lev = 0; lev <= num_of_nestGrids; lev++) {
 					nm = nest.hdr[lev].nm;
-					memset(nest.etad[lev],     0, (size_t)(nm * sizeof(double)));
-					memset(nest.fluxm_a[lev],  0, (size_t)(nm * sizeof(double)));
-					memset(nest.fluxm_d[lev],  0, (size_t)(nm * sizeof(double)));
-					memset(nest.fluxn_a[lev],  0, (size_t)(nm * sizeof(double)));
-					memset(nest.fluxn_d[lev],  0, (size_t)(nm * sizeof(double)));
-					memset(nest.htotal_a[lev], 0, (size_t)(nm * sizeof(double)));
-					memset(nest.htotal_d[lev], 0, (size_t)(nm * sizeof(double)));
+					memset(nest.etad[lev],     0, (size_t)(nm * sizeof(real)));
+					memset(nest.fluxm_a[lev],  0, (size_t)(nm * sizeof(real)));
+					memset(nest.fluxm_d[lev],  0, (size_t)(nm * sizeof(real)));
+					memset(nest.fluxn_a[lev],  0, (size_t)(nm * sizeof(real)));
+					memset(nest.fluxn_d[lev],  0, (size_t)(nm * sizeof(real)));
+					memset(nest.htotal_a[lev], 0, (size_t)(nm * sizeof(real)));
+					memset(nest.htotal_d[lev], 0, (size_t)(nm * sizeof(real)));
+					nest.ad_copy[lev] = TRUE;
 				}
 				/* ------------------------------------------------------------------------------- */
 				fprintf(stderr, "Computing prism %d out of %d (row = %d\tcol = %d)\t%s\n",
@@ -2113,9 +3147,12 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 			err_trap(nc_put_att_double(ncid_Mar,  ids_Mar[4], "BB_inc_RC", NC_DOUBLE, 8U, BB));
 			err_trap(nc_close(ncid_Mar)); 
 		}
-		else
+		else {
+			t0 = TM_TIC(&nest);
 			write_maregs_nc(&nest, hcum, maregs_array, maregs_timeout, lcum_p, mareg_names,
 			                history, n_mareg, count_time_maregs_timeout, writeLevel);
+			TM_TOC(&nest, PH_MAREGS, writeLevel, t0, n_mareg * count_time_maregs_timeout);
+		}
 
 		mxFree(maregs_array);
 		mxFree(maregs_array_t);
@@ -2123,21 +3160,19 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 	}
 #endif
 	
-	if (do_tracers) {			/* Write the tracers file and free memory */
-		for (k = 0; k < n_of_cycles; k++) {
-			fprintf(fp_oranges, "%.2f", k * dt);
-			for (n = 0; n < n_oranges; n++)
-				fprintf(fp_oranges, "\t%.5f\t%.5f", oranges[n].x[k], oranges[n].y[k]);
-
-			fprintf(fp_oranges, "\n");
-		}
-
-		fclose (fp_oranges);
-		for (n = 0; n < n_oranges; n++) {
-			mxFree(oranges[n].x);		mxFree(oranges[n].y);
+	if (do_tracers) {			/* Close the tracers file and free memory */
+#ifdef HAVE_NETCDF
+		if (oranges.ncid >= 0) {
+			err_trap(nc_close(oranges.ncid));
+			mxFree(oranges.buf);
 		}
+#endif
+		if (oranges.fp) fclose(oranges.fp);
+		mxFree(oranges.x);	mxFree(oranges.y);	mxFree(oranges.cell);
 	}
+	if (nest.tm) t_loop = tm_clock() - t_loop;
 
+EndEnsemble:
 #ifdef I_AM_MEX
 	if (!IamCompiled) {
 		*ptr_wb = 1.0;
@@ -2149,25 +3184,61 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 	/* Clean up allocated memory. */
 	mxDestroyArray(rhs[0]);		mxDestroyArray(rhs[1]);		mxDestroyArray(rhs[2]);
 #else
-	fprintf(stderr, "\t100 %%\tCPU secs/ticks = %.3f\n", (double)(clock() - tic));
+	if (STRIP_RANK(&nest) == 0)
+		fprintf(stderr, "\t100 %%\tCPU secs/ticks = %.3f\n", (double)(clock() - tic));
 #endif
 
 	if (cumpt) {
-		fclose (fp);
+		if (fp) fclose (fp);
 		if (cum_p) mxFree((void *) cum_p);
 		if (time_p)mxFree((void *) time_p);	 
 	}
 
+	if (nest.aw) {
+		aw_stop(nest.aw);
+		if (verbose && aw.n_waits)
+			mexPrintf("NSWING: The solver waited %u times for the background writer\n", aw.n_waits);
+		nest.aw = NULL;
+	}
+
+	if (ckp_blk) mxFree(ckp_blk);
+
+	if (report_active && n_cells > 0)
+		mexPrintf("NSWING: Active region tracking skipped %.1f%% of the base grid cells\n",
+		          100.0 * (1.0 - n_active / n_cells));
+
+	if (fp_dtlog) fclose(fp_dtlog);
+	if (courant > 0 && verbose && n_of_cycles > k_start)
+		mexPrintf("NSWING: Adaptive time step did %.0f base grid steps in %d cycles (mean dt = %g)\n",
+		          n_steps, n_of_cycles - k_start, dt * (n_of_cycles - k_start) / n_steps);
+
+	if (nest.tm) {
+		if (!nest.strip || nest.strip->rank == 0)	/* With -d the first strip reports, for its own rows */
+			tm_report(nest.tm, &nest, num_of_nestGrids, t_loop, fname_timing);
+		mxFree(nest.tm);
+		nest.tm = NULL;
+	}
+
+	if (nest.strip) {
+		if (strip_end(&strip))
+			mexPrintf("NSWING: Error, the process of one or more strips failed (-d option)\n");
+		nest.strip = NULL;
+	}
+
 	free_arrays(&nest, isGeog, num_of_nestGrids);
 	if (vmax) mxFree (vmax);
 	if (wmax) mxFree (wmax);
 	if (lcum_p) mxFree (lcum_p);
-	if (workMax) mxFree (workMax);
 	if (work) mxFree (work);
 	if (mareg_names) {
 		for (k = 0; k < n_mareg; k++) mxFree(mareg_names[k]);
 		mxFree(mareg_names);
 	}
+	if (ens) {
+		for (k = 0; k < n_ens; k++) if (ens[k].grid) mxFree(ens[k].grid);
+		mxFree(ens);
+	}
+	if (faults) mxFree(faults);
 
 #ifndef I_AM_MEX
 	return 0;
@@ -2182,6 +3253,7 @@ void sanitize_nestContainer(struct nestContainer *nest) {
 	nest->do_long_beach  = FALSE;
 	nest->do_short_beach = FALSE;
 	nest->do_linear      = FALSE;
+	nest->do_simd        = FALSE;
 	nest->do_max_level   = FALSE;
 	nest->do_max_velocity= FALSE;
 	nest->out_velocity_x = FALSE;
@@ -2198,8 +3270,19 @@ void sanitize_nestContainer(struct nestContainer *nest) {
 	nest->bnc_var_t = NULL;
 	nest->bnc_var_z = NULL;
 	nest->bnc_var_zTmp = NULL;
+	nest->act_on = FALSE;
+	nest->act_lo = nest->act_hi = NULL;
+	nest->aw = NULL;
+	nest->tm = NULL;
+	nest->strip = NULL;
+	nest->nc_deflate = 4;
+	nest->nc_quant = nest->nc_clipped = 0;
+	nest->nc_chunk[0] = nest->nc_chunk[1] = 128;
+	nest->nc_err = 0;
 	for (i = 0; i < 10; i++) {
 		nest->level[i] = -1;      /* Will be set to the due level number for existing nesting levels */
+		nest->parent[i] = -1;
+		nest->ad_copy[i] = TRUE;
 		nest->manning[i] = 0;
 		nest->LLrow[i] = nest->LLcol[i] = nest->ULrow[i] = nest->ULcol[i] =
 		nest->URrow[i] = nest->URcol[i] = nest->LRrow[i] = nest->LRcol[i] =
@@ -2290,15 +3373,16 @@ int initialize_nestum(struct nestContainer *nest, int isGeog, int lev) {
 	int row, col, i, nSizeIncX, nSizeIncY, n;
 	unsigned int nm = nest->hdr[lev].nm;
 	double dt, scale;
+	int lev_P = (lev > 0) ? nest->parent[lev] : 0;	/* Parent grid */
 	double xoff, yoff, xoff_P, yoff_P;		/* Offsets to move from grid to pixel registration (zero if grid in pix reg) */
-	struct grd_header hdr = nest->hdr[lev-1];
+	struct grd_header hdr = nest->hdr[lev_P];
 
 	if (lev > 0) {
 		/* -------------------- Check that this grid is nestifiable -------------------- */
 		nSizeIncX = irint(hdr.x_inc / nest->hdr[lev].x_inc);
 		if ((hdr.x_inc / nest->hdr[lev].x_inc) - nSizeIncX > 1e-5) {
-			mexPrintf("NSWING ERROR: X increments of inner (%d) and outer (%d) grids are incompatible.\n", lev, lev-1);
-			mexPrintf("\tInteger ratio of parent (%d) to doughter (%d) X increments = %d\n", lev, lev-1, nSizeIncX);
+			mexPrintf("NSWING ERROR: X increments of inner (%d) and outer (%d) grids are incompatible.\n", lev, lev_P);
+			mexPrintf("\tInteger ratio of parent (%d) to doughter (%d) X increments = %d\n", lev, lev_P, nSizeIncX);
 			mexPrintf("\tActual  ratio as a floating point = %f\n\tDifference between the two cannot exceed 1e-5\n",
 			          hdr.x_inc / nest->hdr[lev].x_inc);
 			return(-1);
@@ -2306,19 +3390,19 @@ int initialize_nestum(struct nestContainer *nest, int isGeog, int lev) {
 
 		nSizeIncY = irint(hdr.y_inc / nest->hdr[lev].y_inc);
 		if ((hdr.y_inc / nest->hdr[lev].y_inc) - nSizeIncY > 1e-5) {
-			mexPrintf("NSWING ERROR: Y increments of inner (%d) and outer (%d) grids are incompatible.\n", lev, lev-1);
-			mexPrintf("\tInteger ratio of parent (%d) to doughter (%d) Y increments = %d\n", lev, lev-1, nSizeIncY);
+			mexPrintf("NSWING ERROR: Y increments of inner (%d) and outer (%d) grids are incompatible.\n", lev, lev_P);
+			mexPrintf("\tInteger ratio of parent (%d) to doughter (%d) Y increments = %d\n", lev, lev_P, nSizeIncY);
 			mexPrintf("\tActual  ratio as a floating point = %f\n\tDifference between the two cannot exceed 1e-5\n",
 			          hdr.y_inc / nest->hdr[lev].y_inc);
 			return(-1);
 		}
 
 		if (nSizeIncX != nSizeIncY) {
-			mexPrintf("NSWING ERROR: X/Y increments of inner (%d) and outer (%d) grid do not divide equaly.\n", lev, lev-1);
-			mexPrintf("\tinc_x(%d) = %f\t inc_x(%d) = %f.\n", lev-1, hdr.x_inc, lev, nest->hdr[lev].x_inc);
-			mexPrintf("\tinc_y(%d) = %f\t inc_y(%d) = %f.\n", lev-1, hdr.y_inc, lev, nest->hdr[lev].y_inc);
-			mexPrintf("\tRatio of X increments (round(inc_x(%d) / inc_x(%d)) = %d.\n", lev-1, lev, nSizeIncX);
-			mexPrintf("\tRatio of Y increments (round(inc_y(%d) / inc_y(%d)) = %d.\n", lev-1, lev, nSizeIncY);
+			mexPrintf("NSWING ERROR: X/Y increments of inner (%d) and outer (%d) grid do not divide equaly.\n", lev, lev_P);
+			mexPrintf("\tinc_x(%d) = %f\t inc_x(%d) = %f.\n", lev_P, hdr.x_inc, lev, nest->hdr[lev].x_inc);
+			mexPrintf("\tinc_y(%d) = %f\t inc_y(%d) = %f.\n", lev_P, hdr.y_inc, lev, nest->hdr[lev].y_inc);
+			mexPrintf("\tRatio of X increments (round(inc_x(%d) / inc_x(%d)) = %d.\n", lev_P, lev, nSizeIncX);
+			mexPrintf("\tRatio of Y increments (round(inc_y(%d) / inc_y(%d)) = %d.\n", lev_P, lev, nSizeIncY);
 			return(-1);
 		}
 
@@ -2328,30 +3412,30 @@ int initialize_nestum(struct nestContainer *nest, int isGeog, int lev) {
 		/* Compute the run time step interval for this level */
 		scale = (isGeog) ? 111000 : 1;		/* To get the incs in meters */
 		dt = 0.5 * MIN(nest->hdr[lev].x_inc, nest->hdr[lev].y_inc) * scale / sqrt(NORMAL_GRAV * fabs(nest->hdr[lev].z_min));
-		nest->dt[lev] = nest->dt[lev-1] / ceil(nest->dt[lev-1] / dt);
+		nest->dt[lev] = nest->dt[lev_P] / ceil(nest->dt[lev_P] / dt);
 	}
 
-	nest->level[lev] = lev;
+	nest->level[lev] = (lev > 0) ? nest->level[lev_P] + 1 : 0;
 
 	/* Allocate the working arrays */
-	if (nest->bat[lev] == NULL && (nest->bat[lev] = (double *)  mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if (nest->bat[lev] == NULL && (nest->bat[lev] = (real *)    mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(bat)", nm); return(-1);}
 
-	if ((nest->etaa[lev] = (double *)     mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->etaa[lev] = (real *)       mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(etaa)", nm); return(-1);}
-	if ((nest->etad[lev] = (double *)     mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->etad[lev] = (real *)       mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(etad)", nm); return(-1);}
-	if ((nest->fluxm_a[lev] = (double *)  mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->fluxm_a[lev] = (real *)    mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(fluxm_a)", nm); return(-1);}
-	if ((nest->fluxm_d[lev] = (double *)  mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->fluxm_d[lev] = (real *)    mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(fluxm_d)", nm); return(-1);}
-	if ((nest->fluxn_a[lev] = (double *)  mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->fluxn_a[lev] = (real *)    mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(fluxn_a)", nm); return(-1);}
-	if ((nest->fluxn_d[lev] = (double *)  mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->fluxn_d[lev] = (real *)    mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(fluxn_d)", nm); return(-1);}
-	if ((nest->htotal_a[lev] = (double *) mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->htotal_a[lev] = (real *)   mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(htotal_a)", nm); return(-1);}
-	if ((nest->htotal_d[lev] = (double *) mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->htotal_d[lev] = (real *)   mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(htotal_d)", nm); return(-1);}
 
 	if (nest->do_long_beach && (lev == nest->writeLevel)) {
@@ -2364,11 +3448,11 @@ int initialize_nestum(struct nestContainer *nest, int isGeog, int lev) {
 	}
 
 	if (nest->out_velocity_x && (lev == nest->writeLevel)) {
-		if ((nest->vex[lev] = (double *) mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+		if ((nest->vex[lev] = (real *)   mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 			{no_sys_mem("(vex)", nm); return(-1);}
 	}
 	if (nest->out_velocity_y && (lev == nest->writeLevel)) {
-		if ((nest->vey[lev] = (double *) mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+		if ((nest->vey[lev] = (real *)   mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 			{no_sys_mem("(vey)", nm); return(-1);}
 	}
 
@@ -2407,8 +3491,8 @@ int initialize_nestum(struct nestContainer *nest, int isGeog, int lev) {
 	/* These two must be set to zero if inner grid was already pixel registrated */
 	xoff = nest->hdr[lev].x_inc / 2;
 	yoff = nest->hdr[lev].y_inc / 2;
-	xoff_P = nest->hdr[lev-1].x_inc / 2;
-	yoff_P = nest->hdr[lev-1].y_inc / 2;
+	xoff_P = nest->hdr[lev_P].x_inc / 2;
+	yoff_P = nest->hdr[lev_P].y_inc / 2;
 
 	/* Compute the 4 coorners coordinates of the nodes on the parent grid embracing the nested grid */
 	nest->LLx[lev] = (nest->hdr[lev].x_min - xoff) - hdr.x_inc / 2;
@@ -2430,6 +3514,17 @@ int initialize_nestum(struct nestContainer *nest, int isGeog, int lev) {
 	nest->LRrow[lev] = irint((nest->LRy[lev] - hdr.y_min) / hdr.y_inc);
 	nest->LRcol[lev] = irint((nest->LRx[lev] - hdr.x_min) / hdr.x_inc);
 
+	/* Grids nested in the same parent run concurrently and each one upscales into the parent cells that
+	   it covers. So the parent cells covered by two siblings (border ones included) may not overlap. */
+	for (i = 1; i < lev; i++) {
+		if (nest->parent[i] != lev_P) continue;
+		if (nest->LLcol[lev] <= nest->LRcol[i] && nest->LLcol[i] <= nest->LRcol[lev] &&
+		    nest->LLrow[lev] <= nest->ULrow[i] && nest->LLrow[i] <= nest->ULrow[lev]) {
+			mexPrintf("NSWING ERROR: nested grids %d and %d overlap (or touch) inside their parent grid (%d).\n", i, lev, lev_P);
+			return(-1);
+		}
+	}
+
 	/* Allocate vectors of the size of side inner grid to hold the BC */
 	n = nest->hdr[lev].nx;
 	nest->edge_rowTmp[lev] = (double *) mxCalloc((size_t)n, sizeof(double));	/* To be filled by interp */
@@ -2510,6 +3605,318 @@ void free_arrays(struct nestContainer *nest, int isGeog, int lev) {
 	if (nest->bnc_var_t) mxFree(nest->bnc_var_t);
 	if (nest->bnc_var_zTmp) mxFree(nest->bnc_var_zTmp);
 	if (nest->bnc_var_z_interp) mxFree(nest->bnc_var_z_interp);
+	if (nest->act_lo) mxFree(nest->act_lo);
+}
+
+/* --------------------------------------------------------------------------- */
+int read_ensemble(char *fname, struct ens_source **src) {
+	/* Read the -Fe table of sources. One per line, either the 9 parameters of -F (separated by slashes,
+	   commas or blanks) or the name of an initial condition grid. Returns the number of sources or -1 */
+	int   n = 0, n_alloc = 0, nf;
+	char  line[512], txt[512], *c;
+	FILE *fp;
+	struct ens_source *s = NULL;
+
+	if ((fp = fopen(fname, "r")) == NULL) {
+		mexPrintf("NSWING: Unable to open file %s - exiting\n", fname);
+		return(-1);
+	}
+	while (fgets(line, 512, fp) != NULL) {
+		if (line[0] == '#' || sscanf(line, "%s", txt) != 1) continue;	/* Jump comment and empty lines */
+		if (n == n_alloc) {
+			n_alloc += 256;
+			if ((s = (struct ens_source *)mxRealloc(s, n_alloc * sizeof(struct ens_source))) == NULL) {
+				no_sys_mem("(ens_source)", n_alloc);	fclose(fp);
+				return(-1);
+			}
+		}
+		strcpy(txt, line);
+		for (c = txt; *c; c++) if (*c == '/' || *c == ',') *c = ' ';
+		nf = sscanf(txt, "%lf %lf %lf %lf %lf %lf %lf %lf %lf", &s[n].p[0], &s[n].p[1], &s[n].p[2], &s[n].p[3],
+		            &s[n].p[4], &s[n].p[5], &s[n].p[6], &s[n].p[7], &s[n].p[8]);
+		s[n].grid = NULL;
+		if (nf != 9) {		/* Than it must be a grid name */
+			sscanf(line, "%s", txt);
+			s[n].grid = (char *)mxMalloc(strlen(txt) + 1);
+			strcpy(s[n].grid, txt);
+		}
+		n++;
+	}
+	fclose(fp);
+	if (n == 0) mexPrintf("NSWING: Error, file %s has no sources\n", fname);
+	*src = s;
+	return(n);
+}
+
+/* --------------------------------------------------------------------------- */
+#define ENS_ALLOC(p, n, type) if (nest->p && (w->p = (type *)mxCalloc((size_t)(n), sizeof(type))) == NULL) return(-1)
+int ens_worker_new(struct nestContainer *nest, struct nestContainer *w, int nNg) {
+	/* Make W a copy of NEST that shares its bathymetries, geometry and r0..r4 coefficients (all read only
+	   during a run) but has its own simulation state, so that several sources can run at the same time. */
+	int lev;
+
+	*w = *nest;
+	for (lev = 0; lev <= nNg; lev++) {	/* First forget NEST's state arrays, so that ens_worker_free() can be used on failure */
+		w->etaa[lev] = w->etad[lev] = w->fluxm_a[lev] = w->fluxm_d[lev] = w->fluxn_a[lev] = w->fluxn_d[lev] = NULL;
+		w->htotal_a[lev] = w->htotal_d[lev] = w->vex[lev] = w->vey[lev] = NULL;
+		w->long_beach[lev] = w->short_beach[lev] = NULL;
+		w->edge_rowTmp[lev] = w->edge_colTmp[lev] = w->edge_row_Ptmp[lev] = w->edge_col_Ptmp[lev] = NULL;
+	}
+	w->act_lo = w->act_hi = NULL;
+	w->wmax = w->vmax = NULL;
+	w->do_max_level = (nest->writeLevel > 0);	/* Nested grids max level is updated inside nestify() */
+	w->do_max_velocity = FALSE;
+	w->aw = NULL;
+	w->tm = NULL;
+
+	for (lev = 0; lev <= nNg; lev++) {	/* Allocate the ones that NEST has */
+		ENS_ALLOC(etaa[lev],     nest->hdr[lev].nm, real);
+		ENS_ALLOC(etad[lev],     nest->hdr[lev].nm, real);
+		ENS_ALLOC(fluxm_a[lev],  nest->hdr[lev].nm, real);
+		ENS_ALLOC(fluxm_d[lev],  nest->hdr[lev].nm, real);
+		ENS_ALLOC(fluxn_a[lev],  nest->hdr[lev].nm, real);
+		ENS_ALLOC(fluxn_d[lev],  nest->hdr[lev].nm, real);
+		ENS_ALLOC(htotal_a[lev], nest->hdr[lev].nm, real);
+		ENS_ALLOC(htotal_d[lev], nest->hdr[lev].nm, real);
+		ENS_ALLOC(vex[lev],      nest->hdr[lev].nm, real);
+		ENS_ALLOC(vey[lev],      nest->hdr[lev].nm, real);
+		ENS_ALLOC(long_beach[lev],  nest->hdr[lev].nm, short int);
+		ENS_ALLOC(short_beach[lev], nest->hdr[lev].nm, short int);
+		ENS_ALLOC(edge_rowTmp[lev],   nest->hdr[lev].nx, double);
+		ENS_ALLOC(edge_colTmp[lev],   nest->hdr[lev].ny, double);
+		ENS_ALLOC(edge_row_Ptmp[lev], nest->LRcol[lev] - nest->LLcol[lev] + 1, double);
+		ENS_ALLOC(edge_col_Ptmp[lev], nest->ULrow[lev] - nest->LLrow[lev] + 1, double);
+	}
+	ENS_ALLOC(act_lo, 4 * nest->hdr[0].ny, int);
+	if (w->act_lo) w->act_hi = &w->act_lo[2 * nest->hdr[0].ny];
+
+	/* The max level of the output grid */
+	if ((w->wmax = (float *)mxCalloc((size_t)nest->hdr[nest->writeLevel].nm, sizeof(float))) == NULL) return(-1);
+	return(0);
+}
+#undef ENS_ALLOC
+
+/* --------------------------------------------------------------------------- */
+void ens_worker_free(struct nestContainer *w, int nNg) {
+	/* Free what ens_worker_new() allocated. The shared arrays belong to the original nestContainer */
+	int lev;
+
+	for (lev = 0; lev <= nNg; lev++) {
+		if (w->etaa[lev]) mxFree(w->etaa[lev]);
+		if (w->etad[lev]) mxFree(w->etad[lev]);
+		if (w->fluxm_a[lev]) mxFree(w->fluxm_a[lev]);
+		if (w->fluxm_d[lev]) mxFree(w->fluxm_d[lev]);
+		if (w->fluxn_a[lev]) mxFree(w->fluxn_a[lev]);
+		if (w->fluxn_d[lev]) mxFree(w->fluxn_d[lev]);
+		if (w->htotal_a[lev]) mxFree(w->htotal_a[lev]);
+		if (w->htotal_d[lev]) mxFree(w->htotal_d[lev]);
+		if (w->vex[lev]) mxFree(w->vex[lev]);
+		if (w->vey[lev]) mxFree(w->vey[lev]);
+		if (w->long_beach[lev])  mxFree(w->long_beach[lev]);
+		if (w->short_beach[lev]) mxFree(w->short_beach[lev]);
+		if (w->edge_rowTmp[lev]) mxFree(w->edge_rowTmp[lev]);
+		if (w->edge_colTmp[lev]) mxFree(w->edge_colTmp[lev]);
+		if (w->edge_row_Ptmp[lev]) mxFree(w->edge_row_Ptmp[lev]);
+		if (w->edge_col_Ptmp[lev]) mxFree(w->edge_col_Ptmp[lev]);
+	}
+	if (w->act_lo) mxFree(w->act_lo);
+	if (w->wmax) mxFree(w->wmax);
+}
+
+/* --------------------------------------------------------------------------- */
+int ens_start(struct nestContainer *w, int nNg, int isGeog, struct srf_header hdr_b, struct ens_source *src) {
+	/* Put the worker W at rest with the initial condition of source SRC. Called by the master thread only,
+	   because it reads the source grids and reports the errors (returns -1) with the MEX functions. */
+	int    lev, r_bin;
+	size_t nm;
+	struct srf_header hdr;
+
+	for (lev = 0; lev <= nNg; lev++) {
+		nm = (size_t)w->hdr[lev].nm;
+		memset(w->etaa[lev],     0, nm * sizeof(real));
+		memset(w->etad[lev],     0, nm * sizeof(real));
+		memset(w->fluxm_a[lev],  0, nm * sizeof(real));
+		memset(w->fluxm_d[lev],  0, nm * sizeof(real));
+		memset(w->fluxn_a[lev],  0, nm * sizeof(real));
+		memset(w->fluxn_d[lev],  0, nm * sizeof(real));
+		memset(w->htotal_a[lev], 0, nm * sizeof(real));
+		memset(w->htotal_d[lev], 0, nm * sizeof(real));
+		if (w->vex[lev]) memset(w->vex[lev], 0, nm * sizeof(real));
+		if (w->vey[lev]) memset(w->vey[lev], 0, nm * sizeof(real));
+		if (w->long_beach[lev])  memset(w->long_beach[lev],  0, nm * sizeof(short int));
+		if (w->short_beach[lev]) memset(w->short_beach[lev], 0, nm * sizeof(short int));
+		w->ad_copy[lev] = TRUE;
+	}
+	memset(w->wmax, 0, (size_t)w->hdr[w->writeLevel].nm * sizeof(float));
+
+	if (src->grid == NULL) {	/* Okada. deform() wants the fault dimensions in meters */
+		deform(hdr_b, (hdr_b.x_max - hdr_b.x_min) / (hdr_b.nx - 1), (hdr_b.y_max - hdr_b.y_min) / (hdr_b.ny - 1),
+		       isGeog, src->p[4] * 1000, src->p[5] * 1000, src->p[1], src->p[0], src->p[2], src->p[3],
+		       src->p[6] * 1000, src->p[7], src->p[8], w->etaa[0]);
+	}
+	else {
+		if ((r_bin = read_grd_info_ascii(src->grid, &hdr)) < 0) return(-1);
+		if (hdr.nx != w->hdr[0].nx || hdr.ny != w->hdr[0].ny) {
+			mexPrintf("NSWING: Source grid %s and bathymetry have different sizes\n", src->grid);
+			return(-1);
+		}
+		if ((r_bin) ? read_grd_bin(src->grid, &hdr, w->etaa[0], 1) : read_grd_ascii(src->grid, &hdr, w->etaa[0], 1))
+			return(-1);
+	}
+	return(0);
+}
+
+/* --------------------------------------------------------------------------- */
+void ens_run(struct nestContainer *w, int nNg, int isGeog, int n_of_cycles, int do_active, double run_jump_time,
+             unsigned int *lcum_p, int n_mareg, int cumint, float *maregs) {
+	/* Run one source of the ensemble, set by ens_start(), with the same sequence of steps as the main loop. The
+	   max level of the writeLevel grid is left in w->wmax and, when n_mareg > 0, the maregraphs (n_mareg values
+	   every cumint cycles) in MAREGS. Only computes, so that the workers can run it in their own threads. */
+	int    k, n_t = 0, writeLevel = w->writeLevel;
+	unsigned int ij;
+	double time_h = 0, dt = w->dt[0];
+
+	w->time_h = 0;
+	if (nNg) {
+		w->run_jump_time = run_jump_time;
+		if (w->run_jump_time > 0 && w->run_jump_time < w->dt[0])
+			w->run_jump_time = 0;
+		else
+			resamplegrid(w, nNg);
+	}
+
+	for (k = 0; k < n_of_cycles; k++) {
+		if (do_active && (w->act_on = (k > 0)))
+			active_region(w, k == 1);
+
+		if (isGeog == 0)
+			mass(w, 0);
+		else
+			mass_sp(w, 0);
+
+		if (k) openb(w->hdr[0], w->bat[0], w->fluxm_a[0], w->fluxn_a[0], w->etad[0], w);
+
+		if (nNg) nest_children(w, nNg, 0, isGeog);
+
+		moment_conservation(w, isGeog, 0);
+		update(w, 0);
+
+		if (n_mareg && (k % cumint == 0)) {
+			for (ij = 0; ij < n_mareg; ij++)
+				maregs[n_t * n_mareg + ij] = (float)w->etaa[writeLevel][lcum_p[ij]];
+			n_t++;
+		}
+
+		if (writeLevel == 0)		/* Otherwise it was done inside nestify() */
+			update_maxs(w, TRUE, MAX_LEVEL);
+
+		time_h += dt;
+		w->time_h = time_h;
+	}
+}
+
+/* --------------------------------------------------------------------------- */
+int run_ensemble(struct nestContainer *nest, int nNg, int isGeog, struct srf_header hdr_b, int n_of_cycles,
+                 int do_active, struct ens_source *src, int n_src, unsigned int *lcum_p, char *names[], int n_mareg,
+                 int cumint, char *out, char hist[]) {
+	/* Run all the sources of the -Fe table. The bathymetries and the grids geometry are loaded once and shared
+	   by all workers (one per OpenMP thread), each one with its own simulation state. The sources go in rounds of
+	   one per worker. The master thread allocates the workers, sets the sources (ens_start()) and writes the
+	   results, and only the runs themselves are threaded, so that no MEX function is called by other threads.
+	   With netCDF the max levels and maregraphs go to the OUT file, with a 'source' dimension. Otherwise to
+	   <out>_####.grd and .dat files. */
+	int    s, k, n_work = 1, n_round, n_fail = 0, n_t, lev = nest->writeLevel, *ok;
+	float *maregs;
+#ifdef HAVE_NETCDF
+	int    ncid, ids[12];
+	size_t start[3] = {0,0,0}, count[3];
+#else
+	char   fname[600];
+	int    i, j;
+	FILE  *fp;
+#endif
+	char   stem[512];
+	struct nestContainer *W;
+
+	n_t = (n_mareg) ? (n_of_cycles - 1) / cumint + 1 : 0;
+	strcpy(stem, out);
+#ifdef HAVE_NETCDF
+	if ((ncid = open_ensemble_nc(nest, out, hist, ids, src, n_src, lcum_p, names, n_mareg, n_t,
+	                             cumint * nest->dt[0], lev)) < 0)
+		return(-1);
+#else
+	s = (int)strlen(stem) - 1;
+	while (s > 0 && stem[s] != '.' && stem[s] != '/' && stem[s] != '\\') s--;
+	if (s > 0 && stem[s] == '.') stem[s] = '\0';	/* Drop the extension */
+#endif
+
+#if HAVE_OPENMP
+	n_work = MIN(omp_get_max_threads(), n_src);
+#endif
+	W = (struct nestContainer *)mxCalloc((size_t)n_work, sizeof(struct nestContainer));
+	ok = (int *)mxCalloc((size_t)n_work, sizeof(int));
+	maregs = (float *)mxCalloc((size_t)MAX(n_work * n_t * n_mareg, 1), sizeof(float));
+	for (k = 0; k < n_work; k++) {
+		if (ens_worker_new(nest, &W[k], nNg)) {		/* Then do with the workers that fitted in memory */
+			ens_worker_free(&W[k], nNg);
+			mexPrintf("NSWING: Not enough memory for more than %d ensemble workers\n", k);
+			n_work = k;
+		}
+	}
+
+	for (s = 0; s < n_src && n_work > 0; s += n_round) {
+		n_round = MIN(n_work, n_src - s);
+		for (k = 0; k < n_round; k++)
+			ok[k] = (ens_start(&W[k], nNg, isGeog, hdr_b, &src[s + k]) == 0);
+
+#if HAVE_OPENMP
+#pragma omp parallel for schedule(static,1) num_threads(n_round)
+#endif
+		for (k = 0; k < n_round; k++)
+			if (ok[k]) ens_run(&W[k], nNg, isGeog, n_of_cycles, do_active, nest->run_jump_time, lcum_p, n_mareg,
+			                   cumint, &maregs[(size_t)k * n_t * n_mareg]);
+
+		for (k = 0; k < n_round; k++) {
+			if (!ok[k]) {
+				n_fail++;
+				continue;
+			}
+#ifdef HAVE_NETCDF
+			start[0] = s + k;	count[0] = 1;	count[1] = nest->hdr[lev].ny;	count[2] = nest->hdr[lev].nx;
+			err_trap(nc_put_vara_float(ncid, ids[4], start, count, W[k].wmax));
+			if (n_t) {
+				count[1] = n_t;		count[2] = n_mareg;
+				err_trap(nc_put_vara_float(ncid, ids[9], start, count, &maregs[(size_t)k * n_t * n_mareg]));
+			}
+#else
+			sprintf(fname, "%s_%04d.grd", stem, s + k + 1);
+			write_grd_bin(fname, nest->hdr[lev].x_min, nest->hdr[lev].y_min, nest->hdr[lev].x_inc,
+			              nest->hdr[lev].y_inc, 0, 0, nest->hdr[lev].nx, nest->hdr[lev].ny, nest->hdr[lev].nx, W[k].wmax);
+			sprintf(fname, "%s_%04d.dat", stem, s + k + 1);
+			if (n_t && (fp = fopen(fname, "w")) != NULL) {
+				for (i = 0; i < n_t; i++) {
+					fprintf(fp, "%.3f", (i * cumint + 0.5) * nest->dt[0]);
+					for (j = 0; j < n_mareg; j++)
+						fprintf(fp, "\t%.5f", maregs[((size_t)k * n_t + i) * n_mareg + j]);
+					fprintf(fp, "\n");
+				}
+				fclose(fp);
+			}
+#endif
+		}
+		mexPrintf("\tSource %d out of %d\r", s + n_round, n_src);
+	}
+	if (n_work == 0) n_fail = n_src;
+
+	for (k = 0; k < n_work; k++)
+		ens_worker_free(&W[k], nNg);
+	mxFree(W);		mxFree(ok);		mxFree(maregs);
+
+#ifdef HAVE_NETCDF
+	err_trap(nc_close(ncid));
+#endif
+	if (n_fail) mexPrintf("\nNSWING: %d of the %d sources failed\n", n_fail, n_src);
+	return((n_fail) ? -1 : 0);
 }
 
 /* --------------------------------------------------------------------------- */
@@ -2521,80 +3928,1164 @@ void power(struct nestContainer *nest, float *work, int lev) {
 	*/
 	unsigned int ij;
 	for (ij = 0; ij < nest->hdr[lev].nm; ij++) {
-		if (nest->htotal_d[lev][ij] > EPS2) {
-			work[ij] = (float)(( sqrt(nest->htotal_d[lev][ij] * NORMAL_GRAV) *
-			                   ((nest->fluxm_d[lev][ij] * nest->fluxm_d[lev][ij]) +
-			                    (nest->fluxn_d[lev][ij] * nest->fluxn_d[lev][ij])) /
-			                     nest->htotal_d[lev][ij] ) * 500);
+		if (nest->htotal_a[lev][ij] > EPS2) {
+			work[ij] = (float)(( sqrt(nest->htotal_a[lev][ij] * NORMAL_GRAV) *
+			                   ((nest->fluxm_a[lev][ij] * nest->fluxm_a[lev][ij]) +
+			                    (nest->fluxn_a[lev][ij] * nest->fluxn_a[lev][ij])) /
+			                     nest->htotal_a[lev][ij] ) * 500);
+		}
+	}
+}
+
+/* --------------------------------------------------------------------------- */
+void total_energy(struct nestContainer *nest, float *work, int lev) {
+	/* Compute wave total energy according to 1/2*rho*H*u^2 + 1/2*rho*g*eta^2
+	   http://rspa.royalsocietypublishing.org/content/465/2103/725.full.pdf 
+	   http://arxiv.org/ct?url=http%3A%2F%2Fdx.doi.org%2F10%252E1098%2Frspa%252E2008%252E0332&v=9ed92a65 
+	*/
+	unsigned int ij;
+
+	for (ij = 0; ij < nest->hdr[lev].nm; ij++) {
+		if (nest->htotal_a[lev][ij] > EPS2) {
+			work[ij] = (float)(( nest->etaa[lev][ij] * nest->etaa[lev][ij] * NORMAL_GRAV +
+			                   ((nest->fluxm_a[lev][ij] * nest->fluxm_a[lev][ij]) +
+			                    (nest->fluxn_a[lev][ij] * nest->fluxn_a[lev][ij])) /
+			                     nest->htotal_a[lev][ij] ) * 500);
+		}
+	}
+}
+
+/* --------------------------------------------------------------------------- */
+int write_grd_bin(char *name, double x_min, double y_min, double x_inc, double y_inc, unsigned int i_start,
+	unsigned int j_start, unsigned int i_end, unsigned int j_end, unsigned int nX, float *work) {
+
+	/* Writes a grid in the Surfer binary format */
+	int status;
+
+	if ((status = write_srf(name, x_min, y_min, x_inc, y_inc, i_start, j_start, i_end, j_end, nX, work)) == -1) {
+		mexPrintf("Fatal Error: Could not create file %s!\n", name);
+	}
+	else if (status == -2) {
+		mexPrintf("Fatal Error: Error writing file %s!\n", name);
+	}
+
+	return ((status) ? -1 : 0);
+}
+
+/* --------------------------------------------------------------------------- */
+int write_srf(char *name, double x_min, double y_min, double x_inc, double y_inc, unsigned int i_start,
+	unsigned int j_start, unsigned int i_end, unsigned int j_end, unsigned int nX, float *work) {
+
+	/* Does the work of write_grd_bin() but, since it is also called by the background writer thread,
+	   it does not print anything. Returns -1 if the file could not be created and -2 if a write failed. */
+	unsigned int i, j;
+	double x_max, y_max;
+	float work_min = FLT_MAX, work_max = -FLT_MAX, tmp;
+	struct srf_header h;
+	FILE *fp;
+
+	if ((fp = fopen (name, "wb")) == NULL)
+		return (-1);
+
+	x_max = x_min + (i_end - i_start - 1) * x_inc;
+	y_max = y_min + (j_end - j_start - 1) * y_inc;
+
+	/* Find zmin/zmax */
+	for (j = j_start; j < j_end; j++) {
+		for (i = i_start; i < i_end; i++) {
+			tmp = work[ijs(i,j,nX)];
+			work_max = MAX(tmp, work_max);
+			work_min = MIN(tmp, work_min);
+		}
+	}
+
+	/* store header information and array */
+	strcpy (h.id,"DSBB");
+	h.nx = (i_end - i_start);	h.ny = (j_end - j_start);
+	h.x_min = x_min;		h.x_max = x_max;
+	h.y_min = y_min;		h.y_max = y_max;
+	h.z_min = (double)work_min;	h.z_max = (double)work_max;
+
+	if (fwrite ((void *)&h, sizeof (struct srf_header), (size_t)1, fp) != 1) {
+		fclose(fp);
+		return (-2);
+	}
+
+	for (j = j_start; j < j_end; j++) {		/* One row at a time */
+		if (fwrite ((void *)&work[ijs(i_start,j,nX)], sizeof(float), (size_t)(i_end - i_start), fp) != i_end - i_start) {
+			fclose(fp);
+			return (-2);
+		}
+	}
+
+	fclose(fp);
+	return (0);
+}
+
+/* --------------------------------------------------------------------------- */
+int put_grd(struct async_writer *aw, char *name, double x_min, double y_min, double x_inc, double y_inc,
+            unsigned int i_start, unsigned int j_start, unsigned int i_end, unsigned int j_end, unsigned int nX, float *work) {
+	/* Same as write_grd_bin() but, when there is a background writer, only copy the sub-region to a job of
+	   its queue and return. The work array can then be reused right away. */
+	unsigned int row, nc = i_end - i_start;
+	float *pf;
+	struct aw_job *job;
+
+	if (aw == NULL || (job = aw_job_new(aw, AW_GRD, (size_t)nc * (j_end - j_start) * sizeof(float))) == NULL)
+		return (write_grd_bin(name, x_min, y_min, x_inc, y_inc, i_start, j_start, i_end, j_end, nX, work));
+
+	strncpy(job->name, name, 255);		job->name[255] = '\0';
+	job->x_min = x_min;		job->y_min = y_min;
+	job->x_inc = x_inc;		job->y_inc = y_inc;
+	job->nx = nc;			job->ny = j_end - j_start;
+	for (row = j_start, pf = (float *)job->data; row < j_end; row++, pf += nc)
+		memcpy(pf, &work[ijs(i_start,row,nX)], nc * sizeof(float));
+
+	aw_job_submit(aw);
+	return (0);
+}
+
+#if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+unsigned __stdcall aw_main(void *arg) {
+	aw_run((struct async_writer *)arg);
+	return (0);
+}
+#else
+void *aw_main(void *arg) {
+	aw_run((struct async_writer *)arg);
+	return (NULL);
+}
+#endif
+
+/* --------------------------------------------------------------------------- */
+int aw_start(struct async_writer *aw, size_t budget) {
+	/* Initialize the queue of the background writer and launch its thread. Jobs are done in the order they
+	   were queued, so the files get the same contents as when written by the solver itself. */
+	memset(aw, 0, sizeof(struct async_writer));
+	aw->budget = budget;
+#if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+	InitializeCriticalSection(&aw->mutex);
+	InitializeConditionVariable(&aw->has_job);
+	InitializeConditionVariable(&aw->has_room);
+	if ((aw->thread = (HANDLE)_beginthreadex(NULL, 0, aw_main, aw, 0, NULL)) == 0) {
+		DeleteCriticalSection(&aw->mutex);
+		return (-1);
+	}
+#else
+	pthread_mutex_init(&aw->mutex, NULL);
+	pthread_cond_init(&aw->has_job, NULL);
+	pthread_cond_init(&aw->has_room, NULL);
+	if (pthread_create(&aw->thread, NULL, aw_main, aw)) {
+		pthread_cond_destroy(&aw->has_room);
+		pthread_cond_destroy(&aw->has_job);
+		pthread_mutex_destroy(&aw->mutex);
+		return (-1);
+	}
+#endif
+	return (0);
+}
+
+/* --------------------------------------------------------------------------- */
+void aw_stop(struct async_writer *aw) {
+	/* Wait for the queue to drain, stop the writer thread and release its resources */
+	aw_flush(aw);
+	aw_lock(&aw->mutex);
+	aw->quit = TRUE;
+	aw_wake(&aw->has_job);
+	aw_unlock(&aw->mutex);
+#if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+	WaitForSingleObject(aw->thread, INFINITE);
+	CloseHandle(aw->thread);
+	DeleteCriticalSection(&aw->mutex);
+#else
+	pthread_join(aw->thread, NULL);
+	pthread_cond_destroy(&aw->has_room);
+	pthread_cond_destroy(&aw->has_job);
+	pthread_mutex_destroy(&aw->mutex);
+#endif
+}
+
+/* --------------------------------------------------------------------------- */
+void aw_flush(struct async_writer *aw) {
+	/* Block until all queued jobs are written. Must be called before the solver thread touches a
+	   netCDF file again on its own (the netCDF library is not thread safe). */
+	int status, kind;
+	char name[256];
+
+	aw_lock(&aw->mutex);
+	while (aw->n_jobs > 0)
+		aw_wait(&aw->has_room, &aw->mutex);
+	status = aw->status;	kind = aw->err_kind;	strcpy(name, aw->err_name);
+	aw->status = 0;
+	aw_unlock(&aw->mutex);
+	if (status) aw_report(status, kind, name);
+}
+
+/* --------------------------------------------------------------------------- */
+void aw_report(int status, int kind, char *name) {
+	/* Errors of the writer thread are reported here, by the solver thread (no mexPrintf in other threads) */
+	if (kind == AW_GRD || kind == AW_CKP) {
+		mexPrintf("NSWING: Background writer could not %s file %s\n", (status == -1) ? "create" : "write", name);
+	}
+#ifdef HAVE_NETCDF
+	else {
+		mexPrintf("NSWING: Background writer netCDF error = %s\n", nc_strerror(status));
+	}
+#endif
+}
+
+/* --------------------------------------------------------------------------- */
+struct aw_job *aw_job_new(struct async_writer *aw, int kind, size_t nbytes) {
+	/* Get the next free job of the queue with a data buffer of nbytes. If the queue is full or holding it
+	   would exceed the memory budget, wait for the writer to catch up (a job bigger than the whole budget
+	   waits for an empty queue). Returns NULL if no memory, in which case the caller must write by itself. */
+	int status, kind_err;
+	char name[256];
+	struct aw_job *job;
+
+	aw_lock(&aw->mutex);
+	if (aw->n_jobs == AW_SLOTS || (aw->n_jobs > 0 && aw->in_use + nbytes > aw->budget)) {
+		aw->n_waits++;
+		while (aw->n_jobs == AW_SLOTS || (aw->n_jobs > 0 && aw->in_use + nbytes > aw->budget))
+			aw_wait(&aw->has_room, &aw->mutex);
+	}
+	status = aw->status;	kind_err = aw->err_kind;	strcpy(name, aw->err_name);
+	aw->status = 0;
+	aw_unlock(&aw->mutex);
+	if (status) aw_report(status, kind_err, name);
+
+	job = &aw->job[aw->tail];	/* Only the solver touches the tail job until it is submitted */
+	if ((job->data = malloc(nbytes)) == NULL) {
+		aw_flush(aw);
+		return (NULL);
+	}
+	job->kind   = kind;
+	job->nbytes = nbytes;
+	return (job);
+}
+
+/* --------------------------------------------------------------------------- */
+void aw_job_submit(struct async_writer *aw) {
+	/* Hand the tail job, filled by the solver, to the writer thread */
+	aw_lock(&aw->mutex);
+	aw->in_use += aw->job[aw->tail].nbytes;
+	aw->tail = (aw->tail + 1) % AW_SLOTS;
+	aw->n_jobs++;
+	aw_wake(&aw->has_job);
+	aw_unlock(&aw->mutex);
+}
+
+/* --------------------------------------------------------------------------- */
+void aw_run(struct async_writer *aw) {
+	/* Body of the writer thread. Writes the queued jobs, in order, until told to quit */
+	int status = 0;
+	struct aw_job *job;
+
+	for (;;) {
+		aw_lock(&aw->mutex);
+		while (aw->n_jobs == 0 && !aw->quit)
+			aw_wait(&aw->has_job, &aw->mutex);
+		if (aw->n_jobs == 0) {
+			aw_unlock(&aw->mutex);
+			break;
+		}
+		job = &aw->job[aw->head];
+		aw_unlock(&aw->mutex);
+
+		/* The slow part is done without holding the lock so that the solver can keep queueing */
+		if (job->kind == AW_GRD)
+			status = write_srf(job->name, job->x_min, job->y_min, job->x_inc, job->y_inc, 0, 0, job->nx,
+			                   job->ny, job->nx, (float *)job->data);
+		else if (job->kind == AW_CKP)
+			status = write_ckp(job->name, (char *)job->data, job->nbytes);
+#ifdef HAVE_NETCDF
+		else if (job->kind == AW_NC_FLT)
+			status = nc_put_vara_float(job->ncid, job->varid, job->start, job->count, (float *)job->data);
+		else
+			status = nc_put_vara_double(job->ncid, job->varid, job->start, job->count, (double *)job->data);
+#endif
+		free(job->data);
+		job->data = NULL;
+
+		aw_lock(&aw->mutex);
+		if (status && !aw->status) {
+			aw->status = status;	aw->err_kind = job->kind;
+			strcpy(aw->err_name, job->name);
+		}
+		aw->in_use -= job->nbytes;
+		aw->head = (aw->head + 1) % AW_SLOTS;
+		aw->n_jobs--;
+		aw_wake(&aw->has_room);
+		aw_unlock(&aw->mutex);
+	}
+}
+
+/* --------------------------------------------------------------------------- */
+int ckp_blocks(struct nestContainer *nest, int n_levels, int k, float *wmax, float *vmax, struct tracers *oranges,
+               int n_oranges, double *maregs_timeout, unsigned int n_times, float *maregs_array, unsigned int n_vals,
+               struct ckp_block *b) {
+	/* List the arrays that make the state of the simulation after k cycles. Used both to write and to read a
+	   checkpoint so that the two cannot go out of sync. If b is NULL only count them. Returns the count. */
+	int lev, n = 0;
+	size_t nm;
+#define CKP_ADD(ptr, nbytes) {if (b) {b[n].p = (void *)(ptr); b[n].n = (nbytes);} n++;}
+
+	for (lev = 0; lev < n_levels; lev++) {
+		nm = (size_t)nest->hdr[lev].nm * sizeof(real);
+		CKP_ADD(nest->etaa[lev], nm);		CKP_ADD(nest->etad[lev], nm);
+		CKP_ADD(nest->fluxm_a[lev], nm);	CKP_ADD(nest->fluxm_d[lev], nm);
+		CKP_ADD(nest->fluxn_a[lev], nm);	CKP_ADD(nest->fluxn_d[lev], nm);
+		CKP_ADD(nest->htotal_a[lev], nm);	CKP_ADD(nest->htotal_d[lev], nm);
+		if (nest->vex[lev]) CKP_ADD(nest->vex[lev], nm);
+		if (nest->vey[lev]) CKP_ADD(nest->vey[lev], nm);
+		if (nest->long_beach[lev])  CKP_ADD(nest->long_beach[lev],  (size_t)nest->hdr[lev].nm * sizeof(short));
+		if (nest->short_beach[lev]) CKP_ADD(nest->short_beach[lev], (size_t)nest->hdr[lev].nm * sizeof(short));
+	}
+	if (nest->bnc_var_zTmp) CKP_ADD(nest->bnc_var_zTmp, (size_t)nest->bnc_pos_nPts * sizeof(double));
+
+	nm = (size_t)nest->hdr[nest->writeLevel].nm * sizeof(float);
+	if (wmax) CKP_ADD(wmax, nm);
+	if (vmax) CKP_ADD(vmax, nm);
+	if (n_oranges) {		/* Current tracer positions */
+		CKP_ADD(oranges->x, (size_t)n_oranges * sizeof(double));
+		CKP_ADD(oranges->y, (size_t)n_oranges * sizeof(double));
+	}
+	if (maregs_timeout) {	/* Maregraphs that will be written to netCDF at the end */
+		CKP_ADD(maregs_timeout, (size_t)n_times * sizeof(double));
+		CKP_ADD(maregs_array, (size_t)n_vals * sizeof(float));
+	}
+#undef CKP_ADD
+	return (n);
+}
+
+/* --------------------------------------------------------------------------- */
+size_t ckp_size(int n_blocks, struct ckp_block *b) {
+	/* Size of the checkpoint file. The header plus the table of offsets and sizes, then the arrays, each one
+	   padded to a multiple of CKP_ALIGN */
+	int i;
+	size_t n;
+
+	n = (sizeof(struct ckp_header) + 2 * n_blocks * sizeof(uint64_t) + CKP_ALIGN - 1) / CKP_ALIGN * CKP_ALIGN;
+	for (i = 0; i < n_blocks; i++)
+		n += (b[i].n + CKP_ALIGN - 1) / CKP_ALIGN * CKP_ALIGN;
+	return (n);
+}
+
+/* --------------------------------------------------------------------------- */
+void ckp_image(char *buf, struct ckp_header *h, struct ckp_block *b, int n_blocks) {
+	/* Copy the header and the arrays into buf (of ckp_size() bytes) with the layout of the checkpoint file */
+	int i;
+	size_t off;
+	uint64_t *tab = (uint64_t *)&buf[sizeof(struct ckp_header)];
+
+	h->n_blocks = n_blocks;
+	h->n_bytes  = ckp_size(n_blocks, b);
+	off = (sizeof(struct ckp_header) + 2 * n_blocks * sizeof(uint64_t) + CKP_ALIGN - 1) / CKP_ALIGN * CKP_ALIGN;
+	memset(buf, 0, off);
+	memcpy(buf, h, sizeof(struct ckp_header));
+	for (i = 0; i < n_blocks; i++) {
+		tab[i] = off;		tab[n_blocks + i] = b[i].n;
+		memcpy(&buf[off], b[i].p, b[i].n);
+		memset(&buf[off + b[i].n], 0, (b[i].n + CKP_ALIGN - 1) / CKP_ALIGN * CKP_ALIGN - b[i].n);
+		off += (b[i].n + CKP_ALIGN - 1) / CKP_ALIGN * CKP_ALIGN;
+	}
+}
+
+/* --------------------------------------------------------------------------- */
+int ckp_save(struct async_writer *aw, char *name, struct ckp_header *h, struct ckp_block *b, int n_blocks) {
+	/* Write a checkpoint. With a background writer the solver only copies the state to memory and the file
+	   is written by the writer thread. */
+	int status;
+	size_t n_bytes = ckp_size(n_blocks, b);
+	char  *buf;
+	struct aw_job *job;
+
+	if (aw && (job = aw_job_new(aw, AW_CKP, n_bytes)) != NULL) {
+		ckp_image((char *)job->data, h, b, n_blocks);
+		strncpy(job->name, name, 255);		job->name[255] = '\0';
+		aw_job_submit(aw);
+		return (0);
+	}
+
+	if ((buf = (char *)malloc(n_bytes)) == NULL) {
+		mexPrintf("NSWING: Not enough memory to write the checkpoint file %s\n", name);
+		return (-1);
+	}
+	ckp_image(buf, h, b, n_blocks);
+	if ((status = write_ckp(name, buf, n_bytes)) != 0)
+		mexPrintf("NSWING: Could not %s the checkpoint file %s\n", (status == -1) ? "create" : "write", name);
+	free(buf);
+	return (status);
+}
+
+/* --------------------------------------------------------------------------- */
+int write_ckp(char *name, char *buf, size_t n_bytes) {
+	/* Write the checkpoint image to name.tmp and then rename it to name, so that a job killed in the middle
+	   of the write still has the previous checkpoint. Silent, because it also runs in the writer thread.
+	   Returns -1 if the file could not be created and -2 if the write failed. */
+	int  status = 0;
+	char tmp[264];
+	FILE *fp;
+
+	sprintf(tmp, "%.255s.tmp", name);
+	if ((fp = fopen(tmp, "wb")) == NULL)
+		return (-1);
+	if (fwrite(buf, 1, n_bytes, fp) != n_bytes || fflush(fp)) status = -2;
+	if (fclose(fp)) status = -2;
+	if (status == 0) {
+#if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+		if (!MoveFileExA(tmp, name, MOVEFILE_REPLACE_EXISTING)) status = -2;
+#else
+		if (rename(tmp, name)) status = -2;
+#endif
+	}
+	return (status);
+}
+
+/* --------------------------------------------------------------------------- */
+int ckp_open(char *name, struct ckp_header *h, FILE **fp) {
+	/* Open a checkpoint file and read its header. Returns 1 if there is no such file (nothing to resume),
+	   -1 if the file is not a valid checkpoint of this build and 0 on success */
+	if ((*fp = fopen(name, "rb")) == NULL)
+		return (1);
+
+	if (fread(h, sizeof(struct ckp_header), 1, *fp) != 1 || strcmp(h->id, "NSWCKP2")) {
+		mexPrintf("NSWING: File %s is not a nswing checkpoint\n", name);
+		fclose(*fp);
+		return (-1);
+	}
+	if (h->real_size != (int)sizeof(real)) {
+		mexPrintf("NSWING: Checkpoint %s was written by a %s precision build\n", name,
+		          (h->real_size == 4) ? "single" : "double");
+		fclose(*fp);
+		return (-1);
+	}
+	if (fseek64(*fp, (int64_t)h->n_bytes - 1, SEEK_SET) || fgetc(*fp) == EOF) {
+		mexPrintf("NSWING: Checkpoint %s is truncated\n", name);
+		fclose(*fp);
+		return (-1);
+	}
+	return (0);
+}
+
+/* --------------------------------------------------------------------------- */
+int ckp_match(struct ckp_header *h, struct nestContainer *nest, int n_levels, int isGeog, double dt, int n_of_cycles) {
+	/* Check that the checkpoint belongs to a run with the same grids, coordinates and time step */
+	int lev, bad;
+
+	bad = (h->n_levels != n_levels || h->isGeog != isGeog || h->dt != dt);
+	for (lev = 0; !bad && lev < n_levels; lev++)
+		bad = (h->nx[lev] != nest->hdr[lev].nx || h->ny[lev] != nest->hdr[lev].ny || h->parent[lev] != nest->parent[lev]);
+	if (bad) {
+		mexPrintf("NSWING: The checkpoint is not from this simulation (grids, -f or -t differ)\n");
+		return (-1);
+	}
+	if (h->k >= n_of_cycles) {
+		mexPrintf("NSWING: The checkpoint is already at cycle %d (see -N)\n", h->k);
+		return (-1);
+	}
+	return (0);
+}
+
+/* --------------------------------------------------------------------------- */
+int ckp_load(FILE *fp, struct ckp_header *h, struct ckp_block *b, int n_blocks) {
+	/* Read the arrays of an opened checkpoint into the b list. Their number and sizes must match the ones
+	   that were written, otherwise the run does not use the same options (e.g. -M, -S, -L or -T). */
+	int i, bad = (h->n_blocks != n_blocks);
+	uint64_t *tab;
+
+	if ((tab = (uint64_t *)mxCalloc((size_t)(2 * n_blocks + 1), sizeof(uint64_t))) == NULL)
+		{no_sys_mem("(ckp_load)", 2 * n_blocks); return(-1);}
+	if (!bad && (fseek64(fp, (int64_t)sizeof(struct ckp_header), SEEK_SET) ||
+	             fread(tab, sizeof(uint64_t), (size_t)(2 * n_blocks), fp) != (size_t)(2 * n_blocks)))
+		bad = TRUE;
+	for (i = 0; !bad && i < n_blocks; i++)
+		bad = (tab[n_blocks + i] != b[i].n);
+	if (bad) {
+		mexPrintf("NSWING: The checkpoint was written with other output options (-M, -S, -L, -T, ...)\n");
+		mxFree(tab);
+		return (-1);
+	}
+	for (i = 0; i < n_blocks; i++) {
+		if (b[i].n && (fseek64(fp, (int64_t)tab[i], SEEK_SET) || fread(b[i].p, 1, b[i].n, fp) != b[i].n)) {
+			mexPrintf("NSWING: Error reading the checkpoint file\n");
+			mxFree(tab);
+			return (-1);
+		}
+	}
+	mxFree(tab);
+	return (0);
+}
+
+/* ------------------------------------------------------------------------------ */
+int strip_fork(struct strip_ctx *s, int n, struct srf_header hdr, double dx, double dy, int with_img, int n_mar) {
+	/* Split the rows of level 0 in N strips and start a process for each one but the first, which is this one.
+	   The processes share one anonymous memory mapping with the barrier, the mailboxes where each strip leaves
+	   its border rows for the neighbours, the values at the maregraphs and, if WITH_IMG, the whole grid to write.
+	   Only the strip_*() functions know that the strips talk through shared memory, so that they can be replaced
+	   by a cluster transport. All processes return from here, each with the rows of its strip in S. */
+#ifdef HAVE_STRIPS
+	int    r, g0, g1, base, rem, pid;
+	size_t off_box, off_mar, off_img;
+	char  *map;
+
+	memset(s, 0, sizeof(struct strip_ctx));
+	s->n = n;		s->n_mar = n_mar;
+	s->g.nx = hdr.nx;			s->g.ny = hdr.ny;
+	s->g.nm = (unsigned int)hdr.nx * (unsigned int)hdr.ny;
+	s->g.x_inc = dx;			s->g.y_inc = dy;
+	s->g.x_min = hdr.x_min;		s->g.x_max = hdr.x_max;
+	s->g.y_min = hdr.y_min;		s->g.y_max = hdr.y_max;
+	s->g.z_min = hdr.z_min;		s->g.z_max = hdr.z_max;
+
+	s->box_len = (size_t)8 * STRIP_HALO * hdr.nx;		/* Border rows of the 8 arrays swapped by strip_exchange() */
+	off_box = (sizeof(struct strip_shm) + 63) / 64 * 64;
+	off_mar = off_box + (size_t)n * 4 * s->box_len * sizeof(real);
+	off_img = off_mar + ((size_t)5 * n_mar * sizeof(real) + 63) / 64 * 64;
+	s->map_len = off_img + ((with_img) ? (size_t)s->g.nm * sizeof(float) : 0);
+	if ((map = (char *)mmap(NULL, s->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		mexPrintf("NSWING: Error, could not map %g MB of shared memory for the strips (-d option)\n", s->map_len / 1048576.0);
+		return (-1);
+	}
+	s->shm = (struct strip_shm *)map;
+	s->box = (real *)(map + off_box);
+	s->mar = (real *)(map + off_mar);
+	s->img = (with_img) ? (float *)(map + off_img) : NULL;		/* The mapping starts zeroed */
+
+	s->mar_ij = (unsigned int *)mxMalloc((size_t)MAX(n_mar, 1) * sizeof(unsigned int));
+	for (r = 0; r < n_mar; r++) s->mar_ij[r] = r;
+	s->pid = (int *)mxCalloc((size_t)n, sizeof(int));
+	s->ppid = (int)getpid();
+
+	fflush(NULL);		/* Otherwise what is still buffered would be written by every process */
+	for (r = 1; r < n; r++) {
+		if ((pid = (int)fork()) == 0) {
+			s->rank = r;
+			break;
+		}
+		if (pid < 0) {
+			mexPrintf("NSWING: Error, could not start the process of strip %d (-d option)\n", r);
+			s->shm->failed = TRUE;	/* The ones already started give up at their first barrier */
+			return (-1);
+		}
+		s->pid[r] = pid;
+	}
+
+	base = hdr.ny / n;		rem = hdr.ny % n;
+	g0 = s->rank * base + MIN(s->rank, rem);
+	g1 = g0 + base + (s->rank < rem);
+	s->row0   = MAX(0, g0 - STRIP_HALO);
+	s->n_rows = MIN(hdr.ny, g1 + STRIP_HALO) - s->row0;
+	s->own0   = g0 - s->row0;		s->own1 = g1 - s->row0;
+	return (0);
+#else
+	mexPrintf("NSWING: Error, this build cannot split the grid in strips (-d option)\n");
+	return (-1);
+#endif
+}
+
+/* ------------------------------------------------------------------------------ */
+int strip_end(struct strip_ctx *s) {
+	/* In strip 0, wait for the processes of the other strips. Returns -1 if one of them failed */
+	int bad = 0;
+#ifdef HAVE_STRIPS
+	int r, st;
+
+	if (s->rank == 0) {
+		for (r = 1; r < s->n; r++)
+			if (waitpid((pid_t)s->pid[r], &st, 0) < 0 || !WIFEXITED(st) || WEXITSTATUS(st) != 0) bad++;
+	}
+	munmap((void *)s->shm, s->map_len);
+#endif
+	mxFree(s->pid);		mxFree(s->mar_ij);
+	s->shm = NULL;
+	return ((bad) ? -1 : 0);
+}
+
+/* ------------------------------------------------------------------------------ */
+void strip_barrier(struct strip_ctx *s) {
+	/* Wait for the processes of all strips. The last one to arrive starts a new generation. The others spin
+	   on it, yielding the CPU, and then sleep in short naps if it takes long (e.g. while strip 0 writes).
+	   Every second they check that the others are still alive (strip 0 checks its children and these check
+	   their parent). If one died the run cannot be completed, so all give up. No locks are used so that a
+	   process that dies at any point cannot leave the others blocked. Strip 0 only peeks at its children
+	   (WNOWAIT), so that one that ended normally after the last barrier is still there for strip_end(). */
+#ifdef HAVE_STRIPS
+	int    gen, r, n_spin = 0;
+	time_t t_last = time(NULL);
+	siginfo_t info;
+	struct timespec nap = {0, 100000};
+	struct strip_shm *h = s->shm;
+
+	gen = h->gen;
+	if (__sync_add_and_fetch(&h->n_in, 1) == s->n) {
+		h->n_in = 0;
+		__sync_add_and_fetch(&h->gen, 1);
+	}
+	while (h->gen == gen && !h->failed) {
+		if (++n_spin < 1000) {
+			sched_yield();
+			continue;
+		}
+		nanosleep(&nap, NULL);
+		if (h->gen != gen || time(NULL) == t_last) continue;	/* Released while napping, or checked recently */
+		t_last = time(NULL);
+		if (s->rank == 0) {
+			for (r = 1; r < s->n; r++) {
+				info.si_pid = 0;
+				if (waitid(P_PID, (id_t)s->pid[r], &info, WEXITED | WNOHANG | WNOWAIT) != 0 || info.si_pid != 0)
+					h->failed = TRUE;
+			}
+		}
+		else if ((int)getppid() != s->ppid)
+			h->failed = TRUE;
+	}
+	__sync_synchronize();		/* See what the others wrote before the barrier */
+	if (h->failed) {
+		mexPrintf("NSWING: Error, the process of a strip died (-d option). Giving up in strip %d\n", s->rank);
+		exit(EXIT_FAILURE);
+	}
+#endif
+}
+
+/* ------------------------------------------------------------------------------ */
+void strip_exchange(struct nestContainer *nest) {
+	/* Refresh the halo rows of this strip with the rows computed by its neighbours. Each strip first copies
+	   its STRIP_HALO owned rows next to each border to its mailboxes and, once all did it, copies those of the
+	   neighbours to its halo rows. All the state arrays (not only the 'a' ones) go, so that the halo rows are
+	   exactly those of a single process run. Consecutive steps use different mailboxes, so that a strip that
+	   runs ahead does not overwrite what a slower neighbour did not read yet. One barrier per step is enough. */
+	int    n;
+	size_t nx = nest->hdr[0].nx, blk = STRIP_HALO * nx, len = blk * sizeof(real);
+	real  *a[8], *box;
+	struct strip_ctx *s = nest->strip;
+
+	a[0] = nest->etaa[0];		a[1] = nest->etad[0];
+	a[2] = nest->fluxm_a[0];	a[3] = nest->fluxm_d[0];
+	a[4] = nest->fluxn_a[0];	a[5] = nest->fluxn_d[0];
+	a[6] = nest->htotal_a[0];	a[7] = nest->htotal_d[0];
+
+#define STRIP_BOX(rank,side) &s->box[(((size_t)(rank) * 2 + (side)) * 2 + s->parity) * s->box_len]
+	if (s->rank > 0)              /* First owned rows. The north halo of the strip below */
+		for (n = 0, box = STRIP_BOX(s->rank, 0); n < 8; n++)
+			memcpy(&box[n * blk], &a[n][s->own0 * nx], len);
+	if (s->rank < s->n - 1)       /* Last owned rows. The south halo of the strip above */
+		for (n = 0, box = STRIP_BOX(s->rank, 1); n < 8; n++)
+			memcpy(&box[n * blk], &a[n][(s->own1 - STRIP_HALO) * nx], len);
+
+	strip_barrier(s);
+
+	if (s->rank > 0)
+		for (n = 0, box = STRIP_BOX(s->rank - 1, 1); n < 8; n++)
+			memcpy(&a[n][(s->own0 - STRIP_HALO) * nx], &box[n * blk], len);
+	if (s->rank < s->n - 1)
+		for (n = 0, box = STRIP_BOX(s->rank + 1, 0); n < 8; n++)
+			memcpy(&a[n][s->own1 * nx], &box[n * blk], len);
+#undef STRIP_BOX
+	s->parity = !s->parity;
+}
+
+/* ------------------------------------------------------------------------------ */
+float *strip_gather(struct nestContainer *nest, float *work) {
+	/* Collect the owned rows of a level 0 grid of floats from all the strips. Returns the whole grid in strip 0
+	   and NULL in the others, which then have nothing to write. Without strips it just returns WORK. */
+	size_t nx = nest->hdr[0].nx;
+	struct strip_ctx *s = nest->strip;
+
+	if (s == NULL) return (work);
+	strip_barrier(s);		/* Strip 0 is done with the previous grid */
+	memcpy(&s->img[(s->row0 + s->own0) * nx], &work[s->own0 * nx], (s->own1 - s->own0) * nx * sizeof(float));
+	strip_barrier(s);
+	return ((s->rank == 0) ? s->img : NULL);
+}
+
+/* ------------------------------------------------------------------------------ */
+unsigned int *strip_maregs(struct nestContainer *nest, unsigned int *lcum_p, int n_mareg, real **eta, real **htotal,
+                           real **vx, real **vy, real **bat) {
+	/* Collect the values at the maregraphs from the strips that own them. On return the arrays pointed by the
+	   five pointers (those that are not NULL) have one value per maregraph, in their order, and the returned
+	   array replaces lcum_p to index them. */
+	int    a, m, row;
+	unsigned int nx = nest->hdr[0].nx;
+	real **v[5];
+	struct strip_ctx *s = nest->strip;
+
+	v[0] = eta;		v[1] = htotal;		v[2] = vx;		v[3] = vy;		v[4] = bat;
+	strip_barrier(s);		/* Strip 0 is done with the previous values */
+	for (m = 0; m < n_mareg; m++) {
+		row = (int)(lcum_p[m] / nx) - s->row0;
+		if (row < s->own0 || row >= s->own1) continue;
+		for (a = 0; a < 5; a++)
+			if (v[a] && *v[a]) s->mar[a * s->n_mar + m] = (*v[a])[lcum_p[m] - (unsigned int)s->row0 * nx];
+	}
+	strip_barrier(s);
+	for (a = 0; a < 5; a++)
+		if (v[a] && *v[a]) *v[a] = &s->mar[a * s->n_mar];
+	return (s->mar_ij);
+}
+
+/* ------------------------------------------------------------------------------ */
+double tm_clock(void) {
+	/* Wall clock in seconds. Without OpenMP, clock() is the best portable choice (it is CPU time on Unix) */
+#if HAVE_OPENMP
+	return (omp_get_wtime());
+#else
+	return ((double)clock() / CLOCKS_PER_SEC);
+#endif
+}
+
+/* ------------------------------------------------------------------------------ */
+void tm_add(struct phase_timers *tm, int phase, int lev, double t0, double cells) {
+	/* Account one call of PHASE of grid LEV that started at T0 and processed CELLS cells. Sibling grids
+	   run on different threads but each one only touches its own LEV entries. */
+	tm->secs[phase][lev]  += tm_clock() - t0;
+	tm->calls[phase][lev] += 1;
+	tm->cells[phase][lev] += cells;
+}
+
+/* ------------------------------------------------------------------------------ */
+int tm_report(struct phase_timers *tm, struct nestContainer *nest, int nNg, double t_loop, char *fname) {
+	/* Print the time spent in each phase of the main loop and, per grid, the cell updates per second.
+	   If FNAME, write the same table to it as JSON (if the name ends in .json) or CSV. */
+	static char *names[N_PHASES] = {"active_region", "mass_conservation", "openb", "edge_communication",
+	                                "moment_conservation", "upscale", "update", "update_max", "maregraphs",
+	                                "tracers", "write_grids", "write_netcdf", "checkpoint", "tiled_step",
+	                                "halo_exchange"};
+	int    ph, lev, first = TRUE, json;
+	double t_lev, t_all = 0, c_lev;
+	FILE  *fp = NULL;
+
+	mexPrintf("\nNSWING: Time per phase of the main loop (wall clock seconds)\n");
+	mexPrintf("%-20s %5s %10s %11s %7s %12s\n", "phase", "grid", "calls", "seconds", "% loop", "Mcells/s");
+	for (lev = 0; lev <= nNg; lev++) {
+		for (ph = 0, t_lev = 0; ph < N_PHASES; ph++) {
+			if (tm->calls[ph][lev] == 0) continue;
+			mexPrintf("%-20s %5d %10.0f %11.3f %7.2f %12.2f\n", names[ph], lev, tm->calls[ph][lev], tm->secs[ph][lev],
+			          (t_loop > 0) ? 100 * tm->secs[ph][lev] / t_loop : 0,
+			          (tm->secs[ph][lev] > 0) ? tm->cells[ph][lev] / tm->secs[ph][lev] * 1e-6 : 0);
+			t_lev += tm->secs[ph][lev];
+		}
+		/* The cell updates of a grid are the ones of its update() calls */
+		c_lev = tm->cells[PH_UPDATE][lev];
+		mexPrintf("%-20s %5d %10s %11.3f %7.2f %12.2f\n", "  grid total", lev, "", t_lev,
+		          (t_loop > 0) ? 100 * t_lev / t_loop : 0, (t_lev > 0) ? c_lev / t_lev * 1e-6 : 0);
+		t_all += t_lev;
+	}
+	mexPrintf("%-20s %5s %10s %11.3f %7.2f\n", "not accounted", "", "", t_loop - t_all,
+	          (t_loop > 0) ? 100 * (t_loop - t_all) / t_loop : 0);
+	mexPrintf("%-20s %5s %10s %11.3f\n", "main loop", "", "", t_loop);
+
+	if (!fname || !fname[0]) return (0);
+
+	if ((fp = fopen(fname, "w")) == NULL) {
+		mexPrintf("NSWING: Unable to create the timings file %s\n", fname);
+		return (-1);
+	}
+	json = (strlen(fname) > 5 && !strcmp(&fname[strlen(fname) - 5], ".json"));
+	if (json)
+		fprintf(fp, "{\n  \"loop_seconds\": %.6f,\n  \"phases\": [\n", t_loop);
+	else
+		fprintf(fp, "phase,grid,level,nx,ny,calls,seconds,cells,cells_per_second\n");
+	for (lev = 0; lev <= nNg; lev++) {
+		for (ph = 0; ph < N_PHASES; ph++) {
+			if (tm->calls[ph][lev] == 0) continue;
+			if (json) {
+				fprintf(fp, "%s    {\"phase\": \"%s\", \"grid\": %d, \"level\": %d, \"nx\": %d, \"ny\": %d, ",
+				        (first) ? "" : ",\n", names[ph], lev, nest->level[lev], nest->hdr[lev].nx, nest->hdr[lev].ny);
+				fprintf(fp, "\"calls\": %.0f, \"seconds\": %.6f, \"cells\": %.0f, \"cells_per_second\": %.1f}",
+				        tm->calls[ph][lev], tm->secs[ph][lev], tm->cells[ph][lev],
+				        (tm->secs[ph][lev] > 0) ? tm->cells[ph][lev] / tm->secs[ph][lev] : 0);
+			}
+			else
+				fprintf(fp, "%s,%d,%d,%d,%d,%.0f,%.6f,%.0f,%.1f\n", names[ph], lev, nest->level[lev], nest->hdr[lev].nx,
+				        nest->hdr[lev].ny, tm->calls[ph][lev], tm->secs[ph][lev], tm->cells[ph][lev],
+				        (tm->secs[ph][lev] > 0) ? tm->cells[ph][lev] / tm->secs[ph][lev] : 0);
+			first = FALSE;
 		}
 	}
+	if (json) fprintf(fp, "\n  ]\n}\n");
+	fclose(fp);
+	return (0);
 }
 
-/* --------------------------------------------------------------------------- */
-void total_energy(struct nestContainer *nest, float *work, int lev) {
-	/* Compute wave total energy according to 1/2*rho*H*u^2 + 1/2*rho*g*eta^2
-	   http://rspa.royalsocietypublishing.org/content/465/2103/725.full.pdf 
-	   http://arxiv.org/ct?url=http%3A%2F%2Fdx.doi.org%2F10%252E1098%2Frspa%252E2008%252E0332&v=9ed92a65 
-	*/
-	unsigned int ij;
+/* ------------------------------------------------------------------------------ */
+int compare_grids(char *name, unsigned int i_start, unsigned int j_start, unsigned int i_end, unsigned int j_end,
+                  unsigned int nX, float *work) {
+	/* Report the max and RMS differences between the (sub-region of) work and the grid stored in file 'name'.
+	   Used to validate a single precision build against a double precision one (or vice-versa). */
+	unsigned int i, j, ij = 0, n = 0;
+	int r_bin;
+	double dif, dif_max = 0, sum2 = 0;
+	real *ref;
+	struct srf_header hdr;
+
+	if ((r_bin = read_grd_info_ascii(name, &hdr)) < 0) return (-1);
+	if ((unsigned int)hdr.nx != (i_end - i_start) || (unsigned int)hdr.ny != (j_end - j_start)) {
+		mexPrintf("NSWING: Validation grid %s has not the same size as the max level one (%d x %d)\n",
+		          name, i_end - i_start, j_end - j_start);
+		return (-1);
+	}
+	if ((ref = (real *)mxCalloc((size_t)hdr.nx * (size_t)hdr.ny, sizeof(real))) == NULL)
+		{no_sys_mem("(ref)", hdr.nx * hdr.ny); return(-1);}
 
-	for (ij = 0; ij < nest->hdr[lev].nm; ij++) {
-		if (nest->htotal_d[lev][ij] > EPS2) {
-			work[ij] = (float)(( nest->etad[lev][ij] * nest->etad[lev][ij] * NORMAL_GRAV +
-			                   ((nest->fluxm_d[lev][ij] * nest->fluxm_d[lev][ij]) +
-			                    (nest->fluxn_d[lev][ij] * nest->fluxn_d[lev][ij])) /
-			                     nest->htotal_d[lev][ij] ) * 500);
+	if ((r_bin) ? read_grd_bin(name, &hdr, ref, 1) : read_grd_ascii(name, &hdr, ref, 1)) {
+		mxFree(ref);
+		return (-1);
+	}
+
+	for (j = j_start; j < j_end; j++) {
+		for (i = i_start; i < i_end; i++, ij++) {
+			dif = fabs((double)work[ijs(i,j,nX)] - ref[ij]);
+			if (dif != dif) continue;		/* NaN in either grid */
+			if (dif > dif_max) dif_max = dif;
+			sum2 += dif * dif;
+			n++;
 		}
 	}
+	mxFree(ref);
+
+	mexPrintf("NSWING: max level versus %s -> max diff = %g\tRMS diff = %g\t(%u nodes)\n",
+	          name, dif_max, (n) ? sqrt(sum2 / n) : 0., n);
+	return (0);
 }
 
-/* --------------------------------------------------------------------------- */
-int write_grd_bin(char *name, double x_min, double y_min, double x_inc, double y_inc, unsigned int i_start,
-	unsigned int j_start, unsigned int i_end, unsigned int j_end, unsigned int nX, float *work) {
+#ifdef HAVE_STRIPS
+/* ------------------------------------------------------------------------------ */
+double bench_bathy(int scn, double x, double y) {
+	/* Elevation (positive up) of the synthetic scenarios of the benchmark (-Y option) at X,Y given as fractions
+	   of the domain. 0 is a 4000 m deep flat basin, 1 a beach that goes up from -4000 m at X = 0.5 to -10 m at
+	   X = 0.85 and then, with a gentler slope, to +50 m at X = 1. 2 is the same beach with a 10 m deep harbour
+	   dug into it around Y = 0.5. */
+	if (scn == 0 || x < 0.5) return (-4000);
+	if (scn == 2 && x > 0.86 && x < 0.93 && fabs(y - 0.5) < 0.02) return (-10);
+	if (x < 0.85) return (-4000 + 3990 * (x - 0.5) / 0.35);
+	return (-10 + 60 * (x - 0.85) / 0.15);
+}
 
-	/* Writes a grid in the Surfer binary format */
-	unsigned int i, j;
-	double x_max, y_max;
-	float work_min = FLT_MAX, work_max = -FLT_MAX, tmp;
-	struct srf_header h;
-	FILE *fp;
+/* ------------------------------------------------------------------------------ */
+int bench_grid(char *name, int scn, struct grd_header *h, double Lx, double Ly) {
+	/* Write the bathymetry of scenario SCN on the nodes of H to the binary grid NAME. Lx, Ly are the domain sizes */
+	int   i, j;
+	float *z;
 
-	if ((fp = fopen (name, "wb")) == NULL) {
-		mexPrintf("Fatal Error: Could not create file %s!\n", name);
+	if ((z = (float *)mxCalloc((size_t)h->nx * (size_t)h->ny, sizeof(float))) == NULL) {
+		no_sys_mem("(bench_grid)", (unsigned int)h->nx * h->ny);
 		return (-1);
 	}
+	for (j = 0; j < h->ny; j++)
+		for (i = 0; i < h->nx; i++)
+			z[ijs(i,j,h->nx)] = (float)bench_bathy(scn, (h->x_min + i * h->x_inc) / Lx, (h->y_min + j * h->y_inc) / Ly);
+	i = write_grd_bin(name, h->x_min, h->y_min, h->x_inc, h->y_inc, 0, 0, h->nx, h->ny, h->nx, z);
+	mxFree(z);
+	return (i);
+}
 
-	x_max = x_min + (i_end - i_start - 1) * x_inc;
-	y_max = y_min + (j_end - j_start - 1) * y_inc;
+/* ------------------------------------------------------------------------------ */
+void bench_child(struct grd_header *p, struct grd_header *c, double fx0, double fx1, double fy0, double fy1, int r) {
+	/* Header C of a grid nested in P with a refinement of R, over the cells of P between the fractions
+	   FX0, FX1 and FY0, FY1 of its width and height. The nodes of C are the centers of its cells, so it
+	   starts half a cell of P plus half a cell of C inside the first node of P that it covers. */
+	int i0, j0;
+
+	i0 = (int)(fx0 * (p->nx - 1));		j0 = (int)(fy0 * (p->ny - 1));
+	c->nx = (int)((fx1 - fx0) * (p->nx - 1)) * r;
+	c->ny = (int)((fy1 - fy0) * (p->ny - 1)) * r;
+	c->x_inc = p->x_inc / r;			c->y_inc = p->y_inc / r;
+	c->x_min = p->x_min + (i0 + 0.5) * p->x_inc + c->x_inc / 2;
+	c->y_min = p->y_min + (j0 + 0.5) * p->y_inc + c->y_inc / 2;
+	c->nm = (unsigned int)c->nx * (unsigned int)c->ny;
+}
 
-	/* Find zmin/zmax */
-	for (j = j_start; j < j_end; j++) {
-		for (i = i_start; i < i_end; i++) {
-			tmp = work[ijs(i,j,nX)];
-			work_max = MAX(tmp, work_max);
-			work_min = MIN(tmp, work_min);
-		}
+/* ------------------------------------------------------------------------------ */
+int bench_checksum(char *name, uint64_t *sum, double *z_max) {
+	/* FNV-1a (64 bits) hash of the values of the binary grid NAME and their max (NaNs excluded). The values are
+	   the floats of the file, so a double and a single precision build can be compared with it. */
+	size_t i, n;
+	unsigned char *c;
+	float *z;
+	struct srf_header hdr;
+	FILE  *fp;
+
+	if ((fp = fopen(name, "rb")) == NULL) return (-1);
+	read_header_bin(fp, &hdr);
+	n = (size_t)hdr.nx * (size_t)hdr.ny;
+	z = (float *)mxCalloc(MAX(n, 1), sizeof(float));
+	if (fread((void *)z, sizeof(float), n, fp) != n) {
+		fclose(fp);		mxFree(z);
+		return (-1);
 	}
+	fclose(fp);
+	*sum = 14695981039346656037ULL;
+	for (i = 0, c = (unsigned char *)z; i < n * sizeof(float); i++) {
+		*sum ^= c[i];
+		*sum *= 1099511628211ULL;
+	}
+	for (i = 0, *z_max = -FLT_MAX; i < n; i++)
+		if (z[i] == z[i] && z[i] > *z_max) *z_max = z[i];
+	mxFree(z);
+	return (0);
+}
 
-	/* store header information and array */
-	strcpy (h.id,"DSBB");
-	h.nx = (i_end - i_start);	h.ny = (j_end - j_start);
-	h.x_min = x_min;		h.x_max = x_max;
-	h.y_min = y_min;		h.y_max = y_max;
-	h.z_min = (double)work_min;	h.z_max = (double)work_max;
+/* ------------------------------------------------------------------------------ */
+double bench_json(char *buf, char *phase, char *key) {
+	/* Sum, over all grids, of the KEY values of PHASE in the contents BUF of a -P<file>.json file */
+	char   pat[64], *p = buf, *q, *end;
+	double s = 0;
+
+	sprintf(pat, "\"phase\": \"%s\"", phase);
+	while ((p = strstr(p, pat)) != NULL) {
+		p += strlen(pat);
+		end = strchr(p, '}');
+		sprintf(pat, "\"%s\": ", key);
+		if ((q = strstr(p, pat)) != NULL && end && q < end) s += atof(q + strlen(pat));
+		sprintf(pat, "\"phase\": \"%s\"", phase);
+	}
+	return (s);
+}
 
-	if (fwrite ((void *)&h, sizeof (struct srf_header), (size_t)1, fp) != 1) {
-		fprintf (stderr, "Fatal Error: Error writing file %s!\n", name);
+/* ------------------------------------------------------------------------------ */
+int bench_exec(char **args, char *dir, char *log, double *peak_mb) {
+	/* Run the program ARGS in directory DIR with its output going to LOG. Returns its exit status (-1 if it could
+	   not be started or was killed) and, in PEAK_MB, the high-water mark of its resident memory */
+	int    st, fd;
+	pid_t  pid;
+	struct rusage ru;
+
+	fflush(NULL);
+	if ((pid = fork()) == 0) {
+		if (chdir(dir) || (fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) _exit(127);
+		dup2(fd, 1);		dup2(fd, 2);
+		execvp(args[0], args);
+		_exit(127);
+	}
+	if (pid < 0 || wait4(pid, &st, 0, &ru) < 0) return (-1);
+#ifdef __APPLE__
+	*peak_mb = ru.ru_maxrss / 1048576.0;	/* Bytes on macOS, KB on the others */
+#else
+	*peak_mb = ru.ru_maxrss / 1024.0;
+#endif
+	return ((WIFEXITED(st)) ? WEXITSTATUS(st) : -1);
+}
+
+/* ------------------------------------------------------------------------------ */
+int bench_ref(char *file, char *scn, int nx, char *path, char *prec, int cycles, double *mcps, char *sum) {
+	/* Find the line of the -Y...+o<file> table FILE with the same scenario, size, path, precision and cycles.
+	   Returns 1 and its speed and checksum if there is one. */
+	int    r_nx, r_ny, r_cycles, found = 0;
+	char   line[512], r_scn[32], r_path[32], r_prec[16], r_sum[32];
+	double r_cells, r_secs, r_mcps;
+	FILE  *fp;
+
+	if ((fp = fopen(file, "r")) == NULL) return (0);
+	while (!found && fgets(line, 512, fp)) {
+		if (sscanf(line, "%31[^,],%d,%d,%lf,%31[^,],%15[^,],%d,%lf,%lf,%*f,%*f,%31s", r_scn, &r_nx, &r_ny,
+		           &r_cells, r_path, r_prec, &r_cycles, &r_secs, &r_mcps, r_sum) != 10) continue;
+		if (strcmp(r_scn, scn) || r_nx != nx || strcmp(r_path, path) || strcmp(r_prec, prec) || r_cycles != cycles)
+			continue;
+		*mcps = r_mcps;
+		strcpy(sum, r_sum);
+		found = 1;
+	}
+	fclose(fp);
+	return (found);
+}
+
+/* ------------------------------------------------------------------------------ */
+int bench_run(char *prog, char *spec) {
+	/* The -Y option. Build the synthetic scenarios at each size, run them with every kernel path of this build
+	   for a fixed number of cycles and report the cell updates per second of the main loop, the memory
+	   high-water mark and a checksum of the max level grid. The paths must all give the same checksum, and
+	   with +r it is also checked against a table saved before with +o. Returns the number of failed checks. */
+	static char *scn_name[3] = {"flat", "beach", "harbour"};
+	static char *var_name[6] = {"serial", "simd", "tiled", "active", "strips", "threads"};
+	int    n_sizes = 0, sizes[16], cycles = 200, n_threads = 1, keep = FALSE, n_bad = 0, n_lev, lev;
+	int    scn, is, iv, nA, st;
+	char   scns[8] = "fbh", out[256] = "", ref[256] = "", exe[4096], *pch, *args[24], opt[8][128], name[256];
+	char   log[64], sum_txt[32], r_sum[32], *buf, note[128];
+	char  *prec;
+	double Lx = 200000, Ly, dt, secs, cells, mcps, peak, z_max, r_mcps, cells_grid;
+	uint64_t sum, sum_serial = 0;
+	struct grd_header h[3];
+	FILE  *fp, *fp_out = NULL;
+
+#ifdef SINGLE_PRECISION
+	prec = "single";
+#else
+	prec = "double";
+#endif
+#if HAVE_OPENMP
+	n_threads = omp_get_num_procs();
+#endif
+
+	/* -Y[<n1>[/<n2>...]][,<cycles>][+s<fbh>][+j<n>][+o<file>][+r<file>][+k] */
+	for (pch = spec; *pch >= '0' && *pch <= '9' && n_sizes < 16; ) {
+		sizes[n_sizes++] = (int)strtol(pch, &pch, 10);
+		if (*pch == '/') pch++;
+	}
+	if (*pch == ',') cycles = (int)strtol(pch + 1, &pch, 10);
+	if (*pch && *pch != '+') {
+		mexPrintf("NSWING: Error, -Y option, could not decode %s\n", spec);
 		return (-1);
 	}
+	while ((pch = strchr(pch, '+')) != NULL) {
+		pch++;
+		if (pch[0] == 's')      sscanf(&pch[1], "%7[fbh]", scns);
+		else if (pch[0] == 'j') n_threads = atoi(&pch[1]);
+		else if (pch[0] == 'o') sscanf(&pch[1], "%255[^+]", out);
+		else if (pch[0] == 'r') sscanf(&pch[1], "%255[^+]", ref);
+		else if (pch[0] == 'k') keep = TRUE;
+		else {
+			mexPrintf("NSWING: Error, -Y option, unknown modifier +%c\n", pch[0]);
+			return (-1);
+		}
+	}
+	if (n_sizes == 0) {
+		sizes[0] = 256;		sizes[1] = 1024;
+		n_sizes = 2;
+	}
+	for (is = 0; is < n_sizes; is++) {
+		if (sizes[is] < 64 || sizes[is] > 32766) {
+			mexPrintf("NSWING: Error, -Y option, the sizes must be between 64 and 32766 (got %d)\n", sizes[is]);
+			return (-1);
+		}
+	}
+	if (cycles < 1) cycles = 1;
+	n_threads = MAX(n_threads, 1);
 
-	for (j = j_start; j < j_end; j++)
-		for (i = i_start; i < i_end; i++)
-			fwrite ((void *)&work[ijs(i,j,nX)], sizeof(float), (size_t)1, fp);
+	/* The runs start in the benchmark directory, so a relative name of this program would not be found there */
+	if (!strchr(prog, '/') || !realpath(prog, exe)) strncpy(exe, prog, 4095);
+	if (mkdir(BENCH_DIR, 0755) && errno != EEXIST) {
+		mexPrintf("NSWING: Error, -Y option, could not create the directory %s\n", BENCH_DIR);
+		return (-1);
+	}
+	if (out[0] && (fp_out = fopen(out, "w")) == NULL) {
+		mexPrintf("NSWING: Error, -Y option, could not create the file %s\n", out);
+		return (-1);
+	}
+	if (fp_out)
+		fprintf(fp_out, "scenario,nx,ny,cells,path,precision,cycles,seconds,mcells_per_second,peak_mb,max_level,checksum\n");
+
+	mexPrintf("NSWING benchmark: %s precision build, %d cycles per run, %d thread(s) for the threads and strips paths\n",
+	          prec, cycles, n_threads);
+	mexPrintf("%-8s %11s %10s %-8s %9s %8s %8s %8s  %-16s\n", "scenario", "base grid", "cells", "path", "Mcells/s",
+	          "seconds", "peak MB", "max (m)", "checksum");
+
+	for (scn = 0; scn < 3; scn++) {
+		if (!strchr(scns, "fbh"[scn])) continue;
+		for (is = 0; is < n_sizes; is++) {
+			/* The grids. The domain is always 200 km wide, so the bigger sizes are finer, not larger, grids */
+			h[0].nx = sizes[is];		h[0].ny = (scn == 0) ? sizes[is] : sizes[is] / 2;
+			h[0].x_min = h[0].y_min = 0;
+			h[0].x_inc = h[0].y_inc = Lx / (h[0].nx - 1);
+			h[0].nm = (unsigned int)h[0].nx * (unsigned int)h[0].ny;
+			Ly = h[0].y_inc * (h[0].ny - 1);
+			n_lev = 1;
+			if (scn == 2) {		/* The coast and then the harbour, each 3 times finer */
+				bench_child(&h[0], &h[1], 0.7, 0.98, 0.3, 0.7, 3);
+				bench_child(&h[1], &h[2], 0.5, 0.9, 0.35, 0.65, 3);
+				n_lev = 3;
+			}
+			for (lev = 0, cells_grid = 0; lev < n_lev; lev++) {
+				sprintf(name, "%s/l%d.grd", BENCH_DIR, lev);
+				if (bench_grid(name, scn, &h[lev], Lx, Ly)) return (-1);
+				cells_grid += h[lev].nm;
+			}
+			dt = 0.5 * h[0].x_inc / sqrt(NORMAL_GRAV * 4000);
+
+			/* The Okada source. A 60 x 30 km thrust, in the middle of the basin or on the slope of the beach */
+			sprintf(opt[0], "-F20/0/90/5/60/30/5/%.0f/%.0f", Lx * ((scn == 0) ? 0.5 : 0.7), Ly / 2 - 30000);
+			sprintf(opt[1], "-t%.6g", dt);
+			sprintf(opt[2], "-N%d", cycles);
+			sprintf(opt[3], "-Gb+%d,%d", n_lev - 1, cycles);
+			sprintf(opt[4], "-j%d", n_threads);
+			sprintf(opt[5], "-d%d", MAX(n_threads, 2));
+			nA = 0;
+			args[nA++] = exe;		args[nA++] = "l0.grd";
+			if (scn == 2) {
+				args[nA++] = "-1l1.grd";	args[nA++] = "-2l2.grd";
+			}
+			args[nA++] = opt[0];	args[nA++] = opt[1];	args[nA++] = opt[2];	args[nA++] = opt[3];
+			args[nA++] = "-M";		args[nA++] = "-J1e30";	/* Only the max level grid is written */
+			args[nA++] = "-Pt.json";
+
+			for (iv = 0; iv < 6; iv++) {
+				st = nA;
+				args[st++] = (iv == 5) ? opt[4] : "-j1";
+				if (iv == 1) args[st++] = "-s";
+				else if (iv == 2) args[st++] = "-k";
+				else if (iv == 3) args[st++] = "-a";
+				else if (iv == 4) args[st++] = opt[5];
+				args[st] = NULL;
+#if !HAVE_OPENMP
+				if (iv >= 4) continue;		/* No threads and clock() would only count the CPU time of the first strip */
+#endif
+				if (scn == 2 && (iv == 2 || iv == 4)) continue;	/* These are not used with nested grids */
+
+				sprintf(name, "%s/t.json", BENCH_DIR);		remove(name);
+				sprintf(name, "%s/b_max.grd", BENCH_DIR);	remove(name);
+				sprintf(log, "%s_%d_%s.log", scn_name[scn], sizes[is], var_name[iv]);
+				if ((st = bench_exec(args, BENCH_DIR, log, &peak)) != 0 || bench_checksum(name, &sum, &z_max)) {
+					mexPrintf("%-8s %5dx%-5d %10.0f %-8s  FAILED (status %d), see %s/%s\n", scn_name[scn], h[0].nx,
+					          h[0].ny, cells_grid, var_name[iv], st, BENCH_DIR, log);
+					n_bad++;
+					continue;
+				}
+				sprintf(name, "%s/%s", BENCH_DIR, log);		remove(name);
+
+				/* The cell updates of the main loop and its time, without the one spent writing the max grid */
+				sprintf(name, "%s/t.json", BENCH_DIR);
+				secs = cells = 0;
+				if ((fp = fopen(name, "rb")) != NULL) {
+					fseek(fp, 0, SEEK_END);		st = (int)ftell(fp);		rewind(fp);
+					buf = (char *)mxCalloc((size_t)st + 1, 1);
+					fread((void *)buf, 1, (size_t)st, fp);
+					fclose(fp);
+					if ((pch = strstr(buf, "\"loop_seconds\": ")) != NULL) secs = atof(pch + 16);
+					secs -= bench_json(buf, "write_grids", "seconds");
+					cells = bench_json(buf, "update", "cells");
+					mxFree(buf);
+				}
+				if (iv == 4) cells = (double)h[0].nm * cycles;	/* The timings file has only the first strip cells */
+				mcps = (secs > 0) ? cells / secs * 1e-6 : 0;
+
+				sprintf(sum_txt, "%016llx", (unsigned long long)sum);
+				note[0] = '\0';
+				if (iv == 0)
+					sum_serial = sum;
+				else if (sum != sum_serial) {
+					strcat(note, "  DIFFERS from serial");
+					n_bad++;
+				}
+				if (ref[0] && bench_ref(ref, scn_name[scn], h[0].nx, var_name[iv], prec, cycles, &r_mcps, r_sum)) {
+					sprintf(&note[strlen(note)], "  %.2fx ref", (r_mcps > 0) ? mcps / r_mcps : 0);
+					if (strcmp(r_sum, sum_txt)) {
+						strcat(note, ", DIFFERS from ref");
+						n_bad++;
+					}
+				}
+				mexPrintf("%-8s %5dx%-5d %10.0f %-8s %9.2f %8.3f %8.1f %8.4f  %s%s\n", scn_name[scn], h[0].nx, h[0].ny,
+				          cells_grid, var_name[iv], mcps, secs, peak, z_max, sum_txt, note);
+				if (fp_out)
+					fprintf(fp_out, "%s,%d,%d,%.0f,%s,%s,%d,%.6f,%.3f,%.1f,%.6f,%s\n", scn_name[scn], h[0].nx, h[0].ny,
+					        cells_grid, var_name[iv], prec, cycles, secs, mcps, peak, z_max, sum_txt);
+			}
+		}
+	}
+	if (fp_out) fclose(fp_out);
 
-	fclose(fp);
-	return (0);
+	if (!keep) {
+		for (lev = 0; lev < 3; lev++) {
+			sprintf(name, "%s/l%d.grd", BENCH_DIR, lev);		remove(name);
+		}
+		sprintf(name, "%s/t.json", BENCH_DIR);		remove(name);
+		sprintf(name, "%s/b_max.grd", BENCH_DIR);	remove(name);
+		rmdir(BENCH_DIR);		/* Fails, and so keeps them, if there are logs of failed runs */
+	}
+	if (n_bad)
+		mexPrintf("NSWING benchmark: %d run(s) failed or changed the max level grid\n", n_bad);
+	return (n_bad);
 }
+#endif
 
 /* ------------------------------------------------------------------------------ */
 int read_grd_info_ascii(char *file, struct srf_header *hdr) {
@@ -2635,11 +5126,18 @@ int read_grd_info_ascii(char *file, struct srf_header *hdr) {
 }
 
 /* ------------------------------------------------------------------------------ */
-int read_grd_ascii(char *file, struct srf_header *hdr, double *work, int sign) {
+int read_grd_ascii(char *file, struct srf_header *hdr, real *work, int sign) {
+	return (read_grd_ascii_rows(file, hdr, work, sign, 0, 0));
+}
+
+/* ------------------------------------------------------------------------------ */
+int read_grd_ascii_rows(char *file, struct srf_header *hdr, real *work, int sign, int row0, int n_rows) {
 	/* sign is either +1 or -1, in case one wants to revert sign of the imported grid */
 
-	/* Reads a grid in the Surfer ascii format */
-	unsigned int i = 0, j, n_field;
+	/* Reads the rows [row0, row0 + n_rows[ of a grid in the Surfer ascii format (all if n_rows == 0). hdr is then
+	   that of the rows read. */
+	unsigned int i = 0, j, n_field, i0, i1;
+	double z, dy;
 	char *p, buffer[512], line[512];
 	FILE *fp;
 
@@ -2659,20 +5157,30 @@ int read_grd_ascii(char *file, struct srf_header *hdr, double *work, int sign) {
 	fgets (line, 512, fp);
 	sscanf (line, "%lf %lf", &hdr->z_min, &hdr->z_max);
 
-	while (fgets (line, 512, fp) != NULL) {
+	if (n_rows <= 0) n_rows = hdr->ny - row0;
+	i0 = (unsigned int)row0 * hdr->nx;		i1 = i0 + (unsigned int)n_rows * hdr->nx;
+	while (fgets (line, 512, fp) != NULL && i < i1) {
 		strcpy (buffer, line);
 		n_field = count_col (buffer);	/* Count # of fields in line */
 		if (n_field == 0) continue;
 		p = (char *)strtok (line, " \t\n\015\032");
 		j = 0;
 		while (p && j < n_field) {
-			sscanf (p, "%lf", &work[i]);
-			work[i] *= sign;
+			if (i >= i0 && i < i1) {
+				sscanf (p, "%lf", &z);
+				work[i - i0] = (real)(z * sign);
+			}
 			j++;	i++;
 			p = (char *)strtok ((char *)NULL, " \t\n\015\032");
 		}
 	}
 	fclose(fp);
+
+	if (n_rows < hdr->ny) {
+		dy = (hdr->y_max - hdr->y_min) / (hdr->ny - 1);
+		hdr->y_min += row0 * dy;		hdr->y_max = hdr->y_min + (n_rows - 1) * dy;
+		hdr->ny = n_rows;
+	}
 	return (0);
 } 
 
@@ -2698,10 +5206,17 @@ int read_header_bin(FILE *fp, struct srf_header *hdr) {
 }
 
 /* -------------------------------------------------------------------- */
-int read_grd_bin(char *file, struct srf_header *hdr, double *work, int sign) {
+int read_grd_bin(char *file, struct srf_header *hdr, real *work, int sign) {
+	return (read_grd_bin_rows(file, hdr, work, sign, 0, 0));
+}
+
+/* -------------------------------------------------------------------- */
+int read_grd_bin_rows(char *file, struct srf_header *hdr, real *work, int sign, int row0, int n_rows) {
 	/* sign is either +1 or -1, in case one wants to revert sign of the imported grid */
+	/* Only reads the rows [row0, row0 + n_rows[ (all if n_rows == 0). hdr is then that of the rows read. */
 	int i, j;
 	unsigned int ij, kk;
+	double	dy;
 	float	*tmp;			/* Array pointer for reading in rows of data */
 	FILE	*fp;
 
@@ -2711,9 +5226,13 @@ int read_grd_bin(char *file, struct srf_header *hdr, double *work, int sign) {
 	}
 	fread ((void *)hdr, sizeof (struct srf_header), (size_t)1, fp); 
 
+	if (n_rows <= 0) n_rows = hdr->ny - row0;
+	if (row0 > 0)
+		fseek64(fp, (int64_t)sizeof(struct srf_header) + (int64_t)row0 * hdr->nx * sizeof(float), SEEK_SET);
+
 	/* Allocate memory for one row of data (for reading purposes) */
 	tmp = (float *) mxMalloc ((size_t)hdr->nx * sizeof (float));
-	for (j = 0; j < hdr->ny; j++) {
+	for (j = 0; j < n_rows; j++) {
 		fread (tmp, sizeof (float), (size_t)hdr->nx, fp);	/* Get one row */
 		ij = j * hdr->nx;
 		for (i = 0; i < hdr->nx; i++) {
@@ -2724,6 +5243,11 @@ int read_grd_bin(char *file, struct srf_header *hdr, double *work, int sign) {
 	fclose(fp);
 	mxFree ((void *)tmp);
 
+	if (n_rows < hdr->ny) {
+		dy = (hdr->y_max - hdr->y_min) / (hdr->ny - 1);
+		hdr->y_min += row0 * dy;		hdr->y_max = hdr->y_min + (n_rows - 1) * dy;
+		hdr->ny = n_rows;
+	}
 	return (0);
 }
 
@@ -2791,7 +5315,7 @@ int read_maregs(struct grd_header hdr, char *file, unsigned int *lcum_p, char *n
 /* -------------------------------------------------------------------- */
 int read_tracers(struct grd_header hdr, char *file, struct tracers *oranges) {
 	/* Read tracers positions */
-	int     i = 0, k = 0, ix, jy, n;
+	int     i = 0, k = 0, n;
 	char    line[256];
 	double  x, y;
 	FILE   *fp;
@@ -2815,14 +5339,109 @@ int read_tracers(struct grd_header hdr, char *file, struct tracers *oranges) {
 		if (x < hdr.x_min || x > hdr.x_max || y < hdr.y_min || y > hdr.y_max)
 			continue;
 
-		oranges[i].x[0] = x;
-		oranges[i].y[0] = y;
+		oranges->x[i] = x;
+		oranges->y[i] = y;
 		i++;
 	}
 	fclose (fp);
 	return (i);
 }
 
+/* -------------------------------------------------------------------- */
+void advect_tracers(struct tracers *o, struct grd_header hdr, real *vx_for_oranges, real *vy_for_oranges,
+                    real *htotal, double dt) {
+	/* Move the tracers one time step with the velocity interpolated (bilinear) at their positions. First
+	   find the cells of all of them in a loop that the compiler vectorizes, then gather the velocities of
+	   the cell corners. Tracers that left the grid (or that are on its last row or column) stay put. */
+	int n, nx = hdr.nx;
+	double x_min = hdr.x_min, y_min = hdr.y_min, x_inc = hdr.x_inc, y_inc = hdr.y_inc;
+	double *RESTRICT x = o->x, *RESTRICT y = o->y;
+	int    *RESTRICT cell = o->cell;
+
+#if HAVE_OPENMP && _OPENMP >= 201307
+#pragma omp simd
+#endif
+	for (n = 0; n < o->n; n++) {
+		double xr = (x[n] - x_min) / x_inc, yr = (y[n] - y_min) / y_inc;
+		cell[n] = (xr >= 0 && yr >= 0 && xr < nx - 1 && yr < hdr.ny - 1) ? (int)yr * nx + (int)xr : -1;
+	}
+
+#if HAVE_OPENMP
+#pragma omp parallel for if (o->n > 4096)
+#endif
+	for (n = 0; n < o->n; n++) {
+		int    ij_c = cell[n];
+		double vx, vy, vx1, vx2, vy1, vy2, dx, dy;
+		double v_LLx, v_LLy, v_LRx, v_LRy, v_ULx, v_ULy, v_URx, v_URy;
+
+		if (ij_c < 0) continue;
+		dx = x[n] - (x_min + (ij_c % nx) * x_inc);
+		dy = y[n] - (y_min + (ij_c / nx) * y_inc);
+
+		if (htotal[ij_c] > EPS2 && htotal[ij_c + 1] > EPS2) {			/* LowerLeft and LowerRight corners */
+			v_LLx = vx_for_oranges[ij_c];		v_LLy = vy_for_oranges[ij_c];
+			v_LRx = vx_for_oranges[ij_c+1];		v_LRy = vy_for_oranges[ij_c+1];
+		}
+		else
+			v_LLx = v_LLy = v_LRx = v_LRy = 0;
+
+		ij_c += nx;
+		if (htotal[ij_c] > EPS2 && htotal[ij_c + 1] > EPS2) {			/* UpperLeft and UpperRight corners */
+			v_ULx = vx_for_oranges[ij_c];		v_ULy = vy_for_oranges[ij_c];
+			v_URx = vx_for_oranges[ij_c+1];		v_URy = vy_for_oranges[ij_c+1];
+		}
+		else
+			v_ULx = v_ULy = v_URx = v_URy = 0;
+
+		dx /= x_inc;
+		dy /= y_inc;
+
+		vx1 = v_LLx + (v_LRx - v_LLx) * dx;		vx2 = v_ULx + (v_URx - v_ULx) * dx;
+		vy1 = v_LLy + (v_ULy - v_LLy) * dy;		vy2 = v_LRy + (v_URy - v_LRy) * dy;
+		vx  = vx1 + (vx2 - vx1) * dy;			vy  = vy1 + (vy2 - vy1) * dx;
+
+		x[n] += vx * dt;
+		y[n] += vy * dt;
+	}
+}
+
+/* -------------------------------------------------------------------- */
+void write_tracers(struct nestContainer *nest, struct tracers *o, double t) {
+	/* Write the current positions of the tracers. In the ASCII table a line with the time and the x,y of all
+	   of them. In the netCDF file only the ones that are inside the grid are appended to the ragged array. */
+	int n;
+
+	if (o->ncid < 0) {
+		fprintf(o->fp, "%.2f", t);
+		for (n = 0; n < o->n; n++)
+			fprintf(o->fp, "\t%.5f\t%.5f", o->x[n], o->y[n]);
+		fprintf(o->fp, "\n");
+		return;
+	}
+#ifdef HAVE_NETCDF
+	{
+		int    m = 0;
+		size_t start[1], count[1];
+		double *tt = o->buf, *id = &o->buf[o->n], *xx = &o->buf[2*o->n], *yy = &o->buf[3*o->n];
+		struct grd_header hdr = nest->hdr[nest->writeLevel];
+
+		for (n = 0; n < o->n; n++) {
+			if (o->x[n] < hdr.x_min || o->x[n] > hdr.x_max || o->y[n] < hdr.y_min || o->y[n] > hdr.y_max)
+				continue;
+			tt[m] = t;	id[m] = n;	xx[m] = o->x[n];	yy[m] = o->y[n];
+			m++;
+		}
+		if (m == 0) return;
+		start[0] = o->n_obs;	count[0] = m;
+		put_vara_double(nest->aw, o->ncid, o->ids[0], 1, start, count, tt);
+		put_vara_double(nest->aw, o->ncid, o->ids[1], 1, start, count, id);
+		put_vara_double(nest->aw, o->ncid, o->ids[2], 1, start, count, xx);
+		put_vara_double(nest->aw, o->ncid, o->ids[3], 1, start, count, yy);
+		o->n_obs += m;
+	}
+#endif
+}
+
 /* -------------------------------------------------------------------- */
 int read_bnc_file(struct nestContainer *nest, char *file) {
 	/* Read file with a boundary condition time series */
@@ -3050,15 +5669,17 @@ double ddmmss_to_degree(char *text) {
 int open_most_nc(struct nestContainer *nest, float *work, char *base, char *name_var, char hist[], int *ids,
 	unsigned int nx, unsigned int ny, double xMinOut, double yMinOut, int isMost, int lev) {
 	/* Open and initialize a generic 3D or a MOST netCDF file for writing.
-	   When generic 3D file also writes the bathymetry grid right away.
+	   When generic 3D file also writes the bathymetry grid right away (the caller puts it in WORK).
 	   Returns the ncid of the opened file.
 	*/
 	char    *long_name = NULL, *units = NULL, *basename = NULL;
-	int      ncid = -1, status, dim0[3], dim3[3], id;
-	unsigned int m, n, ij;
-	float    dummy = -1e34f;
+	int      ncid = -1, status, dim0[3], dim3[3], pack = (nest->nc_quant == 'p' && !isMost);
+	unsigned int m, n;
+	float    dummy = -1e34f, nan = (float)mxGetNaN();
 	double  *x, *y;
 
+	if (nan == 0) nan = (float)loc_nan.d;	/* Dirty hack. With the Intel compiler for example mxGetNaN() returns 0*/
+
 	basename = (char *)mxMalloc(strlen(base) * sizeof(char));
 	strcpy(basename, base);
 	if (!strcmp(name_var,"HA")) {
@@ -3100,19 +5721,19 @@ int open_most_nc(struct nestContainer *nest, float *work, char *base, char *name
 			err_trap(nc_def_var(ncid, "SLON",  NC_FLOAT, 0, &dim0[0], &ids[2]));
 			err_trap(nc_def_var(ncid, "SLAT",  NC_FLOAT, 0, &dim0[1], &ids[3]));
 			err_trap(nc_def_var(ncid, "time",  NC_DOUBLE,1, &dim0[2], &ids[4]));
-			err_trap(nc_def_var(ncid, name_var,NC_FLOAT, 3, dim3,     &ids[5]));
+			ids[5] = def_slice_var(nest, ncid, name_var, dim3, nx, ny, FALSE, dummy);
 		}
 		else {
 			err_trap(nc_def_var(ncid, "time",   NC_DOUBLE,1, &dim0[2], &ids[2]));
-			err_trap(nc_def_var(ncid, name_var, NC_FLOAT, 3, dim3,     &ids[3]));
+			ids[3] = def_slice_var(nest, ncid, name_var, dim3, nx, ny, pack, nan);
 			if (nest->out_momentum) {
-				err_trap(nc_def_var(ncid, "Mlon", NC_FLOAT,3, dim3,  &ids[5]));
-				err_trap(nc_def_var(ncid, "Mlat", NC_FLOAT,3, dim3,  &ids[6]));
+				ids[5] = def_slice_var(nest, ncid, "Mlon", dim3, nx, ny, pack, nan);
+				ids[6] = def_slice_var(nest, ncid, "Mlat", dim3, nx, ny, pack, nan);
 			}
 			if (nest->out_velocity_x)
-				err_trap(nc_def_var(ncid, "Vlon", NC_FLOAT,3, dim3,  &ids[5]));
+				ids[5] = def_slice_var(nest, ncid, "Vlon", dim3, nx, ny, pack, nan);
 			if (nest->out_velocity_y)
-				err_trap(nc_def_var(ncid, "Vlat", NC_FLOAT,3, dim3,  &ids[6]));
+				ids[6] = def_slice_var(nest, ncid, "Vlat", dim3, nx, ny, pack, nan);
 			dim3[0] = dim0[1];			dim3[1] = dim0[0];		/* Bathym array is rank 2 */
 			err_trap(nc_def_var(ncid, "bathymetry",NC_FLOAT,2, dim3,  &ids[4]));
 		}
@@ -3129,19 +5750,19 @@ int open_most_nc(struct nestContainer *nest, float *work, char *base, char *name
 			err_trap(nc_def_var(ncid, "SLON",  NC_FLOAT,0,  &dim0[0], &ids[2]));
 			err_trap(nc_def_var(ncid, "SLAT",  NC_FLOAT,0,  &dim0[1], &ids[3]));
 			err_trap(nc_def_var(ncid, "time",  NC_DOUBLE,1, &dim0[2], &ids[4]));
-			err_trap(nc_def_var(ncid, name_var,NC_FLOAT,3,  dim3,     &ids[5]));
+			ids[5] = def_slice_var(nest, ncid, name_var, dim3, nx, ny, FALSE, dummy);
 		}
 		else {
 			err_trap(nc_def_var(ncid, "time",  NC_DOUBLE,1, &dim0[2], &ids[2]));
-			err_trap(nc_def_var(ncid, name_var,NC_FLOAT,3,  dim3,     &ids[3]));
+			ids[3] = def_slice_var(nest, ncid, name_var, dim3, nx, ny, pack, nan);
 			if (nest->out_momentum) {
-				err_trap(nc_def_var(ncid, "Mx",NC_FLOAT,3, dim3,  &ids[5]));
-				err_trap(nc_def_var(ncid, "My",NC_FLOAT,3, dim3,  &ids[6]));
+				ids[5] = def_slice_var(nest, ncid, "Mx", dim3, nx, ny, pack, nan);
+				ids[6] = def_slice_var(nest, ncid, "My", dim3, nx, ny, pack, nan);
 			}
 			if (nest->out_velocity_x)
-				err_trap(nc_def_var(ncid, "Vx",NC_FLOAT,3, dim3,  &ids[5]));
+				ids[5] = def_slice_var(nest, ncid, "Vx", dim3, nx, ny, pack, nan);
 			if (nest->out_velocity_y)
-				err_trap(nc_def_var(ncid, "Vy",NC_FLOAT,3, dim3,  &ids[6]));
+				ids[6] = def_slice_var(nest, ncid, "Vy", dim3, nx, ny, pack, nan);
 			dim3[0] = dim0[1];			dim3[1] = dim0[0];		/* Bathym array is rank 2 */
 			err_trap(nc_def_var(ncid, "bathymetry",NC_FLOAT,2, dim3, &ids[4]));
 		}
@@ -3154,10 +5775,6 @@ int open_most_nc(struct nestContainer *nest, float *work, char *base, char *name
 			err_trap(nc_def_var(ncid, "ShortBeach", NC_UBYTE, 2, dim3, &ids[8]));
 	}
 
-	/* Set a deflation level of 5 (4 zero based) and shuffle for z variable */
-	id = (isMost) ? 5 : 3;
-	err_trap(nc_def_var_deflate(ncid, ids[id], 1, 1, 4));
-
 	/* ---- Variables Attributes --------- */
 	if (isMost) {
 		err_trap(nc_put_att_text (ncid, ids[0], "units", 12, "degrees_east"));
@@ -3171,16 +5788,11 @@ int open_most_nc(struct nestContainer *nest, float *work, char *base, char *name
 		err_trap(nc_put_att_text (ncid, ids[4], "units", 7, "SECONDS"));
 		err_trap(nc_put_att_text (ncid, ids[5], "long_name", strlen(long_name), long_name));
 		err_trap(nc_put_att_text (ncid, ids[5], "units", strlen(units), units));
-		err_trap(nc_put_att_float(ncid, ids[5], "missing_value", NC_FLOAT, 1, &dummy));
-		err_trap(nc_put_att_float(ncid, ids[5], "_FillValue", NC_FLOAT, 1, &dummy));
 		err_trap(nc_put_att_text (ncid, ids[5], "history", 6, "Nikles"));
 	}
 	else {
 		size_t	start_b[2] = {0,0}, count_b[2];
 		double dummy[2] = {0, 0}, range[2];
-		float nan = (float)mxGetNaN();
-
-		if (nan == 0) nan = (float)loc_nan.d;	/* Dirty hack. With the Intel compiler for example mxGetNaN() returns 0*/
 
 		range[0] = xMinOut;		range[1] = xMinOut + (nx - 1) * nest->hdr[lev].x_inc;
 		err_trap(nc_put_att_double(ncid, ids[0], "actual_range", NC_DOUBLE, 2U, range));
@@ -3197,8 +5809,6 @@ int open_most_nc(struct nestContainer *nest, float *work, char *base, char *name
 		err_trap(nc_put_att_text  (ncid, ids[2], "units", 7, "Seconds"));
 		err_trap(nc_put_att_text  (ncid, ids[3], "long_name", strlen(long_name), long_name));
 		err_trap(nc_put_att_text  (ncid, ids[3], "units", strlen(units), units));
-		err_trap(nc_put_att_float (ncid, ids[3], "missing_value", NC_FLOAT, 1, &nan));
-		err_trap(nc_put_att_float (ncid, ids[3], "_FillValue", NC_FLOAT, 1, &nan));
 		err_trap(nc_put_att_double(ncid, ids[3], "actual_range", NC_DOUBLE, 2U, dummy));
 
 		err_trap(nc_put_att_text  (ncid, ids[4], "long_name", 10, "bathymetry"));
@@ -3208,40 +5818,30 @@ int open_most_nc(struct nestContainer *nest, float *work, char *base, char *name
 		range[0] = nest->hdr[lev].z_min;	range[1] = nest->hdr[lev].z_max;
 		err_trap(nc_put_att_double(ncid, ids[4], "actual_range", NC_DOUBLE, 2U, range));
 
-		for (ij = 0; ij < nest->hdr[lev].nm; ij++)		/* Change bathy sign back to pos up and copy to work array */
-			work[ij] = (float)-nest->bat[lev][ij];
-
-		count_b[0] = nest->hdr[lev].ny;	count_b[1] = nest->hdr[lev].nx;
+		/* WORK has the bathymetry (pos up), of the whole grid if in strips (see strip_gather()) */
+		count_b[0] = ny;	count_b[1] = nx;
 		err_trap(nc_put_vara_float(ncid, ids[4], start_b, count_b, work));	/* Write the bathymetry */
 
 		if (nest->out_momentum) {
 			long_name = "Moment Component along x/Longitude";
 			err_trap(nc_put_att_text  (ncid, ids[5], "long_name", strlen(long_name), long_name));
 			err_trap(nc_put_att_text  (ncid, ids[5], "units", 15, "Meters^2/second"));
-			err_trap(nc_put_att_float (ncid, ids[5], "missing_value", NC_FLOAT, 1, &nan));
-			err_trap(nc_put_att_float (ncid, ids[5], "_FillValue", NC_FLOAT, 1, &nan));
 			err_trap(nc_put_att_double(ncid, ids[5], "actual_range", NC_DOUBLE, 2U, dummy));
 			long_name = "Moment Component along x/Latitude";
 			err_trap(nc_put_att_text  (ncid, ids[6], "long_name", strlen(long_name), long_name));
 			err_trap(nc_put_att_text  (ncid, ids[6], "units", 15, "Meters^2/second"));
-			err_trap(nc_put_att_float (ncid, ids[6], "missing_value", NC_FLOAT, 1, &nan));
-			err_trap(nc_put_att_float (ncid, ids[6], "_FillValue", NC_FLOAT, 1, &nan));
 			err_trap(nc_put_att_double(ncid, ids[6], "actual_range", NC_DOUBLE, 2U, dummy));
 		}
 		if (nest->out_velocity_x) {			/* Horizontal velocity, 3D case */
 			long_name = "Velocity Component along x/Longitude";
 			err_trap(nc_put_att_text  (ncid, ids[5], "long_name", strlen(long_name), long_name));
 			err_trap(nc_put_att_text  (ncid, ids[5], "units", 13, "Meters/second"));
-			err_trap(nc_put_att_float (ncid, ids[5], "missing_value", NC_FLOAT, 1, &nan));
-			err_trap(nc_put_att_float (ncid, ids[5], "_FillValue", NC_FLOAT, 1, &nan));
 			err_trap(nc_put_att_double(ncid, ids[5], "actual_range", NC_DOUBLE, 2U, dummy));
 		}
 		if (nest->out_velocity_y) {			/* Vertical velocity, 3D case */
 			long_name = "Velocity Component along x/Latitude";
 			err_trap(nc_put_att_text  (ncid, ids[6], "long_name", strlen(long_name), long_name));
 			err_trap(nc_put_att_text  (ncid, ids[6], "units", 13, "Meters/second"));
-			err_trap(nc_put_att_float (ncid, ids[6], "missing_value", NC_FLOAT, 1, &nan));
-			err_trap(nc_put_att_float (ncid, ids[6], "_FillValue", NC_FLOAT, 1, &nan));
 			err_trap(nc_put_att_double(ncid, ids[6], "actual_range", NC_DOUBLE, 2U, dummy));
 		}
 
@@ -3290,6 +5890,81 @@ int open_most_nc(struct nestContainer *nest, float *work, char *base, char *name
 	return (ncid);
 }
 
+/* --------------------------------------------------------------------------- */
+void put_slice(struct nestContainer *nest, int ncid, int id, size_t *start, size_t *count, float *work, double *range) {
+	/* Write a slice of a 3D file and update RANGE with its min/max. When in strips, the slice is first
+	   collected from all of them and only the first one writes it */
+	unsigned int ij, nm;
+
+	if ((work = strip_gather(nest, work)) == NULL) return;
+	nm = (nest->strip) ? nest->strip->g.nm : nest->hdr[nest->writeLevel].nm;
+	for (ij = 0; ij < nm; ij++) {
+		range[0] = MIN(work[ij], range[0]);
+		range[1] = MAX(work[ij], range[1]);
+	}
+	if (nest->nc_quant) nc_quantize(nest, work, nm, nest->nc_quant == 'p');
+	put_vara_float(nest->aw, ncid, id, 3, start, count, work);
+}
+
+/* --------------------------------------------------------------------------- */
+int def_slice_var(struct nestContainer *nest, int ncid, char *name, int *dim3, unsigned int nx, unsigned int ny, int pack,
+                  float fill) {
+	/* Define a variable of the time slices of a 3D file. Its chunks are one slice deep and nc_chunk rows and columns
+	   wide. So a slice write fills whole chunks and reading the time series of a point only inflates the chunks
+	   around it. When PACK it holds integers that are unpacked with scale_factor (-z+p). Returns the variable id */
+	int    id, i_fill = -2147483647;
+	float  scale = (float)(2 * nest->nc_err), offset = 0;
+	size_t chunk[3];
+
+	err_trap(nc_def_var(ncid, name, (pack) ? NC_INT : NC_FLOAT, 3, dim3, &id));
+	chunk[0] = 1;	chunk[1] = MIN(ny, (unsigned int)nest->nc_chunk[0]);	chunk[2] = MIN(nx, (unsigned int)nest->nc_chunk[1]);
+	err_trap(nc_def_var_chunking(ncid, id, NC_CHUNKED, chunk));
+	if (nest->nc_deflate > 0)
+		err_trap(nc_def_var_deflate(ncid, id, 1, 1, nest->nc_deflate));
+	if (pack) {
+		err_trap(nc_put_att_float(ncid, id, "scale_factor", NC_FLOAT, 1, &scale));
+		err_trap(nc_put_att_float(ncid, id, "add_offset",   NC_FLOAT, 1, &offset));
+		err_trap(nc_put_att_int  (ncid, id, "missing_value", NC_INT, 1, &i_fill));
+		err_trap(nc_put_att_int  (ncid, id, "_FillValue",    NC_INT, 1, &i_fill));
+	}
+	else {
+		err_trap(nc_put_att_float(ncid, id, "missing_value", NC_FLOAT, 1, &fill));
+		err_trap(nc_put_att_float(ncid, id, "_FillValue",    NC_FLOAT, 1, &fill));
+	}
+	if (nest->nc_quant && !pack)
+		err_trap(nc_put_att_double(ncid, id, "quantization_max_error", NC_DOUBLE, 1, &nest->nc_err));
+	return (id);
+}
+
+/* --------------------------------------------------------------------------- */
+void nc_quantize(struct nestContainer *nest, float *work, size_t n, int pack) {
+	/* Lossy compression of a slice (-z option), with errors not larger than nc_err. Either round to a multiple of the
+	   largest power of 2 not above 2*nc_err, which zeroes the low bits of the mantissas so that deflate packs them
+	   (bit rounding), or, when PACK, convert to the integers of the scale_factor packing. Shuffle and deflate squeeze
+	   their high bytes, so they end up as small as shorts but without the clipping. NaNs become the _FillValue. */
+	size_t i;
+	float  q;
+
+	if (pack) {
+		q = (float)(2 * nest->nc_err);
+		for (i = 0; i < n; i++) {
+			if (work[i] != work[i]) {work[i] = -2147483647.0f;	continue;}
+			work[i] = rintf(work[i] / q);
+			if (work[i] > 2e9f || work[i] < -2e9f) {
+				work[i] = (work[i] > 0) ? 2e9f : -2e9f;
+				if (nest->nc_clipped++ == 0)
+					mexPrintf("NSWING: Warning, values outside of the range of the -z+p packing (+-%g) were clipped\n",
+					          2e9 * q);
+			}
+		}
+	}
+	else {
+		q = (float)pow(2, floor(log(2 * nest->nc_err) / log(2.0)));
+		for (i = 0; i < n; i++)
+			work[i] = rintf(work[i] / q) * q;
+	}
+}
+
 /* --------------------------------------------------------------------------- */
 void write_most_slice(struct nestContainer *nest, int *ncid, int *ids, unsigned int i_start, unsigned int j_start,
                       unsigned int i_end, unsigned int j_end, float *work, size_t *start, size_t *count,
@@ -3298,50 +5973,32 @@ void write_most_slice(struct nestContainer *nest, int *ncid, int *ids, unsigned
 	unsigned int col, row, n, ij, k;
 
 	if (!isMost) {
-		/* ----------- Find the min/max of this slice --------- */
-		for (ij = 0; ij < nest->hdr[lev].nm; ij++) {
-			slice_range[0] = MIN(work[ij], slice_range[0]);
-			slice_range[1] = MAX(work[ij], slice_range[1]);
-		}
-
-		err_trap(nc_put_vara_float(ncid[0], ids[0], start, count, work));
+		put_slice(nest, ncid[0], ids[0], start, count, work, &slice_range[0]);
 
 		/* Conditionally write the Vx & Vy velocity components */
 		if (nest->out_velocity_x) {
 			for (ij = 0; ij < nest->hdr[nest->writeLevel].nm; ij++) {
-				work[ij] = (nest->htotal_d[nest->writeLevel][ij] > EPS2) ? (float)nest->vex[nest->writeLevel][ij] : 0;
-				if (nest->htotal_d[nest->writeLevel][ij] < 0.5 && fabs(work[ij]) >= V_LIMIT)	/* Clip above this combination */
+				work[ij] = (nest->htotal_a[nest->writeLevel][ij] > EPS2) ? (float)nest->vex[nest->writeLevel][ij] : 0;
+				if (nest->htotal_a[nest->writeLevel][ij] < 0.5 && fabs(work[ij]) >= V_LIMIT)	/* Clip above this combination */
 					work[ij] = 0;
-
-				slice_range[2] = MIN(work[ij], slice_range[2]);
-				slice_range[3] = MAX(work[ij], slice_range[3]);
 			}			
-			err_trap(nc_put_vara_float(ncid[0], ids[1], start, count, work));
+			put_slice(nest, ncid[0], ids[1], start, count, work, &slice_range[2]);
 		}
 		if (nest->out_velocity_y) {
 			for (ij = 0; ij < nest->hdr[nest->writeLevel].nm; ij++) {
-				work[ij] = (nest->htotal_d[nest->writeLevel][ij] > EPS2) ? (float)nest->vey[nest->writeLevel][ij] : 0;
-				if (nest->htotal_d[nest->writeLevel][ij] < 0.5 && fabs(work[ij]) >= V_LIMIT)	/* Clip above this combination */
+				work[ij] = (nest->htotal_a[nest->writeLevel][ij] > EPS2) ? (float)nest->vey[nest->writeLevel][ij] : 0;
+				if (nest->htotal_a[nest->writeLevel][ij] < 0.5 && fabs(work[ij]) >= V_LIMIT)	/* Clip above this combination */
 					work[ij] = 0;
-
-				slice_range[4] = MIN(work[ij], slice_range[4]);
-				slice_range[5] = MAX(work[ij], slice_range[5]);
 			}			
-			err_trap (nc_put_vara_float (ncid[0], ids[2], start, count, work));
+			put_slice(nest, ncid[0], ids[2], start, count, work, &slice_range[4]);
 		}
 		if (nest->out_momentum) {
-			for (ij = 0; ij < nest->hdr[nest->writeLevel].nm; ij++) {
-				work[ij] = (float)nest->fluxm_d[nest->writeLevel][ij];
-				slice_range[2] = MIN(work[ij], slice_range[2]);
-				slice_range[3] = MAX(work[ij], slice_range[3]);
-			}
-			err_trap (nc_put_vara_float (ncid[0], ids[1], start, count, work));
-			for (ij = 0; ij < nest->hdr[nest->writeLevel].nm; ij++) {
-				work[ij] = (float)nest->fluxn_d[nest->writeLevel][ij];
-				slice_range[4] = MIN(work[ij], slice_range[2]);
-				slice_range[5] = MAX(work[ij], slice_range[3]);
-			}
-			err_trap (nc_put_vara_float (ncid[0], ids[2], start, count, work));
+			for (ij = 0; ij < nest->hdr[nest->writeLevel].nm; ij++)
+				work[ij] = (float)nest->fluxm_a[nest->writeLevel][ij];
+			put_slice(nest, ncid[0], ids[1], start, count, work, &slice_range[2]);
+			for (ij = 0; ij < nest->hdr[nest->writeLevel].nm; ij++)
+				work[ij] = (float)nest->fluxn_a[nest->writeLevel][ij];
+			put_slice(nest, ncid[0], ids[2], start, count, work, &slice_range[4]);
 		}
 	}
 	else {
@@ -3349,29 +6006,32 @@ void write_most_slice(struct nestContainer *nest, int *ncid, int *ids, unsigned
 			if (n == 0) {		/* Amplitude */
 				for (row = j_start, k = 0; row < j_end; row++)
 					for (col = i_start; col < i_end; col++)
-						work[k++] = (float)(nest->etad[lev][ij_grd(col, row, nest->hdr[lev])] * 100);
+						work[k++] = (float)(nest->etaa[lev][ij_grd(col, row, nest->hdr[lev])] * 100);
 
-				err_trap (nc_put_vara_float (ncid[0], ids[0], start, count, work));
+				if (nest->nc_quant) nc_quantize(nest, work, k, FALSE);
+				put_vara_float(nest->aw, ncid[0], ids[0], 3, start, count, work);
 			}
 			else if (n == 1) {		/* X velocity */ 
 				for (row = j_start, k = 0; row < j_end; row++) {
 					for (col = i_start; col < i_end; col++) {
 						ij = ij_grd(col, row, nest->hdr[lev]);
-						work[k++] = (nest->htotal_d[lev][ij] < EPS3) ? 0 :
-						            (float)(nest->fluxm_d[lev][ij] / nest->htotal_d[lev][ij] * 100);
+						work[k++] = (nest->htotal_a[lev][ij] < EPS3) ? 0 :
+						            (float)(nest->fluxm_a[lev][ij] / nest->htotal_a[lev][ij] * 100);
 					}
 				}
-				err_trap (nc_put_vara_float (ncid[1], ids[1], start, count, work));
+				if (nest->nc_quant) nc_quantize(nest, work, k, FALSE);
+				put_vara_float(nest->aw, ncid[1], ids[1], 3, start, count, work);
 			}
 			else {				/* Y velocity */ 
 				for (row = j_start, k = 0; row < j_end; row++) {
 					for (col = i_start; col < i_end; col++) {
 						ij = ij_grd(col, row, nest->hdr[lev]);
-						work[k++] = (nest->htotal_d[lev][ij] < EPS3) ? 0 :
-						            (float)(nest->fluxn_d[lev][ij] / nest->htotal_d[lev][ij] * 100);
+						work[k++] = (nest->htotal_a[lev][ij] < EPS3) ? 0 :
+						            (float)(nest->fluxn_a[lev][ij] / nest->htotal_a[lev][ij] * 100);
 					}
 				}
-				err_trap (nc_put_vara_float (ncid[2], ids[2], start, count, work));
+				if (nest->nc_quant) nc_quantize(nest, work, k, FALSE);
+				put_vara_float(nest->aw, ncid[2], ids[2], 3, start, count, work);
 			}
 		}
 	}
@@ -3461,6 +6121,108 @@ int write_greens_nc(struct nestContainer *nest, char *fname, float *work, size_t
 	return (ncid);
 }
 
+/* -------------------------------------------------------------------- */
+int open_ensemble_nc(struct nestContainer *nest, char *fname, char hist[], int *ids, struct ens_source *src,
+	int n_src, unsigned int *lcum_p, char *names[], int n_maregs, int n_times, double dt_mar, int lev) {
+	/* Create the netCDF file of an ensemble run (-Fe). Each source is a slice along the 'source' dimension
+	   of the max level grid (ids[4]) and of the maregraphs (ids[9], only when n_times > 0). Those slices are
+	   written by run_ensemble() as the sources finish. Returns the ncid or -1 */
+
+	int     k, ix, iy, ncid = -1, status, dim0[6], dim3[3];
+	size_t  chunk[3];
+	double *x, *y, *p;
+
+	if ((status = nc_create(fname, NC_NETCDF4, &ncid)) != NC_NOERR) {
+		mexPrintf("NSWING: Unable to create file -- %s -- exiting\n", fname);
+		return(-1);
+	}
+
+	/* ---- Define dimensions ------------ */
+	err_trap(nc_def_dim(ncid, "source", (size_t)n_src,            &dim0[0]));
+	err_trap(nc_def_dim(ncid, "param",  (size_t)9,                &dim0[1]));
+	err_trap(nc_def_dim(ncid, "y",      (size_t)nest->hdr[lev].ny, &dim0[2]));
+	err_trap(nc_def_dim(ncid, "x",      (size_t)nest->hdr[lev].nx, &dim0[3]));
+
+	/* ---- Define variables ------------- */
+	err_trap(nc_def_var(ncid, "x",      NC_DOUBLE,1, &dim0[3], &ids[0]));
+	err_trap(nc_def_var(ncid, "y",      NC_DOUBLE,1, &dim0[2], &ids[1]));
+	err_trap(nc_def_var(ncid, "okada",  NC_DOUBLE,2, dim0,     &ids[2]));
+	dim3[0] = dim0[0];	dim3[1] = dim0[2];	dim3[2] = dim0[3];
+	err_trap(nc_def_var(ncid, "max_level", NC_FLOAT, 3, dim3,  &ids[4]));
+	chunk[0] = 1;	chunk[1] = nest->hdr[lev].ny;	chunk[2] = nest->hdr[lev].nx;	/* One source per chunk */
+	err_trap(nc_def_var_chunking(ncid, ids[4], NC_CHUNKED, chunk));
+	err_trap(nc_def_var_deflate(ncid, ids[4], 1, 1, 4));
+
+	if (n_times) {
+		err_trap(nc_def_dim(ncid, "time",  (size_t)n_times,  &dim0[4]));
+		err_trap(nc_def_dim(ncid, "count", (size_t)n_maregs, &dim0[5]));
+		err_trap(nc_def_var(ncid, "time",  NC_DOUBLE,1, &dim0[4], &ids[5]));
+		if (nest->isGeog) {
+			err_trap(nc_def_var(ncid, "lonMareg", NC_DOUBLE,1, &dim0[5], &ids[6]));
+			err_trap(nc_def_var(ncid, "latMareg", NC_DOUBLE,1, &dim0[5], &ids[7]));
+		}
+		else {
+			err_trap(nc_def_var(ncid, "xMareg",   NC_DOUBLE,1, &dim0[5], &ids[6]));
+			err_trap(nc_def_var(ncid, "yMareg",   NC_DOUBLE,1, &dim0[5], &ids[7]));
+		}
+		err_trap(nc_def_var(ncid, "NamesMareg",   NC_STRING,1, &dim0[5], &ids[8]));
+		dim3[0] = dim0[0];	dim3[1] = dim0[4];	dim3[2] = dim0[5];
+		err_trap(nc_def_var(ncid, "maregs",       NC_FLOAT, 3, dim3,     &ids[9]));
+		chunk[0] = 1;	chunk[1] = n_times;	chunk[2] = n_maregs;
+		err_trap(nc_def_var_chunking(ncid, ids[9], NC_CHUNKED, chunk));
+		err_trap(nc_def_var_deflate(ncid, ids[9], 1, 1, 4));
+	}
+
+	/* ---- Variables Attributes --------- */
+	err_trap(nc_put_att_text(ncid, ids[2], "Description", 85,
+	         "dip, azimuth, rake, slip, length, width, top depth, x, y of -F. NaN for a source grid"));
+	err_trap(nc_put_att_text(ncid, ids[4], "Description", 34, "Maximum water level of each source"));
+
+	/* ---- Global Attributes ------------ */
+	err_trap(nc_put_att_text(ncid, NC_GLOBAL, "Institution", 10, "Mirone Tec"));
+#ifdef I_AM_MEX
+	err_trap(nc_put_att_text(ncid, NC_GLOBAL, "Description", 24, "Created by Mirone-NSWING"));
+#else
+	err_trap(nc_put_att_text(ncid, NC_GLOBAL, "Description", 17, "Created by NSWING"));
+#endif
+	err_trap(nc_put_att_text(ncid, NC_GLOBAL, "History", strlen(hist), hist));
+	err_trap(nc_put_att_int(ncid,  NC_GLOBAL, "Number of sources", NC_INT, 1, &n_src));
+
+	err_trap(nc_enddef (ncid));
+
+	k = MAX(MAX(nest->hdr[lev].nx, nest->hdr[lev].ny), MAX(n_maregs, n_times));
+	x = (double *)mxMalloc(sizeof(double) * k);
+	y = (double *)mxMalloc(sizeof(double) * k);
+	p = (double *)mxMalloc(sizeof(double) * 9 * n_src);
+
+	for (k = 0; k < nest->hdr[lev].nx; k++) x[k] = nest->hdr[lev].x_min + k * nest->hdr[lev].x_inc;
+	for (k = 0; k < nest->hdr[lev].ny; k++) y[k] = nest->hdr[lev].y_min + k * nest->hdr[lev].y_inc;
+	err_trap(nc_put_var_double(ncid, ids[0], x));
+	err_trap(nc_put_var_double(ncid, ids[1], y));
+	for (k = 0; k < 9 * n_src; k++)
+		p[k] = (src[k/9].grid) ? mxGetNaN() : src[k/9].p[k%9];
+	err_trap(nc_put_var_double(ncid, ids[2], p));
+
+	if (n_times) {
+		for (k = 0; k < n_times; k++) x[k] = (k + 0.5) * dt_mar;	/* Same times as the main loop (time + dt/2) */
+		err_trap(nc_put_var_double(ncid, ids[5], x));
+		for (k = 0; k < n_maregs; k++) {
+			ix = lcum_p[k] % nest->hdr[lev].nx;
+			iy = lcum_p[k] / nest->hdr[lev].nx;
+			x[k] = nest->hdr[lev].x_min + ix * nest->hdr[lev].x_inc;
+			y[k] = nest->hdr[lev].y_min + iy * nest->hdr[lev].y_inc;
+		}
+		err_trap(nc_put_var_double(ncid, ids[6], x));
+		err_trap(nc_put_var_double(ncid, ids[7], y));
+		err_trap(nc_put_var_string(ncid, ids[8], (const char **)names));
+	}
+	mxFree(x);
+	mxFree(y);
+	mxFree(p);
+
+	return (ncid);
+}
+
 /* -------------------------------------------------------------------- */
 int write_maregs_nc(struct nestContainer *nest, char *fname, float *work, double *t, unsigned int *lcum_p,
 	char *names[], char hist[], int n_maregs, unsigned int n_times, int lev) {
@@ -3539,9 +6301,71 @@ int write_maregs_nc(struct nestContainer *nest, char *fname, float *work, double
 	mxFree(y); 
 	mxFree(maregs_vec); 
 
-	err_trap(nc_close(ncid)); 
+	err_trap(nc_close(ncid)); 
+
+	return (0);
+}
+
+/* -------------------------------------------------------------------- */
+int open_tracers_nc(struct nestContainer *nest, struct tracers *o, char *fname, char hist[]) {
+	/* Create the netCDF file of the tracers trajectories. It is a CF ragged array with an index (featureType
+	   trajectory). Each written cycle appends the positions of the tracers that are inside the grid to the
+	   unlimited 'obs' dimension, so that the file does not grow with the ones that left it.
+	   Returns the ncid or -1 */
+	int     n, ncid = -1, status, dim0[2], ids_t, *ids = o->ids;
+	size_t  chunk = 65536;
+	int    *traj;
+
+	if ((status = nc_create(fname, NC_NETCDF4, &ncid)) != NC_NOERR) {
+		mexPrintf("NSWING: Unable to create file -- %s -- exiting\n", fname);
+		return(-1);
+	}
+
+	/* ---- Define dimensions ------------ */
+	err_trap(nc_def_dim(ncid, "trajectory", (size_t)o->n, &dim0[0]));
+	err_trap(nc_def_dim(ncid, "obs",        NC_UNLIMITED, &dim0[1]));
+
+	/* ---- Define variables ------------- */
+	err_trap(nc_def_var(ncid, "trajectory",       NC_INT,    1, &dim0[0], &ids_t));
+	err_trap(nc_def_var(ncid, "time",             NC_DOUBLE, 1, &dim0[1], &ids[0]));
+	err_trap(nc_def_var(ncid, "trajectory_index", NC_INT,    1, &dim0[1], &ids[1]));
+	err_trap(nc_def_var(ncid, (nest->isGeog) ? "lon" : "x", NC_DOUBLE, 1, &dim0[1], &ids[2]));
+	err_trap(nc_def_var(ncid, (nest->isGeog) ? "lat" : "y", NC_DOUBLE, 1, &dim0[1], &ids[3]));
+
+	/* An unlimited dimension has chunks of one value by default. Use big ones and compress them */
+	for (n = 0; n < 4; n++) {
+		err_trap(nc_def_var_chunking(ncid, ids[n], NC_CHUNKED, &chunk));
+		err_trap(nc_def_var_deflate(ncid, ids[n], 1, 1, 4));
+	}
+
+	err_trap(nc_put_att_text(ncid, ids_t, "cf_role", 13, "trajectory_id"));
+	err_trap(nc_put_att_text(ncid, ids[0], "units", 7, "seconds"));
+	err_trap(nc_put_att_text(ncid, ids[1], "instance_dimension", 10, "trajectory"));
+	if (nest->isGeog) {
+		err_trap(nc_put_att_text(ncid, ids[2], "units", 12, "degrees_east"));
+		err_trap(nc_put_att_text(ncid, ids[3], "units", 13, "degrees_north"));
+	}
+
+	/* ---- Global Attributes ------------ */
+	err_trap(nc_put_att_text(ncid, NC_GLOBAL, "Conventions", 6, "CF-1.6"));
+	err_trap(nc_put_att_text(ncid, NC_GLOBAL, "featureType", 10, "trajectory"));
+	err_trap(nc_put_att_text(ncid, NC_GLOBAL, "Institution", 10, "Mirone Tec"));
+#ifdef I_AM_MEX
+	err_trap(nc_put_att_text(ncid, NC_GLOBAL, "Description", 24, "Created by Mirone-NSWING"));
+#else
+	err_trap(nc_put_att_text(ncid, NC_GLOBAL, "Description", 17, "Created by NSWING"));
+#endif
+	err_trap(nc_put_att_text(ncid, NC_GLOBAL, "History", strlen(hist), hist));
+
+	err_trap(nc_enddef(ncid));
 
-	return (0);
+	traj = (int *)mxMalloc(sizeof(int) * o->n);
+	for (n = 0; n < o->n; n++) traj[n] = n;
+	err_trap(nc_put_var_int(ncid, ids_t, traj));
+	mxFree(traj);
+
+	o->n_obs = 0;
+	return (ncid);
 }
 
 /* -------------------------------------------------------------------- */
@@ -3703,25 +6527,25 @@ void write_anuga_slice(struct nestContainer *nest, int ncid, int z_id, unsigned
 		if (!with_land) {		/* Land nodes are kept = 0 */
 			if (i_end == nest->hdr[lev].nx && j_end == nest->hdr[lev].ny) {        /* Full Region */
 				for (ij = 0; ij < nest->hdr[lev].nm; ij++)
-					work[ij] = (float)nest->etad[lev][ij];              /* Anuga calls this -> stage */
+					work[ij] = (float)nest->etaa[lev][ij];              /* Anuga calls this -> stage */
 			}
 			else {		/* A sub-region */
 				for (row = j_start; row < j_end; row++)
 					for (col = i_start; col < i_end; col++)
-						work[k++] = (float)nest->etad[lev][ij_grd(col, row, nest->hdr[lev])];
+						work[k++] = (float)nest->etaa[lev][ij_grd(col, row, nest->hdr[lev])];
 			}
 		}
 		else {
 			if (i_end == nest->hdr[lev].nx && j_end == nest->hdr[lev].ny) {        /* Full Region */
 				for (ij = 0; ij < nest->hdr[lev].nm; ij++)
-					work[ij] = (nest->htotal_d[lev][ij] < EPS3) ? (float)-nest->bat[lev][ij] : (float)nest->etad[lev][ij];
+					work[ij] = (nest->htotal_a[lev][ij] < EPS3) ? (float)-nest->bat[lev][ij] : (float)nest->etaa[lev][ij];
 			}
 			else {		/* A sub-region */
 				for (row = j_start; row < j_end; row++) {
 					for (col = i_start; col < i_end; col++) {
 						ij = ij_grd(col, row, nest->hdr[lev]);
-						work[k++] = (nest->htotal_d[lev][ij] < EPS3) ? (float)-nest->bat[lev][ij] :
-						           (float)nest->etad[lev][ij]; 
+						work[k++] = (nest->htotal_a[lev][ij] < EPS3) ? (float)-nest->bat[lev][ij] :
+						           (float)nest->etaa[lev][ij]; 
 					}
 				}
 			}
@@ -3730,23 +6554,23 @@ void write_anuga_slice(struct nestContainer *nest, int ncid, int z_id, unsigned
 	else if (idx == 2) {	/* X momentum */
 		if (i_end == nest->hdr[lev].nx && j_end == nest->hdr[lev].ny) {
 			for (ij = 0; ij < nest->hdr[lev].nm; ij++)
-				work[ij] = (float)nest->fluxm_d[lev][ij];
+				work[ij] = (float)nest->fluxm_a[lev][ij];
 		}
 		else {		/* A sub-region */
 			for (row = j_start; row < j_end; row++)
 				for (col = i_start; col < i_end; col++)
-					work[k++] = (float)nest->fluxm_d[lev][ij_grd(col, row, nest->hdr[lev])];
+					work[k++] = (float)nest->fluxm_a[lev][ij_grd(col, row, nest->hdr[lev])];
 		}
 	}
 	else {			/* Y momentum */
 		if (i_end == nest->hdr[lev].nx && j_end == nest->hdr[lev].ny) {
 			for (ij = 0; ij < nest->hdr[lev].nm; ij++)
-				work[ij] = (float)nest->fluxn_d[lev][ij];
+				work[ij] = (float)nest->fluxn_a[lev][ij];
 		}
 		else {		/* A sub-region */
 			for (row = j_start; row < j_end; row++)
 				for (col = i_start; col < i_end; col++)
-					work[k++] = (float)nest->fluxn_d[lev][ij_grd(col, row, nest->hdr[lev])];
+					work[k++] = (float)nest->fluxn_a[lev][ij_grd(col, row, nest->hdr[lev])];
 		}
 	}
 
@@ -3756,7 +6580,47 @@ void write_anuga_slice(struct nestContainer *nest, int ncid, int z_id, unsigned
 		slice_range[0] = MIN(work[k], slice_range[0]);
 	}
 
-	err_trap (nc_put_vara_float (ncid, z_id, start, count, work));
+	put_vara_float(nest->aw, ncid, z_id, 2, start, count, work);
+}
+
+/* --------------------------------------------------------------------------- */
+void put_vara_float(struct async_writer *aw, int ncid, int varid, int ndims, size_t *start, size_t *count, float *work) {
+	/* nc_put_vara_float() or, when there is a background writer, queue a copy of the hyperslab */
+	int i;
+	size_t n = 1;
+	struct aw_job *job;
+
+	for (i = 0; i < ndims; i++) n *= count[i];
+	if (aw == NULL || (job = aw_job_new(aw, AW_NC_FLT, n * sizeof(float))) == NULL) {
+		err_trap(nc_put_vara_float(ncid, varid, start, count, work));
+		return;
+	}
+	job->ncid = ncid;	job->varid = varid;
+	for (i = 0; i < ndims; i++) {
+		job->start[i] = start[i];	job->count[i] = count[i];
+	}
+	memcpy(job->data, work, n * sizeof(float));
+	aw_job_submit(aw);
+}
+
+/* --------------------------------------------------------------------------- */
+void put_vara_double(struct async_writer *aw, int ncid, int varid, int ndims, size_t *start, size_t *count, double *work) {
+	/* Same as put_vara_float() for doubles (the time variables) */
+	int i;
+	size_t n = 1;
+	struct aw_job *job;
+
+	for (i = 0; i < ndims; i++) n *= count[i];
+	if (aw == NULL || (job = aw_job_new(aw, AW_NC_DBL, n * sizeof(double))) == NULL) {
+		err_trap(nc_put_vara_double(ncid, varid, start, count, work));
+		return;
+	}
+	job->ncid = ncid;	job->varid = varid;
+	for (i = 0; i < ndims; i++) {
+		job->start[i] = start[i];	job->count[i] = count[i];
+	}
+	memcpy(job->data, work, n * sizeof(double));
+	aw_job_submit(aw);
 }
 
 /* --------------------------------------------------------------------------- */
@@ -3776,12 +6640,18 @@ void err_trap_(int status) {
  *		Updates only etad and htotal_d
  * -------------------------------------------------------------------- */
 void mass(struct nestContainer *nest, int lev) {
+	mass_rows(nest, lev, 0, nest->hdr[lev].ny);
+}
+
+/* Same as mass() but only for the rows [row0, row1[ (see tiled_step()) */
+void mass_rows(struct nestContainer *nest, int lev, int row0, int row1) {
 
 	int row, col;
 	int cm1, rm1;			/* previous column (cm1 = col -1) and row (rm1 = row - 1) */
 	unsigned int ij;
+	int c0, c1;			/* First and last+1 columns to compute in each row */
 	double dtdx, dtdy, dd = 0, zzz;
-	double *etaa, *etad, *htotal_d, *bat, *fluxm_a, *fluxn_a;
+	real   *etaa, *etad, *htotal_d, *bat, *fluxm_a, *fluxn_a;
 
 	etaa     = nest->etaa[lev];          etad    = nest->etad[lev];
 	htotal_d = nest->htotal_d[lev];      bat     = nest->bat[lev];
@@ -3790,10 +6660,15 @@ void mass(struct nestContainer *nest, int lev) {
 	dtdx = nest->dt[lev] / nest->hdr[lev].x_inc;
 	dtdy = nest->dt[lev] / nest->hdr[lev].y_inc;
 
-	for (row = 0; row < nest->hdr[lev].ny; row++) {
-		ij = row * nest->hdr[lev].nx;
+#if HAVE_OPENMP
+#pragma omp parallel for private(ij, col, c0, c1, cm1, rm1, dd, zzz)
+#endif
+	for (row = row0; row < row1; row++) {
+		c0 = 0;		c1 = nest->hdr[lev].nx;
+		ACTIVE_COLS(nest, lev, row, c0, c1);
+		ij = row * nest->hdr[lev].nx + c0;
 		rm1 = (row == 0) ? 0 : nest->hdr[lev].nx;
-		for (col = 0; col < nest->hdr[lev].nx; col++) {
+		for (col = c0; col < c1; col++) {
 			/* case ocean and non permanent dry area */
 			if (bat[ij] > MAXRUNUP) {
 				cm1 = (col == 0) ? 0 : 1;
@@ -3901,14 +6776,22 @@ void wall_two(struct nestContainer *nest, int ot1, int ot2, int in1, int in2) {
 /* ---------------------------------------------------------------------- */
 /* open boundary condition */
 /* ---------------------------------------------------------------------- */
-void openb(struct grd_header hdr, double *bat, double *fluxm_d, double *fluxn_d, double *etad, struct nestContainer *nest) {
+void openb(struct grd_header hdr, real *bat, real *fluxm_d, real *fluxn_d, real *etad, struct nestContainer *nest) {
+	openb_rows(hdr, bat, fluxm_d, fluxn_d, etad, nest, 0, hdr.ny);
+}
 
-	int i, j;
+/* Same as openb() but only for the border cells in the rows [row0, row1[ (see tiled_step()) */
+void openb_rows(struct grd_header hdr, real *bat, real *fluxm_d, real *fluxn_d, real *etad, struct nestContainer *nest, int row0, int row1) {
+
+	int i, j, has_first = (row0 == 0), has_last = (row1 == hdr.ny);
 	double uh, zz, d__1, d__2;
 
 	/* ----- first column (South border) */
 	j = 0;
-	for (i = 1; i < hdr.nx - 1; i++) {
+#if HAVE_OPENMP
+#pragma omp parallel for private(uh, zz, d__2) if (has_first)
+#endif
+	for (i = 1; i < ((has_first) ? hdr.nx - 1 : 1); i++) {
 		if (bat[ij_grd(i,j,hdr)] < EPS5) {
 			etad[ij_grd(i,j,hdr)] = -bat[ij_grd(i,j,hdr)];
 			continue;
@@ -3922,7 +6805,10 @@ void openb(struct grd_header hdr, double *bat, double *fluxm_d, double *fluxn_d,
 
 	/* ------ last column (North border) */
 	j = hdr.ny - 1;
-	for (i = 1; i < hdr.nx - 1; i++) {
+#if HAVE_OPENMP
+#pragma omp parallel for private(uh, zz, d__2) if (has_last)
+#endif
+	for (i = 1; i < ((has_last) ? hdr.nx - 1 : 1); i++) {
 		if (bat[ij_grd(i,j,hdr)] > EPS5) {
 			uh = (fluxm_d[ij_grd(i,j,hdr)] + fluxm_d[ij_grd(i-1,j,hdr)]) * 0.5;
 			d__2 = fluxn_d[ij_grd(i,j-1,hdr)];
@@ -3937,7 +6823,10 @@ void openb(struct grd_header hdr, double *bat, double *fluxm_d, double *fluxn_d,
 
 	/* ------ first row (West border) */
 	i = 0;
-	for (j = 1; j < hdr.ny - 1; j++) {
+#if HAVE_OPENMP
+#pragma omp parallel for private(uh, zz, d__2)
+#endif
+	for (j = MAX(row0, 1); j < MIN(row1, hdr.ny - 1); j++) {
 		if (bat[ij_grd(i,j,hdr)] < EPS5) {
 			etad[ij_grd(i,j,hdr)] = -bat[ij_grd(i,j,hdr)];
 			continue;
@@ -3956,7 +6845,10 @@ void openb(struct grd_header hdr, double *bat, double *fluxm_d, double *fluxn_d,
 
 	/* ------- last row (East border) */
 	i = hdr.nx - 1;
-	for (j = 1; j < hdr.ny - 1; j++) {
+#if HAVE_OPENMP
+#pragma omp parallel for private(uh, zz, d__2)
+#endif
+	for (j = MAX(row0, 1); j < MIN(row1, hdr.ny - 1); j++) {
 		if (bat[ij_grd(i,j,hdr)] > EPS5) {
 			uh = (fluxn_d[ij_grd(i,j,hdr)] + fluxn_d[ij_grd(i,j-1,hdr)]) * 0.5;
 			d__2 = fluxm_d[ij_grd(i-1,j,hdr)];
@@ -3969,7 +6861,7 @@ void openb(struct grd_header hdr, double *bat, double *fluxm_d, double *fluxn_d,
 	}
 
 	/* -------- first row & first column (SW corner) */
-	if (nest->bnc_border[1] == 0) { 
+	if (has_first && nest->bnc_border[1] == 0) { 
 		if (bat[0] > EPS5) {
 			zz = sqrt(fluxm_d[0] * fluxm_d[0] + fluxn_d[0] * fluxn_d[0]) / sqrt(NORMAL_GRAV * bat[0]);
 			if (fluxm_d[0] > 0 || fluxn_d[0] > 0) zz *= -1;
@@ -3980,6 +6872,8 @@ void openb(struct grd_header hdr, double *bat, double *fluxm_d, double *fluxn_d,
 			etad[0] = -bat[0];
 	}
 
+	if (!has_last) return;		/* All the blocks below write on the last row */
+
 	/* -------- last row & first column */
 	if (bat[ij_grd(hdr.nx-1,0,hdr)] > EPS5) {
 		d__1 = fluxm_d[ij_grd(hdr.nx-2,0,hdr)];
@@ -4020,13 +6914,242 @@ void openb(struct grd_header hdr, double *bat, double *fluxm_d, double *fluxn_d,
 /* update eta and fluxes */
 /* --------------------------------------------------------------------- */
 void update(struct nestContainer *nest, int lev) {
-	memcpy(nest->etaa[lev],    nest->etad[lev],    nest->hdr[lev].nm * sizeof(double));
-	memcpy(nest->fluxm_a[lev], nest->fluxm_d[lev], nest->hdr[lev].nm * sizeof(double));
-	memcpy(nest->fluxn_a[lev], nest->fluxn_d[lev], nest->hdr[lev].nm * sizeof(double));
-	memcpy(nest->htotal_a[lev],nest->htotal_d[lev],nest->hdr[lev].nm * sizeof(double));
+	/* The 'd' arrays become the 'a' ones of the next time step. That is only a pointers swap because every
+	   cell of the 'd' arrays that may differ from 'a' is rewritten at each step (the level 0 cells left out
+	   of the active region are handled by active_region()). But the first time after the arrays were
+	   (re)initialized they are copied instead, so that the cells that are never written (e.g. htotal over
+	   permanent dry land, which the initial conditions may have set) are equal in both. After the call
+	   the current state is in the 'a' arrays and nobody should keep a copy of these pointers. */
+	real *t;
+
+	if (nest->ad_copy[lev]) {
+		memcpy(nest->etaa[lev],    nest->etad[lev],    nest->hdr[lev].nm * sizeof(real));
+		memcpy(nest->fluxm_a[lev], nest->fluxm_d[lev], nest->hdr[lev].nm * sizeof(real));
+		memcpy(nest->fluxn_a[lev], nest->fluxn_d[lev], nest->hdr[lev].nm * sizeof(real));
+		memcpy(nest->htotal_a[lev],nest->htotal_d[lev],nest->hdr[lev].nm * sizeof(real));
+		nest->ad_copy[lev] = FALSE;
+		return;
+	}
+	t = nest->etaa[lev];      nest->etaa[lev] = nest->etad[lev];          nest->etad[lev] = t;
+	t = nest->fluxm_a[lev];   nest->fluxm_a[lev] = nest->fluxm_d[lev];    nest->fluxm_d[lev] = t;
+	t = nest->fluxn_a[lev];   nest->fluxn_a[lev] = nest->fluxn_d[lev];    nest->fluxn_d[lev] = t;
+	t = nest->htotal_a[lev];  nest->htotal_a[lev] = nest->htotal_d[lev];  nest->htotal_d[lev] = t;
+}
+
+/* --------------------------------------------------------------------- */
+/* Zero the cells of one row of a moment output array that are out of [c0, c1[ */
+/* --------------------------------------------------------------------- */
+void zero_outside(real *flux, int row, int nx, int c0, int c1) {
+	/* The moment functions write all cells of the [c0, c1[ interval of the rows they visit and this
+	   clears the others, since update() does not copy the 'd' arrays but swaps them with the 'a' ones */
+	if (c1 <= c0) {
+		memset(&flux[row * nx], 0, nx * sizeof(real));
+		return;
+	}
+	if (c0 > 0)  memset(&flux[row * nx], 0, c0 * sizeof(real));
+	if (c1 < nx) memset(&flux[row * nx + c1], 0, (nx - c1) * sizeof(real));
+}
+
+/* --------------------------------------------------------------------- */
+/* one time step of the base grid with the sweeps fused in bands of rows */
+/* --------------------------------------------------------------------- */
+void tiled_step(struct nestContainer *nest, int isGeog, int tile, int do_openb, int do_max) {
+	/* Does the same as the mass, openb, update_maxs and moment calls of the main loop (no nested grids), but
+	   in bands of TILE rows so that the mass() results of a band are still in cache when moment() reads
+	   them. The moment of row r needs the mass of rows r-1 to r+2, so it lags two rows behind. With OpenMP
+	   each thread pipelines its own slab of rows. The first two and the last rows of a slab are read by
+	   the neighbor slabs, so they are done before a barrier. No cell is computed twice and the results are
+	   those of the separate sweeps. update_maxs() is called as in the main loop, i.e. after update(), but
+	   then eta is the new one over land too. */
+	int ny = nest->hdr[0].ny;
+
+#if HAVE_OPENMP
+#pragma omp parallel
+#endif
+	{
+		int s0, s1, r, r1, m0, n_th = 1, i_th = 0;
+#if HAVE_OPENMP
+		n_th = omp_get_num_threads();	i_th = omp_get_thread_num();
+#endif
+		s0 = (int)((int64_t)ny * i_th / n_th);	s1 = (int)((int64_t)ny * (i_th + 1) / n_th);
+
+		tiled_mass(nest, isGeog, s0, MIN(s0 + 2, s1), do_openb, do_max);
+		tiled_mass(nest, isGeog, MAX(s1 - 1, s0 + 2), s1, do_openb, do_max);
+#if HAVE_OPENMP
+#pragma omp barrier
+#endif
+		for (r = s0 + 2, m0 = s0; r < s1 - 1; r = r1) {
+			r1 = MIN(r + tile, s1 - 1);
+			tiled_mass(nest, isGeog, r, r1, do_openb, do_max);
+			if (r1 < s1 - 1 && r1 - 2 > m0) {
+				tiled_moment(nest, isGeog, m0, r1 - 2);
+				m0 = r1 - 2;
+			}
+		}
+		tiled_moment(nest, isGeog, m0, s1);
+	}
+}
+
+/* --------------------------------------------------------------------- */
+void tiled_mass(struct nestContainer *nest, int isGeog, int row0, int row1, int do_openb, int do_max) {
+	/* The mass, open boundary and max level part of tiled_step() for the rows [row0, row1[ */
+	if (row0 >= row1) return;
+	if (isGeog == 0)
+		mass_rows(nest, 0, row0, row1);
+	else
+		mass_sp_rows(nest, 0, row0, row1);
+	if (do_openb)
+		openb_rows(nest->hdr[0], nest->bat[0], nest->fluxm_a[0], nest->fluxn_a[0], nest->etad[0], nest, row0, row1);
+	if (do_max)
+		update_maxs_rows(nest, nest->etad[0], nest->etad[0], NULL, MAX_LEVEL, row0, row1);
+}
+
+/* --------------------------------------------------------------------- */
+void tiled_moment(struct nestContainer *nest, int isGeog, int row0, int row1) {
+	/* The moment part of tiled_step() for the rows [row0, row1[ */
+	if (row0 >= row1) return;
+	if (isGeog == 0) {
+		moment_M_rows(nest, 0, row0, row1);
+		moment_N_rows(nest, 0, row0, row1);
+	}
+	else {
+		moment_sp_M_rows(nest, 0, row0, row1);
+		moment_sp_N_rows(nest, 0, row0, row1);
+	}
+}
+
+/* --------------------------------------------------------------------- */
+/* bounds of the level 0 cells that may change in next time step */
+/* --------------------------------------------------------------------- */
+double active_region(struct nestContainer *nest, int full) {
+	/* Find, in each row, the first and last cells that are not at rest (water at rest or dry land, with
+	   no fluxes) and dilate those bounds by ACTIVE_HALO cells. That is the most that the mass + moment
+	   stencils can propagate a change in one time step. So the halo follows the numerical stencils and
+	   not the (slower, Courant < 1) physical wave front, and the skipped cells are exactly those that a
+	   full sweep would leave unchanged. With 'full' the whole grid is scanned, otherwise only the current
+	   region (cells outside it are at rest by construction). Must be called after a full time step so
+	   that htotal is consistent with eta. Returns the number of cells in the new active region.
+	   Since update() swaps the 'a' and 'd' arrays, the eta and htotal 'd' cells that mass() will not visit
+	   must hold the current state too. So they are copied here: all cells with 'full', otherwise only
+	   the ones that left the region (the others were not touched since they were last copied). */
+	int row, col, r, k, lo, hi, c0, c1, nx, ny, *tlo, *thi;
+	unsigned int ij;
+	double n = 0;
+	real *bat, *etaa, *etad, *htotal_a, *htotal_d, *fluxm_a, *fluxn_a;
+
+	nx = nest->hdr[0].nx;	ny = nest->hdr[0].ny;
+	tlo = &nest->act_lo[ny];	thi = &nest->act_hi[ny];	/* Second halves are scratch */
+	bat = nest->bat[0];            etaa = nest->etaa[0];            etad = nest->etad[0];
+	fluxm_a = nest->fluxm_a[0];    fluxn_a = nest->fluxn_a[0];
+	htotal_a = nest->htotal_a[0];  htotal_d = nest->htotal_d[0];
+
+	if (full) {
+		memcpy(etad,     etaa,     nest->hdr[0].nm * sizeof(real));
+		memcpy(htotal_d, htotal_a, nest->hdr[0].nm * sizeof(real));
+	}
+
+#if HAVE_OPENMP
+#pragma omp parallel for private(col, ij, lo, hi, c0, c1)
+#endif
+	for (row = 0; row < ny; row++) {
+		c0 = (full) ? 0 : nest->act_lo[row];
+		c1 = (full) ? nx - 1 : nest->act_hi[row];
+		lo = nx;	hi = -1;
+		for (col = c0, ij = row * nx + c0; col <= c1; col++, ij++) {
+			if (bat[ij] <= MAXRUNUP) continue;		/* These never change */
+			if (fluxm_a[ij] != 0 || fluxn_a[ij] != 0 || etaa[ij] != ((bat[ij] > EPS10) ? 0 : -bat[ij])) {
+				if (lo == nx) lo = col;
+				hi = col;
+			}
+		}
+		tlo[row] = lo;		thi[row] = hi;
+	}
+	for (k = 1; k < 10 && nest->level[k] > 0; k++) {	/* upscale() writes on the parent cells covered by the first level nested grids */
+		if (nest->parent[k] != 0) continue;
+		for (row = nest->LLrow[k]; row <= nest->ULrow[k]; row++) {
+			tlo[row] = MIN(tlo[row], nest->LLcol[k]);
+			thi[row] = MAX(thi[row], nest->LRcol[k]);
+		}
+	}
+
+	for (row = 0; row < ny; row++) {
+		lo = nx;	hi = -1;
+		for (r = MAX(row - ACTIVE_HALO, 0); r <= MIN(row + ACTIVE_HALO, ny - 1); r++) {
+			if (tlo[r] < lo) lo = tlo[r];
+			if (thi[r] > hi) hi = thi[r];
+		}
+		if (hi >= 0) {
+			lo = MAX(lo - ACTIVE_HALO, 0);		hi = MIN(hi + ACTIVE_HALO, nx - 1);
+			n += hi - lo + 1;
+		}
+		if (!full) {
+			for (col = nest->act_lo[row], ij = row * nx + col; col <= nest->act_hi[row]; col++, ij++) {
+				if (col >= lo && col <= hi) continue;
+				etad[ij] = etaa[ij];	htotal_d[ij] = htotal_a[ij];
+			}
+		}
+		nest->act_lo[row] = lo;		nest->act_hi[row] = hi;
+	}
+	return (n);
 }
 
 
+/* -------------------------------------------------------------------- */
+/* Branch free version of the b3/d3 (interior wet-wet) case of moment_M for the [v0, v1[ columns of one
+   row (-s option). Same expressions as in moment_M, but all upwind candidates are computed and the choices
+   are turned into selects so that the compiler can vectorize the loop. The result is stored for all those
+   columns and moment_M redoes the cells that are not wet-wet (see WETWET_M) */
+void moment_M_wet(real *RESTRICT fluxm_d, real *RESTRICT fluxm_a, real *RESTRICT fluxn_a, real *RESTRICT htotal_a, real *RESTRICT htotal_d,
+	real *RESTRICT etad, int ij0, int v0, int v1, int rm1, int rp1, int rm2, double dtdx, double dtdy, double cor, int do_cor) {
+	int col;
+
+#if HAVE_OPENMP && _OPENMP >= 201307
+#pragma omp simd
+#endif
+	for (col = v0; col < v1; col++) {
+		int    k = ij0 + col;
+		double a_dd, a_dpa, a_dpa_cp1, a_dpa_cm1, a_dpa_rp1, a_dpa_rm1, a_xqq, a_xqe_p, a_xqe_m, a_xp, a_advx, a_advy;
+		double t1, t2, t3, t4;
+		a_dd  = (htotal_d[k] + htotal_d[k+1]) * 0.5;
+		a_dpa = (htotal_d[k] + htotal_a[k] + htotal_d[k+1] + htotal_a[k+1]) * 0.25;
+		a_xqq = (fluxn_a[k] + fluxn_a[k+1] + fluxn_a[k-rm1] + fluxn_a[k+1-rm1]) * 0.25;
+		a_xp  = fluxm_a[k] - dtdx * NORMAL_GRAV * a_dd * (etad[k+1] - etad[k]);
+		a_xp  = (do_cor) ? a_xp + cor * a_xqq : a_xp;
+
+		/* All upwind candidates are computed and the right one is picked up afterwards */
+		a_dpa_cp1 = (htotal_d[k+1] + htotal_a[k+1] + htotal_d[k+2] + htotal_a[k+2]) * 0.25;
+		a_dpa_cm1 = (htotal_d[k-1] + htotal_a[k-1] + htotal_d[k] + htotal_a[k]) * 0.25;
+		t1 = -dtdx * (fluxm_a[k] * fluxm_a[k] / a_dpa);
+		t2 =  dtdx * (fluxm_a[k+1]*fluxm_a[k+1] / a_dpa_cp1 - fluxm_a[k]*fluxm_a[k] / a_dpa);
+		t3 =  dtdx * (fluxm_a[k] * fluxm_a[k] / a_dpa);
+		t4 =  dtdx * (fluxm_a[k] * fluxm_a[k] / a_dpa - fluxm_a[k-1] * fluxm_a[k-1] / a_dpa_cm1);
+		t1 = ((a_dpa_cp1 < EPS3) | (htotal_d[k+1] < EPS5)) ? t1 : t2;
+		t3 = ((a_dpa_cm1 < EPS3) | (htotal_d[k] < EPS5)) ? t3 : t4;
+		a_advx = (fluxm_a[k] < 0) ? t1 : t3;
+
+		a_dpa_rp1 = (htotal_d[k+rp1] + htotal_a[k+rp1] + htotal_d[k+1+rp1] + htotal_a[k+1+rp1]) * 0.25;
+		a_dpa_rm1 = (htotal_d[k-rm1] + htotal_a[k-rm1] + htotal_d[k+1-rm1] + htotal_a[k+1-rm1]) * 0.25;
+		a_xqe_p = (fluxn_a[k+rp1] + fluxn_a[k+1+rp1] + fluxn_a[k] + fluxn_a[k+1]) * 0.25;
+		a_xqe_m = (fluxn_a[k-rm1] + fluxn_a[k+1-rm1] + fluxn_a[k-rm2] + fluxn_a[k+1-rm2]) * 0.25;
+		t1 = -dtdy * (fluxm_a[k] * a_xqq / a_dpa);
+		t2 =  dtdy * (fluxm_a[k+rp1] * a_xqe_p / a_dpa_rp1 - fluxm_a[k] * a_xqq / a_dpa);
+		t3 =  dtdy * (fluxm_a[k] * a_xqq / a_dpa);
+		t4 =  dtdy * (fluxm_a[k] * a_xqq / a_dpa - fluxm_a[k-rm1] * a_xqe_m / a_dpa_rm1);
+		t1 = ((htotal_d[k+rp1] < EPS5) | (htotal_d[k+1+rp1] < EPS5) | (a_dpa_rp1 < EPS5)) ? t1 : t2;
+		t3 = ((htotal_d[k-rm1] < EPS5) | (htotal_d[k+1-rm1] < EPS5) | (a_dpa_rm1 < EPS5)) ? t3 : t4;
+		a_advy = (a_xqq < 0) ? t1 : t3;
+
+		a_xp = a_xp - a_advx - a_advy;
+#ifdef LIMIT_DISCHARGE
+		t1 = V_LIMIT * a_dd;
+		a_xp = (fabs(a_xp) < EPS10) ? 0 : a_xp;
+		a_xp = (a_xp > t1) ? t1 : a_xp;
+		a_xp = (a_xp < -t1) ? -t1 : a_xp;
+#endif
+		fluxm_d[k] = a_xp;
+	}
+}
+
 /* -------------------------------------------------------------------------
  * Solve nonlinear momentum equation, cartesian coordinates with moving boundary
  *
@@ -4044,18 +7167,26 @@ void update(struct nestContainer *nest, int lev) {
  *		Updates fluxm_d and fluxn_d
  * ---------------------------------------------------------------------- */
 void moment_M(struct nestContainer *nest, int lev) {
+	moment_M_rows(nest, lev, 0, nest->hdr[lev].ny);
+}
+
+/* Same as moment_M() but only for the rows [row0, row1[ (see tiled_step()) */
+void moment_M_rows(struct nestContainer *nest, int lev, int row0, int row1) {
 
 	unsigned int ij;
-	int first, last, jupe, row, col;
+	int first, last, jupe, row, col, c0, c1;
 	int valid_vel;
 	int cm1, rm1;			/* previous column (cm1 = col - 1) and row (rm1 = row - 1) */
 	int cp1, rp1;			/* next column (cp1 = col + 1) and row (rp1 = row + 1) */
 	int rm2, cp2;
+	int v0, v1, do_vec, do_cor;	/* Columns interval done by the branch free loop and its switches */
+	double cor;
 	double xp, xqe, xqq, ff = 0, dd, df, cte, f_limit;
 	double advx, dtdx, dtdy, advy, rlat;
 	double dpa_ij, dpa_ij_rp1, dpa_ij_rm1, dpa_ij_cm1, dpa_ij_cp1;
 
-	double dt, manning, *bat, *htotal_a, *htotal_d, *etad, *fluxm_a, *fluxm_d, *fluxn_a, *fluxn_d, *vex, *r4m;
+	double dt, manning, *r4m;
+	real   *bat, *htotal_a, *htotal_d, *etad, *fluxm_a, *fluxm_d, *fluxn_a, *fluxn_d, *vex;
 	struct grd_header hdr;
 
 	hdr      = nest->hdr[lev];             vex      = nest->vex[lev];
@@ -4082,26 +7213,47 @@ void moment_M(struct nestContainer *nest, int lev) {
 
 	/* fixes friction parameter */
 	cte = (manning != 0) ? manning * manning * dt * 4.9 : 0;
+	do_cor = nest->do_Coriolis;
+	do_vec = (nest->do_simd && manning == 0 && !(nest->out_velocity_x && (lev == nest->writeLevel)));	/* The velocities need the cases cascade */
 
-	memset(fluxm_d, 0, hdr.nm * sizeof(double));	/* Do this rather than seting to zero under looping conditions */
+	if (last && row1 == hdr.ny) zero_outside(fluxm_d, hdr.ny - 1, hdr.nx, 0, 0);	/* The row not visited by the loop below */
 
 	/* main computation cycle fluxm_d */
-	for (row = 0; row < hdr.ny - last; row++) {
+#if HAVE_OPENMP
+#pragma omp parallel for private(ij, col, c0, c1, v0, v1, cor, valid_vel, cm1, rm1, cp1, rp1, rm2, cp2, xp, xqe, xqq, ff, dd, df, f_limit, \
+	advx, advy, dpa_ij, dpa_ij_rp1, dpa_ij_rm1, dpa_ij_cm1, dpa_ij_cp1)
+#endif
+	for (row = row0; row < MIN(row1, hdr.ny - last); row++) {
 		rp1 = (row < hdr.ny - 1) ? hdr.nx : 0;
 		rm1 = (row == 0) ? 0 : hdr.nx;
-		ij = row * hdr.nx - 1 + first;
+		c0 = first;		c1 = hdr.nx - 1;
+		ACTIVE_COLS(nest, lev, row, c0, c1);
+		zero_outside(fluxm_d, row, hdr.nx, c0, c1);	/* Columns not visited by the loop below */
+		v0 = v1 = 0;
+
+		if (do_vec && row >= jupe && row <= (hdr.ny - jupe - 1)) {
+			/* Branch free pass over the interior cells. Those that are not wet-wet are redone below */
+			rm2 = (row < 2) ? 0 : 2 * hdr.nx;
+			v0 = MAX(c0, MAX(jupe, 1));		v1 = MIN(c1, MIN(hdr.nx - jupe, hdr.nx - 2));
+			cor = (do_cor) ? r4m[row] * 2 : 0;
+			moment_M_wet(fluxm_d, fluxm_a, fluxn_a, htotal_a, htotal_d, etad, row * hdr.nx, v0, v1, rm1, rp1, rm2, dtdx, dtdy, cor, do_cor);
+		}
 
-		for (col = first; col < hdr.nx - 1; col++) {
+		ij = row * hdr.nx - 1 + c0;
+		for (col = c0; col < c1; col++) {
 			cp1 = 1;
 			cp2 = (col < hdr.nx - 2) ? 2 : 1;
 			cm1 = (col == 0) ? 0 : 1;
 			ij++;
+			if (col >= v0 && col < v1) {	/* The branch free pass stored the wet-wet solution here */
+				if (WETWET_M(ij)) continue;
+			}
 			/* no flux to permanent dry areas */
-			if (bat[ij] <= MAXRUNUP) continue;
+			if (bat[ij] <= MAXRUNUP) {fluxm_d[ij] = 0;	continue;}
 
 			/* Looks weird but it's faster than an IF case (branch prediction?) */
 			dpa_ij = (dpa_ij = (htotal_d[ij] + htotal_a[ij] + htotal_d[ij+cp1] + htotal_a[ij+cp1]) * 0.25) > EPS5 ? dpa_ij : 0;
-			xp = 0;
+			xp = dd = 0;		/* dd reset so that vex never depends on the previous cell (thread safe) */
 
 			valid_vel = TRUE;
 			if (htotal_d[ij] > EPS5 && htotal_d[ij+cp1] > EPS5) {		/* case wet-wet */
@@ -4219,29 +7371,88 @@ L120:
 					xp = -f_limit;
 			}
 #endif
-			fluxm_d[ij] = xp;
-
 L121:
+			fluxm_d[ij] = xp;		/* Also on the no flux jumps, where it is still 0 */
 			if (nest->out_velocity_x && (lev == nest->writeLevel))
 				vex[ij] = (valid_vel && dd > EPS3) ? xp / df : 0;
 		}
 	}
 }
 
+/* -------------------------------------------------------------------- */
+/* Same as moment_M_wet but for moment_N */
+void moment_N_wet(real *RESTRICT fluxn_d, real *RESTRICT fluxm_a, real *RESTRICT fluxn_a, real *RESTRICT htotal_a, real *RESTRICT htotal_d,
+	real *RESTRICT etad, int ij0, int v0, int v1, int rm1, int rp1, int rp2, double dtdx, double dtdy, double cor, int do_cor) {
+	int col;
+
+#if HAVE_OPENMP && _OPENMP >= 201307
+#pragma omp simd
+#endif
+	for (col = v0; col < v1; col++) {
+		int    k = ij0 + col;
+		double a_dd, a_dqa, a_dqa_rp1, a_dqa_rm1, a_dqa_cp1, a_dqa_cm1, a_xpp, a_xpe_p, a_xpe_m, a_xq, a_advx, a_advy;
+		double t1, t2, t3, t4;
+		a_dd  = (htotal_d[k] + htotal_d[k+rp1]) * 0.5;
+		a_dqa = (htotal_d[k] + htotal_a[k] + htotal_d[k+rp1] + htotal_a[k+rp1]) * 0.25;
+		a_xpp = (fluxm_a[k] + fluxm_a[k+rp1] + fluxm_a[k-1] + fluxm_a[k-1+rp1]) * 0.25;
+		a_xq  = fluxn_a[k] - dtdy * NORMAL_GRAV * a_dd * (etad[k+rp1] - etad[k]);
+		a_xq  = (do_cor) ? a_xq - cor * a_xpp : a_xq;
+
+		a_dqa_rp1 = (htotal_d[k+rp1] + htotal_a[k+rp1] + htotal_d[k+rp2] + htotal_a[k+rp2]) * 0.25;
+		a_dqa_rm1 = (htotal_d[k-rm1] + htotal_a[k-rm1] + htotal_d[k] + htotal_a[k]) * 0.25;
+		t1 = -dtdy * ((fluxn_a[k] * fluxn_a[k]) / a_dqa);
+		t2 =  dtdy * (fluxn_a[k+rp1]*fluxn_a[k+rp1] / a_dqa_rp1 - fluxn_a[k]*fluxn_a[k] / a_dqa);
+		t3 =  dtdy * (fluxn_a[k] * fluxn_a[k]) / a_dqa;
+		t4 =  dtdy * (fluxn_a[k] * fluxn_a[k] / a_dqa - fluxn_a[k-rm1]*fluxn_a[k-rm1] / a_dqa_rm1);
+		t1 = ((a_dqa_rp1 < EPS5) | (htotal_d[k+rp1] < EPS5)) ? t1 : t2;
+		t3 = ((a_dqa_rm1 < EPS3) | (htotal_d[k] < EPS5)) ? t3 : t4;
+		a_advy = (fluxn_a[k] < 0) ? t1 : t3;
+
+		a_dqa_cp1 = (htotal_d[k+1] + htotal_a[k+1] + htotal_d[k+rp1+1] + htotal_a[k+rp1+1]) * 0.25;
+		a_dqa_cm1 = (htotal_d[k-1] + htotal_a[k-1] + htotal_d[k+rp1-1] + htotal_a[k+rp1-1]) * 0.25;
+		a_xpe_p = (fluxm_a[k+1] + fluxm_a[k+1+rp1] + fluxm_a[k] + fluxm_a[k+rp1]) * 0.25;
+		a_xpe_m = (fluxm_a[k-1] + fluxm_a[k-1+rp1] + fluxm_a[k-2] + fluxm_a[k-2+rp1]) * 0.25;
+		t1 = -dtdx * (fluxn_a[k] * a_xpp / a_dqa);
+		t2 =  dtdx * (fluxn_a[k+1] * a_xpe_p / a_dqa_cp1 - fluxn_a[k] * a_xpp / a_dqa);
+		t3 =  dtdx * (fluxn_a[k] * a_xpp / a_dqa);
+		t4 =  dtdx * (fluxn_a[k] * a_xpp / a_dqa - fluxn_a[k-1] * a_xpe_m / a_dqa_cm1);
+		t1 = ((htotal_d[k+1] < EPS5) | (htotal_d[k+1+rp1] < EPS5) | (a_dqa_cp1 < EPS3)) ? t1 : t2;
+		t3 = ((htotal_d[k-1] < EPS5) | (htotal_d[k-1+rp1] < EPS5) | (a_dqa_cm1 < EPS3)) ? t3 : t4;
+		a_advx = (a_xpp < 0) ? t1 : t3;
+
+		a_xq = a_xq - a_advx - a_advy;
+#ifdef LIMIT_DISCHARGE
+		t1 = V_LIMIT * a_dd;
+		a_xq = (fabs(a_xq) < EPS10) ? 0 : a_xq;
+		a_xq = (a_xq > t1) ? t1 : a_xq;
+		a_xq = (a_xq < -t1) ? -t1 : a_xq;
+#endif
+		fluxn_d[k] = a_xq;
+	}
+}
+
 /* -------------------------------------------------------------------- */
 void moment_N(struct nestContainer *nest, int lev) {
+	moment_N_rows(nest, lev, 0, nest->hdr[lev].ny);
+}
+
+/* Same as moment_N() but only for the rows [row0, row1[ (see tiled_step()) */
+void moment_N_rows(struct nestContainer *nest, int lev, int row0, int row1) {
 
 	unsigned int ij;
-	int first, last, jupe, row, col;
+	int first, last, jupe, row, col, c0, c1;
 	int valid_vel;
 	int cm1, rm1;			/* previous column (cm1 = col - 1) and row (rm1 = row - 1) */
 	int cp1, rp1;			/* next column (cp1 = col + 1) and row (rp1 = row + 1) */
 	int cm2, rp2;
+	int v0, v1, do_vec, do_cor;	/* Columns interval done by the branch free loop and its switches */
+	double cor;
 	double xq, xpe, xpp, ff = 0, dd, df, cte, f_limit;
 	double advx, dtdx, dtdy, advy, rlat;
 	double dqa_ij, dqa_ij_rp1, dqa_ij_rm1, dqa_ij_cm1, dqa_ij_cp1;
 
-	double dt, manning, *bat, *htotal_a, *htotal_d, *etad, *fluxm_a, *fluxm_d, *fluxn_a, *fluxn_d, *vey, *r4n;
+	double dt, manning, *r4n;
+	real   *bat, *htotal_a, *htotal_d, *etad, *fluxm_a, *fluxm_d, *fluxn_a, *fluxn_d, *vey;
 	struct grd_header hdr;
 
 	hdr      = nest->hdr[lev];             vey      = nest->vey[lev];
@@ -4268,25 +7479,47 @@ void moment_N(struct nestContainer *nest, int lev) {
 
 	/* fixes friction parameter */
 	cte = (manning != 0) ? manning * manning * dt * 4.9 : 0;
+	do_cor = nest->do_Coriolis;
+	do_vec = (nest->do_simd && manning == 0 && !(nest->out_velocity_y && (lev == nest->writeLevel)));	/* The velocities need the cases cascade */
 
-	memset(fluxn_d, 0, hdr.nm * sizeof(double));	/* Do this rather than seting to zero under looping conditions */ 
+	if (first && row0 == 0) zero_outside(fluxn_d, 0, hdr.nx, 0, 0);	/* The rows not visited by the loop below */
+	if (row1 == hdr.ny) zero_outside(fluxn_d, hdr.ny - 1, hdr.nx, 0, 0);
 
 	/* main computation cycle fluxn_d */
-	for (row = first; row < hdr.ny - 1; row++) {
+#if HAVE_OPENMP
+#pragma omp parallel for private(ij, col, c0, c1, v0, v1, cor, valid_vel, cm1, rm1, cp1, rp1, cm2, rp2, xq, xpe, xpp, ff, dd, df, f_limit, \
+	advx, advy, dqa_ij, dqa_ij_rp1, dqa_ij_rm1, dqa_ij_cm1, dqa_ij_cp1)
+#endif
+	for (row = MAX(row0, first); row < MIN(row1, hdr.ny - 1); row++) {
 		rp1 = hdr.nx;
 		rp2 = (row < hdr.ny - 2) ? 2*hdr.nx : hdr.nx;
 		rm1 = (row == 0) ? 0 : hdr.nx;
-		ij = row * hdr.nx - 1;
-		for (col = 0; col < hdr.nx - last; col++) {
+		c0 = 0;		c1 = hdr.nx - last;
+		ACTIVE_COLS(nest, lev, row, c0, c1);
+		zero_outside(fluxn_d, row, hdr.nx, c0, c1);	/* Columns not visited by the loop below */
+		v0 = v1 = 0;
+
+		if (do_vec && row >= jupe && row <= (hdr.ny - jupe - 1)) {
+			/* Branch free pass over the interior cells. Those that are not wet-wet are redone below */
+			v0 = MAX(c0, MAX(jupe, 2));		v1 = MIN(c1, MIN(hdr.nx - jupe, hdr.nx - 1));
+			cor = (do_cor) ? r4n[row] * 2 : 0;
+			moment_N_wet(fluxn_d, fluxm_a, fluxn_a, htotal_a, htotal_d, etad, row * hdr.nx, v0, v1, rm1, rp1, rp2, dtdx, dtdy, cor, do_cor);
+		}
+
+		ij = row * hdr.nx - 1 + c0;
+		for (col = c0; col < c1; col++) {
 			cp1 = (col < hdr.nx - 1) ? 1 : 0;
 			cm1 = (col == 0) ? 0 : 1;
 			ij++;
+			if (col >= v0 && col < v1) {	/* The branch free pass stored the wet-wet solution here */
+				if (WETWET_N(ij)) continue;
+			}
 			/* no flux to permanent dry areas */
-			if (bat[ij] <= MAXRUNUP) continue;
+			if (bat[ij] <= MAXRUNUP) {fluxn_d[ij] = 0;	continue;}
 
 			/* Looks weird but it's faster than an IF case (branch prediction?) */
 			dqa_ij = (dqa_ij = (htotal_d[ij] + htotal_a[ij] + htotal_d[ij+rp1] + htotal_a[ij+rp1]) * 0.25) > EPS5 ? dqa_ij : 0;
-			xq = 0;
+			xq = dd = 0;
 
 			/* moving boundary - Imamura algorithm following cho 2009 */
 			valid_vel = TRUE;
@@ -4404,9 +7637,8 @@ L200:
 				else if (xq < -f_limit) xq = -f_limit;
 			}
 #endif
-			fluxn_d[ij] = xq;
-
 L201:
+			fluxn_d[ij] = xq;		/* Also on the no flux jumps, where it is still 0 */
 			if (nest->out_velocity_y && (lev == nest->writeLevel))
 				vey[ij] = (valid_vel && dd > EPS3) ? xq / df : 0;
 		}
@@ -4417,8 +7649,8 @@ L201:
 /* initializes parameters needed for spherical computations */
 /* -------------------------------------------------------------------- */
 void inisp(struct nestContainer *nest) {
-	int row, k = 0;
-	double phim_rad, phin_rad, omega, raio_t, dxtemp, dytemp, dt;
+	int row, k = 0, r_off;
+	double phim_rad, phin_rad, omega, raio_t, dxtemp, dytemp, dt, y0;
 
 	raio_t = 6.371e6;
 	omega = 7.2722e-5;
@@ -4426,9 +7658,13 @@ void inisp(struct nestContainer *nest) {
 		dt = nest->dt[k];
 		dxtemp = raio_t * nest->hdr[k].x_inc * D2R;
 		dytemp = raio_t * nest->hdr[k].y_inc * D2R;
+		y0 = nest->hdr[k].y_min;	r_off = 0;
+		if (k == 0 && nest->strip) {	/* Count rows from the whole grid so that the latitudes are the same */
+			y0 = nest->strip->g.y_min;	r_off = nest->strip->row0;
+		}
 		for (row = 0; row < nest->hdr[k].ny; row++) {
-			phim_rad = (nest->hdr[k].y_min + row * nest->hdr[k].y_inc) * D2R;
-			phin_rad = (nest->hdr[k].y_min + (row + 0.5) * nest->hdr[k].y_inc) * D2R;
+			phim_rad = (y0 + (row + r_off) * nest->hdr[k].y_inc) * D2R;
+			phin_rad = (y0 + (row + r_off + 0.5) * nest->hdr[k].y_inc) * D2R;
 			nest->r0[k][row] = dt / dytemp;
 			nest->r1m[k][row] = sin(phim_rad);
 			nest->r1n[k][row] = cos(phin_rad);
@@ -4447,14 +7683,15 @@ void inisp(struct nestContainer *nest) {
 /* initializes vectors needed for computing the Coriolis  */
 /* -------------------------------------------------------------------- */
 void inicart(struct nestContainer *nest) {
-	int row, k = 0;
+	int row, k = 0, r_off;
 	double phim_rad, phin_rad, dt, omega = 7.2722e-5;
 
 	while (nest->level[k] >= 0) {
 		dt = nest->dt[k];
+		r_off = (k == 0 && nest->strip) ? nest->strip->row0 : 0;
 		for (row = 0; row < nest->hdr[k].ny; row++) {
-			phim_rad = nest->lat_min4Coriolis + row * nest->hdr[k].y_inc * M_PI / 2e9;
-			phin_rad = nest->lat_min4Coriolis + (row * nest->hdr[k].y_inc + nest->hdr[k].y_inc / 2.) * M_PI / 2e9;
+			phim_rad = nest->lat_min4Coriolis + (row + r_off) * nest->hdr[k].y_inc * M_PI / 2e9;
+			phin_rad = nest->lat_min4Coriolis + ((row + r_off) * nest->hdr[k].y_inc + nest->hdr[k].y_inc / 2.) * M_PI / 2e9;
 			nest->r4m[k][row] = dt * omega * sin(phim_rad);
 			nest->r4n[k][row] = dt * omega * sin(phin_rad);
 		}
@@ -4462,6 +7699,82 @@ void inicart(struct nestContainer *nest) {
 	}
 }
 
+/* -------------------------------------------------------------------- */
+/* Largest stable time step of grid LEV for the adaptive time step. It is COURANT times the cell size over
+   the fastest signal of the wet cells, the celerity sqrt(g*h) plus the flow speed. As in the moment
+   functions, the speed is bounded by V_LIMIT. Returns a huge value when the whole grid is dry. */
+/* -------------------------------------------------------------------- */
+double cfl_dt(struct nestContainer *nest, int lev, int isGeog, double courant) {
+	int row, col, nx = nest->hdr[lev].nx;
+	unsigned int ij;
+	double c, h, u, c_thr, c_max = 0, scale = (isGeog) ? 111000 : 1;		/* To get the incs in meters */
+	real *bat = nest->bat[lev], *eta = nest->etaa[lev], *fluxm = nest->fluxm_a[lev], *fluxn = nest->fluxn_a[lev];
+
+	/* Each thread keeps its own max, merged at the end (no max reductions before OpenMP 3.1, e.g. cl /openmp) */
+#if HAVE_OPENMP
+#pragma omp parallel private(row, col, ij, c, h, u, c_thr)
+#endif
+	{
+		c_thr = 0;
+#if HAVE_OPENMP
+#pragma omp for
+#endif
+		for (row = 0; row < nest->hdr[lev].ny; row++) {
+			for (col = 0, ij = row * nx; col < nx; col++, ij++) {
+				if ((h = bat[ij] + eta[ij]) <= EPS2) continue;	/* Not htotal, that is still zero before the first step */
+				u = sqrt(fluxm[ij] * fluxm[ij] + fluxn[ij] * fluxn[ij]) / h;
+				c = sqrt(NORMAL_GRAV * h) + MIN(u, V_LIMIT);
+				if (c > c_thr) c_thr = c;
+			}
+		}
+#if HAVE_OPENMP
+#pragma omp critical (cfl_max)
+#endif
+		if (c_thr > c_max) c_max = c_thr;
+	}
+	return (c_max > 0) ? courant * MIN(nest->hdr[lev].x_inc, nest->hdr[lev].y_inc) * scale / c_max : 1e30;
+}
+
+/* -------------------------------------------------------------------- */
+/* Pick the time steps of all grids for the next cycle of DT seconds. The base grid does the cycle in the
+   fewest equal steps that are stable, and each nested grid does the step of its parent in the fewest
+   equal steps that are stable (the same rule as in initialize_nestum()), so that the ratios stay integer
+   and the cycle ends exactly at the output times. Returns the number of steps of the base grid. */
+/* -------------------------------------------------------------------- */
+int adapt_dt(struct nestContainer *nest, int nNg, int isGeog, double dt, double courant) {
+	int lev, lev_P, n_sub;
+
+	n_sub = (int)ceil(dt / cfl_dt(nest, 0, isGeog, courant));
+	nest->dt[0] = dt / n_sub;
+	for (lev = 1; lev <= nNg; lev++) {
+		lev_P = nest->parent[lev];
+		nest->dt[lev] = nest->dt[lev_P] / ceil(nest->dt[lev_P] / cfl_dt(nest, lev, isGeog, courant));
+	}
+	return (n_sub);
+}
+
+/* -------------------------------------------------------------------- */
+/* Write one line of the history of the adaptive time step: the time and cycle from which the time steps
+   are used, the number of base grid steps in a cycle and the time step of each grid. */
+/* -------------------------------------------------------------------- */
+void log_dt(FILE *fp, struct nestContainer *nest, int nNg, int cycle, double time_h, int n_sub) {
+	int lev;
+
+	if (fp) {
+		fprintf(fp, "%.3f\t%d\t%d", time_h, cycle, n_sub);
+		for (lev = 0; lev <= nNg; lev++)
+			fprintf(fp, "\t%.6g", nest->dt[lev]);
+		fprintf(fp, "\n");
+	}
+	else {
+		mexPrintf("Time step at t = %.3f (cycle %d): %d steps of %g", time_h, cycle, n_sub, nest->dt[0]);
+		for (lev = 1; lev <= nNg; lev++) {
+			mexPrintf(", grid %d: %g", lev, nest->dt[lev]);
+		}
+		mexPrintf("\n");
+	}
+}
+
 /* -------------------------------------------------------------------- */
 /* solves non linear continuity equation w/ spherical coordinates */
 /* Computes water depth (htotal) needed for friction and */
@@ -4470,17 +7783,28 @@ void inicart(struct nestContainer *nest) {
 /* htotal > 0 - wet cell with htotal (m) of water depth */
 /* -------------------------------------------------------------------- */
 void mass_sp(struct nestContainer *nest, int lev) {
+	mass_sp_rows(nest, lev, 0, nest->hdr[lev].ny);
+}
+
+/* Same as mass_sp() but only for the rows [row0, row1[ (see tiled_step()) */
+void mass_sp_rows(struct nestContainer *nest, int lev, int row0, int row1) {
 
 	unsigned int ij;
 	int row, col;
 	int cm1, rm1, rowm1;			/* previous column (cm1 = col -1) and row (rm1 = row - 1) */
+	int c0, c1;				/* First and last+1 columns to compute in each row */
 	double etan, dd;
 
-	for (row = 0; row < nest->hdr[lev].ny; row++) {
-		ij = row * nest->hdr[lev].nx;
+#if HAVE_OPENMP
+#pragma omp parallel for private(ij, col, c0, c1, cm1, rm1, rowm1, etan, dd)
+#endif
+	for (row = row0; row < row1; row++) {
+		c0 = 0;		c1 = nest->hdr[lev].nx;
+		ACTIVE_COLS(nest, lev, row, c0, c1);
+		ij = row * nest->hdr[lev].nx + c0;
 		rm1 = ((row == 0) ? 0 : 1) * nest->hdr[lev].nx;
 		rowm1 = MAX(row - 1, 0);
-		for (col = 0; col < nest->hdr[lev].nx; col++) {
+		for (col = c0; col < c1; col++) {
 			/* case ocean and non permanent dry area */
 			if (nest->bat[lev][ij] > MAXRUNUP) {
 				cm1 = (col == 0) ? 0 : 1;
@@ -4513,22 +7837,85 @@ void mass_sp(struct nestContainer *nest, int lev) {
 	}
 }
 
+/* -------------------------------------------------------------------- */
+/* Same as moment_M_wet but for moment_sp_M. The double locals mirror the ones of moment_sp_M so that
+   both give the same bits also with single precision state arrays */
+void moment_sp_M_wet(real *RESTRICT fluxm_d, real *RESTRICT fluxm_a, real *RESTRICT fluxn_a, real *RESTRICT htotal_a, real *RESTRICT htotal_d,
+	real *RESTRICT etad, int ij0, int v0, int v1, int rm1, int rp1, int rm2, double r0, double r2m, double r3m, double cor, int do_cor) {
+	int col;
+
+#if HAVE_OPENMP && _OPENMP >= 201307
+#pragma omp simd
+#endif
+	for (col = v0; col < v1; col++) {
+		int    k = ij0 + col;
+		double h0 = htotal_d[k], h1 = htotal_d[k+1], e0 = etad[k], m0 = fluxm_a[k];
+		double h_rp1 = htotal_d[k+rp1], h1_rp1 = htotal_d[k+1+rp1], h_rm1 = htotal_d[k-rm1], h1_rm1 = htotal_d[k+1-rm1];
+		double a_dd, a_dpa, a_dpa_cp1, a_dpa_cm1, a_dpa_rp1, a_dpa_rm1, a_xqq, a_xqe_p, a_xqe_m, a_xp, a_advx, a_advy;
+		double t1, t2, t3, t4;
+		a_dd  = (h0 + h1) * 0.5;
+		a_dpa = (h0 + htotal_a[k] + h1 + htotal_a[k+1]) * 0.25;
+		a_xqq = (fluxn_a[k] + fluxn_a[k+1] + fluxn_a[k-rm1] + fluxn_a[k+1-rm1]) * 0.25;
+		a_xp  = m0 - r3m * a_dd * (etad[k+1] - e0);
+		a_xp  = (do_cor) ? a_xp + cor * a_xqq : a_xp;
+
+		a_dpa_cp1 = (h1 + htotal_a[k+1] + htotal_d[k+2] + htotal_a[k+2]) * 0.25;
+		a_dpa_cm1 = (htotal_d[k-1] + htotal_a[k-1] + h0 + htotal_a[k]) * 0.25;
+		t1 = -r2m * (m0 * m0) / a_dpa;
+		t2 = -r2m * (m0*m0) / a_dpa + r2m * (fluxm_a[k+1]*fluxm_a[k+1]) / a_dpa_cp1;
+		t3 =  r2m * (m0 * m0) / a_dpa;
+		t4 =  r2m * (m0 * m0) / a_dpa - r2m * (fluxm_a[k-1] * fluxm_a[k-1]) / a_dpa_cm1;
+		t1 = ((a_dpa_cp1 < EPS3) | (h1 < EPS5)) ? t1 : t2;
+		t3 = ((a_dpa_cm1 < EPS3) | (h0 < EPS5)) ? t3 : t4;
+		a_advx = (m0 < 0) ? t1 : t3;
+
+		a_dpa_rp1 = (h_rp1 + htotal_a[k+rp1] + h1_rp1 + htotal_a[k+1+rp1]) * 0.25;
+		a_dpa_rm1 = (h_rm1 + htotal_a[k-rm1] + h1_rm1 + htotal_a[k+1-rm1]) * 0.25;
+		a_xqe_p = (fluxn_a[k+rp1] + fluxn_a[k+1+rp1] + fluxn_a[k] + fluxn_a[k+1]) * 0.25;
+		a_xqe_m = (fluxn_a[k-rm1] + fluxn_a[k+1-rm1] + fluxn_a[k-rm2] + fluxn_a[k+1-rm2]) * 0.25;
+		t1 = -r0 * (m0 * a_xqq / a_dpa);
+		t2 = -r0 * (m0 * a_xqq / a_dpa) + r0 * (fluxm_a[k+rp1] * a_xqe_p / a_dpa_rp1);
+		t3 =  r0 * (m0 * a_xqq / a_dpa);
+		t4 =  r0 * (m0 * a_xqq / a_dpa) - r0 * (fluxm_a[k-rm1] * a_xqe_m / a_dpa_rm1);
+		t1 = ((a_dpa_rp1 < EPS5) | (h_rp1 < EPS5) | (h1_rp1 < EPS5)) ? t1 : t2;
+		t3 = ((a_dpa_rm1 < EPS5) | (h_rm1 < EPS5) | (h1_rm1 < EPS5)) ? t3 : t4;
+		a_advy = (a_xqq < 0) ? t1 : t3;
+
+		a_xp = a_xp - a_advx - a_advy;
+#ifdef LIMIT_DISCHARGE
+		t1 = V_LIMIT * a_dd;
+		a_xp = (fabs(a_xp) < EPS10) ? 0 : a_xp;
+		a_xp = (a_xp > t1) ? t1 : a_xp;
+		a_xp = (a_xp < -t1) ? -t1 : a_xp;
+#endif
+		fluxm_d[k] = a_xp;
+	}
+}
+
 /* ---------------------------------------------------------------------- */
 /* Solve nonlinear momentum equation, in spherical coordinates */
 /* with moving boundary */
 /* ---------------------------------------------------------------------- */
 void moment_sp_M(struct nestContainer *nest, int lev) {
+	moment_sp_M_rows(nest, lev, 0, nest->hdr[lev].ny);
+}
+
+/* Same as moment_sp_M() but only for the rows [row0, row1[ (see tiled_step()) */
+void moment_sp_M_rows(struct nestContainer *nest, int lev, int row0, int row1) {
 
 	unsigned int ij;
-	int first, last, jupe, row, col;
+	int first, last, jupe, row, col, c0, c1;
 	int valid_vel;
 	int cm1, rm1;			/* previous column (cm1 = col - 1) and row (rm1 = row - 1) */
 	int cp1, rp1;			/* next column (cp1 = col + 1) and row (rp1 = row + 1) */
 	int rm2, cp2;
+	int v0, v1, do_vec, do_cor;	/* Columns interval done by the branch free loop and its switches */
+	double cor;
 	double ff = 0, cte;
 	double dd, df, xp, xqe, xqq, advx, advy, f_limit;
 	double dpa_ij, dpa_ij_rp1, dpa_ij_rm1, dpa_ij_cm1, dpa_ij_cp1;
-	double dt, manning, *htotal_a, *htotal_d, *bat, *etad, *fluxm_a, *fluxn_a, *fluxm_d, *fluxn_d, *vex;
+	double dt, manning;
+	real   *htotal_a, *htotal_d, *bat, *etad, *fluxm_a, *fluxn_a, *fluxm_d, *fluxn_d, *vex;
 	double *r0, *r2m, *r3m, *r4m;
 	struct grd_header hdr;
 	double bat__ij;
@@ -4559,29 +7946,52 @@ void moment_sp_M(struct nestContainer *nest, int lev) {
 
 	/* - fixes friction parameter */
 	cte = (manning != 0) ? manning * manning * dt * 4.9 : 0;
+	do_cor = nest->do_Coriolis;
+	do_vec = (nest->do_simd && manning == 0 && !(nest->out_velocity_x && (lev == nest->writeLevel)));	/* The velocities need the cases cascade */
 
-	memset(fluxm_d, 0, hdr.nm * sizeof(double));	/* Do this rather than seting to zero under looping conditions */
+	if (last && row1 == hdr.ny) zero_outside(fluxm_d, hdr.ny - 1, hdr.nx, 0, 0);	/* The row not visited by the loop below */
 
-	for (row = 0; row < hdr.ny - last; row++) {		/* - main computation cycle fluxm_d */
+#if HAVE_OPENMP
+#pragma omp parallel for private(ij, col, c0, c1, v0, v1, cor, valid_vel, cm1, rm1, cp1, rp1, rm2, cp2, xp, xqe, xqq, ff, dd, df, f_limit, \
+	advx, advy, dpa_ij, dpa_ij_rp1, dpa_ij_rm1, dpa_ij_cm1, dpa_ij_cp1, bat__ij, htotal_d__ij, htotal_d__ij_p_cp1, etad__ij, fluxm_a__ij)
+#endif
+	for (row = row0; row < MIN(row1, hdr.ny - last); row++) {		/* - main computation cycle fluxm_d */
 		rp1 = (row < hdr.ny - 1) ? hdr.nx : 0;
 		rm1 = (row == 0) ? 0 : hdr.nx;
-		ij = row * hdr.nx - 1 + first;
-		for (col = first; col < hdr.nx - 1; col++) {
+		c0 = first;		c1 = hdr.nx - 1;
+		ACTIVE_COLS(nest, lev, row, c0, c1);
+		zero_outside(fluxm_d, row, hdr.nx, c0, c1);	/* Columns not visited by the loop below */
+		v0 = v1 = 0;
+
+		if (do_vec && row >= jupe && row <= (hdr.ny - jupe - 1)) {
+			/* Branch free pass over the interior cells. Those that are not wet-wet are redone below */
+			rm2 = ((row < 2) ? 0 : 2) * hdr.nx;
+			v0 = MAX(c0, MAX(jupe, 1));		v1 = MIN(c1, MIN(hdr.nx - jupe, hdr.nx - 2));
+			cor = (do_cor) ? r4m[row] * 2 : 0;
+			moment_sp_M_wet(fluxm_d, fluxm_a, fluxn_a, htotal_a, htotal_d, etad, row * hdr.nx, v0, v1, rm1, rp1, rm2, r0[row], r2m[row], r3m[row], cor, do_cor);
+		}
+
+		ij = row * hdr.nx - 1 + c0;
+		for (col = c0; col < c1; col++) {
 			cp1 = 1;
 			cp2 = (col < hdr.nx - 2) ? 2 : 1;
 			cm1 = (col == 0) ? 0 : 1;
 			ij++;
 
+			if (col >= v0 && col < v1) {	/* The branch free pass stored the wet-wet solution here */
+				if (WETWET_SP_M(ij)) continue;
+			}
+
 			bat__ij = bat[ij];
 
 			/* no flux to permanent dry areas */
-			if (bat__ij <= MAXRUNUP) continue;
+			if (bat__ij <= MAXRUNUP) {fluxm_d[ij] = 0;	continue;}
 
 			htotal_d__ij = htotal_d[ij];
 			htotal_d__ij_p_cp1 = htotal_d[ij+cp1];
 			etad__ij = etad[ij];
 			fluxm_a__ij = fluxm_a[ij];
-			xp = 0;
+			xp = dd = 0;
 
 			/* Looks weird but it's faster than an IF case (branch prediction?) */
 			dpa_ij = (dpa_ij = (htotal_d__ij + htotal_a[ij] + htotal_d__ij_p_cp1 + htotal_a[ij+cp1]) * 0.25) > EPS5 ? dpa_ij : 0;
@@ -4708,8 +8118,8 @@ L120:
 			}
 #endif
 
-			fluxm_d[ij] = xp;
 L121:
+			fluxm_d[ij] = xp;		/* Also on the no flux jumps, where it is still 0 */
 			if (nest->out_velocity_x && (lev == nest->writeLevel))
 				vex[ij] = (valid_vel && dd > EPS3) ? xp / df : 0;
 		}
@@ -4717,19 +8127,81 @@ L121:
 }
 
 
+/* -------------------------------------------------------------------- */
+/* Same as moment_sp_M_wet but for moment_sp_N */
+void moment_sp_N_wet(real *RESTRICT fluxn_d, real *RESTRICT fluxm_a, real *RESTRICT fluxn_a, real *RESTRICT htotal_a, real *RESTRICT htotal_d,
+	real *RESTRICT etad, int ij0, int v0, int v1, int rm1, int rp1, int rp2, double r0, double r2n, double r3n, double cor, int do_cor) {
+	int col;
+
+#if HAVE_OPENMP && _OPENMP >= 201307
+#pragma omp simd
+#endif
+	for (col = v0; col < v1; col++) {
+		int    k = ij0 + col;
+		double h0 = htotal_d[k], h_rp1 = htotal_d[k+rp1], ha_rp1 = htotal_a[k+rp1], e0 = etad[k], e_rp1 = etad[k+rp1];
+		double n0 = fluxn_a[k], h_cp1 = htotal_d[k+1], h_cm1 = htotal_d[k-1];
+		double a_dd, a_dqa, a_dqa_rp1, a_dqa_rm1, a_dqa_cp1, a_dqa_cm1, a_xpp, a_xpe_p, a_xpe_m, a_xq, a_advx, a_advy;
+		double t1, t2, t3, t4;
+		a_dd  = (h0 + h_rp1) * 0.5;
+		a_dqa = (h0 + htotal_a[k] + h_rp1 + ha_rp1) * 0.25;
+		a_xpp = (fluxm_a[k] + fluxm_a[k+rp1] + fluxm_a[k-1] + fluxm_a[k-1+rp1]) * 0.25;
+		a_xq  = n0 - r3n * a_dd * (e_rp1 - e0);
+		a_xq  = (do_cor) ? a_xq - cor * a_xpp : a_xq;
+
+		a_dqa_rp1 = (h_rp1 + ha_rp1 + htotal_d[k+rp2] + htotal_a[k+rp2]) * 0.25;
+		a_dqa_rm1 = (htotal_d[k-rm1] + htotal_a[k-rm1] + h0 + htotal_a[k]) * 0.25;
+		t1 = -r0 * (n0 * n0) / a_dqa;
+		t2 =  r0 * (fluxn_a[k+rp1]*fluxn_a[k+rp1] / a_dqa_rp1 - n0 * n0 / a_dqa);
+		t3 =  r0 * (n0 * n0) / a_dqa;
+		t4 =  r0 * (n0 * n0 / a_dqa) - r0 * (fluxn_a[k-rm1] * fluxn_a[k-rm1] / a_dqa_rm1);
+		t1 = ((a_dqa_rp1 < EPS5) | (h_rp1 < EPS5)) ? t1 : t2;
+		t3 = ((a_dqa_rm1 < EPS3) | (h0 < EPS5)) ? t3 : t4;
+		a_advy = (n0 < 0) ? t1 : t3;
+
+		a_dqa_cp1 = (h_cp1 + htotal_a[k+1] + htotal_d[k+rp1+1] + htotal_a[k+rp1+1]) * 0.25;
+		a_dqa_cm1 = (h_cm1 + htotal_a[k-1] + htotal_d[k+rp1-1] + htotal_a[k+rp1-1]) * 0.25;
+		a_xpe_p = (fluxm_a[k+1] + fluxm_a[k+1+rp1] + fluxm_a[k] + fluxm_a[k+rp1]) * 0.25;
+		a_xpe_m = (fluxm_a[k-1] + fluxm_a[k-1+rp1] + fluxm_a[k-2] + fluxm_a[k-2+rp1]) * 0.25;
+		t1 = -r2n * (n0 * a_xpp / a_dqa);
+		t2 = -r2n * (n0 * a_xpp / a_dqa) + r2n * (fluxn_a[k+1] * a_xpe_p / a_dqa_cp1);
+		t3 =  r2n * (n0 * a_xpp / a_dqa);
+		t4 =  r2n * (n0 * a_xpp / a_dqa) - r2n * (fluxn_a[k-1] * a_xpe_m / a_dqa_cm1);
+		t1 = ((a_dqa_cp1 < EPS3) | (h_cp1 < EPS5) | (htotal_d[k+1+rp1] < EPS5)) ? t1 : t2;
+		t3 = ((a_dqa_cm1 < EPS3) | (h_cm1 < EPS5) | (htotal_d[k-1+rp1] < EPS5)) ? t3 : t4;
+		a_advx = (a_xpp < 0) ? t1 : t3;
+
+		a_xq = a_xq - a_advx - a_advy;
+#ifdef LIMIT_DISCHARGE
+		t1 = V_LIMIT * a_dd;
+		a_xq = (fabs(a_xq) < EPS10) ? 0 : a_xq;
+		a_xq = (a_xq > t1) ? t1 : a_xq;
+		a_xq = (a_xq < -t1) ? -t1 : a_xq;
+#endif
+		fluxn_d[k] = a_xq;
+	}
+}
+
 /* ----------------------------------------------------------------------------------------- */
 void moment_sp_N(struct nestContainer *nest, int lev) {
+	moment_sp_N_rows(nest, lev, 0, nest->hdr[lev].ny);
+}
+
+/* Same as moment_sp_N() but only for the rows [row0, row1[ (see tiled_step()) */
+void moment_sp_N_rows(struct nestContainer *nest, int lev, int row0, int row1) {
 
 	unsigned int ij;
-	int first, last, jupe, row, col;
+	int first, last, jupe, row, col, c0, c1;
 	int valid_vel;
 	int cm1, rm1;			/* previous column (cm1 = col - 1) and row (rm1 = row - 1) */
 	int cp1, rp1;			/* next column (cp1 = col + 1) and row (rp1 = row + 1) */
 	int cm2, rp2;
+	int v0, v1, do_vec, do_cor;	/* Columns interval done by the branch free loop and its switches */
+	double cor;
 	double ff = 0, cte;
 	double dd, df, xq, xpe, xpp, advx, advy, f_limit;
 	double dqa_ij, dqa_ij_rp1, dqa_ij_rm1, dqa_ij_cm1, dqa_ij_cp1;
-	double dt, manning, *htotal_a, *htotal_d, *bat, *etad, *fluxm_a, *fluxn_a, *fluxm_d, *fluxn_d, *vey;
+	double dt, manning;
+	real   *htotal_a, *htotal_d, *bat, *etad, *fluxm_a, *fluxn_a, *fluxm_d, *fluxn_d, *vey;
 	double *r0, *r2n, *r3n, *r4n;
 	struct grd_header hdr;
 	double bat__ij;
@@ -4762,24 +8234,48 @@ void moment_sp_N(struct nestContainer *nest, int lev) {
 
 	/* - fixes friction parameter */
 	cte = (manning != 0) ? manning * manning * dt * 4.9 : 0;
+	do_cor = nest->do_Coriolis;
+	do_vec = (nest->do_simd && manning == 0 && !(nest->out_velocity_y && (lev == nest->writeLevel)));	/* The velocities need the cases cascade */
 
-	memset(fluxn_d, 0, hdr.nm * sizeof(double));	/* Do this rather than seting to zero under looping conditions */
+	if (first && row0 == 0) zero_outside(fluxn_d, 0, hdr.nx, 0, 0);	/* The rows not visited by the loop below */
+	if (row1 == hdr.ny) zero_outside(fluxn_d, hdr.ny - 1, hdr.nx, 0, 0);
 
 	/* - main computation cycle fluxn_d */
-	for (row = first; row < hdr.ny - 1; row++) {
+#if HAVE_OPENMP
+#pragma omp parallel for private(ij, col, c0, c1, v0, v1, cor, valid_vel, cm1, rm1, cp1, rp1, cm2, rp2, xq, xpe, xpp, ff, dd, df, f_limit, \
+	advx, advy, dqa_ij, dqa_ij_rp1, dqa_ij_rm1, dqa_ij_cm1, dqa_ij_cp1, bat__ij, htotal_d__ij, htotal_d__ij_p_rp1, \
+	htotal_a__ij_p_rp1, etad__ij, etad__ij_p_rp1, fluxn_a__ij)
+#endif
+	for (row = MAX(row0, first); row < MIN(row1, hdr.ny - 1); row++) {
 		rp1 = hdr.nx;
 		rp2 = (row < hdr.ny - 2) ? 2*hdr.nx : hdr.nx;
 		rm1 = (row == 0) ? 0 : hdr.nx;
-		ij = row * hdr.nx - 1;
-		for (col = 0; col < hdr.nx - last; col++) {
+		c0 = 0;		c1 = hdr.nx - last;
+		ACTIVE_COLS(nest, lev, row, c0, c1);
+		zero_outside(fluxn_d, row, hdr.nx, c0, c1);	/* Columns not visited by the loop below */
+		v0 = v1 = 0;
+
+		if (do_vec && row >= jupe && row <= (hdr.ny - jupe - 1)) {
+			/* Branch free pass over the interior cells. Those that are not wet-wet are redone below */
+			v0 = MAX(c0, MAX(jupe, 2));		v1 = MIN(c1, MIN(hdr.nx - jupe, hdr.nx - 1));
+			cor = (do_cor) ? r4n[row] * 2 : 0;
+			moment_sp_N_wet(fluxn_d, fluxm_a, fluxn_a, htotal_a, htotal_d, etad, row * hdr.nx, v0, v1, rm1, rp1, rp2, r0[row], r2n[row], r3n[row], cor, do_cor);
+		}
+
+		ij = row * hdr.nx - 1 + c0;
+		for (col = c0; col < c1; col++) {
 			cp1 = (col < hdr.nx-1) ? 1 : 0;
 			cm1 = (col == 0) ? 0 : 1;
 			ij++;
 
+			if (col >= v0 && col < v1) {	/* The branch free pass stored the wet-wet solution here */
+				if (WETWET_SP_N(ij)) continue;
+			}
+
 			bat__ij = bat[ij];
 
 			/* no flux to permanent dry areas */
-			if (bat__ij <= MAXRUNUP) continue;
+			if (bat__ij <= MAXRUNUP) {fluxn_d[ij] = 0;	continue;}
 
 			/* Access these the minimum times possible */
 			htotal_d__ij = htotal_d[ij];
@@ -4788,7 +8284,7 @@ void moment_sp_N(struct nestContainer *nest, int lev) {
 			htotal_a__ij_p_rp1 = htotal_a[ij+rp1];
 			etad__ij_p_rp1 = etad[ij+rp1];
 			fluxn_a__ij = fluxn_a[ij];
-			xq = 0;
+			xq = dd = 0;
 
 			/* Looks weird but it's faster than an IF case (branch prediction?) */
 			dqa_ij = (dqa_ij = (htotal_d__ij + htotal_a[ij] + htotal_d__ij_p_rp1 + htotal_a__ij_p_rp1) * 0.25) > EPS5 ? dqa_ij : 0;
@@ -4913,9 +8409,8 @@ L200:
 				else if (xq < -f_limit) xq = -f_limit;
 			}
 #endif
-			fluxn_d[ij] = xq;
-
 L201:
+			fluxn_d[ij] = xq;		/* Also on the no flux jumps, where it is still 0 */
 			if (nest->out_velocity_y && (lev == nest->writeLevel))
 				vey[ij] = (valid_vel && dd > EPS3) ? xq / df : 0;
 		}
@@ -4923,25 +8418,26 @@ L201:
 }
 
 /* ----------------------------------------------------------------------------------------- */
-void interp_edges(struct nestContainer *nest, double *flux_L1, double *flux_L2, char *what, int lev, int i_time) {
+void interp_edges(struct nestContainer *nest, real *flux_L1, real *flux_L2, char *what, int lev, int i_time) {
 	/* Interpolate outer Fluxes on boundary edges with the resolution of the nested grid
 	   and assign them to inner grid, at its boundaries. */
-	int i, n, col, row, last_iter;
-	double s, t1, *bat_P, *etad_P;
+	int i, n, col, row, last_iter, lev_P = nest->parent[lev];
+	double s, t1;
+	real   *bat_P, *etad_P;
 	//unsigned int ij;
 	//double grx, gry, c1, c2, hp, hm, xm;
 
-	bat_P  = nest->bat[lev-1];	/* Parent bathymetry */;
-	etad_P = nest->etad[lev-1];
-	last_iter = (int)(nest->dt[lev-1] / nest->dt[lev]);  /* No truncations here */
+	bat_P  = nest->bat[lev_P];	/* Parent bathymetry */;
+	etad_P = nest->etad[lev_P];
+	last_iter = (int)(nest->dt[lev_P] / nest->dt[lev]);  /* No truncations here */
 
 	if (what[0] == 'N') {			/* Only FLUXN uses this branch */
 		n = (nest->LRcol[lev] - nest->LLcol[lev] + 1);
 		/* SOUTH boundary */
-		s = nest->hdr[lev].y_inc / nest->hdr[lev-1].y_inc;
+		s = nest->hdr[lev].y_inc / nest->hdr[lev_P].y_inc;
 		for (i = 0, col = nest->LLcol[lev]; col <= nest->LRcol[lev]; col++, i++) {
-			t1 = flux_L1[ij_grd(col, nest->LLrow[lev], nest->hdr[lev-1])];
-			//t2 = flux_L1[ij_grd(col, nest->LLrow[lev]+1, nest->hdr[lev-1])];
+			t1 = flux_L1[ij_grd(col, nest->LLrow[lev], nest->hdr[lev_P])];
+			//t2 = flux_L1[ij_grd(col, nest->LLrow[lev]+1, nest->hdr[lev_P])];
 			nest->edge_row_Ptmp[lev][i] = t1;
 		}
 		intp_lin (nest->edge_row_P[lev], nest->edge_row_Ptmp[lev], n, nest->hdr[lev].nx,
@@ -4955,8 +8451,8 @@ void interp_edges(struct nestContainer *nest, double *flux_L1, double *flux_L2,
 
 		/* NORTH boundary */
 		for (i = 0, col = nest->LLcol[lev]; col <= nest->LRcol[lev]; col++, i++) {
-			t1 = flux_L1[ij_grd(col, nest->ULrow[lev]-1, nest->hdr[lev-1])];
-			//t2 = flux_L1[ij_grd(col, nest->ULrow[lev],   nest->hdr[lev-1])];
+			t1 = flux_L1[ij_grd(col, nest->ULrow[lev]-1, nest->hdr[lev_P])];
+			//t2 = flux_L1[ij_grd(col, nest->ULrow[lev],   nest->hdr[lev_P])];
 			nest->edge_row_Ptmp[lev][i] = t1;
 		}
 		intp_lin (nest->edge_row_P[lev], nest->edge_row_Ptmp[lev], n, nest->hdr[lev].nx,
@@ -4973,10 +8469,10 @@ void interp_edges(struct nestContainer *nest, double *flux_L1, double *flux_L2,
 		//grx = NORMAL_GRAV * nest->dt[lev] / nest->hdr[lev].x_inc;
 		n = (nest->ULrow[lev] - nest->LLrow[lev] + 1);
 		/* WEST (left) boundary. */
-		s = nest->hdr[lev].x_inc / nest->hdr[lev-1].x_inc;
+		s = nest->hdr[lev].x_inc / nest->hdr[lev_P].x_inc;
 		for (i = 0, row = nest->LLrow[lev]; row <= nest->ULrow[lev]; row++, i++) {
-			t1 = flux_L1[ij_grd(nest->LLcol[lev],   row, nest->hdr[lev-1])];
-			//t2 = flux_L1[ij_grd(nest->LLcol[lev]+1, row, nest->hdr[lev-1])];
+			t1 = flux_L1[ij_grd(nest->LLcol[lev],   row, nest->hdr[lev_P])];
+			//t2 = flux_L1[ij_grd(nest->LLcol[lev]+1, row, nest->hdr[lev_P])];
 			nest->edge_col_Ptmp[lev][i] = t1;
 		}
 		intp_lin (nest->edge_col_P[lev], nest->edge_col_Ptmp[lev], n, nest->hdr[lev].ny,
@@ -4991,14 +8487,14 @@ void interp_edges(struct nestContainer *nest, double *flux_L1, double *flux_L2,
 		/* EAST (right) boundary */
 		//if (i_time == 0) {
 			for (i = 0, row = nest->LLrow[lev]; row <= nest->ULrow[lev]; row++, i++)
-				nest->edge_col_Ptmp[lev][i] = flux_L1[ij_grd(nest->LRcol[lev]-1, row, nest->hdr[lev-1])];
+				nest->edge_col_Ptmp[lev][i] = flux_L1[ij_grd(nest->LRcol[lev]-1, row, nest->hdr[lev_P])];
 #if 0
 		}
 		else {
 			c1 = (double)(i_time) / (double)(last_iter);
 			c2 = 1 - c1;
 			for (i = 0, row = nest->LLrow[lev]; row <= nest->ULrow[lev]; row++, i++) {
-				ij = ij_grd(nest->LLcol[lev], row, nest->hdr[lev-1]);
+				ij = ij_grd(nest->LLcol[lev], row, nest->hdr[lev_P]);
 				nest->edge_col_Ptmp[lev][i] = 0;
 				if ((bat_P[ij-1] + etad_P[ij-1] < EPS5) || (bat_P[ij] + etad_P[ij] < EPS5))
 					continue;
@@ -5093,16 +8589,17 @@ int intp_lin (double *x, double *y, int n, int m, double *u, double *v) {
 /* ------------------------------------------------------------------------------------------- */
 /* upscale from doughter to parent level
 /* ------------------------------------------------------------------------------------------- */
-void upscale(struct nestContainer *nest, double *out, int lev, int i_tsr) {
+void upscale(struct nestContainer *nest, real *out, int lev, int i_tsr) {
 	/* Computes the mean of cells inside a square window
 	   lev   -> This grid level
 	*/
-	int	inc, k, col, row, col_P, row_P, wcol, wrow, prow, count, half, rim, do_half = FALSE;
+	int	inc, k, col, row, col_P, row_P, wcol, wrow, prow, count, half, rim, do_half = FALSE, lev_P = nest->parent[lev];
 	unsigned int ij, nm;
-	double	*p, *pa, soma, *bat_P;
+	double	soma;
+	real	*p, *pa, *bat_P;
 
 	inc = nest->incRatio[lev];	/* Grid spatial ratio between Parent and doughter */
-	bat_P = nest->bat[lev-1];	/* Parent bathymetry */
+	bat_P = nest->bat[lev_P];	/* Parent bathymetry */
 
 	nm = nest->hdr[lev].nx * nest->hdr[lev].ny;
 	for (ij = 0; ij < nm; ij++)
@@ -5114,7 +8611,7 @@ void upscale(struct nestContainer *nest, double *out, int lev, int i_tsr) {
 
 	rim = 1 * inc;
 	for (row = 0+rim, prow = 0, row_P = nest->LLrow[lev]+1; row < nest->hdr[lev].ny-rim; row_P++, prow++, row += inc) {
-		ij = ij_grd(nest->LLcol[lev] + 1,  nest->LLrow[lev] + 1 + prow,  nest->hdr[lev-1]);
+		ij = ij_grd(nest->LLcol[lev] + 1,  nest->LLrow[lev] + 1 + prow,  nest->hdr[lev_P]);
 		for (col = 0+rim, col_P = nest->LLcol[lev]+1; col < nest->hdr[lev].nx-rim; col_P++, col += inc) {
 			k = col + row * nest->hdr[lev].nx;       /* Index of window's LL corner */
 			soma = 0;
@@ -5136,8 +8633,8 @@ void upscale(struct nestContainer *nest, double *out, int lev, int i_tsr) {
 			}
 			/* --- case when more than 50% of daugther cells add to a mother cell */
 			if (soma && count > half) {
-				if (bat_P[ij_grd(col_P, row_P, nest->hdr[lev-1])] < 0)
-					out[ij] = soma / count - bat_P[ij_grd(col_P, row_P, nest->hdr[lev-1])];
+				if (bat_P[ij_grd(col_P, row_P, nest->hdr[lev_P])] < 0)
+					out[ij] = soma / count - bat_P[ij_grd(col_P, row_P, nest->hdr[lev_P])];
 				else
 					out[ij] = soma / count;
 			}
@@ -5153,24 +8650,32 @@ void upscale(struct nestContainer *nest, double *out, int lev, int i_tsr) {
 /* --------------------------------------------------------------------- */
 /* upscale from doughter to parent level
 /* --------------------------------------------------------------------- */
-void upscale_(struct nestContainer *nest, double *etad, int lev, int i_tsr) {
+void upscale_(struct nestContainer *nest, real *etad, int lev, int i_tsr) {
 	/* i_tst -> loop variable over the time step ration of the two grids */
 	int half, count, row, col, nrow, ncol, rim, do_half = FALSE;
-	int i0, j0, ii, jj, ki, kj;
+	int i0, j0, ii, jj, ki, kj, lev_P = nest->parent[lev];
 	unsigned int ij;
-	double sum, *bat_P;
+	double sum;
+	real   *bat_P;
 
-	bat_P = nest->bat[lev-1];	/* Parent bathymetry */
+	bat_P = nest->bat[lev_P];	/* Parent bathymetry */
 
 	if (i_tsr % 2 == 0) do_half = TRUE;  /* Compute eta as the mean of etad & etaa */
 
 	half = irint(floor(nest->incRatio[lev] * nest->incRatio[lev] * 2.0 / 3.0));
 
+#if HAVE_OPENMP
+#pragma omp parallel for
+#endif
 	for (ij = 0; ij < nest->hdr[lev].nm; ij++)
 		if (nest->bat[lev][ij] < 0) nest->etad[lev][ij] += nest->bat[lev][ij];
 
 	rim = 1;
-	for (row = nest->LLrow[lev] + 1 + rim, nrow = rim; row < nest->ULrow[lev] - rim; row++, nrow++) {
+#if HAVE_OPENMP
+#pragma omp parallel for private(nrow, col, ncol, i0, j0, ii, jj, ki, kj, ij, sum, count)
+#endif
+	for (row = nest->LLrow[lev] + 1 + rim; row < nest->ULrow[lev] - rim; row++) {
+		nrow = row - nest->LLrow[lev] - 1;	/* Not a loop var so that rows can be split among threads */
 		i0 = nrow * nest->incRatio[lev];
 		for (col = nest->LLcol[lev] + 1 + rim, ncol = rim; col < nest->LRcol[lev] - rim; col++, ncol++) {
 			j0 = ncol * nest->incRatio[lev];
@@ -5195,16 +8700,19 @@ void upscale_(struct nestContainer *nest, double *etad, int lev, int i_tsr) {
 
 			/* --- case when more than 50% of daugther cells add to a mother cell */
 			if (sum && count >= half) {
-				//etad[ij_grd(col,row, nest->hdr[lev-1])] = sum / count - bat_P[ij_grd(col,row, nest->hdr[lev-1])];
-				if (bat_P[ij_grd(col,row, nest->hdr[lev-1])] < 0)
-					etad[ij_grd(col,row, nest->hdr[lev-1])] = sum / count - bat_P[ij_grd(col,row, nest->hdr[lev-1])];
+				//etad[ij_grd(col,row, nest->hdr[lev_P])] = sum / count - bat_P[ij_grd(col,row, nest->hdr[lev_P])];
+				if (bat_P[ij_grd(col,row, nest->hdr[lev_P])] < 0)
+					etad[ij_grd(col,row, nest->hdr[lev_P])] = sum / count - bat_P[ij_grd(col,row, nest->hdr[lev_P])];
 				else
-					etad[ij_grd(col,row, nest->hdr[lev-1])] = sum / count;
+					etad[ij_grd(col,row, nest->hdr[lev_P])] = sum / count;
 			}
 		}
 	}
 
 	/* --- reputs bathymetry on etad on land --- */
+#if HAVE_OPENMP
+#pragma omp parallel for
+#endif
 	for (ij = 0; ij < nest->hdr[lev].nm; ij++)
 		if (nest->bat[lev][ij] < 0) nest->etad[lev][ij] -= nest->bat[lev][ij];
 }
@@ -5228,13 +8736,13 @@ void replicate(struct nestContainer *nest, int lev) {
 }
 
 /* ------------------------------------------------------------------------------ */
-void nestify(struct nestContainer *nest, int nNg, int level, int isGeog) {
-	/* nNg -> number of nested grids */
-	/* level contains the number of times this function was called recursively.
-	   Start with 0 in first call and this counter is increased internally */
-	int j, last_iter, nhalf;
+void nest_children(struct nestContainer *nest, int nNg, int lev, int isGeog) {
+	/* Run the grids nested in grid LEV for one time step of LEV. nNg -> number of nested grids
+	   Sibling grids only share the parent arrays they read from (see the overlap test in initialize_nestum())
+	   so, with OpenMP, each one runs on its own thread between the edge_communication & upscale_ calls. */
+	int i, n_kids = 0, kids[10];
 
-	if (nest->run_jump_time > 0) {      /* If holding childrens state */
+	if (lev == 0 && nest->run_jump_time > 0) {      /* If holding childrens state */
 		if (nest->run_jump_time > nest->time_h)
 			return;
 		else {
@@ -5244,26 +8752,71 @@ void nestify(struct nestContainer *nest, int nNg, int level, int isGeog) {
 		}
 	}
 
-	last_iter = (int)(nest->dt[level-1] / nest->dt[level]);  /* No truncations here */
+	for (i = lev + 1; i <= nNg; i++)
+		if (nest->parent[i] == lev) kids[n_kids++] = i;
+
+#if HAVE_OPENMP
+#pragma omp parallel for schedule(dynamic,1) if (n_kids > 1)
+#endif
+	for (i = 0; i < n_kids; i++)
+		nestify(nest, nNg, kids[i], isGeog);
+}
+
+/* ------------------------------------------------------------------------------ */
+void nestify(struct nestContainer *nest, int nNg, int lev, int isGeog) {
+	/* nNg -> number of nested grids */
+	/* lev is the nested grid to run. It calls nest_children() that calls back here for the grids nested in it */
+	int j, k, last_iter, nhalf, n_sib, lev_P = nest->parent[lev], do_maxs, settled;
+	unsigned int nm = nest->hdr[lev].nm;
+	double t0;
+
+	/* Only the branch of the tree that holds the writeLevel grid must update the max arrays. Siblings of that
+	   branch run on other threads and would otherwise compete to update them. */
+	for (j = nest->writeLevel; j > lev; j = nest->parent[j]);
+	do_maxs = (j == lev);
+	settled = (do_maxs && lev != nest->writeLevel);	/* writeLevel is nested in LEV so it is now between two time steps */
+	/* The grids nested in writeLevel update them too (at their finer time steps), but only along a chain of only
+	   children. Otherwise the siblings would race on the max arrays and on the etad of writeLevel, where they
+	   upscale. So when a grid of that chain has siblings, the update of writeLevel itself is the only one. */
+	for (j = lev, n_sib = 0; j > nest->writeLevel; j = nest->parent[j])
+		for (k = 1; k <= nNg; k++)
+			if (k != j && nest->parent[k] == nest->parent[j]) n_sib++;
+	do_maxs = do_maxs || (j == nest->writeLevel && n_sib == 0);
+
+	last_iter = (int)(nest->dt[lev_P] / nest->dt[lev]);  /* No truncations here */
 	nhalf = (int)((float)last_iter / 2);           /* */
 	for (j = 0; j < last_iter; j++) {
-		edge_communication(nest, level, j);
-		mass_conservation(nest, isGeog, level);
+		t0 = TM_TIC(nest);
+		edge_communication(nest, lev, j);
+		TM_TOC(nest, PH_EDGES, lev, t0, 2 * (nest->hdr[lev].nx + nest->hdr[lev].ny));
+		t0 = TM_TIC(nest);
+		mass_conservation(nest, isGeog, lev);
+		TM_TOC(nest, PH_MASS, lev, t0, nm);
 
-		if (nest->do_max_level)    update_max(nest);             /* This makes sure all time steps are visited */
-		if (nest->do_max_velocity) update_max_velocity(nest);    /* This makes sure all time steps are visited */
+		if (do_maxs && (nest->do_max_level || nest->do_max_velocity)) {
+			t0 = TM_TIC(nest);
+			/* This makes sure all time steps are visited */
+			update_maxs(nest, settled, ((nest->do_max_level) ? MAX_LEVEL : 0) | ((nest->do_max_velocity) ? MAX_SPEED : 0));
+			TM_TOC(nest, PH_MAX, lev, t0, nest->hdr[nest->writeLevel].nm);
+		}
 
 		/* MAGIC happens here */
-		if (nNg != 1)
-			nestify(nest, nNg - 1, level + 1, isGeog);
+		nest_children(nest, nNg, lev, isGeog);
 
-		moment_conservation(nest, isGeog, level);
-		replicate(nest, level);
+		t0 = TM_TIC(nest);
+		moment_conservation(nest, isGeog, lev);
+		replicate(nest, lev);
+		TM_TOC(nest, PH_MOMENT, lev, t0, nm);
 
-		if (j == nhalf && nest->do_upscale)           /* Do the upscale only at middle iteration of this cycle */
-			upscale_(nest, nest->etad[level-1], level, last_iter);
+		if (j == nhalf && nest->do_upscale) {         /* Do the upscale only at middle iteration of this cycle */
+			t0 = TM_TIC(nest);
+			upscale_(nest, nest->etad[lev_P], lev, last_iter);
+			TM_TOC(nest, PH_UPSCALE, lev, t0, nm);
+		}
 
-		update(nest, level);
+		t0 = TM_TIC(nest);
+		update(nest, lev);
+		TM_TOC(nest, PH_UPDATE, lev, t0, nm);
 	}
 }
 
@@ -5271,32 +8824,36 @@ void nestify(struct nestContainer *nest, int nNg, int level, int isGeog) {
 void resamplegrid(struct nestContainer *nest, int nNg) {
 	/* interpolate children's eta & flux to not create family discontinuities */
 	/* nNg -> number of nested grids */
-	int row, col, k;
+	/* The parent is either at the start or between its mass() and moment() calls, so its fluxes are in 'a' */
+	int row, col, k, p;
 	size_t ij;
 	double xx, yy;
-	for (k = 1; k <= nNg; k++) {
+	for (k = 1; k <= nNg; k++) {		/* Parents have lower indices, so they are always resampled first */
+		p = nest->parent[k];
 		for (row = ij = 0; row < nest->hdr[k].ny; row++) {
 			yy = nest->hdr[k].y_min + row * nest->hdr[k].y_inc;
 			for (col = 0; col < nest->hdr[k].nx; col++, ij++) {
 				if (nest->bat[k][ij] < 0) continue;
 				xx = nest->hdr[k].x_min + col * nest->hdr[k].x_inc;
-				nest->etaa[k][ij]    = GMT_get_bcr_z(nest->etaa[k-1],    nest->hdr[k-1], xx, yy);
-				nest->etad[k][ij]    = GMT_get_bcr_z(nest->etad[k-1],    nest->hdr[k-1], xx, yy);
-				nest->fluxm_a[k][ij] = GMT_get_bcr_z(nest->fluxm_a[k-1], nest->hdr[k-1], xx, yy);
-				nest->fluxn_a[k][ij] = GMT_get_bcr_z(nest->fluxn_a[k-1], nest->hdr[k-1], xx, yy);
-				nest->fluxm_d[k][ij] = GMT_get_bcr_z(nest->fluxm_d[k-1], nest->hdr[k-1], xx, yy);
-				nest->fluxn_d[k][ij] = GMT_get_bcr_z(nest->fluxn_d[k-1], nest->hdr[k-1], xx, yy);
-				nest->htotal_a[k][ij]= GMT_get_bcr_z(nest->htotal_a[k-1],nest->hdr[k-1], xx, yy);
-				nest->htotal_d[k][ij]= GMT_get_bcr_z(nest->htotal_d[k-1],nest->hdr[k-1], xx, yy);
+				nest->etaa[k][ij]    = GMT_get_bcr_z(nest->etaa[p],    nest->hdr[p], xx, yy);
+				nest->etad[k][ij]    = GMT_get_bcr_z(nest->etad[p],    nest->hdr[p], xx, yy);
+				nest->fluxm_a[k][ij] = GMT_get_bcr_z(nest->fluxm_a[p], nest->hdr[p], xx, yy);
+				nest->fluxn_a[k][ij] = GMT_get_bcr_z(nest->fluxn_a[p], nest->hdr[p], xx, yy);
+				nest->fluxm_d[k][ij] = nest->fluxm_a[k][ij];
+				nest->fluxn_d[k][ij] = nest->fluxn_a[k][ij];
+				nest->htotal_a[k][ij]= GMT_get_bcr_z(nest->htotal_a[p],nest->hdr[p], xx, yy);
+				nest->htotal_d[k][ij]= GMT_get_bcr_z(nest->htotal_d[p],nest->hdr[p], xx, yy);
 			}
 		}
+		nest->ad_copy[k] = TRUE;
 	}
 }
 
 /* ------------------------------------------------------------------------------ */
 void edge_communication(struct nestContainer *nest, int lev, int i_time) {
-	interp_edges(nest, nest->fluxm_a[lev-1], nest->fluxm_a[lev], "M", lev, i_time);
-	interp_edges(nest, nest->fluxn_a[lev-1], nest->fluxn_a[lev], "N", lev, i_time);
+	int lev_P = nest->parent[lev];
+	interp_edges(nest, nest->fluxm_a[lev_P], nest->fluxm_a[lev], "M", lev, i_time);
+	interp_edges(nest, nest->fluxn_a[lev_P], nest->fluxn_a[lev], "N", lev, i_time);
 }
 
 /* ------------------------------------------------------------------------------ */
@@ -5390,7 +8947,7 @@ int GetLocalNThread(void) {
 
 /* ---------------------------------------------------------------------------------------- */
 void kaba_source(struct srf_header hdr, double x_inc, double y_inc, double x_min, double x_max,
-	double y_min, double y_max, int type, double *z) {
+	double y_min, double y_max, int type, real *z) {
 	/* Create a prismatic source (a Kaba) to use as source for the Green's functions method.
 	   when type = 1, all variables represent what their names say
 	   when type = 2, x_min/x_max are instead the prism's center and y_min/y_max its half widths
@@ -5411,7 +8968,7 @@ void kaba_source(struct srf_header hdr, double x_inc, double y_inc, double x_min
 		row1 = irint((y_min - hdr.y_min) / y_inc) - ny2;
 		row2 = row1 + 2*ny2;
 	}
-	memset(z, 0, hdr.nx * hdr.ny * sizeof(double));		/* Need because this function may be called recursivly */
+	memset(z, 0, hdr.nx * hdr.ny * sizeof(real));		/* Need because this function may be called recursivly */
 	for (row = row1; row <= row2; row++) {
 		for (col = col1; col <= col2; col++) {
 			z[ij_grd(col,row,hdr)] = 1;
@@ -5422,67 +8979,130 @@ void kaba_source(struct srf_header hdr, double x_inc, double y_inc, double x_min
 /* ---------------------------------------------------------------------------------------- */
 void deform(struct srf_header hdr, double x_inc, double y_inc, int isGeog, double fault_length,
 	double fault_width, double th, double dip, double rake, double d, double top_depth,
-	double xl, double yl, double *z) {
+	double xl, double yl, real *z) {
 
 	/*	Compute the vertical deformation component according to Okada formulation */
+	struct okada_fault f;
 
-	int i, j;
-	unsigned int k = 0;
-	double h1, h2, ds, dd, xx, yy, x1, x2, x3, us, ud, sn_tmp, cs_tmp, tg_tmp;
-	double f1, f2, f3, f4, g1, g2, g3, g4, rx, ry, lon0;
-	double t_c1, t_c2, t_c3, t_c4, t_e2, t_M0, f_length2;
+	f.length = fault_length;	f.width = fault_width;	f.top_depth = top_depth;
+	f.strike = th;	f.dip = dip;	f.rake = rake;	f.slip = d;
+	f.x = xl;		f.y = yl;
+	deform_faults(hdr, x_inc, y_inc, isGeog, &f, 1, 0, z);
+}
+
+/* ---------------------------------------------------------------------------------------- */
+void deform_faults(struct srf_header hdr, double x_inc, double y_inc, int isGeog, struct okada_fault *f, int n_f,
+                   double cut, real *z) {
+	/* Vertical deformation of the N_F faults F according to Okada formulation, superposed in Z. The sines,
+	   cosines and projections of each fault are computed once, and the rows are shared by the threads. If
+	   CUT > 0, a fault does not deform the nodes farther than CUT times its length (or width, if larger)
+	   from its center. Each node adds the faults in the same order, so Z does not depend on the threads. */
+	int i, n;
+	double dip;
 
 	/* Initialize TM variables. Fault origin will be used as projection's origin. However,
 	   this would set it as a singularity point. That's why it is arbitrarely shifted
 	   by a 1/4 of grid step. */ 
-	if (isGeog) {
-		vtm(yl + y_inc / 2, &t_c1, &t_c2, &t_c3, &t_c4, &t_e2, &t_M0);
-		lon0 = xl + x_inc / 2;		/* Central meridian for this transform */
+	for (n = 0; n < n_f; n++) {
+		if (isGeog) {
+			vtm(f[n].y + y_inc / 2, &f[n].t_c1, &f[n].t_c2, &f[n].t_c3, &f[n].t_c4, &f[n].t_e2, &f[n].t_M0);
+			f[n].lon0 = f[n].x + x_inc / 2;		/* Central meridian for this transform */
+		}
+		f[n].f_length2 = f[n].length / 2;
+		dip = f[n].dip * D2R;
+		f[n].h1 = f[n].top_depth / sin(dip);
+		f[n].h2 = f[n].top_depth / sin(dip) + f[n].width;
+		f[n].ds = -f[n].slip * cos(D2R * f[n].rake);
+		f[n].dd =  f[n].slip * sin(D2R * f[n].rake);
+		f[n].sn_th  = sin(D2R * f[n].strike);	f[n].cs_th = cos(D2R * f[n].strike);
+		f[n].sn_dip = sin(dip);		f[n].cs_dip = cos(dip);		f[n].tg_dip = tan(dip);
+		f[n].x2_0 = f[n].top_depth / f[n].tg_dip;
+		f[n].x2_c = (f[n].h1 + f[n].h2) / 2 * f[n].cs_dip;	/* Center of the fault (x1 = 0) seen from above */
+		f[n].cut2 = cut * MAX(f[n].length, f[n].width);
+		f[n].cut2 *= f[n].cut2;
 	}
 
-	f_length2 = fault_length / 2;
-	dip *= D2R;
-	h1 = top_depth / sin(dip);
-	h2 = top_depth / sin(dip) + fault_width;
-	ds = -d * cos(D2R * rake);
-	dd =  d * sin(D2R * rake);
-	sn_tmp = sin(D2R*th);	cs_tmp = cos(D2R*th);	tg_tmp = tan(dip);
-
+#if HAVE_OPENMP
+#pragma omp parallel for schedule(dynamic,4)
+#endif
 	for (i = 0; i < hdr.ny; i++) {
+		int j, m;
+		unsigned int k;
+		double xx, yy, x1, x2, x3, us, ud, f1, f2, f3, f4, g1, g2, g3, g4, rx, ry;
+		struct okada_fault *p;
+
 		yy = hdr.y_min + y_inc * i;
-		for (j = 0; j < hdr.nx; j++) {
-			xx = hdr.x_min + x_inc * j;
-			if (isGeog)
-				tm(xx, yy, &rx, &ry, lon0, t_c1, t_c2, t_c3, t_c4, t_e2, t_M0);	/* Remember that (xl,yl) is already the proj origin */
-			else {
-				rx = xx - xl;
-				ry = yy - yl;
+		for (m = 0; m < n_f; m++) {
+			p = &f[m];
+			for (j = 0, k = (unsigned int)i * hdr.nx; j < hdr.nx; j++, k++) {
+				xx = hdr.x_min + x_inc * j;
+				if (isGeog)		/* Remember that (xl,yl) is already the proj origin */
+					tm(xx, yy, &rx, &ry, p->lon0, p->t_c1, p->t_c2, p->t_c3, p->t_c4, p->t_e2, p->t_M0);
+				else {
+					rx = xx - p->x;
+					ry = yy - p->y;
+				}
+				x1 = rx*p->sn_th + ry*p->cs_th - p->f_length2;
+				x2 = rx*p->cs_th - ry*p->sn_th + p->x2_0;
+				if (p->cut2 > 0 && x1 * x1 + (x2 - p->x2_c) * (x2 - p->x2_c) > p->cut2) {
+					if (m == 0) z[k] = 0;
+					continue;
+				}
+				x3 = 0.0;
+				f1 = uscal(x1, x2, x3,  p->f_length2, p->h2, p->sn_dip, p->cs_dip, p->tg_dip);
+				f2 = uscal(x1, x2, x3,  p->f_length2, p->h1, p->sn_dip, p->cs_dip, p->tg_dip);
+				f3 = uscal(x1, x2, x3, -p->f_length2, p->h2, p->sn_dip, p->cs_dip, p->tg_dip);
+				f4 = uscal(x1, x2, x3, -p->f_length2, p->h1, p->sn_dip, p->cs_dip, p->tg_dip);
+				g1 = udcal(x1, x2, x3,  p->f_length2, p->h2, p->sn_dip, p->cs_dip);
+				g2 = udcal(x1, x2, x3,  p->f_length2, p->h1, p->sn_dip, p->cs_dip);
+				g3 = udcal(x1, x2, x3, -p->f_length2, p->h2, p->sn_dip, p->cs_dip);
+				g4 = udcal(x1, x2, x3, -p->f_length2, p->h1, p->sn_dip, p->cs_dip);
+				us = (f1-f2-f3+f4) * p->ds / (12 * M_PI);
+				ud = (g1-g2-g3+g4) * p->dd / (12 * M_PI);
+				z[k] = (m) ? z[k] + (us + ud) : us + ud;
 			}
-			x1 = rx*sn_tmp + ry*cs_tmp - f_length2;
-			x2 = rx*cs_tmp - ry*sn_tmp + top_depth/tg_tmp;
-			x3 = 0.0;
-			f1 = uscal(x1, x2, x3,  f_length2, h2, dip);
-			f2 = uscal(x1, x2, x3,  f_length2, h1, dip);
-			f3 = uscal(x1, x2, x3, -f_length2, h2, dip);
-			f4 = uscal(x1, x2, x3, -f_length2, h1, dip);
-			g1 = udcal(x1, x2, x3,  f_length2, h2, dip);
-			g2 = udcal(x1, x2, x3,  f_length2, h1, dip);
-			g3 = udcal(x1, x2, x3, -f_length2, h2, dip);
-			g4 = udcal(x1, x2, x3, -f_length2, h1, dip);
-			us = (f1-f2-f3+f4) * ds / (12 * M_PI);
-			ud = (g1-g2-g3+g4) * dd / (12 * M_PI);
-			z[k++] = us + ud;
 		}
 	}
 }
 
 /* ---------------------------------------------------------------------------------------- */
-double uscal(double x1, double x2, double x3, double c, double cc, double dp) {
-	/* Computation of the vertical displacement due to the STRIKE and SLIP component */
-	double sn, cs, c1, c2, c3, r, q, r2, r3, q2, q3, h, k, a1, a2, a3, f;
+int read_faults(char *fname, struct okada_fault **f) {
+	/* Read the -Ff table of a finite fault model. One subfault per line with the 9 parameters of -F, read as
+	   in the -Fe tables. Returns the number of subfaults or -1 */
+	int n, i, bad = FALSE;
+	struct ens_source *src = NULL;
+	struct okada_fault *p;
+
+	if ((n = read_ensemble(fname, &src)) <= 0) return(-1);
+	p = (struct okada_fault *)mxCalloc((size_t)n, sizeof(struct okada_fault));
+	for (i = 0; i < n; i++) {
+		if (src[i].grid) {
+			if (!bad) mexPrintf("NSWING: Error, subfaults file %s has a line without the 9 fault parameters (%s)\n",
+			                    fname, src[i].grid);
+			bad = TRUE;
+			mxFree(src[i].grid);
+			continue;
+		}
+		p[i].dip = src[i].p[0];		p[i].strike = src[i].p[1];	p[i].rake = src[i].p[2];	p[i].slip = src[i].p[3];
+		p[i].length = src[i].p[4] * 1000;	p[i].width = src[i].p[5] * 1000;	p[i].top_depth = src[i].p[6] * 1000;
+		p[i].x = src[i].p[7];		p[i].y = src[i].p[8];
+	}
+	mxFree(src);
+	if (bad) {
+		mxFree(p);
+		return(-1);
+	}
+	*f = p;
+	return(n);
+}
+
+/* ---------------------------------------------------------------------------------------- */
+double uscal(double x1, double x2, double x3, double c, double cc, double sn, double cs, double tg) {
+	/* Computation of the vertical displacement due to the STRIKE and SLIP component. SN, CS and TG are the
+	   sine, cosine and tangent of the dip */
+	double c1, c2, c3, r, q, r2, r3, q2, q3, h, k, a1, a2, a3, f;
 	double b1, b2, b3, b4, b5, b6, b7, b8, b9, b10, b11, b12, b13, b14;
 
-	sn  = sin(dp);	cs = cos(dp);
 	c1  = c;		c2 = cc * cs;	c3 = cc * sn;
 	r   = sqrt((x1-c1)*(x1-c1) + (x2-c2)*(x2-c2) + (x3-c3)*(x3-c3));
 	q   = sqrt((x1-c1)*(x1-c1) + (x2-c2)*(x2-c2) + (x3+c3)*(x3+c3));
@@ -5491,8 +9111,8 @@ double uscal(double x1, double x2, double x3, double c, double cc, double dp) {
 	h   = sqrt(q2*q2 + (q3+cc)*(q3+cc));
 	k   = sqrt(q2*q2 + (x1-c1)*(x1-c1));
 	a1  = log(r+r3-cc);	a2 = log(q+q3+cc);	a3 = log(q+x3+c3);
-	b1  = 1. + 3. * (tan(dp)*tan(dp));
-	b2  = 3. * tan(dp) / cs;
+	b1  = 1. + 3. * (tg*tg);
+	b2  = 3. * tg / cs;
 	b3  = 2. * r2 * sn;
 	b4  = q2 + x2 * sn;
 	b5  = 2. * r2*r2 * cs;
@@ -5511,12 +9131,11 @@ double uscal(double x1, double x2, double x3, double c, double cc, double dp) {
 }
 
 /* ---------------------------------------------------------------------------------------- */
-double udcal(double x1, double x2, double x3, double c, double cc, double dp) {
-	/* Computation of the vertical displacement due to the DIP SLIP component */
-	double sn, cs, c1, c2, c3, r, q, r2, r3, q2, q3, h, k, a1, a2;
+double udcal(double x1, double x2, double x3, double c, double cc, double sn, double cs) {
+	/* Computation of the vertical displacement due to the DIP SLIP component. SN, CS as in uscal() */
+	double c1, c2, c3, r, q, r2, r3, q2, q3, h, k, a1, a2;
 	double b1, b2, b3, d1, d2, d3, d4, d5, d6, t1, t2, t3, f;
 
-	sn = sin(dp);	cs = cos(dp);
 	c1 = c;		c2 = cc * cs;	c3 = cc * sn;
 	r = sqrt((x1-c1)*(x1-c1) + (x2-c2)*(x2-c2) + (x3-c3)*(x3-c3));
 	q = sqrt((x1-c1)*(x1-c1) + (x2-c2)*(x2-c2) + (x3+c3)*(x3+c3));
@@ -5591,7 +9210,7 @@ void tm(double lon, double lat, double *x, double *y, double central_meridian, d
 }
 
 /* ---------------------------------------------------------------------------------------- */
-double GMT_get_bcr_z(double *grd, struct grd_header hdr, double xx, double yy) {
+double GMT_get_bcr_z(real *grd, struct grd_header hdr, double xx, double yy) {
 	/* Given xx, yy in user's grid file (in non-normalized units)
 	   this routine returns the desired bicubic interpolated value at xx, yy
 	   ADAPTED from GMT's routine with the same name. */
@@ -5682,45 +9301,65 @@ unsigned int gmt_bcr_prep (struct grd_header hdr, double xx, double yy, double w
 }
 
 /* ---------------------------------------------------------------------------------------- */
-void update_max(struct nestContainer *nest) {
-	/* Update the max level at this iteration. The issue is that computing the maximum of nested
-	   grids cannot be donne in the main loop because doughter grids are run much more time steps.
-	   The difference may be substancial, specially because aliasing may be bloody striking.  */
+void update_maxs(struct nestContainer *nest, int settled, int what) {
+	/* Update the max arrays at this iteration. WHAT is a combination of MAX_LEVEL, MAX_SPEED and MAX_ENERGY or
+	   MAX_POWER, that are all done in one pass over the grid so that each cell is read only once. The issue is
+	   that computing the maximum of nested grids cannot be donne in the main loop because doughter grids are
+	   run much more time steps. The difference may be substancial, specially because aliasing may be bloody
+	   striking. SETTLED tells that the writeLevel grid already did its update(), so that its current state is
+	   in the 'a' arrays. Otherwise we are between its mass() and update() and the new eta is in 'd' (the
+	   energy and power need the settled state). */
+	int row, writeLevel = nest->writeLevel;
+	real *eta    = (settled) ? nest->etaa[writeLevel] : nest->etad[writeLevel];
+	real *htotal = (settled) ? nest->htotal_a[writeLevel] : nest->htotal_d[writeLevel];
 
-	unsigned int ij;
-	int writeLevel = nest->writeLevel;
-	for (ij = 0; ij < nest->hdr[writeLevel].nm; ij++) {
-		nest->work[ij] = (float)nest->etad[writeLevel][ij];
-		if (nest->bat[writeLevel][ij] < 0) {
-			if ((nest->work[ij] = (float)(nest->etaa[writeLevel][ij] + nest->bat[writeLevel][ij])) < 0)
-				nest->work[ij] = 0;
-		}
-		if (nest->wmax[ij] < nest->work[ij])
-			nest->wmax[ij] = nest->work[ij];
-	}
+#if HAVE_OPENMP
+#pragma omp parallel for
+#endif
+	for (row = 0; row < nest->hdr[writeLevel].ny; row++)
+		update_maxs_rows(nest, eta, nest->etaa[writeLevel], htotal, what, row, row + 1);
 }
 
-/* ---------------------------------------------------------------------------------------- */
-void update_max_velocity(struct nestContainer *nest) {
-	/* Update the max velocity at this iteration. */
+/* Same as update_maxs() but only for the rows [row0, row1[. ETA is the water level, ETA_DRY the one used over
+   land and HTOTAL the water depth used for the velocity */
+void update_maxs_rows(struct nestContainer *nest, real *eta, real *eta_dry, real *htotal, int what, int row0, int row1) {
 	unsigned int ij;
 	int writeLevel = nest->writeLevel;
-	float v;
+	float w, v;
 	double vx, vy;
+	real *bat = nest->bat[writeLevel], *vex = nest->vex[writeLevel], *vey = nest->vey[writeLevel];
+	real *h_a = nest->htotal_a[writeLevel], *eta_a = nest->etaa[writeLevel];
+	real *fm = nest->fluxm_a[writeLevel], *fn = nest->fluxn_a[writeLevel];
+
+	for (ij = row0 * nest->hdr[writeLevel].nx; ij < row1 * nest->hdr[writeLevel].nx; ij++) {
+		if (what & MAX_LEVEL) {
+			w = (float)eta[ij];
+			if (bat[ij] < 0) {
+				if ((w = (float)(eta_dry[ij] + bat[ij])) < 0)
+					w = 0;
+			}
+			if (nest->wmax[ij] < w) nest->wmax[ij] = w;
+		}
+		else if ((what & (MAX_ENERGY | MAX_POWER)) && h_a[ij] > EPS2) {	/* As in total_energy() and power() */
+			if (what & MAX_ENERGY)
+				w = (float)(( eta_a[ij] * eta_a[ij] * NORMAL_GRAV + ((fm[ij] * fm[ij]) + (fn[ij] * fn[ij])) /
+				              h_a[ij] ) * 500);
+			else
+				w = (float)(( sqrt(h_a[ij] * NORMAL_GRAV) * ((fm[ij] * fm[ij]) + (fn[ij] * fn[ij])) /
+				              h_a[ij] ) * 500);
+			if (nest->wmax[ij] < w) nest->wmax[ij] = w;
+		}
 
-	for (ij = 0; ij < nest->hdr[writeLevel].nm; ij++) {
-		vx = vy = 0;
-		if (nest->htotal_d[writeLevel][ij] > EPS2)
-			vx = nest->vex[writeLevel][ij];
-
-		if (nest->htotal_d[writeLevel][ij] > EPS2)
-			vy = nest->vey[writeLevel][ij];
-
-		v = (float)(vx * vx + vy * vy);
-
-		if (nest->htotal_d[writeLevel][ij] < 0.1 && v > 400)	/* Clip above this combination (400 = V_LIMIT * V_LIMIT) */
-			v = 0;
-
-		if (nest->vmax[ij] < v) nest->vmax[ij] = v;
+		if (what & MAX_SPEED) {
+			vx = vy = 0;
+			if (htotal[ij] > EPS2) {
+				vx = vex[ij];
+				vy = vey[ij];
+			}
+			v = (float)(vx * vx + vy * vy);
+			if (htotal[ij] < 0.1 && v > 400)	/* Clip above this combination (400 = V_LIMIT * V_LIMIT) */
+				v = 0;
+			if (nest->vmax[ij] < v) nest->vmax[ij] = v;
+		}
 	}
 }
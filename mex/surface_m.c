@@ -107,78 +107,115 @@
  *	 
  *		04/06/06 J Luis, Updated to compile with version 4.1.3
  *		14/10/06 J Luis, Now includes the memory leak solving solution
+ *		17/10/26 -j<n_threads> Relax the columns in 3 colors (i mod 3) so that each color
+ *			 may be split among threads (compile with -DHAVE_OPENMP)
+ *		17/10/26 All the globals moved into a struct SURFACE_CTX, one per gridding job, so that
+ *			 several jobs may run at the same time. x,y,z given as cell arrays are gridded
+ *			 in one call, one dataset per thread (-jb<n_threads> of them).
+ *		17/10/26 -M[w][<max_cycles>] Multigrid V (or W) cycles. Coarse levels halve the intervals
+ *			 whatever nx-1 and ny-1 are, carry their own data constraints, and are linked by
+ *			 bilinear interpolation (Full Approximation Scheme). Coarse corrections are halved
+ *			 and each cycle is mixed with the previous ones, or low tensions would not converge.
  */
 
 #include "gmt.h"
 #include "mex.h"
+#if HAVE_OPENMP
+#include <omp.h>
+#endif
 
 #define OUTSIDE 2000000000	/* Index number indicating data is outside usable area */
+#define MG_N_SMOOTH 2		/* Relaxation sweeps before and after each coarse level correction (-M) */
+#define MG_DAMP 0.5		/* Fraction of the coarse level change that is added to the finer one (-M) */
+#define MG_DEPTH 5		/* Number of previous cycles mixed with the last one (-M) */
  
-int n_alloc = GMT_CHUNK;
-int npoints=0;			/* Number of data points */
-int nx=0;			/* Number of nodes in x-dir. */
-int ny=0;			/* Number of nodes in y-dir. (Final grid) */
-int mx = 0;
-int my = 0;
-int ij_sw_corner, ij_se_corner, ij_nw_corner, ij_ne_corner;
-int block_nx;			/* Number of nodes in x-dir for a given grid factor */
-int block_ny;			/* Number of nodes in y-dir for a given grid factor */
-int max_iterations=250;		/* Max iter per call to iterate */
-int total_iterations = 0;
-int grid, old_grid;		/* Node spacings  */
-int grid_east;
-int n_fact = 0;			/* Number of factors in common (ny-1, nx-1) */
-int factors[32];		/* Array of common factors */
-int long_verbose = FALSE;
-int n_empty;			/* No of unconstrained nodes at initialization  */
-int set_low = 0;		/* 0 unconstrained,1 = by min data value, 2 = by user value */
-int set_high = 0;		/* 0 unconstrained,1 = by max data value, 2 = by user value */
-int constrained = FALSE;	/* TRUE if set_low or set_high is TRUE */
-double low_limit, high_limit;	/* Constrains on range of solution */
-double x_min, x_max, y_min, y_max;	/* minmax coordinates */
-float *lower, *upper;		/* arrays for minmax values, if set */
-double xinc, yinc;		/* Size of each grid cell (final size) */
-double grid_xinc, grid_yinc;	/* size of each grid cell for a given grid factor */
-double r_xinc, r_yinc, r_grid_xinc, r_grid_yinc;	/* Reciprocals  */
-double converge_limit = 0.0;	/* Convergence limit */
-double radius = 0.0;			/* Search radius for initializing grid  */
-double	tension = 0.0;		/* Tension parameter on the surface  */
-double	boundary_tension = 0.0;
-double	interior_tension = 0.0;
-double	a0_const_1, a0_const_2;	/* Constants for off grid point equation  */
-double	e_2, e_m2, one_plus_e2;
-double eps_p2, eps_m2, two_plus_ep2, two_plus_em2;
-double	x_edge_const, y_edge_const;
-double	l_epsilon = 1.0;
-double	z_mean;
-double	z_scale = 1.0;		/* Root mean square range of z after removing planar trend  */
-double	r_z_scale = 1.0;	/* reciprocal of z_scale  */
-double	plane_c0, plane_c1, plane_c2;	/* Coefficients of best fitting plane to data  */
-float *u;			/* Pointer to grid array */
-float *v2;			/* Pointer to v.2.0 grid array */
-char *iu;			/* Pointer to grid info array */
-char mode_type[2] = {'I','D'};	/* D means include data points when iterating
-				 * I means just interpolate from larger grid */
-char format[BUFSIZ];
-double	*in0, *in1, *in2;
-
-int	offset[25][12];		/* Indices of 12 nearby points in 25 cases of edge conditions  */
-double		coeff[2][12];	/* Coefficients for 12 nearby points, constrained and unconstrained  */
-
-double relax_old, relax_new = 1.4;	/* Coefficients for relaxation factor to speed up convergence */
-
-int compare_points(const void *point_1v, const void *point_2v);
-
 struct DATA {
 	float x;
 	float y;
 	float z;
 	int index;
-} *data;		/* Data point and index to node it currently constrains  */
+};		/* Data point and index to node it currently constrains  */
 
 struct BRIGGS {
 	double b[6];
-} *briggs;		/* Coefficients in Taylor series for Laplacian(z) a la I. C. Briggs (1974)  */
+};		/* Coefficients in Taylor series for Laplacian(z) a la I. C. Briggs (1974)  */
+
+struct SURFACE_CTX {		/* Everything about one gridding job. Nothing is shared between two of them */
+	int npoints;			/* Number of data points */
+	int nx;				/* Number of nodes in x-dir. */
+	int ny;				/* Number of nodes in y-dir. (Final grid) */
+	int mx;
+	int my;
+	int ij_sw_corner, ij_se_corner, ij_nw_corner, ij_ne_corner;
+	int block_nx;			/* Number of nodes in x-dir for a given grid factor */
+	int block_ny;			/* Number of nodes in y-dir for a given grid factor */
+	int max_iterations;		/* Max iter per call to iterate */
+	int total_iterations;
+	int grid, old_grid;		/* Node spacings  */
+	int grid_east;
+	int n_fact;			/* Number of factors in common (ny-1, nx-1) */
+	int factors[32];		/* Array of common factors */
+	int verbose, long_verbose;	/* Report on progress (-V). Always off inside the threads of a batch */
+	int n_threads;			/* If > 0 (-j option) relax by colors of columns, shared among n_threads */
+	int mg_type;			/* -M option: 0 = grid stepping by common factors, 1 = V-cycles, 2 = W-cycles */
+	int mg_cycles;			/* -M option: Max number of cycles */
+	int n_empty;			/* No of unconstrained nodes at initialization  */
+	int set_low;			/* 0 unconstrained,1 = by min data value, 2 = by user value */
+	int set_high;			/* 0 unconstrained,1 = by max data value, 2 = by user value */
+	int constrained;		/* TRUE if set_low or set_high is TRUE */
+	double low_limit, high_limit;	/* Constrains on range of solution */
+	double x_min, x_max, y_min, y_max;	/* minmax coordinates */
+	float *lower, *upper;		/* arrays for minmax values, if set */
+	double xinc, yinc;		/* Size of each grid cell (final size) */
+	double grid_xinc, grid_yinc;	/* size of each grid cell for a given grid factor */
+	double r_xinc, r_yinc, r_grid_xinc, r_grid_yinc;	/* Reciprocals  */
+	double converge_limit;		/* Convergence limit */
+	double radius;			/* Search radius for initializing grid  */
+	double	tension;		/* Tension parameter on the surface  */
+	double	boundary_tension;
+	double	interior_tension;
+	double	a0_const_1, a0_const_2;	/* Constants for off grid point equation  */
+	double	a0;			/* 1 / diagonal of the unconstrained equation */
+	double	e_2, e_m2, one_plus_e2;
+	double	eps_p2, eps_m2, two_plus_ep2, two_plus_em2;
+	double	x_edge_const, y_edge_const;
+	double	l_epsilon;
+	double	z_mean;
+	double	z_scale;		/* Root mean square range of z after removing planar trend  */
+	double	r_z_scale;		/* reciprocal of z_scale  */
+	double	plane_c0, plane_c1, plane_c2;	/* Coefficients of best fitting plane to data  */
+	double	relax_old, relax_new;	/* Coefficients for relaxation factor to speed up convergence */
+	double	coeff[2][12];		/* Coefficients for 12 nearby points, constrained and unconstrained  */
+	int	offset[25][12];		/* Indices of 12 nearby points in 25 cases of edge conditions  */
+	float	*u;			/* Pointer to grid array */
+	char	*iu;			/* Pointer to grid info array */
+	double	*in0, *in1, *in2;	/* x,y,z given as Matlab arrays, or ... */
+	FILE	*fp_in;			/* ... the file pointer */
+	struct DATA *data;		/* Data point and index to node it currently constrains  */
+	struct BRIGGS *briggs;		/* Coefficients in Taylor series for Laplacian(z) a la I. C. Briggs (1974)  */
+	char	format[BUFSIZ];
+	/* Multigrid only. Each level is a context of its own, with its own nx, ny, data and constraints */
+	float	*rhs;			/* Right hand side of the equations (NULL on the final grid) */
+	float	*res;			/* Residuals, rhs - A(u) */
+	float	*v;			/* Copy of u as it was on arrival from the finer level */
+	int	*col_briggs;		/* With -j, where each column starts in the briggs table */
+	double	mg_sigma;		/* Ratio of the equations of this level to those of the finer one */
+	struct SURFACE_CTX *coarse;	/* Next coarser level (NULL on the coarsest) */
+	float	*mg_g[MG_DEPTH+1];	/* Final grid only: results of the last cycles ... */
+	float	*mg_f[MG_DEPTH+1];	/* ... and the changes they made, for mg_mix() */
+};
+
+char mode_type[2] = {'I','D'};	/* D means include data points when iterating
+				 * I means just interpolate from larger grid */
+
+/* qsort gives no way to pass the context to compare_points, so it is set right before
+   each sort. One per thread, so that jobs may sort at the same time */
+static struct SURFACE_CTX *C_sort;
+#if HAVE_OPENMP
+#pragma omp threadprivate(C_sort)
+#endif
+
+int compare_points(const void *point_1v, const void *point_2v);
 
 struct SUGGESTION {	/* Used to find top ten list of faster grid dimensions  */
 	int	nx;
@@ -186,15 +223,28 @@ struct SUGGESTION {	/* Used to find top ten list of faster grid dimensions  */
 	double	factor;	/* Speed up by a factor of factor  */
 };
 
-FILE	*fp_in = NULL;	/* File pointer  */
-
 int	gcd_euclid(int a, int b);	/* Finds the greatest common divisor  */
-int	get_prime_factors(int n, int *f), iterate(int mode);
-void set_grid_parameters(void), throw_away_unusables(void), remove_planar_trend(void), rescale_z_values(void);
-void load_constraints(char *low, char *high), smart_divide(void), set_offset(void), set_index(void), initialize_grid(void), set_coefficients(void);
-void find_nearest_point(void), fill_in_forecast(void), check_errors(void), replace_planar_trend(void);
-
-int to_data(int n_pts), read_data(void);
+int	get_prime_factors(int n, int *f), iterate(struct SURFACE_CTX *C, int mode);
+void set_grid_parameters(struct SURFACE_CTX *C), throw_away_unusables(struct SURFACE_CTX *C);
+void remove_planar_trend(struct SURFACE_CTX *C), rescale_z_values(struct SURFACE_CTX *C);
+void load_constraints(struct SURFACE_CTX *C, char *low, char *high), smart_divide(struct SURFACE_CTX *C);
+void set_offset(struct SURFACE_CTX *C), set_index(struct SURFACE_CTX *C), initialize_grid(struct SURFACE_CTX *C);
+void set_coefficients(struct SURFACE_CTX *C), find_nearest_point(struct SURFACE_CTX *C);
+void fill_in_forecast(struct SURFACE_CTX *C), check_errors(struct SURFACE_CTX *C), replace_planar_trend(struct SURFACE_CTX *C);
+double relax_column(struct SURFACE_CTX *C, int i, int x_case, int *briggs_index);
+double relax_sweep(struct SURFACE_CTX *C, int *col_briggs), node_value(struct SURFACE_CTX *C, int ij, int kase, int *briggs_index, double *diag);
+void set_boundary(struct SURFACE_CTX *C);
+int *get_col_briggs(struct SURFACE_CTX *C);
+int mg_setup(struct SURFACE_CTX *C);
+void mg_solve(struct SURFACE_CTX *C), mg_fmg(struct SURFACE_CTX *C), mg_cycle(struct SURFACE_CTX *C);
+void mg_smooth(struct SURFACE_CTX *C, int n_sweeps), mg_mix(struct SURFACE_CTX *C, int cycle), mg_free(struct SURFACE_CTX *C);
+void get_residual(struct SURFACE_CTX *C, float *res), residual_column(struct SURFACE_CTX *C, int i, int *briggs_index, float *res);
+void interp_grid(struct SURFACE_CTX *A, float *ua, struct SURFACE_CTX *B, float *ub, int add);
+void restrict_residual(struct SURFACE_CTX *F, float *rf, struct SURFACE_CTX *K, float *rk);
+int surface_prepare(struct SURFACE_CTX *C, int n_pts, char *low, char *high);
+void surface_solve(struct SURFACE_CTX *C), get_output(struct SURFACE_CTX *C, float *out);
+
+int to_data(struct SURFACE_CTX *C, int n_pts), read_data(struct SURFACE_CTX *C);
 
 /* int GMTisLoaded = FALSE;	/* Used to know wether GMT stuff is already in memory or not */
 
@@ -204,12 +254,16 @@ int to_data(int n_pts), read_data(void);
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
 	void	suggest_sizes_for_surface(int nx, int ny);
-	int	i, j, error = FALSE, size_query = FALSE, n_pts = 0;
-	int	argc = 0, n_arg_no_char = 0, index;
+	int	i, k, error = FALSE, size_query = FALSE, n_pts = 0, n_sets = 0;
+	int	argc = 0, n_arg_no_char = 0, n_batch = 0;
 	char	modifier, low[128], high[128], **argv;
-	float	*pdata;
 	double	*info;
+	mxArray	*mx_x, *mx_y, *mx_z, *mx_grd;
 	struct GRD_HEADER h;
+	struct SURFACE_CTX C, *CC = NULL;
+#if HAVE_OPENMP
+	int	n_thr;
+#endif
 
 	argc = nrhs;
 	for (i = 0; i < nrhs; i++) {		/* Check input to find how many arguments are of type char */
@@ -237,12 +291,15 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
 	GMT_grd_init (&h, argc, argv, FALSE);
 
-	x_min = y_min = 0.0;
-	x_max = y_max = 0.0;
-	xinc = yinc = 0.0;
+	memset ((void *)&C, 0, sizeof (struct SURFACE_CTX));
+	C.max_iterations = 250;
+	C.l_epsilon = 1.0;
+	C.z_scale = C.r_z_scale = 1.0;
+	C.relax_new = 1.4;
+	C.mg_cycles = 30;
 
 	/* New in v4.3:  Default to unconstrained:  */
-	set_low = set_high = 0; 
+	C.set_low = C.set_high = 0; 
 
 	gmtdefs.verbose = 0;	/* Otherwise it insists in setting it to on all the times */
 
@@ -254,14 +311,14 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
                       
 				case 'R':
 				case 'f':
-                                      error += GMT_get_common_args (argv[i], &x_min, &x_max, &y_min, &y_max);
+                                      error += GMT_get_common_args (argv[i], &C.x_min, &C.x_max, &C.y_min, &C.y_max);
                                       break;
 				case ':':
 					gmtdefs.xy_toggle[0] = TRUE;
 					break;
 				case 'V':
 					gmtdefs.verbose = 1;
-					if (argv[i][2] == 'L' || argv[i][2] == 'l') long_verbose = TRUE;
+					if (argv[i][2] == 'L' || argv[i][2] == 'l') C.long_verbose = TRUE;
 					break;
 				case 'H':
 					gmtdefs.n_header_recs = atoi (&argv[i][2]);
@@ -269,13 +326,13 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
 				/* Supplemental parameters */
 				case 'A':
-					l_epsilon = atof (&argv[i][2]);
+					C.l_epsilon = atof (&argv[i][2]);
 					break;
 				case 'C':
-					converge_limit = atof (&argv[i][2]);
+					C.converge_limit = atof (&argv[i][2]);
 					break;
 				case 'I':
-					GMT_getinc (&argv[i][2], &xinc, &yinc);
+					GMT_getinc (&argv[i][2], &C.xinc, &C.yinc);
 					break;
 				case 'L':	/* Set limits */
 						/* This is new, to use -Ll and -Lu:  */
@@ -288,12 +345,12 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 							}
 							strcpy (low, &argv[i][3]);
 							if (!access (low, R_OK))	/* file exists */
-								set_low = 3;
+								C.set_low = 3;
 							else if (low[0] == 'd')
-								set_low = 1;
+								C.set_low = 1;
 							else {
-								set_low = 2;
-								low_limit = atof (&argv[i][3]);
+								C.set_low = 2;
+								C.low_limit = atof (&argv[i][3]);
 							}
 							break;
 						case 'u':
@@ -304,12 +361,12 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 							}
 							strcpy (high, &argv[i][3]);
 							if (!access (high, R_OK))	/* file exists */
-								set_high = 3;
+								C.set_high = 3;
 							else if (high[0] == 'd')
-								set_high = 1;
+								C.set_high = 1;
 							else {
-								set_high = 2;
-								high_limit = atof (&argv[i][3]);
+								C.set_high = 2;
+								C.high_limit = atof (&argv[i][3]);
 							}
 							break;
 						default:	/* 360-periodicity option */
@@ -320,23 +377,23 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 					}
 					break;
 				case 'N':
-					max_iterations = atoi (&argv[i][2]);
+					C.max_iterations = atoi (&argv[i][2]);
 					break;
 				case 'S':
-					radius = atof (&argv[i][2]);
+					C.radius = atof (&argv[i][2]);
 					modifier = argv[i][strlen(argv[i])-1];
-					if (modifier == 'm' || modifier == 'M') radius /= 60.0;
+					if (modifier == 'm' || modifier == 'M') C.radius /= 60.0;
 					break;
 				case 'T':
 					modifier = argv[i][strlen(argv[i])-1];
 					if (modifier == 'b' || modifier == 'B') {
-						boundary_tension = atof (&argv[i][2]);
+						C.boundary_tension = atof (&argv[i][2]);
 					}
 					else if (modifier == 'i' || modifier == 'I') {
-						interior_tension = atof (&argv[i][2]);
+						C.interior_tension = atof (&argv[i][2]);
 					}
 					else if (modifier >= '0' && modifier <= '9') {
-						tension = atof (&argv[i][2]);
+						C.tension = atof (&argv[i][2]);
 					}
 					else {
 						mexPrintf("%s: GMT SYNTAX ERROR -T option: Unrecognized modifier %c\n", GMT_program, modifier);
@@ -347,7 +404,18 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 					size_query = TRUE;
 					break;
 				case 'Z':
-					relax_new = atof (&argv[i][2]);
+					C.relax_new = atof (&argv[i][2]);
+					break;
+				case 'j':
+					if (argv[i][2] == 'b')	/* Threads of a batch, one dataset each */
+						n_batch = atoi (&argv[i][3]);
+					else
+						C.n_threads = atoi (&argv[i][2]);
+					break;
+				case 'M':
+					k = (argv[i][2] == 'w' || argv[i][2] == 'W') ? 3 : 2;
+					C.mg_type = k - 1;
+					if (argv[i][k]) C.mg_cycles = atoi (&argv[i][k]);
 					break;
 				default:
 					error = TRUE;
@@ -357,7 +425,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 		}
 		else {
 			if (n_arg_no_char == 0) {
-				if ((fp_in = fopen(argv[i], "r")) == NULL) {
+				if ((C.fp_in = fopen(argv[i], "r")) == NULL) {
 					mexPrintf ("surface: cannot open input data file %s\n", argv[i]);
 					mexErrMsgTxt("\n");
 				}
@@ -370,11 +438,15 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 		mexPrintf ("usage: [Zout,head] = surface_m(x,y,z|<xyz-file>, '-I<xinc>[m|c][/<yinc>[m|c]]',\n");
 		mexPrintf ("\t'-R<west>/<east>/<south>/<north>', '[-A<aspect_ratio>]', '[-C<convergence_limit>]',\n");
 		mexPrintf ("\t'[-Ll<limit>]', '[-Lu<limit>]', '[-N<n_iterations>]', '[-S<search_radius>[m]]', '[-T<tension>[i][b]]',\n");
-		mexPrintf ("\t'[-Q]', '[-V[l]]', '[-Z<over_relaxation_parameter>]', '[-f[i|o]<colinfo>]')\n\n");
+		mexPrintf ("\t'[-Q]', '[-V[l]]', '[-Z<over_relaxation_parameter>]', '[-f[i|o]<colinfo>]', '[-j<n_threads>]',\n");
+		mexPrintf ("\t'[-jb<n_threads>]', '[-M[w][<max_cycles>]]')\n\n");
 		
 		if (GMT_give_synopsis_and_exit) return;
 		
-		mexPrintf ("\tsurface will use provided x,y,z vectors or a single <xyz-file>.\n\n");
+		mexPrintf ("\tsurface will use provided x,y,z vectors or a single <xyz-file>.\n");
+		mexPrintf ("\tx,y,z may also be cell arrays of N datasets (doubles), all gridded with the same options.\n");
+		mexPrintf ("\tThey are solved in parallel (OpenMP builds, -jb<n_threads> threads if given, else all\n");
+		mexPrintf ("\tthe cores) and Zout is a 1xN cell array with the N grids.\n\n");
 		mexPrintf ("\tRequired arguments to surface:\n");
 		mexPrintf ("\t-I sets the Increment of the grid; enter xinc, optionally xinc/yinc.\n");
 		mexPrintf ("\t\tDefault is yinc = xinc.  Append an m [or c] to xinc or yinc to indicate minutes [or seconds]\n");
@@ -411,7 +483,20 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 		mexPrintf ("\t\tAppend l for long verbose\n");
 		mexPrintf ("\t-Z sets <over_relaxation parameter>.  Default = 1.4\n");
 		mexPrintf ("\t\tUse a value between 1 and 2.  Larger number accelerates convergence but can be unstable.\n");
-		mexPrintf ("\t\tUse 1 if you want to be sure to have (slow) stable convergence.\n\n");
+		mexPrintf ("\t\tUse 1 if you want to be sure to have (slow) stable convergence.\n");
+		mexPrintf ("\t-j Relax the grid columns in 3 colors (i mod 3) instead of in one Gauss-Seidel sweep. The\n");
+		mexPrintf ("\t\tcolumns of a color do not see each other, so they are shared among <n_threads> threads\n");
+		mexPrintf ("\t\t(OpenMP builds). The result only depends on -j being used, not on <n_threads>, and\n");
+		mexPrintf ("\t\tagrees with the default sweep to within the convergence limit. In a batch (cell arrays)\n");
+		mexPrintf ("\t\tthe datasets already share the threads, so each one is relaxed in colors by one thread.\n");
+		mexPrintf ("\t-jb Number of threads among which the datasets of a batch are shared. Does not change the\n");
+		mexPrintf ("\t\tresults, nor the relaxation order (that is -j).\n");
+		mexPrintf ("\t-M Solve by multigrid cycles instead of stepping down the common factors of nx-1 and ny-1.\n");
+		mexPrintf ("\t\tEach coarser grid has about half the intervals in x and y, whatever nx and ny are, and\n");
+		mexPrintf ("\t\tthe data constrain all of them. Good for grid dimensions with few or no common factors.\n");
+		mexPrintf ("\t\tV-cycles by default, append w for W-cycles. Stops when a cycle changes no node by more\n");
+		mexPrintf ("\t\tthan <convergence_limit>, or after <max_cycles> cycles [30]. -N, -Z and -j apply to the\n");
+		mexPrintf ("\t\trelaxation sweeps inside the cycles, -S is not used.\n\n");
 		/*GMT_explain_option ('i');*/
 		/*GMT_explain_option ('n');*/
 		mexPrintf ("\t\tDefault is 3 input columns.\n\n");
@@ -424,18 +509,26 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 		mexPrintf ("%s: GMT SYNTAX ERROR:  Must specify -R option\n", GMT_program);
 		error++;
 	}
-	if (xinc <= 0.0 || yinc <= 0.0) {
+	if (C.xinc <= 0.0 || C.yinc <= 0.0) {
 		mexPrintf ("%s: GMT SYNTAX ERROR -I option.  Must specify positive increment(s)\n", GMT_program);
 		error++;
 	}
-	if (max_iterations < 1) {
+	if (C.max_iterations < 1) {
 		mexPrintf ("%s: GMT SYNTAX ERROR -N option.  Max iterations must be nonzero\n", GMT_program);
 		error++;
 	}
-	if (relax_new < 1.0 || relax_new > 2.0) {
+	if (C.relax_new < 1.0 || C.relax_new > 2.0) {
 		mexPrintf ("%s: GMT SYNTAX ERROR -Z option.  Relaxation value must be 1 <= z <= 2\n", GMT_program);
 		error++;
 	}
+	if (C.n_threads < 0 || n_batch < 0) {
+		mexPrintf ("%s: GMT SYNTAX ERROR -j option.  Number of threads must be positive\n", GMT_program);
+		error++;
+	}
+	if (C.mg_type && C.mg_cycles < 1) {
+		mexPrintf ("%s: GMT SYNTAX ERROR -M option.  Max number of cycles must be positive\n", GMT_program);
+		error++;
+	}
 	if (GMT_io.binary[GMT_IN] && gmtdefs.io_header[GMT_IN]) {
 		mexPrintf ("%s: GMT SYNTAX ERROR.  Binary input data cannot have header -H\n", GMT_program);
 		error++;
@@ -447,6 +540,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 	}
 	
 	if (error) mexErrMsgTxt("\n");
+	C.verbose = gmtdefs.verbose;
 
 	if (nlhs < 1 || nlhs > 2)
 		mexErrMsgTxt("SURFACE ERROR: Must provide one or two outputs.\n");
@@ -454,236 +548,713 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 		if (n_arg_no_char != 3)
 			mexErrMsgTxt("SURFACE ERROR: Must provide three numeric inputs (x,y,z)\n");
 
-		/* Check that first argument contains at least a mx3 table */
-		n_pts = mxGetM (prhs[0]);
-		if (!mxIsNumeric(prhs[0]) | !mxIsNumeric(prhs[1]) | !mxIsNumeric(prhs[2]))
-			mexErrMsgTxt("SURFACE ERROR: first 3 input args must contain the x,y,z triplets to interpolate.\n");
+		if (mxIsCell(prhs[0])) {	/* A batch of datasets, all gridded with the same options */
+			n_sets = mxGetNumberOfElements (prhs[0]);
+			if (!mxIsCell(prhs[1]) || !mxIsCell(prhs[2]) || n_sets == 0 ||
+				mxGetNumberOfElements(prhs[1]) != n_sets || mxGetNumberOfElements(prhs[2]) != n_sets)
+				mexErrMsgTxt("SURFACE ERROR: x,y,z cell arrays must have the same (non zero) number of elements.\n");
+			for (k = 0; k < n_sets; k++) {
+				mx_x = mxGetCell (prhs[0], k);	mx_y = mxGetCell (prhs[1], k);	mx_z = mxGetCell (prhs[2], k);
+				if (!mx_x || !mx_y || !mx_z || !mxIsDouble(mx_x) || !mxIsDouble(mx_y) || !mxIsDouble(mx_z))
+					mexErrMsgTxt("SURFACE ERROR: the x,y,z cells must all contain double arrays.\n");
+				if (mxGetNumberOfElements(mx_y) != mxGetNumberOfElements(mx_x) ||
+					mxGetNumberOfElements(mx_z) != mxGetNumberOfElements(mx_x))
+					mexErrMsgTxt("SURFACE ERROR: the x,y,z of a dataset must have the same number of elements.\n");
+			}
+		}
+		else {
+			/* Check that first argument contains at least a mx3 table */
+			n_pts = mxGetM (prhs[0]);
+			if (!mxIsNumeric(prhs[0]) | !mxIsNumeric(prhs[1]) | !mxIsNumeric(prhs[2]))
+				mexErrMsgTxt("SURFACE ERROR: first 3 input args must contain the x,y,z triplets to interpolate.\n");
+		}
 	}
 
-	if (n_arg_no_char > 0) {		/* Input data was transmited in input*/
+	if (n_arg_no_char > 0 && !n_sets) {		/* Input data was transmited in input*/
 		/* Read the input points and convert them to double */
 		if (mxIsDouble(prhs[0])) {
-			in0 = mxGetPr(prhs[0]);
-			in1 = mxGetPr(prhs[1]);
-			in2 = mxGetPr(prhs[2]);
+			C.in0 = mxGetPr(prhs[0]);
+			C.in1 = mxGetPr(prhs[1]);
+			C.in2 = mxGetPr(prhs[2]);
 		}
 		else if (mxIsSingle(prhs[0])) {
-			in0 = mxGetData(prhs[0]);
-			in1 = mxGetData(prhs[1]);
-			in2 = mxGetData(prhs[2]);
+			C.in0 = mxGetData(prhs[0]);
+			C.in1 = mxGetData(prhs[1]);
+			C.in2 = mxGetData(prhs[2]);
 		}
 	}
 
-	h.x_min = x_min;
-	h.x_max = x_max;
-	h.y_min = y_min;
-	h.y_max = y_max;
-	h.x_inc = xinc;
-	h.y_inc = yinc;
+	h.x_min = C.x_min;
+	h.x_max = C.x_max;
+	h.y_min = C.y_min;
+	h.y_max = C.y_max;
+	h.x_inc = C.xinc;
+	h.y_inc = C.yinc;
 
 	/*GMT_grd_RI_verify (&h, 1);*/		/* IF (IVAN == TRUE)  ==> Matlab = BOOM */
 
-	if (tension != 0.0) {
-		boundary_tension = tension;
-		interior_tension = tension;
+	if (C.tension != 0.0) {
+		C.boundary_tension = C.tension;
+		C.interior_tension = C.tension;
 	}
-	relax_old = 1.0 - relax_new;
+	C.relax_old = 1.0 - C.relax_new;
 
-	nx = irint ((x_max - x_min)/xinc) + 1;
-	ny = irint ((y_max - y_min)/yinc) + 1;
-	h.nx = nx;
-	h.ny = ny;
-	mx = nx + 4;
-	my = ny + 4;
-	r_xinc = 1.0 / xinc;
-	r_yinc = 1.0 / yinc;
+	C.nx = irint ((C.x_max - C.x_min)/C.xinc) + 1;
+	C.ny = irint ((C.y_max - C.y_min)/C.yinc) + 1;
+	h.nx = C.nx;
+	h.ny = C.ny;
+	C.mx = C.nx + 4;
+	C.my = C.ny + 4;
+	C.r_xinc = 1.0 / C.xinc;
+	C.r_yinc = 1.0 / C.yinc;
 
 	/* New stuff here for v4.3:  Check out the grid dimensions:  */
-	grid = gcd_euclid (nx-1, ny-1);
+	C.grid = gcd_euclid (C.nx-1, C.ny-1);
 
 	if (gmtdefs.verbose || size_query) {
-		sprintf (format, "W: %s E: %s S: %s N: %s nx: %%d ny: %%d\n", gmtdefs.d_format, gmtdefs.d_format, gmtdefs.d_format, gmtdefs.d_format);
-		mexPrintf (format, x_min, x_max, y_min, y_max, nx-1, ny-1);
+		sprintf (C.format, "W: %s E: %s S: %s N: %s nx: %%d ny: %%d\n", gmtdefs.d_format, gmtdefs.d_format, gmtdefs.d_format, gmtdefs.d_format);
+		mexPrintf (C.format, C.x_min, C.x_max, C.y_min, C.y_max, C.nx-1, C.ny-1);
 	}
-	if (grid == 1 && gmtdefs.verbose) mexPrintf("%s:  WARNING:  Your grid dimensions are mutually prime.\n", GMT_program);
-	if (( grid == 1 && gmtdefs.verbose) || size_query) suggest_sizes_for_surface(nx-1, ny-1);
+	if (C.grid == 1 && gmtdefs.verbose) mexPrintf("%s:  WARNING:  Your grid dimensions are mutually prime.\n", GMT_program);
+	if (( C.grid == 1 && gmtdefs.verbose) || size_query) suggest_sizes_for_surface(C.nx-1, C.ny-1);
 	if (size_query) return;
 
+	if (n_sets) {
+		/* Batch mode. The datasets are prepared one after the other here (that may print and
+		   read files), and then solved in parallel, one dataset per thread. Nothing is shared
+		   between the jobs, so the results are the same as those of one call per dataset */
+		CC = (struct SURFACE_CTX *) mxCalloc ((size_t)n_sets, sizeof (struct SURFACE_CTX));
+		for (k = 0; k < n_sets; k++) {
+			memcpy ((void *)&CC[k], (void *)&C, sizeof (struct SURFACE_CTX));
+			CC[k].in0 = mxGetPr (mxGetCell (prhs[0], k));
+			CC[k].in1 = mxGetPr (mxGetCell (prhs[1], k));
+			CC[k].in2 = mxGetPr (mxGetCell (prhs[2], k));
+			if (surface_prepare (&CC[k], mxGetNumberOfElements (mxGetCell (prhs[0], k)), low, high))
+				mexErrMsgTxt("\n");
+			CC[k].verbose = CC[k].long_verbose = FALSE;	/* mexPrintf is not to be called from threads */
+			if (CC[k].n_threads) CC[k].n_threads = 1;	/* Same colors, but no threads inside the batch ones */
+		}
+
+#if HAVE_OPENMP
+		n_thr = (n_batch > 0) ? n_batch : omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic,1) num_threads(n_thr)
+#endif
+		for (k = 0; k < n_sets; k++)
+			surface_solve (&CC[k]);
+
+		plhs[0] = mxCreateCellMatrix (1, n_sets);
+		for (k = 0; k < n_sets; k++) {
+			mx_grd = mxCreateNumericMatrix (C.ny,C.nx,mxSINGLE_CLASS,mxREAL);
+			get_output (&CC[k], (float *)mxGetData(mx_grd));
+			mxSetCell (plhs[0], k, mx_grd);
+			GMT_free ((void *) CC[k].u);
+		}
+		mxFree ((void *)CC);
+	}
+	else {
+		if (surface_prepare (&C, n_pts, low, high)) mexErrMsgTxt("\n");
+		surface_solve (&C);
+
+		plhs[0] = mxCreateNumericMatrix (C.ny,C.nx,mxSINGLE_CLASS,mxREAL);
+		get_output (&C, (float *)mxGetData(plhs[0]));
+		GMT_free ((void *) C.u);
+	}
+
+	/*write_output(&h, grdfile);*/
+
+	if (nlhs == 2) {	/* User also wants the header */
+		plhs[1] = mxCreateDoubleMatrix (1, 9, mxREAL);
+		info = mxGetPr (plhs[1]);
+		info[0] = h.x_min;
+		info[1] = h.x_max;
+		info[2] = h.y_min;
+		info[3] = h.y_max;
+		info[4] = h.z_min;
+		info[5] = h.z_max;
+		info[6] = h.node_offset;
+		info[7] = h.x_inc;
+		info[8] = h.y_inc;
+	}
+
+	GMT_end (argc, argv);
+}
+
+int surface_prepare (struct SURFACE_CTX *C, int n_pts, char *low, char *high) {
+	/* Loads the data and sets up everything for the first iteration. Must run in the Matlab
+	   thread. Data come from in0,in1,in2 (n_pts of them) or, when these are NULL, from fp_in */
+	int	n_levels;
+
 	/* New idea: set grid = 1, read data, setting index.  Then throw
 		away data that can't be used in end game, constraining
 		size of briggs->b[6] structure.  */
 	
-	grid = 1;
-	set_grid_parameters();
-	if (n_arg_no_char == 0)	{	/* Input data will be read inside next subroutine*/
-		if (read_data()) mexErrMsgTxt("\n");
+	C->grid = 1;
+	set_grid_parameters(C);
+	if (C->in0 == NULL)	{	/* Input data will be read inside next subroutine*/
+		if (read_data(C)) return (1);
 	}
 	else {				/* Input data was transmited in input and will be copyied to the data struct*/
-		if (to_data(n_pts)) mexErrMsgTxt("\n");
+		if (to_data(C, n_pts)) return (1);
 	}
 
-	throw_away_unusables();
-	remove_planar_trend();
-	rescale_z_values();
-	load_constraints(low, high);
+	throw_away_unusables(C);
+	remove_planar_trend(C);
+	rescale_z_values(C);
+	load_constraints(C, low, high);
 	
 	/* Set up factors and reset grid to first value  */
 	
-	grid = gcd_euclid(nx-1, ny-1);
-	n_fact = get_prime_factors(grid, factors);
-	set_grid_parameters();
-	while ( block_nx < 4 || block_ny < 4 ) {
-		smart_divide();
-		set_grid_parameters();
+	if (C->mg_type) {	/* Multigrid works on the final grid and on levels of its own */
+		C->grid = 1;
+		C->n_fact = 0;
+	}
+	else {
+		C->grid = gcd_euclid(C->nx-1, C->ny-1);
+		C->n_fact = get_prime_factors(C->grid, C->factors);
+	}
+	set_grid_parameters(C);
+	while ( C->block_nx < 4 || C->block_ny < 4 ) {
+		smart_divide(C);
+		set_grid_parameters(C);
 	}
-	set_offset();
-	set_index();
+	set_offset(C);
+	set_index(C);
 	/* Now the data are ready to go for the first iteration.  */
 
 	/* Allocate more space  */
 	
-	briggs = (struct BRIGGS *) GMT_memory (VNULL, (size_t)npoints, sizeof(struct BRIGGS), GMT_program);
-	iu = (char *) GMT_memory (VNULL, (size_t)(mx * my), sizeof(char), GMT_program);
-	u = (float *) GMT_memory (VNULL, (size_t)(mx * my), sizeof(float), GMT_program);
+	C->briggs = (struct BRIGGS *) GMT_memory (VNULL, (size_t)C->npoints, sizeof(struct BRIGGS), GMT_program);
+	C->iu = (char *) GMT_memory (VNULL, (size_t)(C->mx * C->my), sizeof(char), GMT_program);
+	C->u = (float *) GMT_memory (VNULL, (size_t)(C->mx * C->my), sizeof(float), GMT_program);
 
-	if (radius > 0) initialize_grid(); /* Fill in nodes with a weighted avg in a search radius  */
+	if (C->mg_type) {
+		n_levels = mg_setup(C);
+		if (C->verbose) mexPrintf ("%s: Multigrid with %d levels\n", GMT_program, n_levels);
+	}
+	else if (C->radius > 0) initialize_grid(C); /* Fill in nodes with a weighted avg in a search radius  */
+
+	return (0);
+}
 
-	if (gmtdefs.verbose) mexPrintf("Grid\tMode\tIteration\tMax Change\tConv Limit\tTotal Iterations\n");
+void surface_solve (struct SURFACE_CTX *C) {
+	/* All the iterations, from the coarsest grid to the final one. Only touches C, so several of
+	   these may run at the same time (but then with verbose off). The solution is left in C->u */
+
+	if (C->mg_type) {
+		if (C->verbose) mexPrintf("Cycle\tMax Change\tConv Limit\tTotal Iterations\n");
+		mg_solve (C);
+		mg_free (C);
+	}
+	else {
+		if (C->verbose) mexPrintf("Grid\tMode\tIteration\tMax Change\tConv Limit\tTotal Iterations\n");
 	
-	set_coefficients();
+		set_coefficients(C);
 	
-	old_grid = grid;
-	find_nearest_point ();
-	iterate (1);
+		C->old_grid = C->grid;
+		find_nearest_point (C);
+		iterate (C, 1);
 	 
-	while (grid > 1) {
-		smart_divide ();
-		set_grid_parameters();
-		set_offset();
-		set_index ();
-		fill_in_forecast ();
-		iterate(0);
-		old_grid = grid;
-		find_nearest_point ();
-		iterate (1);
+		while (C->grid > 1) {
+			smart_divide (C);
+			set_grid_parameters(C);
+			set_offset(C);
+			set_index (C);
+			fill_in_forecast (C);
+			iterate(C, 0);
+			C->old_grid = C->grid;
+			find_nearest_point (C);
+			iterate (C, 1);
+		}
 	}
 	
-	if (gmtdefs.verbose) check_errors ();
+	if (C->verbose) check_errors (C);
 
-	replace_planar_trend();
+	replace_planar_trend(C);
 	
-	GMT_free ((void *) data);
-	GMT_free ((void *) briggs);
-	GMT_free ((void *)iu);
-	if (set_low) GMT_free ((void *)lower);
-	if (set_high) GMT_free ((void *)upper);
+	GMT_free ((void *) C->data);
+	GMT_free ((void *) C->briggs);
+	GMT_free ((void *) C->iu);
+	if (C->set_low) GMT_free ((void *) C->lower);
+	if (C->set_high) GMT_free ((void *) C->upper);
+}
 
-	/*write_output(&h, grdfile);*/
+void get_output (struct SURFACE_CTX *C, float *out) {
+	/* Copy the solution into a ny x nx Matlab (column major, South up) array */
+	int i, j, index;
 
-	v2 = (float *) GMT_memory (VNULL, (size_t)(nx * ny), sizeof (float), GMT_program);
-	index = ij_sw_corner;
-	for(i = 0; i < nx; i++, index += my) for (j = 0; j < ny; j++) v2[j*nx+i] = u[index + ny - j - 1];
-	/* Transpose from gmt grd orientation to Matlab orientation */
-	for (i = 0; i < ny; i++) for (j = 0; j < nx; j++) u[j*ny+ny-i-1] = v2[i*nx+j];
+	for (i = 0, index = C->ij_sw_corner; i < C->nx; i++, index += C->my)
+		for (j = 0; j < C->ny; j++) out[i*C->ny + j] = C->u[index + j];
+}
 
-	plhs[0] = mxCreateNumericMatrix (ny,nx,mxSINGLE_CLASS,mxREAL);
-	pdata = mxGetData(plhs[0]);
-	memcpy(pdata, u, ny*nx * 4);
+/* ------------------------------------------------------------------------------------------
+ *	Multigrid solver (-M). The grid stepping above needs common factors of nx-1 and ny-1 and
+ *	has no way back to correct the coarse grids. Here each coarser level has about half the
+ *	intervals of the one above (nx-1 -> ceil((nx-1)/2), per direction, down to 4 nodes) and
+ *	sees its own data constraints. Levels are linked by bilinear interpolation, so they need
+ *	not be nested, and the cycles use the Full Approximation Scheme (the coarse levels solve
+ *	for the whole surface, not for a correction) so that the constrained nodes and the -L
+ *	limits are handled as they are on the final grid.
+ *	The coarse equations are only an approximation of the final ones near the edges and the
+ *	data, more so at low tension, so the coarse corrections are damped (MG_DAMP) and the few
+ *	modes that the cycles still amplify are removed by mixing the last MG_DEPTH+1 cycles
+ *	(Anderson). That costs 2*(MG_DEPTH+1) extra copies of the final grid.
+ * ------------------------------------------------------------------------------------------ */
+
+int mg_setup (struct SURFACE_CTX *C) {
+	/* Builds the coarser levels under C, which must already be at grid = 1 with its data
+	   indexed. The spacing, aspect ratio and tensions of a level are those that give the same
+	   continuous equation as the final grid. Returns the number of levels */
+	int	nx, ny, k, n_levels = 1;
+	double	rx, ry, tau, tau_b, s, s_up = 1.0;
+	struct SURFACE_CTX *F, *K;
+
+	C->res = (float *) GMT_memory (VNULL, (size_t)(C->mx * C->my), sizeof(float), GMT_program);
+	C->v = (float *) GMT_memory (VNULL, (size_t)(C->mx * C->my), sizeof(float), GMT_program);
+	for (k = 0; k <= MG_DEPTH; k++) {
+		C->mg_g[k] = (float *) GMT_memory (VNULL, (size_t)(C->mx * C->my), sizeof(float), GMT_program);
+		C->mg_f[k] = (float *) GMT_memory (VNULL, (size_t)(C->mx * C->my), sizeof(float), GMT_program);
+	}
 
-	if (nlhs == 2) {	/* User also wants the header */
-		plhs[1] = mxCreateDoubleMatrix (1, 9, mxREAL);
-		info = mxGetPr (plhs[1]);
-		info[0] = h.x_min;
-		info[1] = h.x_max;
-		info[2] = h.y_min;
-		info[3] = h.y_max;
-		info[4] = h.z_min;
-		info[5] = h.z_max;
-		info[6] = h.node_offset;
-		info[7] = h.x_inc;
-		info[8] = h.y_inc;
+	/* In grid units the equation is (1-T) Lap^2 u - T Lap u, so T/(1-T) goes with the spacing squared */
+	tau = (C->interior_tension < 1.0) ? C->interior_tension / (1.0 - C->interior_tension) : -1.0;
+	tau_b = (C->boundary_tension < 1.0) ? C->boundary_tension / (1.0 - C->boundary_tension) : -1.0;
+
+	for (F = C; ; F = K, n_levels++) {
+		nx = (F->nx >= 6) ? F->nx / 2 + 1 : F->nx;
+		ny = (F->ny >= 6) ? F->ny / 2 + 1 : F->ny;
+		if (nx == F->nx && ny == F->ny) break;
+
+		K = (struct SURFACE_CTX *) GMT_memory (VNULL, (size_t)1, sizeof(struct SURFACE_CTX), GMT_program);
+		memcpy ((void *)K, (void *)C, sizeof(struct SURFACE_CTX));
+		K->nx = nx;
+		K->ny = ny;
+		K->mx = nx + 4;
+		K->my = ny + 4;
+		K->xinc = (C->x_max - C->x_min) / (nx - 1);
+		K->yinc = (C->y_max - C->y_min) / (ny - 1);
+		K->r_xinc = 1.0 / K->xinc;
+		K->r_yinc = 1.0 / K->yinc;
+		rx = K->xinc / C->xinc;
+		ry = K->yinc / C->yinc;
+		K->l_epsilon = C->l_epsilon * rx / ry;
+		K->interior_tension = (tau < 0.0) ? 1.0 : rx * rx * tau / (1.0 + rx * rx * tau);
+		K->boundary_tension = (tau_b < 0.0) ? 1.0 : rx * tau_b / (1.0 + rx * tau_b);
+		s = (tau < 0.0) ? rx * rx : pow (rx, 4.0) * (1.0 + tau) / (1.0 + rx * rx * tau);
+		K->mg_sigma = s / s_up;
+		s_up = s;
+		K->plane_c1 = C->plane_c1 * rx;		/* The trend is in units of the final grid */
+		K->plane_c2 = C->plane_c2 * ry;
+		K->constrained = K->set_low = K->set_high = 0;	/* Limits are only enforced on the final grid */
+		K->lower = K->upper = NULL;
+		K->verbose = K->long_verbose = FALSE;
+		K->converge_limit = 0.1 * C->converge_limit;	/* For the coarsest level, solved by iterate() */
+		K->grid = 1;
+		K->n_fact = 0;
+		K->data = (struct DATA *) GMT_memory (VNULL, (size_t)C->npoints, sizeof(struct DATA), GMT_program);
+		memcpy ((void *)K->data, (void *)C->data, (size_t)C->npoints * sizeof(struct DATA));
+		K->briggs = (struct BRIGGS *) GMT_memory (VNULL, (size_t)C->npoints, sizeof(struct BRIGGS), GMT_program);
+		K->iu = (char *) GMT_memory (VNULL, (size_t)(K->mx * K->my), sizeof(char), GMT_program);
+		K->u = (float *) GMT_memory (VNULL, (size_t)(K->mx * K->my), sizeof(float), GMT_program);
+		K->rhs = (float *) GMT_memory (VNULL, (size_t)(K->mx * K->my), sizeof(float), GMT_program);
+		K->res = (float *) GMT_memory (VNULL, (size_t)(K->mx * K->my), sizeof(float), GMT_program);
+		K->v = (float *) GMT_memory (VNULL, (size_t)(K->mx * K->my), sizeof(float), GMT_program);
+		K->col_briggs = NULL;
+		K->coarse = NULL;
+		set_grid_parameters (K);
+		set_offset (K);
+		set_index (K);
+		F->coarse = K;
+	}
+	return (n_levels);
+}
+
+void mg_solve (struct SURFACE_CTX *C) {
+	/* Full multigrid start (each level gets the solution of the one below plus one cycle)
+	   and then cycles on the final grid until none changes it by more than converge_limit */
+	int	i, j, ij, ij_v2, cycle;
+	double	change;
+	struct SURFACE_CTX *K;
+
+	for (K = C; K; K = K->coarse) {
+		set_coefficients (K);
+		find_nearest_point (K);
+		if (K->n_threads) K->col_briggs = get_col_briggs (K);
 	}
 
-	GMT_free ((void *) u);
-	GMT_free ((void *)v2);
-	GMT_end (argc, argv);
+	if (C->coarse) {
+		mg_fmg (C->coarse);
+		interp_grid (C->coarse, C->coarse->u, C, C->u, FALSE);
+	}
+
+	sprintf (C->format, "%%4d\t%s\t%s\t%%10d\n", gmtdefs.d_format, gmtdefs.d_format);
+	for (cycle = 1; cycle <= C->mg_cycles; cycle++) {
+		memcpy ((void *)C->v, (void *)C->u, (size_t)(C->mx * C->my) * sizeof(float));
+		mg_cycle (C);
+		mg_mix (C, cycle);
+		for (i = 0, change = 0.0; i < C->nx; i++) {
+			for (j = 0, ij = C->ij_sw_corner + i * C->my; j < C->ny; j++, ij++)
+				if (fabs (C->u[ij] - C->v[ij]) > change) change = fabs (C->u[ij] - C->v[ij]);
+		}
+		change *= C->z_scale;	/* Put change into z units  */
+		if (C->verbose) mexPrintf (C->format, cycle, change, C->converge_limit, C->total_iterations);
+		if (change <= C->converge_limit) break;
+	}
+	if (C->constrained) {	/* The mixed grid may be a bit outside the limits */
+		for (i = 0; i < C->nx; i++) {
+			for (j = 0, ij = C->ij_sw_corner + i * C->my; j < C->ny; j++, ij++) {
+				ij_v2 = (C->ny - j - 1) * C->nx + i;
+				if (C->set_low && !GMT_is_fnan (C->lower[ij_v2]) && C->u[ij] < C->lower[ij_v2])
+					C->u[ij] = C->lower[ij_v2];
+				else if (C->set_high && !GMT_is_fnan (C->upper[ij_v2]) && C->u[ij] > C->upper[ij_v2])
+					C->u[ij] = C->upper[ij_v2];
+			}
+		}
+	}
+	if (C->verbose && cycle > C->mg_cycles)
+		mexPrintf ("%s: WARNING: No convergence after %d cycles.\n", GMT_program, C->mg_cycles);
+}
+
+void mg_fmg (struct SURFACE_CTX *C) {
+	/* Solves the problem of level C alone, starting from the solution of the level below */
+	if (!C->coarse) {
+		iterate (C, 1);
+		return;
+	}
+	mg_fmg (C->coarse);
+	interp_grid (C->coarse, C->coarse->u, C, C->u, FALSE);
+	mg_cycle (C);
+}
+
+void mg_cycle (struct SURFACE_CTX *C) {
+	/* One V (mg_type = 1) or W (2) cycle from level C down */
+	int	i, j, ij, k;
+	struct SURFACE_CTX *K = C->coarse;
+
+	if (!K) {	/* Coarsest level. Small enough to be solved by relaxation */
+		iterate (C, 1);
+		return;
+	}
+
+	mg_smooth (C, MG_N_SMOOTH);
+	get_residual (C, C->res);
+
+	/* K gets u restricted (saved in v) and rhs = A_K(v) + sigma * R(res) */
+	restrict_residual (C, C->res, K, K->rhs);
+	interp_grid (C, C->u, K, K->u, FALSE);
+	memcpy ((void *)K->v, (void *)K->u, (size_t)(K->mx * K->my) * sizeof(float));
+	for (i = 0; i < K->nx; i++) {
+		for (j = 0, ij = K->ij_sw_corner + i * K->my; j < K->ny; j++, ij++) K->rhs[ij] *= (float)K->mg_sigma;
+	}
+	get_residual (K, K->res);	/* = sigma * R(res) - A_K(v) */
+	for (i = 0; i < K->nx; i++) {
+		for (j = 0, ij = K->ij_sw_corner + i * K->my; j < K->ny; j++, ij++) K->rhs[ij] = 2 * K->rhs[ij] - K->res[ij];
+	}
+
+	for (k = 0; k < C->mg_type; k++) mg_cycle (K);
+
+	/* Interpolate the change of K back to C. Damped, as the coarse levels overshoot at low tension */
+	for (i = 0; i < K->nx; i++) {
+		for (j = 0, ij = K->ij_sw_corner + i * K->my; j < K->ny; j++, ij++) K->v[ij] = (float)(MG_DAMP * (K->u[ij] - K->v[ij]));
+	}
+	interp_grid (K, K->v, C, C->u, TRUE);
+
+	mg_smooth (C, MG_N_SMOOTH);
+}
+
+void mg_smooth (struct SURFACE_CTX *C, int n_sweeps) {
+	int	k;
+
+	for (k = 0; k < n_sweeps; k++) {
+		set_boundary (C);
+		relax_sweep (C, C->col_briggs);
+	}
+	C->total_iterations += n_sweeps;
+}
+
+void mg_mix (struct SURFACE_CTX *C, int cycle) {
+	/* Anderson mixing. C->u is the result of the cycle that started from C->v. It is replaced by
+	   the combination of the results of the last MG_DEPTH+1 cycles whose changes best cancel out
+	   (least squares). The cycles alone do not converge on a few modes of the biharmonic (free
+	   edges and corners, data seen differently by the coarse levels); this takes care of them */
+	int	i, j, ij, a, b, m, n_hist, slot[MG_DEPTH+1];
+	double	sum, value, d_max, A[MG_DEPTH][MG_DEPTH+1], gamma[MG_DEPTH];
+	float	*f, *g;
+
+	n_hist = MIN (cycle, MG_DEPTH + 1);
+	for (a = 0; a < n_hist; a++) slot[a] = (cycle - n_hist + a) % (MG_DEPTH + 1);
+	f = C->mg_f[slot[n_hist-1]];
+	g = C->mg_g[slot[n_hist-1]];
+	for (i = 0; i < C->nx; i++) {
+		for (j = 0, ij = C->ij_sw_corner + i * C->my; j < C->ny; j++, ij++) {
+			g[ij] = C->u[ij];
+			f[ij] = C->u[ij] - C->v[ij];
+		}
+	}
+	if ((m = n_hist - 1) == 0) return;
+
+	/* Normal equations of min | f - sum (gamma[a] * (f[a+1] - f[a])) |  */
+	for (a = 0; a < m; a++) {
+		for (b = a; b <= m; b++) {
+			for (i = 0, sum = 0.0; i < C->nx; i++) {
+				for (j = 0, ij = C->ij_sw_corner + i * C->my; j < C->ny; j++, ij++) {
+					value = (b < m) ? C->mg_f[slot[b+1]][ij] - C->mg_f[slot[b]][ij] : f[ij];
+					sum += (C->mg_f[slot[a+1]][ij] - C->mg_f[slot[a]][ij]) * value;
+				}
+			}
+			A[a][b] = sum;
+			if (b < m) A[b][a] = sum;
+		}
+	}
+	for (a = 0, d_max = 0.0; a < m; a++) d_max = MAX (d_max, A[a][a]);
+	if (d_max == 0.0) return;	/* The last cycles made the same changes. Keep the result of this one */
+	for (a = 0; a < m; a++) A[a][a] += 1.0e-10 * d_max;	/* In case the changes are not independent */
+	for (a = 0; a < m; a++) {	/* Cholesky would do, but m is tiny */
+		for (b = a + 1; b < m; b++) {
+			value = A[b][a] / A[a][a];
+			for (i = a; i <= m; i++) A[b][i] -= value * A[a][i];
+		}
+	}
+	for (a = m - 1; a >= 0; a--) {
+		for (b = a + 1, sum = A[a][m]; b < m; b++) sum -= A[a][b] * gamma[b];
+		gamma[a] = sum / A[a][a];
+	}
+
+	for (i = 0; i < C->nx; i++) {
+		for (j = 0, ij = C->ij_sw_corner + i * C->my; j < C->ny; j++, ij++) {
+			if (C->iu[ij] == 5) continue;	/* Point is fixed  */
+			for (a = 0, value = g[ij]; a < m; a++) value -= gamma[a] * (C->mg_g[slot[a+1]][ij] - C->mg_g[slot[a]][ij]);
+			C->u[ij] = (float)value;	/* Not clipped to -L: the next cycle does it, and clipping here stalls the mixing */
+		}
+	}
+}
+
+void get_residual (struct SURFACE_CTX *C, float *res) {
+	/* res = rhs - A(u) at the nodes of C (0 at the fixed ones). On the final grid the
+	   equations include the -L limits, so res is 0 at nodes held there by them */
+	int	i, briggs_index = 0;
+
+	set_boundary (C);
+	if (!C->n_threads) {
+		for (i = 0; i < C->nx; i++) residual_column (C, i, &briggs_index, res);
+	}
+	else {
+#if HAVE_OPENMP
+#pragma omp parallel for num_threads(C->n_threads) private(briggs_index)
+#endif
+		for (i = 0; i < C->nx; i++) {
+			briggs_index = C->col_briggs[i];
+			residual_column (C, i, &briggs_index, res);
+		}
+	}
+}
+
+void residual_column (struct SURFACE_CTX *C, int i, int *briggs_index, float *res) {
+	int	j, ij, ij_v2, kase, x_case, y_case;
+	double	value, diag;
+
+	if (i < 2)
+		x_case = i;
+	else if (C->nx - 1 - i < 2)
+		x_case = 4 - (C->nx - 1 - i);
+	else
+		x_case = 2;
+
+	for (j = 0, ij = C->ij_sw_corner + i * C->my; j < C->ny; j++, ij++) {
+		if (C->iu[ij] == 5) {	/* Point is fixed  */
+			res[ij] = 0.0;
+			continue;
+		}
+		if (j < 2)
+			y_case = j;
+		else if (C->ny - 1 - j < 2)
+			y_case = 4 - (C->ny - 1 - j);
+		else
+			y_case = 2;
+
+		kase = x_case * 5 + y_case;
+		value = node_value (C, ij, kase, briggs_index, &diag);
+		if (C->constrained) {
+			ij_v2 = (C->ny - j - 1) * C->nx + i;
+			if (C->set_low && !GMT_is_fnan (C->lower[ij_v2]) && value < C->lower[ij_v2])
+				value = C->lower[ij_v2];
+			else if (C->set_high && !GMT_is_fnan (C->upper[ij_v2]) && value > C->upper[ij_v2])
+				value = C->upper[ij_v2];
+		}
+		res[ij] = (float)((value - C->u[ij]) * diag);
+	}
+}
+
+void interp_grid (struct SURFACE_CTX *A, float *ua, struct SURFACE_CTX *B, float *ub, int add) {
+	/* Bilinear interpolation of ua, given at the nodes of level A, to the nodes of level B.
+	   ub is set to it, or incremented by it if add is TRUE. Fixed nodes of B are not touched */
+	int	i, j, i0, j0, a, b;
+	double	rx, ry, wx, wy, val;
+
+	rx = (A->nx - 1.0) / (B->nx - 1.0);
+	ry = (A->ny - 1.0) / (B->ny - 1.0);
+	for (i = 0; i < B->nx; i++) {
+		i0 = MIN ((int)(i * rx), A->nx - 2);
+		wx = i * rx - i0;
+		for (j = 0, b = B->ij_sw_corner + i * B->my; j < B->ny; j++, b++) {
+			if (B->iu[b] == 5) continue;
+			j0 = MIN ((int)(j * ry), A->ny - 2);
+			wy = j * ry - j0;
+			a = A->ij_sw_corner + i0 * A->my + j0;
+			val = (1.0 - wx) * ((1.0 - wy) * ua[a] + wy * ua[a+1]) + wx * ((1.0 - wy) * ua[a+A->my] + wy * ua[a+A->my+1]);
+			ub[b] = (float)((add) ? ub[b] + val : val);
+		}
+	}
 }
 
-void	set_coefficients(void) {
+void restrict_residual (struct SURFACE_CTX *F, float *rf, struct SURFACE_CTX *K, float *rk) {
+	/* Residuals of level F to level K. Each K node gets the mean of the F residuals weighted
+	   as in interp_grid() from K to F (full weighting if every other F node is a K node) */
+	int	i, j, i0, j0, f, k;
+	double	rx, ry, wx, wy, r, *wx_sum, *wy_sum;
+
+	wx_sum = (double *) GMT_memory (VNULL, (size_t)K->nx, sizeof(double), GMT_program);
+	wy_sum = (double *) GMT_memory (VNULL, (size_t)K->ny, sizeof(double), GMT_program);
+	rx = (K->nx - 1.0) / (F->nx - 1.0);
+	ry = (K->ny - 1.0) / (F->ny - 1.0);
+	for (i = 0; i < K->nx; i++) {
+		for (j = 0, k = K->ij_sw_corner + i * K->my; j < K->ny; j++, k++) rk[k] = 0.0;
+	}
+	for (i = 0; i < F->nx; i++) {
+		i0 = MIN ((int)(i * rx), K->nx - 2);
+		wx = i * rx - i0;
+		wx_sum[i0] += 1.0 - wx;
+		wx_sum[i0+1] += wx;
+	}
+	for (j = 0; j < F->ny; j++) {
+		j0 = MIN ((int)(j * ry), K->ny - 2);
+		wy = j * ry - j0;
+		wy_sum[j0] += 1.0 - wy;
+		wy_sum[j0+1] += wy;
+	}
+	for (i = 0; i < F->nx; i++) {
+		i0 = MIN ((int)(i * rx), K->nx - 2);
+		wx = i * rx - i0;
+		for (j = 0, f = F->ij_sw_corner + i * F->my; j < F->ny; j++, f++) {
+			j0 = MIN ((int)(j * ry), K->ny - 2);
+			wy = j * ry - j0;
+			k = K->ij_sw_corner + i0 * K->my + j0;
+			r = rf[f];
+			rk[k] += (float)((1.0 - wx) * (1.0 - wy) * r);
+			rk[k+1] += (float)((1.0 - wx) * wy * r);
+			rk[k+K->my] += (float)(wx * (1.0 - wy) * r);
+			rk[k+K->my+1] += (float)(wx * wy * r);
+		}
+	}
+	for (i = 0; i < K->nx; i++) {
+		for (j = 0, k = K->ij_sw_corner + i * K->my; j < K->ny; j++, k++) rk[k] /= (float)(wx_sum[i] * wy_sum[j]);
+	}
+	GMT_free ((void *)wx_sum);
+	GMT_free ((void *)wy_sum);
+}
+
+void mg_free (struct SURFACE_CTX *C) {
+	/* Frees the coarse levels, and the multigrid arrays of the final grid */
+	int	k;
+	struct SURFACE_CTX *K, *next;
+
+	for (K = C->coarse; K; K = next) {
+		next = K->coarse;
+		GMT_free ((void *) K->data);
+		GMT_free ((void *) K->briggs);
+		GMT_free ((void *) K->iu);
+		GMT_free ((void *) K->u);
+		GMT_free ((void *) K->rhs);
+		GMT_free ((void *) K->res);
+		GMT_free ((void *) K->v);
+		if (K->col_briggs) GMT_free ((void *) K->col_briggs);
+		GMT_free ((void *) K);
+	}
+	C->coarse = NULL;
+	GMT_free ((void *) C->res);
+	GMT_free ((void *) C->v);
+	for (k = 0; k <= MG_DEPTH; k++) {
+		GMT_free ((void *) C->mg_g[k]);
+		GMT_free ((void *) C->mg_f[k]);
+	}
+	if (C->col_briggs) GMT_free ((void *) C->col_briggs);
+}
+
+void	set_coefficients(struct SURFACE_CTX *C) {
 	double	e_4, loose, a0;
 	
-	loose = 1.0 - interior_tension;
-	e_2 = l_epsilon * l_epsilon;
-	e_4 = e_2 * e_2;
-	eps_p2 = e_2;
-	eps_m2 = 1.0/e_2;
-	one_plus_e2 = 1.0 + e_2;
-	two_plus_ep2 = 2.0 + 2.0*eps_p2;
-	two_plus_em2 = 2.0 + 2.0*eps_m2;
-	
-	x_edge_const = 4 * one_plus_e2 - 2 * (interior_tension / loose);
-	e_m2 = 1.0 / e_2;
-	y_edge_const = 4 * (1.0 + e_m2) - 2 * (interior_tension * e_m2 / loose);
-
-	
-	a0 = 1.0 / ( (6 * e_4 * loose + 10 * e_2 * loose + 8 * loose - 2 * one_plus_e2) + 4*interior_tension*one_plus_e2);
-	a0_const_1 = 2 * loose * (1.0 + e_4);
-	a0_const_2 = 2.0 - interior_tension + 2 * loose * e_2;
-	
-	coeff[1][4] = coeff[1][7] = -loose;
-	coeff[1][0] = coeff[1][11] = -loose * e_4;
-	coeff[0][4] = coeff[0][7] = -loose * a0;
-	coeff[0][0] = coeff[0][11] = -loose * e_4 * a0;
-	coeff[1][5] = coeff[1][6] = 2 * loose * one_plus_e2;
-	coeff[0][5] = coeff[0][6] = (2 * coeff[1][5] + interior_tension) * a0;
-	coeff[1][2] = coeff[1][9] = coeff[1][5] * e_2;
-	coeff[0][2] = coeff[0][9] = coeff[0][5] * e_2;
-	coeff[1][1] = coeff[1][3] = coeff[1][8] = coeff[1][10] = -2 * loose * e_2;
-	coeff[0][1] = coeff[0][3] = coeff[0][8] = coeff[0][10] = coeff[1][1] * a0;
-	
-	e_2 *= 2;		/* We will need these in boundary conditions  */
-	e_m2 *= 2;
-	
-	ij_sw_corner = 2 * my + 2;			/*  Corners of array of actual data  */
-	ij_se_corner = ij_sw_corner + (nx - 1) * my;
-	ij_nw_corner = ij_sw_corner + (ny - 1);
-	ij_ne_corner = ij_se_corner + (ny - 1);
+	loose = 1.0 - C->interior_tension;
+	C->e_2 = C->l_epsilon * C->l_epsilon;
+	e_4 = C->e_2 * C->e_2;
+	C->eps_p2 = C->e_2;
+	C->eps_m2 = 1.0/C->e_2;
+	C->one_plus_e2 = 1.0 + C->e_2;
+	C->two_plus_ep2 = 2.0 + 2.0*C->eps_p2;
+	C->two_plus_em2 = 2.0 + 2.0*C->eps_m2;
+	
+	C->x_edge_const = 4 * C->one_plus_e2 - 2 * (C->interior_tension / loose);
+	C->e_m2 = 1.0 / C->e_2;
+	C->y_edge_const = 4 * (1.0 + C->e_m2) - 2 * (C->interior_tension * C->e_m2 / loose);
+
+	
+	a0 = 1.0 / ( (6 * e_4 * loose + 10 * C->e_2 * loose + 8 * loose - 2 * C->one_plus_e2) + 4*C->interior_tension*C->one_plus_e2);
+	C->a0 = a0;
+	C->a0_const_1 = 2 * loose * (1.0 + e_4);
+	C->a0_const_2 = 2.0 - C->interior_tension + 2 * loose * C->e_2;
+	
+	C->coeff[1][4] = C->coeff[1][7] = -loose;
+	C->coeff[1][0] = C->coeff[1][11] = -loose * e_4;
+	C->coeff[0][4] = C->coeff[0][7] = -loose * a0;
+	C->coeff[0][0] = C->coeff[0][11] = -loose * e_4 * a0;
+	C->coeff[1][5] = C->coeff[1][6] = 2 * loose * C->one_plus_e2;
+	C->coeff[0][5] = C->coeff[0][6] = (2 * C->coeff[1][5] + C->interior_tension) * a0;
+	C->coeff[1][2] = C->coeff[1][9] = C->coeff[1][5] * C->e_2;
+	C->coeff[0][2] = C->coeff[0][9] = C->coeff[0][5] * C->e_2;
+	C->coeff[1][1] = C->coeff[1][3] = C->coeff[1][8] = C->coeff[1][10] = -2 * loose * C->e_2;
+	C->coeff[0][1] = C->coeff[0][3] = C->coeff[0][8] = C->coeff[0][10] = C->coeff[1][1] * a0;
+	
+	C->e_2 *= 2;		/* We will need these in boundary conditions  */
+	C->e_m2 *= 2;
+	
+	C->ij_sw_corner = 2 * C->my + 2;			/*  Corners of array of actual data  */
+	C->ij_se_corner = C->ij_sw_corner + (C->nx - 1) * C->my;
+	C->ij_nw_corner = C->ij_sw_corner + (C->ny - 1);
+	C->ij_ne_corner = C->ij_se_corner + (C->ny - 1);
 }
 
-void	set_offset(void) {
+void	set_offset(struct SURFACE_CTX *C) {
 	int	add_w[5], add_e[5], add_s[5], add_n[5], add_w2[5], add_e2[5], add_s2[5], add_n2[5];
 	int	i, j, kase;
 	
-	add_w[0] = -my; add_w[1] = add_w[2] = add_w[3] = add_w[4] = -grid_east;
-	add_w2[0] = -2 * my;  add_w2[1] = -my - grid_east;  add_w2[2] = add_w2[3] = add_w2[4] = -2 * grid_east;
-	add_e[4] = my; add_e[0] = add_e[1] = add_e[2] = add_e[3] = grid_east;
-	add_e2[4] = 2 * my;  add_e2[3] = my + grid_east;  add_e2[2] = add_e2[1] = add_e2[0] = 2 * grid_east;
+	add_w[0] = -C->my; add_w[1] = add_w[2] = add_w[3] = add_w[4] = -C->grid_east;
+	add_w2[0] = -2 * C->my;  add_w2[1] = -C->my - C->grid_east;  add_w2[2] = add_w2[3] = add_w2[4] = -2 * C->grid_east;
+	add_e[4] = C->my; add_e[0] = add_e[1] = add_e[2] = add_e[3] = C->grid_east;
+	add_e2[4] = 2 * C->my;  add_e2[3] = C->my + C->grid_east;  add_e2[2] = add_e2[1] = add_e2[0] = 2 * C->grid_east;
 
-	add_n[4] = 1; add_n[3] = add_n[2] = add_n[1] = add_n[0] = grid;
-	add_n2[4] = 2;  add_n2[3] = grid + 1;  add_n2[2] = add_n2[1] = add_n2[0] = 2 * grid;
-	add_s[0] = -1; add_s[1] = add_s[2] = add_s[3] = add_s[4] = -grid;
-	add_s2[0] = -2;  add_s2[1] = -grid - 1;  add_s2[2] = add_s2[3] = add_s2[4] = -2 * grid;
+	add_n[4] = 1; add_n[3] = add_n[2] = add_n[1] = add_n[0] = C->grid;
+	add_n2[4] = 2;  add_n2[3] = C->grid + 1;  add_n2[2] = add_n2[1] = add_n2[0] = 2 * C->grid;
+	add_s[0] = -1; add_s[1] = add_s[2] = add_s[3] = add_s[4] = -C->grid;
+	add_s2[0] = -2;  add_s2[1] = -C->grid - 1;  add_s2[2] = add_s2[3] = add_s2[4] = -2 * C->grid;
 
 	for (i = 0, kase = 0; i < 5; i++) {
 		for (j = 0; j < 5; j++, kase++) {
-			offset[kase][0] = add_n2[j];
-			offset[kase][1] = add_n[j] + add_w[i];
-			offset[kase][2] = add_n[j];
-			offset[kase][3] = add_n[j] + add_e[i];
-			offset[kase][4] = add_w2[i];
-			offset[kase][5] = add_w[i];
-			offset[kase][6] = add_e[i];
-			offset[kase][7] = add_e2[i];
-			offset[kase][8] = add_s[j] + add_w[i];
-			offset[kase][9] = add_s[j];
-			offset[kase][10] = add_s[j] + add_e[i];
-			offset[kase][11] = add_s2[j];
+			C->offset[kase][0] = add_n2[j];
+			C->offset[kase][1] = add_n[j] + add_w[i];
+			C->offset[kase][2] = add_n[j];
+			C->offset[kase][3] = add_n[j] + add_e[i];
+			C->offset[kase][4] = add_w2[i];
+			C->offset[kase][5] = add_w[i];
+			C->offset[kase][6] = add_e[i];
+			C->offset[kase][7] = add_e2[i];
+			C->offset[kase][8] = add_s[j] + add_w[i];
+			C->offset[kase][9] = add_s[j];
+			C->offset[kase][10] = add_s[j] + add_e[i];
+			C->offset[kase][11] = add_s2[j];
 		}
 	}
 }
 
 
-void fill_in_forecast (void) {
+void fill_in_forecast (struct SURFACE_CTX *C) {
 
 	/* Fills in bilinear estimates into new node locations
 	   after grid is divided.   */
@@ -694,69 +1265,69 @@ void fill_in_forecast (void) {
 	double old_size;
 	
 		
-	old_size = 1.0 / (double)old_grid;
+	old_size = 1.0 / (double)C->old_grid;
 
 	/* first do from southwest corner */
 	
-	for (i = 0; i < nx-1; i += old_grid) {
+	for (i = 0; i < C->nx-1; i += C->old_grid) {
 		
-		for (j = 0; j < ny-1; j += old_grid) {
+		for (j = 0; j < C->ny-1; j += C->old_grid) {
 			
 			/* get indices of bilinear square */
-			index_0 = ij_sw_corner + i * my + j;
-			index_1 = index_0 + old_grid * my;
-			index_2 = index_1 + old_grid;
-			index_3 = index_0 + old_grid;
+			index_0 = C->ij_sw_corner + i * C->my + j;
+			index_1 = index_0 + C->old_grid * C->my;
+			index_2 = index_1 + C->old_grid;
+			index_3 = index_0 + C->old_grid;
 			
 			/* get coefficients */
-			a0 = u[index_0];
-			a1 = u[index_1] - a0;
-			a2 = u[index_3] - a0;
-			a3 = u[index_2] - a0 - a1 - a2;
+			a0 = C->u[index_0];
+			a1 = C->u[index_1] - a0;
+			a2 = C->u[index_3] - a0;
+			a3 = C->u[index_2] - a0 - a1 - a2;
 			
 			/* find all possible new fill ins */
 			
-			for (ii = i;  ii < i + old_grid; ii += grid) {
+			for (ii = i;  ii < i + C->old_grid; ii += C->grid) {
 				delta_x = (ii - i) * old_size;
-				for (jj = j;  jj < j + old_grid; jj += grid) {
-					index_new = ij_sw_corner + ii * my + jj;
+				for (jj = j;  jj < j + C->old_grid; jj += C->grid) {
+					index_new = C->ij_sw_corner + ii * C->my + jj;
 					if (index_new == index_0) continue;
 					delta_y = (jj - j) * old_size;
-					u[index_new] = (float)(a0 + a1 * delta_x + delta_y * ( a2 + a3 * delta_x));	
-					iu[index_new] = 0;
+					C->u[index_new] = (float)(a0 + a1 * delta_x + delta_y * ( a2 + a3 * delta_x));	
+					C->iu[index_new] = 0;
 				}
 			}
-			iu[index_0] = 5;
+			C->iu[index_0] = 5;
 		}
 	}
 	
 	/* now do linear guess along east edge */
 	
-	for (j = 0; j < (ny-1); j += old_grid) {
-		index_0 = ij_se_corner + j;
-		index_3 = index_0 + old_grid;
-		for (jj = j;  jj < j + old_grid; jj += grid) {
-			index_new = ij_se_corner + jj;
+	for (j = 0; j < (C->ny-1); j += C->old_grid) {
+		index_0 = C->ij_se_corner + j;
+		index_3 = index_0 + C->old_grid;
+		for (jj = j;  jj < j + C->old_grid; jj += C->grid) {
+			index_new = C->ij_se_corner + jj;
 			delta_y = (jj - j) * old_size;
-			u[index_new] = u[index_0] + (float)(delta_y * (u[index_3] - u[index_0]));
-			iu[index_new] = 0;
+			C->u[index_new] = C->u[index_0] + (float)(delta_y * (C->u[index_3] - C->u[index_0]));
+			C->iu[index_new] = 0;
 		}
-		iu[index_0] = 5;
+		C->iu[index_0] = 5;
 	}
 	/* now do linear guess along north edge */
-	for (i = 0; i < (nx-1); i += old_grid) {
-		index_0 = ij_nw_corner + i * my;
-		index_1 = index_0 + old_grid * my;
-		for (ii = i;  ii < i + old_grid; ii += grid) {
-			index_new = ij_nw_corner + ii * my;
+	for (i = 0; i < (C->nx-1); i += C->old_grid) {
+		index_0 = C->ij_nw_corner + i * C->my;
+		index_1 = index_0 + C->old_grid * C->my;
+		for (ii = i;  ii < i + C->old_grid; ii += C->grid) {
+			index_new = C->ij_nw_corner + ii * C->my;
 			delta_x = (ii - i) * old_size;
-			u[index_new] = u[index_0] + (float)(delta_x * (u[index_1] - u[index_0]));
-			iu[index_new] = 0;
+			C->u[index_new] = C->u[index_0] + (float)(delta_x * (C->u[index_1] - C->u[index_0]));
+			C->iu[index_new] = 0;
 		}
-		iu[index_0] = 5;
+		C->iu[index_0] = 5;
 	}
 	/* now set northeast corner to fixed and we're done */
-	iu[ij_ne_corner] = 5;
+	C->iu[C->ij_ne_corner] = 5;
 }
 
 int compare_points (const void *point_1v, const void *point_2v)
@@ -781,10 +1352,10 @@ struct DATA *point_1, *point_2;
 	else if (index_1 == OUTSIDE)
 		return (0);
 	else {	/* Points are in same grid cell, find the one who is nearest to grid point */
-		block_i = point_1->index/block_ny;
-		block_j = point_1->index%block_ny;
-		x0 = x_min + block_i * grid_xinc;
-		y0 = y_min + block_j * grid_yinc;
+		block_i = point_1->index/C_sort->block_ny;
+		block_j = point_1->index%C_sort->block_ny;
+		x0 = C_sort->x_min + block_i * C_sort->grid_xinc;
+		y0 = C_sort->y_min + block_j * C_sort->grid_yinc;
 		dist_1 = (point_1->x - x0) * (point_1->x - x0) + (point_1->y - y0) * (point_1->y - y0);
 		dist_2 = (point_2->x - x0) * (point_2->x - x0) + (point_2->y - y0) * (point_2->y - y0);
 		if (dist_1 < dist_2)
@@ -796,36 +1367,37 @@ struct DATA *point_1, *point_2;
 	}
 }
 
-void smart_divide (void) {
+void smart_divide (struct SURFACE_CTX *C) {
 		/* Divide grid by its largest prime factor */
-	grid /= factors[n_fact - 1];
-	n_fact--;
+	C->grid /= C->factors[C->n_fact - 1];
+	C->n_fact--;
 }
 
-void set_index (void) {
+void set_index (struct SURFACE_CTX *C) {
 		/* recomputes data[k].index for new value of grid,
 		   sorts data on index and radii, and throws away
 		   data which are now outside the usable limits. */
 	int i, j, k, k_skipped = 0;
 
-	for (k = 0; k < npoints; k++) {
-		i = (int)floor(((data[k].x-x_min)*r_grid_xinc) + 0.5);
-		j = (int)floor(((data[k].y-y_min)*r_grid_yinc) + 0.5);
-		if (i < 0 || i >= block_nx || j < 0 || j >= block_ny) {
-			data[k].index = OUTSIDE;
+	for (k = 0; k < C->npoints; k++) {
+		i = (int)floor(((C->data[k].x-C->x_min)*C->r_grid_xinc) + 0.5);
+		j = (int)floor(((C->data[k].y-C->y_min)*C->r_grid_yinc) + 0.5);
+		if (i < 0 || i >= C->block_nx || j < 0 || j >= C->block_ny) {
+			C->data[k].index = OUTSIDE;
 			k_skipped++;
 		}
 		else
-			data[k].index = i * block_ny + j;
+			C->data[k].index = i * C->block_ny + j;
 	}
 	
-	qsort ((void *)data, (size_t)npoints, sizeof (struct DATA), compare_points);
+	C_sort = C;
+	qsort ((void *)C->data, (size_t)C->npoints, sizeof (struct DATA), compare_points);
 	
-	npoints -= k_skipped;
+	C->npoints -= k_skipped;
 	
 }
 
-void find_nearest_point(void) {
+void find_nearest_point(struct SURFACE_CTX *C) {
 	int i, j, ij_v2, k, last_index, block_i, block_j, iu_index, briggs_index;
 	double x0, y0, dx, dy, xys, xy1, btemp;
 	double b0, b1, b2, b3, b4, b5;
@@ -833,23 +1405,23 @@ void find_nearest_point(void) {
 	
 	last_index = -1;
 
-	for (i = 0; i < nx; i += grid)	/* Reset grid info */
-		for (j = 0; j < ny; j += grid)
-			iu[ij_sw_corner + i*my + j] = 0;
+	for (i = 0; i < C->nx; i += C->grid)	/* Reset grid info */
+		for (j = 0; j < C->ny; j += C->grid)
+			C->iu[C->ij_sw_corner + i*C->my + j] = 0;
 	
 	briggs_index = 0;
-	for (k = 0; k < npoints; k++) {	/* Find constraining value  */
-		if (data[k].index != last_index) {
-			block_i = data[k].index/block_ny;
-			block_j = data[k].index%block_ny;
-			last_index = data[k].index;
-	 		iu_index = ij_sw_corner + (block_i * my + block_j) * grid;
-	 		x0 = x_min + block_i*grid_xinc;
-	 		y0 = y_min + block_j*grid_yinc;
-	 		dx = (data[k].x - x0)*r_grid_xinc;
-	 		dy = (data[k].y - y0)*r_grid_yinc;
+	for (k = 0; k < C->npoints; k++) {	/* Find constraining value  */
+		if (C->data[k].index != last_index) {
+			block_i = C->data[k].index/C->block_ny;
+			block_j = C->data[k].index%C->block_ny;
+			last_index = C->data[k].index;
+	 		iu_index = C->ij_sw_corner + (block_i * C->my + block_j) * C->grid;
+	 		x0 = C->x_min + block_i*C->grid_xinc;
+	 		y0 = C->y_min + block_j*C->grid_yinc;
+	 		dx = (C->data[k].x - x0)*C->r_grid_xinc;
+	 		dy = (C->data[k].y - y0)*C->r_grid_yinc;
 	 		if (fabs(dx) < 0.05 && fabs(dy) < 0.05) {	/* Close enough to assign value to node */
-	 			iu[iu_index] = 5;
+	 			C->iu[iu_index] = 5;
 	 			/* v3.3.4: NEW CODE
 	 			 * Since point is basically moved from (dx, dy) to (0,0) we must adjust for
 	 			 * the small change in the planar trend between the two locations, and then
@@ -857,46 +1429,46 @@ void find_nearest_point(void) {
 	 			 * dx, dy is in -1/1 range normalized by (grid * x|y_inc) so to recover the
 	 			 * dx,dy in final grid fractions we must scale by grid */
 	 			 
-	 			z_at_node = data[k].z + (float) (r_z_scale * grid * (plane_c1 * dx + plane_c2 * dy));
-	 			if (constrained) {
-					ij_v2 = (ny - block_j * grid - 1) * nx + block_i * grid;
-					if (set_low  && !GMT_is_fnan (lower[ij_v2]) && z_at_node < lower[ij_v2])
-						z_at_node = lower[ij_v2];
-					else if (set_high && !GMT_is_fnan (upper[ij_v2]) && z_at_node > upper[ij_v2])
-						z_at_node = upper[ij_v2];
+	 			z_at_node = C->data[k].z + (float) (C->r_z_scale * C->grid * (C->plane_c1 * dx + C->plane_c2 * dy));
+	 			if (C->constrained) {
+					ij_v2 = (C->ny - block_j * C->grid - 1) * C->nx + block_i * C->grid;
+					if (C->set_low  && !GMT_is_fnan (C->lower[ij_v2]) && z_at_node < C->lower[ij_v2])
+						z_at_node = C->lower[ij_v2];
+					else if (C->set_high && !GMT_is_fnan (C->upper[ij_v2]) && z_at_node > C->upper[ij_v2])
+						z_at_node = C->upper[ij_v2];
 	 			}
-	 			u[iu_index] = z_at_node;
+	 			C->u[iu_index] = z_at_node;
 	 		}
 	 		else {
 	 			if (dx >= 0.0) {
 	 				if (dy >= 0.0)
-	 					iu[iu_index] = 1;
+	 					C->iu[iu_index] = 1;
 	 				else
-	 					iu[iu_index] = 4;
+	 					C->iu[iu_index] = 4;
 	 			}
 	 			else {
 	 				if (dy >= 0.0)
-	 					iu[iu_index] = 2;
+	 					C->iu[iu_index] = 2;
 	 				else
-	 					iu[iu_index] = 3;
+	 					C->iu[iu_index] = 3;
 	 			}
 	 			dx = fabs(dx);
 	 			dy = fabs(dy);
-	 			btemp = 2 * one_plus_e2 / ( (dx + dy) * (1.0 + dx + dy) );
+	 			btemp = 2 * C->one_plus_e2 / ( (dx + dy) * (1.0 + dx + dy) );
 	 			b0 = 1.0 - 0.5 * (dx + (dx * dx)) * btemp;
-	 			b3 = 0.5 * (e_2 - (dy + (dy * dy)) * btemp);
+	 			b3 = 0.5 * (C->e_2 - (dy + (dy * dy)) * btemp);
 	 			xys = 1.0 + dx + dy;
 	 			xy1 = 1.0 / xys;
-	 			b1 = (e_2 * xys - 4 * dy) * xy1;
+	 			b1 = (C->e_2 * xys - 4 * dy) * xy1;
 	 			b2 = 2 * (dy - dx + 1.0) * xy1;
 	 			b4 = b0 + b1 + b2 + b3 + btemp;
-	 			b5 = btemp * data[k].z;
-	 			briggs[briggs_index].b[0] = b0;
-	 			briggs[briggs_index].b[1] = b1;
-	 			briggs[briggs_index].b[2] = b2;
-	 			briggs[briggs_index].b[3] = b3;
-	 			briggs[briggs_index].b[4] = b4;
-	 			briggs[briggs_index].b[5] = b5;
+	 			b5 = btemp * C->data[k].z;
+	 			C->briggs[briggs_index].b[0] = b0;
+	 			C->briggs[briggs_index].b[1] = b1;
+	 			C->briggs[briggs_index].b[2] = b2;
+	 			C->briggs[briggs_index].b[3] = b3;
+	 			C->briggs[briggs_index].b[4] = b4;
+	 			C->briggs[briggs_index].b[5] = b5;
 	 			briggs_index++;
 	 		}
 	 	}
@@ -904,18 +1476,18 @@ void find_nearest_point(void) {
 }
 
 						
-void set_grid_parameters(void)
+void set_grid_parameters(struct SURFACE_CTX *C)
 {			
-	block_ny = (ny - 1) / grid + 1;
-	block_nx = (nx - 1) / grid + 1;
-	grid_xinc = grid * xinc;
-	grid_yinc = grid * yinc;
-	grid_east = grid * my;
-	r_grid_xinc = 1.0 / grid_xinc;
-	r_grid_yinc = 1.0 / grid_yinc;
+	C->block_ny = (C->ny - 1) / C->grid + 1;
+	C->block_nx = (C->nx - 1) / C->grid + 1;
+	C->grid_xinc = C->grid * C->xinc;
+	C->grid_yinc = C->grid * C->yinc;
+	C->grid_east = C->grid * C->my;
+	C->r_grid_xinc = 1.0 / C->grid_xinc;
+	C->r_grid_yinc = 1.0 / C->grid_yinc;
 }
 
-void initialize_grid(void)
+void initialize_grid(struct SURFACE_CTX *C)
 {	/*
 	 * For the initial gridsize, compute weighted averages of data inside the search radius
 	 * and assign the values to u[i,j] where i,j are multiples of gridsize.
@@ -923,169 +1495,169 @@ void initialize_grid(void)
 	 int	irad, jrad, i, j, imin, imax, jmin, jmax, index_1, index_2, k, ki, kj, k_index;
 	 double	r, rfact, sum_w, sum_zw, weight, x0, y0;
 
-	 irad = (int)ceil(radius/grid_xinc);
-	 jrad = (int)ceil(radius/grid_yinc);
-	 rfact = -4.5/(radius*radius);
+	 irad = (int)ceil(C->radius/C->grid_xinc);
+	 jrad = (int)ceil(C->radius/C->grid_yinc);
+	 rfact = -4.5/(C->radius*C->radius);
 	 
-	 for (i = 0; i < block_nx; i ++ ) {
-	 	x0 = x_min + i*grid_xinc;
-	 	for (j = 0; j < block_ny; j ++ ) {
-	 		y0 = y_min + j*grid_yinc;
+	 for (i = 0; i < C->block_nx; i ++ ) {
+	 	x0 = C->x_min + i*C->grid_xinc;
+	 	for (j = 0; j < C->block_ny; j ++ ) {
+	 		y0 = C->y_min + j*C->grid_yinc;
 	 		imin = i - irad;
 	 		if (imin < 0) imin = 0;
 	 		imax = i + irad;
-	 		if (imax >= block_nx) imax = block_nx - 1;
+	 		if (imax >= C->block_nx) imax = C->block_nx - 1;
 	 		jmin = j - jrad;
 	 		if (jmin < 0) jmin = 0;
 	 		jmax = j + jrad;
-	 		if (jmax >= block_ny) jmax = block_ny - 1;
-	 		index_1 = imin*block_ny + jmin;
-	 		index_2 = imax*block_ny + jmax + 1;
+	 		if (jmax >= C->block_ny) jmax = C->block_ny - 1;
+	 		index_1 = imin*C->block_ny + jmin;
+	 		index_2 = imax*C->block_ny + jmax + 1;
 	 		sum_w = sum_zw = 0.0;
 	 		k = 0;
-	 		while (k < npoints && data[k].index < index_1) k++;
-	 		for (ki = imin; k < npoints && ki <= imax && data[k].index < index_2; ki++) {
-	 			for (kj = jmin; k < npoints && kj <= jmax && data[k].index < index_2; kj++) {
-	 				k_index = ki*block_ny + kj;
-	 				while (k < npoints && data[k].index < k_index) k++;
-	 				while (k < npoints && data[k].index == k_index) {
-	 					r = (data[k].x-x0)*(data[k].x-x0) + (data[k].y-y0)*(data[k].y-y0);
+	 		while (k < C->npoints && C->data[k].index < index_1) k++;
+	 		for (ki = imin; k < C->npoints && ki <= imax && C->data[k].index < index_2; ki++) {
+	 			for (kj = jmin; k < C->npoints && kj <= jmax && C->data[k].index < index_2; kj++) {
+	 				k_index = ki*C->block_ny + kj;
+	 				while (k < C->npoints && C->data[k].index < k_index) k++;
+	 				while (k < C->npoints && C->data[k].index == k_index) {
+	 					r = (C->data[k].x-x0)*(C->data[k].x-x0) + (C->data[k].y-y0)*(C->data[k].y-y0);
 	 					weight = exp (rfact*r);
 	 					sum_w += weight;
-	 					sum_zw += weight*data[k].z;
+	 					sum_zw += weight*C->data[k].z;
 	 					k++;
 	 				}
 	 			}
 	 		}
 	 		if (sum_w == 0.0) {
-	 			sprintf (format, "%%s: Warning: no data inside search radius at: %s %s\n", gmtdefs.d_format, gmtdefs.d_format);
-	 			mexPrintf (format, GMT_program, x0, y0);
-	 			u[ij_sw_corner + (i * my + j) * grid] = (float)z_mean;
+	 			sprintf (C->format, "%%s: Warning: no data inside search radius at: %s %s\n", gmtdefs.d_format, gmtdefs.d_format);
+	 			mexPrintf (C->format, GMT_program, x0, y0);
+	 			C->u[C->ij_sw_corner + (i * C->my + j) * C->grid] = (float)C->z_mean;
 	 		}
 	 		else {
-	 			u[ij_sw_corner + (i*my+j)*grid] = (float)(sum_zw/sum_w);
+	 			C->u[C->ij_sw_corner + (i*C->my+j)*C->grid] = (float)(sum_zw/sum_w);
 	 		}
 		}
 	}
 }
 
 
-void new_initialize_grid(void) {
+void new_initialize_grid(struct SURFACE_CTX *C) {
 	/* For the initial gridsize, load constrained nodes with weighted avg of their data;
 	 * and then do something with the unconstrained ones.  */
 	 int	k, k_index, u_index, block_i, block_j;
 	 double	sum_w, sum_zw, weight, x0, y0, dx, dy, dx_scale, dy_scale;
 
-	dx_scale = 4.0 / grid_xinc;
-	dy_scale = 4.0 / grid_yinc;
-	n_empty = block_ny * block_nx;
+	dx_scale = 4.0 / C->grid_xinc;
+	dy_scale = 4.0 / C->grid_yinc;
+	C->n_empty = C->block_ny * C->block_nx;
 	k = 0;
-	while (k < npoints) {
-		block_i = data[k].index / block_ny;
-		block_j = data[k].index % block_ny;
-		x0 = x_min + block_i*grid_xinc;
-		y0 = y_min + block_j*grid_yinc;
-		u_index = ij_sw_corner + (block_i*my + block_j) * grid;
-		k_index = data[k].index;
+	while (k < C->npoints) {
+		block_i = C->data[k].index / C->block_ny;
+		block_j = C->data[k].index % C->block_ny;
+		x0 = C->x_min + block_i*C->grid_xinc;
+		y0 = C->y_min + block_j*C->grid_yinc;
+		u_index = C->ij_sw_corner + (block_i*C->my + block_j) * C->grid;
+		k_index = C->data[k].index;
 		
-		dy = (data[k].y - y0) * dy_scale;
-		dx = (data[k].x - x0) * dx_scale;
+		dy = (C->data[k].y - y0) * dy_scale;
+		dx = (C->data[k].x - x0) * dx_scale;
 		sum_w = 1.0 / (1.0 + dx*dx + dy*dy);
-		sum_zw = data[k].z * sum_w;
+		sum_zw = C->data[k].z * sum_w;
 		k++;
 
-		while (k < npoints && data[k].index == k_index) {
+		while (k < C->npoints && C->data[k].index == k_index) {
 			
-			dy = (data[k].y - y0) * dy_scale;
-			dx = (data[k].x - x0) * dx_scale;
+			dy = (C->data[k].y - y0) * dy_scale;
+			dx = (C->data[k].x - x0) * dx_scale;
 			weight = 1.0 / (1.0 + dx*dx + dy*dy);
-			sum_zw += data[k].z * weight;
+			sum_zw += C->data[k].z * weight;
 			sum_w += weight;
-			sum_zw += weight*data[k].z;
+			sum_zw += weight*C->data[k].z;
 			k++;
 	 	}
-	 	u[u_index] = (float)(sum_zw/sum_w);
-	 	iu[u_index] = 5;
-	 	n_empty--;
+	 	C->u[u_index] = (float)(sum_zw/sum_w);
+	 	C->iu[u_index] = 5;
+	 	C->n_empty--;
 	 }
 }
 
-int to_data(n_pts) {
+int to_data(struct SURFACE_CTX *C, int n_pts) {
 	/* Copy the vectors transmited as inputs into the data structure. For large inputs,
 	this implies a significant memory wasting.*/
 	int	i, j, k, n, kmax, kmin;
 	double	zmin = DBL_MAX, zmax = -DBL_MAX;
 
-	data = (struct DATA *) GMT_memory (VNULL, (size_t)n_pts, sizeof(struct DATA), GMT_program);
+	C->data = (struct DATA *) GMT_memory (VNULL, (size_t)n_pts, sizeof(struct DATA), GMT_program);
 	
 	/* Read in xyz data and computes index no and store it in a structure */
 	
 	k = 0;
-	z_mean = 0;
+	C->z_mean = 0;
 			
 	for (n = 0; n < n_pts; n++) {
-		if (GMT_is_dnan (in2[n])) continue;
+		if (GMT_is_dnan (C->in2[n])) continue;
 		
-		i = (int)floor((((float)in0[n]-x_min)*r_grid_xinc) + 0.5);
-		if (i < 0 || i >= block_nx) continue;
-		j = (int)floor((((float)in1[n]-y_min)*r_grid_yinc) + 0.5);
-		if (j < 0 || j >= block_ny) continue;
-
-		data[k].index = i * block_ny + j;
-		data[k].x = (float)in0[n];
-		data[k].y = (float)in1[n];
-		data[k].z = (float)in2[n];
-		if (zmin > in2[n]) zmin = in2[n], kmin = k;
-		if (zmax < in2[n]) zmax = in2[n], kmax = k;
+		i = (int)floor((((float)C->in0[n]-C->x_min)*C->r_grid_xinc) + 0.5);
+		if (i < 0 || i >= C->block_nx) continue;
+		j = (int)floor((((float)C->in1[n]-C->y_min)*C->r_grid_yinc) + 0.5);
+		if (j < 0 || j >= C->block_ny) continue;
+
+		C->data[k].index = i * C->block_ny + j;
+		C->data[k].x = (float)C->in0[n];
+		C->data[k].y = (float)C->in1[n];
+		C->data[k].z = (float)C->in2[n];
+		if (zmin > C->in2[n]) zmin = C->in2[n], kmin = k;
+		if (zmax < C->in2[n]) zmax = C->in2[n], kmax = k;
 		k++;
-		z_mean += in2[n];
+		C->z_mean += C->in2[n];
 	}
 	
-	npoints = k;
+	C->npoints = k;
 	
-	if (npoints == 0) {
+	if (C->npoints == 0) {
 		mexPrintf ("%s:  No datapoints inside region, aborts\n", GMT_program);
 		return (1);
 	}
 	
-	z_mean /= k;
-	if (gmtdefs.verbose) {
-		sprintf(format, "%s %s %s\n", gmtdefs.d_format, gmtdefs.d_format, gmtdefs.d_format);
+	C->z_mean /= k;
+	if (C->verbose) {
+		sprintf(C->format, "%s %s %s\n", gmtdefs.d_format, gmtdefs.d_format, gmtdefs.d_format);
 		mexPrintf("%s: Minimum value of your dataset x,y,z at: ", GMT_program);
-		mexPrintf(format, (double)data[kmin].x, (double)data[kmin].y, (double)data[kmin].z);
+		mexPrintf(C->format, (double)C->data[kmin].x, (double)C->data[kmin].y, (double)C->data[kmin].z);
 		mexPrintf("%s: Maximum value of your dataset x,y,z at: ", GMT_program);
-		mexPrintf(format, (double)data[kmax].x, (double)data[kmax].y, (double)data[kmax].z);
+		mexPrintf(C->format, (double)C->data[kmax].x, (double)C->data[kmax].y, (double)C->data[kmax].z);
 	}
-	data = (struct DATA *) GMT_memory ((void *)data, (size_t)npoints, sizeof(struct DATA), GMT_program);
+	C->data = (struct DATA *) GMT_memory ((void *)C->data, (size_t)C->npoints, sizeof(struct DATA), GMT_program);
 	
-	if (set_low == 1)
-		low_limit = data[kmin].z;
-	else if (set_low == 2 && low_limit > data[kmin].z)
+	if (C->set_low == 1)
+		C->low_limit = C->data[kmin].z;
+	else if (C->set_low == 2 && C->low_limit > C->data[kmin].z)
 		mexPrintf ("%s: Warning:  Your lower value is > than min data value.\n", GMT_program);
 
-	if (set_high == 1)
-		high_limit = data[kmax].z;
-	else if (set_high == 2 && high_limit < data[kmax].z)
+	if (C->set_high == 1)
+		C->high_limit = C->data[kmax].z;
+	else if (C->set_high == 2 && C->high_limit < C->data[kmax].z)
 		mexPrintf ("%s: Warning:  Your upper value is < than max data value.\n", GMT_program);
 
 	return (0);
 
 }
 
-int read_data(void) {
+int read_data(struct SURFACE_CTX *C) {
 	/* Again something in GMT libs did not work. Now was GMT_input, so I had to make the
 	adaptions in this routine. Unfortunately, this also implies that binary or multisegment
 	files cannot be read.*/
-	int	i, j, ix, iy, jj, k, kmax, kmin, n_fields, n_expected_fields, n_cols = 0;
+	int	i, j, ix, iy, jj, k, kmax, kmin, n_fields, n_expected_fields, n_cols = 0, n_alloc = GMT_CHUNK;
 	double	*in, zmin = DBL_MAX, zmax = -DBL_MAX;
 	char	line[1024], buffer[BUFSIZ], *p;
 
-	data = (struct DATA *) GMT_memory (VNULL, (size_t)n_alloc, sizeof(struct DATA), GMT_program);
+	C->data = (struct DATA *) GMT_memory (VNULL, (size_t)n_alloc, sizeof(struct DATA), GMT_program);
 	
 	/* Read in xyz data and computes index no and store it in a structure */
 	
 	k = 0;
-	z_mean = 0;
+	C->z_mean = 0;
 	in = (double *) calloc ((size_t)(n_alloc), sizeof(double));
 			
 	/* Use here the old toggle recipe because things inside GMT_get_common_args are behaving odly */
@@ -1095,9 +1667,9 @@ int read_data(void) {
 	else {
 		ix = 0;		iy = 1;
 	}
-	for (i = 0; i < gmtdefs.n_header_recs; i++) fgets (line, 1024, fp_in);
+	for (i = 0; i < gmtdefs.n_header_recs; i++) fgets (line, 1024, C->fp_in);
 
-	while (fgets (line, 1024, fp_in)) {
+	while (fgets (line, 1024, C->fp_in)) {
 		if (n_cols == 0) {	/* First time, allocate # of columns */
 			strcpy (buffer, line);
 			p = (char *)strtok (buffer, " \t\n");
@@ -1122,194 +1694,230 @@ int read_data(void) {
 
 		if (GMT_is_dnan (in[2])) continue;
 		
-		i = (int)floor(((in[ix]-x_min)*r_grid_xinc) + 0.5);
-		if (i < 0 || i >= block_nx) continue;
-		j = (int)floor(((in[iy]-y_min)*r_grid_yinc) + 0.5);
-		if (j < 0 || j >= block_ny) continue;
-
-		data[k].index = i * block_ny + j;
-		data[k].x = (float)in[ix];
-		data[k].y = (float)in[iy];
-		data[k].z = (float)in[2];
+		i = (int)floor(((in[ix]-C->x_min)*C->r_grid_xinc) + 0.5);
+		if (i < 0 || i >= C->block_nx) continue;
+		j = (int)floor(((in[iy]-C->y_min)*C->r_grid_yinc) + 0.5);
+		if (j < 0 || j >= C->block_ny) continue;
+
+		C->data[k].index = i * C->block_ny + j;
+		C->data[k].x = (float)in[ix];
+		C->data[k].y = (float)in[iy];
+		C->data[k].z = (float)in[2];
 		if (zmin > in[2]) zmin = in[2], kmin = k;
 		if (zmax < in[2]) zmax = in[2], kmax = k;
 		k++;
-		z_mean += in[2];
+		C->z_mean += in[2];
 		if (k == n_alloc) {
 			n_alloc += GMT_CHUNK;
-			data = (struct DATA *) GMT_memory ((void *)data, (size_t)n_alloc, sizeof(struct DATA), GMT_program);
+			C->data = (struct DATA *) GMT_memory ((void *)C->data, (size_t)n_alloc, sizeof(struct DATA), GMT_program);
 		}
 	}
 	
-	fclose (fp_in);
+	fclose (C->fp_in);
 
-	npoints = k;
+	C->npoints = k;
 	
-	if (npoints == 0) {
+	if (C->npoints == 0) {
 		mexPrintf ("%s:  No datapoints inside region, aborts\n", GMT_program);
 		return (1);
 	}
 	
-	z_mean /= k;
-	if (gmtdefs.verbose) {
-		sprintf(format, "%s %s %s\n", gmtdefs.d_format, gmtdefs.d_format, gmtdefs.d_format);
+	C->z_mean /= k;
+	if (C->verbose) {
+		sprintf(C->format, "%s %s %s\n", gmtdefs.d_format, gmtdefs.d_format, gmtdefs.d_format);
 		mexPrintf("%s: Minimum value of your dataset x,y,z at: ", GMT_program);
-		mexPrintf(format, (double)data[kmin].x, (double)data[kmin].y, (double)data[kmin].z);
+		mexPrintf(C->format, (double)C->data[kmin].x, (double)C->data[kmin].y, (double)C->data[kmin].z);
 		mexPrintf("%s: Maximum value of your dataset x,y,z at: ", GMT_program);
-		mexPrintf(format, (double)data[kmax].x, (double)data[kmax].y, (double)data[kmax].z);
+		mexPrintf(C->format, (double)C->data[kmax].x, (double)C->data[kmax].y, (double)C->data[kmax].z);
 	}
-	data = (struct DATA *) GMT_memory ((void *)data, (size_t)npoints, sizeof(struct DATA), GMT_program);
+	C->data = (struct DATA *) GMT_memory ((void *)C->data, (size_t)C->npoints, sizeof(struct DATA), GMT_program);
 	
-	if (set_low == 1)
-		low_limit = data[kmin].z;
-	else if (set_low == 2 && low_limit > data[kmin].z) {
+	if (C->set_low == 1)
+		C->low_limit = C->data[kmin].z;
+	else if (C->set_low == 2 && C->low_limit > C->data[kmin].z) {
 	/*	low_limit = data[kmin].z;	*/
 		mexPrintf ("%s: Warning:  Your lower value is > than min data value.\n", GMT_program);
 	}
-	if (set_high == 1)
-		high_limit = data[kmax].z;
-	else if (set_high == 2 && high_limit < data[kmax].z) {
+	if (C->set_high == 1)
+		C->high_limit = C->data[kmax].z;
+	else if (C->set_high == 2 && C->high_limit < C->data[kmax].z) {
 	/*	high_limit = data[kmax].z;	*/
 		mexPrintf ("%s: Warning:  Your upper value is < than max data value.\n", GMT_program);
 	}
 	return (0);
 }
 
-int	iterate(int mode) {
+int	iterate(struct SURFACE_CTX *C, int mode) {
 
-	int	i, j, k, ij, kase, briggs_index, ij_v2;
-	int	x_case, y_case, x_w_case, x_e_case, y_s_case, y_n_case;
+	int	*col_briggs = NULL;
 	int	iteration_count = 0;
 	
-	double	current_limit = converge_limit / grid;
-	double	change, max_change = 0.0, busum, sum_ij;
-	double	b0, b1, b2, b3, b4, b5;
+	double	current_limit = C->converge_limit / C->grid;
+	double	max_change = 0.0;
 	
-	double	x_0_const = 4.0 * (1.0 - boundary_tension) / (2.0 - boundary_tension);
-	double	x_1_const = (3 * boundary_tension - 2.0) / (2.0 - boundary_tension);
-	double	y_denom = 2 * l_epsilon * (1.0 - boundary_tension) + boundary_tension;
-	double	y_0_const = 4 * l_epsilon * (1.0 - boundary_tension) / y_denom;
-	double	y_1_const = (boundary_tension - 2 * l_epsilon * (1.0 - boundary_tension) ) / y_denom;
+	sprintf(C->format,"%%4d\t%%c\t%%8d\t%s\t%s\t%%10d\n", gmtdefs.d_format, gmtdefs.d_format);
 
-	sprintf(format,"%%4d\t%%c\t%%8d\t%s\t%s\t%%10d\n", gmtdefs.d_format, gmtdefs.d_format);
+	if (C->n_threads) col_briggs = get_col_briggs (C);	/* iu does not change in here */
 
 	do {
-		briggs_index = 0;	/* Reset the constraint table stack pointer  */
-		
-		max_change = -1.0;
-		
-		/* Fill in auxiliary boundary values (in new way) */
-		
-		/* First set d2[]/dn2 = 0 along edges:  */
-		/* New experiment : (1-T)d2[]/dn2 + Td[]/dn = 0  */
-		
+		set_boundary (C);
+		max_change = relax_sweep (C, col_briggs);
+		iteration_count++;
+		C->total_iterations++;
+		max_change *= C->z_scale;	/* Put max_change into z units  */
+		if (C->long_verbose) mexPrintf (C->format,
+			C->grid, mode_type[mode], iteration_count, max_change, current_limit, C->total_iterations);
+
+	} while (max_change > current_limit && iteration_count < C->max_iterations);
+	
+	if (C->verbose && !C->long_verbose) mexPrintf(C->format,
+		C->grid, mode_type[mode], iteration_count, max_change, current_limit, C->total_iterations);
+
+	if (col_briggs) GMT_free ((void *)col_briggs);
+	return(iteration_count);
+}
+
+int	*get_col_briggs(struct SURFACE_CTX *C) {
+	/* Where each column starts in the briggs table, for the colored relaxation of -j */
+	int	i, j, ij, briggs_index, *col_briggs;
+
+	col_briggs = (int *) GMT_memory (VNULL, (size_t)C->block_nx, sizeof(int), GMT_program);
+	for (i = briggs_index = 0; i < C->block_nx; i++) {
+		col_briggs[i] = briggs_index;
+		for (j = 0, ij = C->ij_sw_corner + i * C->grid * C->my; j < C->ny; j += C->grid, ij += C->grid)
+			if (C->iu[ij] > 0 && C->iu[ij] < 5) briggs_index++;
+	}
+	return (col_briggs);
+}
+
+void	set_boundary(struct SURFACE_CTX *C) {
+	/* Fills the two rows and columns of auxiliary nodes around the grid from its edge values */
+	int	i, j, ij, kase;
+	int	x_case, y_case, x_w_case, x_e_case, y_s_case, y_n_case;
+
+	double	x_0_const = 4.0 * (1.0 - C->boundary_tension) / (2.0 - C->boundary_tension);
+	double	x_1_const = (3 * C->boundary_tension - 2.0) / (2.0 - C->boundary_tension);
+	double	y_denom = 2 * C->l_epsilon * (1.0 - C->boundary_tension) + C->boundary_tension;
+	double	y_0_const = 4 * C->l_epsilon * (1.0 - C->boundary_tension) / y_denom;
+	double	y_1_const = (C->boundary_tension - 2 * C->l_epsilon * (1.0 - C->boundary_tension) ) / y_denom;
+
+	/* Fill in auxiliary boundary values (in new way) */
+	
+	/* First set d2[]/dn2 = 0 along edges:  */
+	/* New experiment : (1-T)d2[]/dn2 + Td[]/dn = 0  */
+	
+	
+	
+	for (i = 0; i < C->nx; i += C->grid) {
+		/* set d2[]/dy2 = 0 on south side:  */
+		ij = C->ij_sw_corner + i * C->my;
+		/* u[ij - 1] = 2 * u[ij] - u[ij + grid];  */
+		C->u[ij - 1] = (float)(y_0_const * C->u[ij] + y_1_const * C->u[ij + C->grid]);
+		/* set d2[]/dy2 = 0 on north side:  */
+		ij = C->ij_nw_corner + i * C->my;
+		/* u[ij + 1] = 2 * u[ij] - u[ij - grid];  */
+		C->u[ij + 1] = (float)(y_0_const * C->u[ij] + y_1_const * C->u[ij - C->grid]);
 		
+	}
+	
+	for (j = 0; j < C->ny; j += C->grid) {
+		/* set d2[]/dx2 = 0 on west side:  */
+		ij = C->ij_sw_corner + j;
+		/* u[ij - my] = 2 * u[ij] - u[ij + grid_east];  */
+		C->u[ij - C->my] = (float)(x_1_const * C->u[ij + C->grid_east] + x_0_const * C->u[ij]);
+		/* set d2[]/dx2 = 0 on east side:  */
+		ij = C->ij_se_corner + j;
+		/* u[ij + my] = 2 * u[ij] - u[ij - grid_east];  */
+		C->u[ij + C->my] = (float)(x_1_const * C->u[ij - C->grid_east] + x_0_const * C->u[ij]);
+	}
 		
-		for (i = 0; i < nx; i += grid) {
-			/* set d2[]/dy2 = 0 on south side:  */
-			ij = ij_sw_corner + i * my;
-			/* u[ij - 1] = 2 * u[ij] - u[ij + grid];  */
-			u[ij - 1] = (float)(y_0_const * u[ij] + y_1_const * u[ij + grid]);
-			/* set d2[]/dy2 = 0 on north side:  */
-			ij = ij_nw_corner + i * my;
-			/* u[ij + 1] = 2 * u[ij] - u[ij - grid];  */
-			u[ij + 1] = (float)(y_0_const * u[ij] + y_1_const * u[ij - grid]);
+	/* Now set d2[]/dxdy = 0 at each corner:  */
+	
+	ij = C->ij_sw_corner;
+	C->u[ij - C->my - 1] = C->u[ij + C->grid_east - 1] + C->u[ij - C->my + C->grid] - C->u[ij + C->grid_east + C->grid];
 			
-		}
-		
-		for (j = 0; j < ny; j += grid) {
-			/* set d2[]/dx2 = 0 on west side:  */
-			ij = ij_sw_corner + j;
-			/* u[ij - my] = 2 * u[ij] - u[ij + grid_east];  */
-			u[ij - my] = (float)(x_1_const * u[ij + grid_east] + x_0_const * u[ij]);
-			/* set d2[]/dx2 = 0 on east side:  */
-			ij = ij_se_corner + j;
-			/* u[ij + my] = 2 * u[ij] - u[ij - grid_east];  */
-			u[ij + my] = (float)(x_1_const * u[ij - grid_east] + x_0_const * u[ij]);
-		}
+	ij = C->ij_nw_corner;
+	C->u[ij - C->my + 1] = C->u[ij + C->grid_east + 1] + C->u[ij - C->my - C->grid] - C->u[ij + C->grid_east - C->grid];
 			
-		/* Now set d2[]/dxdy = 0 at each corner:  */
-		
-		ij = ij_sw_corner;
-		u[ij - my - 1] = u[ij + grid_east - 1] + u[ij - my + grid] - u[ij + grid_east + grid];
-				
-		ij = ij_nw_corner;
-		u[ij - my + 1] = u[ij + grid_east + 1] + u[ij - my - grid] - u[ij + grid_east - grid];
-				
-		ij = ij_se_corner;
-		u[ij + my - 1] = u[ij - grid_east - 1] + u[ij + my + grid] - u[ij - grid_east + grid];
-				
-		ij = ij_ne_corner;
-		u[ij + my + 1] = u[ij - grid_east + 1] + u[ij + my - grid] - u[ij - grid_east - grid];
-		
-		/* Now set (1-T)dC/dn + Tdu/dn = 0 at each edge :  */
-		/* New experiment:  only dC/dn = 0  */
-		
-		x_w_case = 0;
-		x_e_case = block_nx - 1;
-		for (i = 0; i < nx; i += grid, x_w_case++, x_e_case--) {
-		
-			if(x_w_case < 2)
-				x_case = x_w_case;
-			else if(x_e_case < 2)
-				x_case = 4 - x_e_case;
-			else
-				x_case = 2;
-				
-			/* South side :  */
-			kase = x_case * 5;
-			ij = ij_sw_corner + i * my;
-			u[ij + offset[kase][11]] = 
-				(float)(u[ij + offset[kase][0]] + eps_m2*(u[ij + offset[kase][1]] + u[ij + offset[kase][3]]
-					- u[ij + offset[kase][8]] - u[ij + offset[kase][10]])
-					+ two_plus_em2 * (u[ij + offset[kase][9]] - u[ij + offset[kase][2]]) );
-				/*  + tense * eps_m2 * (u[ij + offset[kase][2]] - u[ij + offset[kase][9]]) / (1.0 - tense);  */
-			/* North side :  */
-			kase = x_case * 5 + 4;
-			ij = ij_nw_corner + i * my;
-			u[ij + offset[kase][0]] = 
-				-(float)(-u[ij + offset[kase][11]] + eps_m2 * (u[ij + offset[kase][1]] + u[ij + offset[kase][3]]
-					- u[ij + offset[kase][8]] - u[ij + offset[kase][10]])
-					+ two_plus_em2 * (u[ij + offset[kase][9]] - u[ij + offset[kase][2]]) );
-				/*  - tense * eps_m2 * (u[ij + offset[kase][2]] - u[ij + offset[kase][9]]) / (1.0 - tense);  */
-		}
-		
-		y_s_case = 0;
-		y_n_case = block_ny - 1;
-		for (j = 0; j < ny; j += grid, y_s_case++, y_n_case--) {
-				
-			if(y_s_case < 2)
-				y_case = y_s_case;
-			else if(y_n_case < 2)
-				y_case = 4 - y_n_case;
-			else
-				y_case = 2;
+	ij = C->ij_se_corner;
+	C->u[ij + C->my - 1] = C->u[ij - C->grid_east - 1] + C->u[ij + C->my + C->grid] - C->u[ij - C->grid_east + C->grid];
 			
-			/* West side :  */
-			kase = y_case;
-			ij = ij_sw_corner + j;
-			u[ij+offset[kase][4]] = 
-				u[ij + offset[kase][7]] + (float)(eps_p2 * (u[ij + offset[kase][3]] + u[ij + offset[kase][10]]
-				-u[ij + offset[kase][1]] - u[ij + offset[kase][8]])
-				+ two_plus_ep2 * (u[ij + offset[kase][5]] - u[ij + offset[kase][6]]));
-				/*  + tense * (u[ij + offset[kase][6]] - u[ij + offset[kase][5]]) / (1.0 - tense);  */
-			/* East side :  */
-			kase = 20 + y_case;
-			ij = ij_se_corner + j;
-			u[ij + offset[kase][7]] = 
-				- (float)(-u[ij + offset[kase][4]] + eps_p2 * (u[ij + offset[kase][3]] + u[ij + offset[kase][10]]
-				- u[ij + offset[kase][1]] - u[ij + offset[kase][8]])
-				+ two_plus_ep2 * (u[ij + offset[kase][5]] - u[ij + offset[kase][6]]) );
-				/*  - tense * (u[ij + offset[kase][6]] - u[ij + offset[kase][5]]) / (1.0 - tense);  */
-		}
-
+	ij = C->ij_ne_corner;
+	C->u[ij + C->my + 1] = C->u[ij - C->grid_east + 1] + C->u[ij + C->my - C->grid] - C->u[ij - C->grid_east - C->grid];
+	
+	/* Now set (1-T)dC/dn + Tdu/dn = 0 at each edge :  */
+	/* New experiment:  only dC/dn = 0  */
+	
+	x_w_case = 0;
+	x_e_case = C->block_nx - 1;
+	for (i = 0; i < C->nx; i += C->grid, x_w_case++, x_e_case--) {
+	
+		if(x_w_case < 2)
+			x_case = x_w_case;
+		else if(x_e_case < 2)
+			x_case = 4 - x_e_case;
+		else
+			x_case = 2;
 			
+		/* South side :  */
+		kase = x_case * 5;
+		ij = C->ij_sw_corner + i * C->my;
+		C->u[ij + C->offset[kase][11]] = 
+			(float)(C->u[ij + C->offset[kase][0]] + C->eps_m2*(C->u[ij + C->offset[kase][1]] + C->u[ij + C->offset[kase][3]]
+				- C->u[ij + C->offset[kase][8]] - C->u[ij + C->offset[kase][10]])
+				+ C->two_plus_em2 * (C->u[ij + C->offset[kase][9]] - C->u[ij + C->offset[kase][2]]) );
+			/*  + tense * eps_m2 * (u[ij + offset[kase][2]] - u[ij + offset[kase][9]]) / (1.0 - tense);  */
+		/* North side :  */
+		kase = x_case * 5 + 4;
+		ij = C->ij_nw_corner + i * C->my;
+		C->u[ij + C->offset[kase][0]] = 
+			-(float)(-C->u[ij + C->offset[kase][11]] + C->eps_m2 * (C->u[ij + C->offset[kase][1]] + C->u[ij + C->offset[kase][3]]
+				- C->u[ij + C->offset[kase][8]] - C->u[ij + C->offset[kase][10]])
+				+ C->two_plus_em2 * (C->u[ij + C->offset[kase][9]] - C->u[ij + C->offset[kase][2]]) );
+			/*  - tense * eps_m2 * (u[ij + offset[kase][2]] - u[ij + offset[kase][9]]) / (1.0 - tense);  */
+	}
+	
+	y_s_case = 0;
+	y_n_case = C->block_ny - 1;
+	for (j = 0; j < C->ny; j += C->grid, y_s_case++, y_n_case--) {
 			
-		/* That's it for the boundary points.  Now loop over all data  */
+		if(y_s_case < 2)
+			y_case = y_s_case;
+		else if(y_n_case < 2)
+			y_case = 4 - y_n_case;
+		else
+			y_case = 2;
 		
+		/* West side :  */
+		kase = y_case;
+		ij = C->ij_sw_corner + j;
+		C->u[ij+C->offset[kase][4]] = 
+			C->u[ij + C->offset[kase][7]] + (float)(C->eps_p2 * (C->u[ij + C->offset[kase][3]] + C->u[ij + C->offset[kase][10]]
+			-C->u[ij + C->offset[kase][1]] - C->u[ij + C->offset[kase][8]])
+			+ C->two_plus_ep2 * (C->u[ij + C->offset[kase][5]] - C->u[ij + C->offset[kase][6]]));
+			/*  + tense * (u[ij + offset[kase][6]] - u[ij + offset[kase][5]]) / (1.0 - tense);  */
+		/* East side :  */
+		kase = 20 + y_case;
+		ij = C->ij_se_corner + j;
+		C->u[ij + C->offset[kase][7]] = 
+			- (float)(-C->u[ij + C->offset[kase][4]] + C->eps_p2 * (C->u[ij + C->offset[kase][3]] + C->u[ij + C->offset[kase][10]]
+			- C->u[ij + C->offset[kase][1]] - C->u[ij + C->offset[kase][8]])
+			+ C->two_plus_ep2 * (C->u[ij + C->offset[kase][5]] - C->u[ij + C->offset[kase][6]]) );
+			/*  - tense * (u[ij + offset[kase][6]] - u[ij + offset[kase][5]]) / (1.0 - tense);  */
+	}
+}
+
+double	relax_sweep(struct SURFACE_CTX *C, int *col_briggs) {
+	/* One relaxation pass over the whole grid. With -j the columns go by colors and col_briggs[]
+	   tells where each column starts in the briggs table. Returns the max abs change (-1 if none) */
+	int	i, briggs_index = 0, color;
+	int	x_case, x_w_case, x_e_case;
+	double	change, thr_change, max_change = -1.0;
+
+	if (!C->n_threads) {	/* The classic Gauss-Seidel sweep */
 		x_w_case = 0;
-		x_e_case = block_nx - 1;
-		for (i = 0; i < nx; i += grid, x_w_case++, x_e_case--) {
+		x_e_case = C->block_nx - 1;
+		for (i = 0; i < C->nx; i += C->grid, x_w_case++, x_e_case--) {
 		
 			if(x_w_case < 2)
 				x_case = x_w_case;
@@ -1318,129 +1926,179 @@ int	iterate(int mode) {
 			else
 				x_case = 2;
 			
-			y_s_case = 0;
-			y_n_case = block_ny - 1;
-			
-			ij = ij_sw_corner + i * my;
-			
-			for (j = 0; j < ny; j += grid, ij += grid, y_s_case++, y_n_case--) {
-	
-				if (iu[ij] == 5) continue;	/* Point is fixed  */
-				
-				if(y_s_case < 2)
-					y_case = y_s_case;
-				else if(y_n_case < 2)
-					y_case = 4 - y_n_case;
-				else
-					y_case = 2;
-				
-				kase = x_case * 5 + y_case;
-				sum_ij = 0.0;
-
-				if (iu[ij] == 0) {		/* Point is unconstrained  */
-					for (k = 0; k < 12; k++) {
-						sum_ij += (u[ij + offset[kase][k]] * coeff[0][k]);
-					}
-				}
-				else {				/* Point is constrained  */
-				
-					b0 = briggs[briggs_index].b[0];
-					b1 = briggs[briggs_index].b[1];
-					b2 = briggs[briggs_index].b[2];
-					b3 = briggs[briggs_index].b[3];
-					b4 = briggs[briggs_index].b[4];
-					b5 = briggs[briggs_index].b[5];
-					briggs_index++;
-					if (iu[ij] < 3) {
-						if (iu[ij] == 1) {	/* Point is in quadrant 1  */
-							busum = b0 * u[ij + offset[kase][10]]
-								+ b1 * u[ij + offset[kase][9]]
-								+ b2 * u[ij + offset[kase][5]]
-								+ b3 * u[ij + offset[kase][1]];
-						}
-						else {			/* Point is in quadrant 2  */
-							busum = b0 * u[ij + offset[kase][8]]
-								+ b1 * u[ij + offset[kase][9]]
-								+ b2 * u[ij + offset[kase][6]]
-								+ b3 * u[ij + offset[kase][3]];
-						}
-					}
-					else {
-						if (iu[ij] == 3) {	/* Point is in quadrant 3  */
-							busum = b0 * u[ij + offset[kase][1]]
-								+ b1 * u[ij + offset[kase][2]]
-								+ b2 * u[ij + offset[kase][6]]
-								+ b3 * u[ij + offset[kase][10]];
-						}
-						else {		/* Point is in quadrant 4  */
-							busum = b0 * u[ij + offset[kase][3]]
-								+ b1 * u[ij + offset[kase][2]]
-								+ b2 * u[ij + offset[kase][5]]
-								+ b3 * u[ij + offset[kase][8]];
-						}
-					}
-					for (k = 0; k < 12; k++) {
-						sum_ij += (u[ij + offset[kase][k]] * coeff[1][k]);
-					}
-					sum_ij = (sum_ij + a0_const_2 * (busum + b5))
-						/ (a0_const_1 + a0_const_2 * b4);
-				}
-				
-				/* New relaxation here  */
-				sum_ij = u[ij] * relax_old + sum_ij * relax_new;
-				
-				if (constrained) {	/* Must check limits.  Note lower/upper is v2 format and need ij_v2! */
-					ij_v2 = (ny - j - 1) * nx + i;
-					if (set_low && !GMT_is_fnan (lower[ij_v2]) && sum_ij < lower[ij_v2])
-						sum_ij = lower[ij_v2];
-					else if (set_high && !GMT_is_fnan (upper[ij_v2]) && sum_ij > upper[ij_v2])
-						sum_ij = upper[ij_v2];
+			change = relax_column (C, i, x_case, &briggs_index);
+			if (change > max_change) max_change = change;
+		}
+	}
+	else {		/* The 12 points stencil goes 2 columns away, so columns i mod 3 are independent */
+		for (color = 0; color < 3; color++) {
+			/* A max per thread, merged at the end (cl /openmp is OpenMP 2.0, without max reductions) */
+#if HAVE_OPENMP
+#pragma omp parallel num_threads(C->n_threads) private(i, x_case, briggs_index, change, thr_change)
+#endif
+			{
+				thr_change = -1.0;
+#if HAVE_OPENMP
+#pragma omp for
+#endif
+				for (i = color; i < C->block_nx; i += 3) {
+					if (i < 2)
+						x_case = i;
+					else if (C->block_nx - 1 - i < 2)
+						x_case = 4 - (C->block_nx - 1 - i);
+					else
+						x_case = 2;
+					briggs_index = col_briggs[i];
+					change = relax_column (C, i * C->grid, x_case, &briggs_index);
+					if (change > thr_change) thr_change = change;
 				}
-					
-				change = fabs(sum_ij - u[ij]);
-				u[ij] = (float)sum_ij;
-				if (change > max_change) max_change = change;
+#if HAVE_OPENMP
+#pragma omp critical (relax_max)
+#endif
+				if (thr_change > max_change) max_change = thr_change;
 			}
 		}
-		iteration_count++;
-		total_iterations++;
-		max_change *= z_scale;	/* Put max_change into z units  */
-		if (long_verbose) mexPrintf (format,
-			grid, mode_type[mode], iteration_count, max_change, current_limit, total_iterations);
+	}
+	return (max_change);
+}
+
+double	node_value(struct SURFACE_CTX *C, int ij, int kase, int *briggs_index, double *diag) {
+	/* The value that the equation of node ij asks for, given its neighbors. Advances briggs_index
+	   if the node is constrained. If diag is not NULL it gets the diagonal term of the equation,
+	   so that (value - u[ij]) * diag is the residual of the node */
+	int	k;
+	double	busum, sum_ij;
+	double	b0, b1, b2, b3, b4, b5;
+
+	sum_ij = 0.0;
+
+	if (C->iu[ij] == 0) {		/* Point is unconstrained  */
+		for (k = 0; k < 12; k++) {
+			sum_ij += (C->u[ij + C->offset[kase][k]] * C->coeff[0][k]);
+		}
+		if (C->rhs) sum_ij += C->rhs[ij] * C->a0;
+		if (diag) *diag = 1.0 / C->a0;
+	}
+	else {				/* Point is constrained  */
+	
+		b0 = C->briggs[*briggs_index].b[0];
+		b1 = C->briggs[*briggs_index].b[1];
+		b2 = C->briggs[*briggs_index].b[2];
+		b3 = C->briggs[*briggs_index].b[3];
+		b4 = C->briggs[*briggs_index].b[4];
+		b5 = C->briggs[*briggs_index].b[5];
+		(*briggs_index)++;
+		if (C->iu[ij] < 3) {
+			if (C->iu[ij] == 1) {	/* Point is in quadrant 1  */
+				busum = b0 * C->u[ij + C->offset[kase][10]]
+					+ b1 * C->u[ij + C->offset[kase][9]]
+					+ b2 * C->u[ij + C->offset[kase][5]]
+					+ b3 * C->u[ij + C->offset[kase][1]];
+			}
+			else {			/* Point is in quadrant 2  */
+				busum = b0 * C->u[ij + C->offset[kase][8]]
+					+ b1 * C->u[ij + C->offset[kase][9]]
+					+ b2 * C->u[ij + C->offset[kase][6]]
+					+ b3 * C->u[ij + C->offset[kase][3]];
+			}
+		}
+		else {
+			if (C->iu[ij] == 3) {	/* Point is in quadrant 3  */
+				busum = b0 * C->u[ij + C->offset[kase][1]]
+					+ b1 * C->u[ij + C->offset[kase][2]]
+					+ b2 * C->u[ij + C->offset[kase][6]]
+					+ b3 * C->u[ij + C->offset[kase][10]];
+			}
+			else {		/* Point is in quadrant 4  */
+				busum = b0 * C->u[ij + C->offset[kase][3]]
+					+ b1 * C->u[ij + C->offset[kase][2]]
+					+ b2 * C->u[ij + C->offset[kase][5]]
+					+ b3 * C->u[ij + C->offset[kase][8]];
+			}
+		}
+		for (k = 0; k < 12; k++) {
+			sum_ij += (C->u[ij + C->offset[kase][k]] * C->coeff[1][k]);
+		}
+		if (C->rhs) sum_ij += C->rhs[ij];
+		sum_ij = (sum_ij + C->a0_const_2 * (busum + b5))
+			/ (C->a0_const_1 + C->a0_const_2 * b4);
+		if (diag) *diag = C->a0_const_1 + C->a0_const_2 * b4;
+	}
+	
+	return (sum_ij);
+}
 
-	} while (max_change > current_limit && iteration_count < max_iterations);
+double	relax_column(struct SURFACE_CTX *C, int i, int x_case, int *briggs_index) {
+	/* One over-relaxation pass on the nodes of column i (a multiple of grid), from south to north.
+	   briggs_index points to the first briggs entry of the column and ends after its last one.
+	   Only u of this column is changed. Returns the max abs change of its nodes (-1 if none).  */
+
+	int	j, ij, kase, ij_v2;
+	int	y_case, y_s_case, y_n_case;
+	double	change, max_change = -1.0, sum_ij;
+
+	y_s_case = 0;
+	y_n_case = C->block_ny - 1;
 	
-	if (gmtdefs.verbose && !long_verbose) mexPrintf(format,
-		grid, mode_type[mode], iteration_count, max_change, current_limit, total_iterations);
+	ij = C->ij_sw_corner + i * C->my;
+	
+	for (j = 0; j < C->ny; j += C->grid, ij += C->grid, y_s_case++, y_n_case--) {
 
-	return(iteration_count);
+		if (C->iu[ij] == 5) continue;	/* Point is fixed  */
+		
+		if(y_s_case < 2)
+			y_case = y_s_case;
+		else if(y_n_case < 2)
+			y_case = 4 - y_n_case;
+		else
+			y_case = 2;
+		
+		kase = x_case * 5 + y_case;
+		sum_ij = node_value (C, ij, kase, briggs_index, NULL);
+		
+		/* New relaxation here  */
+		sum_ij = C->u[ij] * C->relax_old + sum_ij * C->relax_new;
+		
+		if (C->constrained) {	/* Must check limits.  Note lower/upper is v2 format and need ij_v2! */
+			ij_v2 = (C->ny - j - 1) * C->nx + i;
+			if (C->set_low && !GMT_is_fnan (C->lower[ij_v2]) && sum_ij < C->lower[ij_v2])
+				sum_ij = C->lower[ij_v2];
+			else if (C->set_high && !GMT_is_fnan (C->upper[ij_v2]) && sum_ij > C->upper[ij_v2])
+				sum_ij = C->upper[ij_v2];
+		}
+			
+		change = fabs(sum_ij - C->u[ij]);
+		C->u[ij] = (float)sum_ij;
+		if (change > max_change) max_change = change;
+	}
+	return(max_change);
 }
 
-void check_errors (void) {
+void check_errors (struct SURFACE_CTX *C) {
 
 	int	i, j, k, ij, n_nodes, move_over[12];	/* move_over = offset[kase][12], but grid = 1 so move_over is easy  */
 	
 	double	x0, y0, dx, dy, mean_error, mean_squared_error, z_est, z_err, curvature, c;
 	double	du_dx, du_dy, d2u_dx2, d2u_dxdy, d2u_dy2, d3u_dx3, d3u_dx2dy, d3u_dxdy2, d3u_dy3;
 	
-	double	x_0_const = 4.0 * (1.0 - boundary_tension) / (2.0 - boundary_tension);
-	double	x_1_const = (3 * boundary_tension - 2.0) / (2.0 - boundary_tension);
-	double	y_denom = 2 * l_epsilon * (1.0 - boundary_tension) + boundary_tension;
-	double	y_0_const = 4 * l_epsilon * (1.0 - boundary_tension) / y_denom;
-	double	y_1_const = (boundary_tension - 2 * l_epsilon * (1.0 - boundary_tension) ) / y_denom;
+	double	x_0_const = 4.0 * (1.0 - C->boundary_tension) / (2.0 - C->boundary_tension);
+	double	x_1_const = (3 * C->boundary_tension - 2.0) / (2.0 - C->boundary_tension);
+	double	y_denom = 2 * C->l_epsilon * (1.0 - C->boundary_tension) + C->boundary_tension;
+	double	y_0_const = 4 * C->l_epsilon * (1.0 - C->boundary_tension) / y_denom;
+	double	y_1_const = (C->boundary_tension - 2 * C->l_epsilon * (1.0 - C->boundary_tension) ) / y_denom;
 	
 	
 	move_over[0] = 2;
-	move_over[1] = 1 - my;
+	move_over[1] = 1 - C->my;
 	move_over[2] = 1;
-	move_over[3] = 1 + my;
-	move_over[4] = -2 * my;
-	move_over[5] = -my;
-	move_over[6] = my;
-	move_over[7] = 2 * my;
-	move_over[8] = -1 - my;
+	move_over[3] = 1 + C->my;
+	move_over[4] = -2 * C->my;
+	move_over[5] = -C->my;
+	move_over[6] = C->my;
+	move_over[7] = 2 * C->my;
+	move_over[8] = -1 - C->my;
 	move_over[9] = -1;
-	move_over[10] = -1 + my;
+	move_over[10] = -1 + C->my;
 	move_over[11] = -2;
 
 	mean_error = 0;
@@ -1448,129 +2106,129 @@ void check_errors (void) {
 	
 	/* First update the boundary values  */
 
-	for (i = 0; i < nx; i ++) {
-		ij = ij_sw_corner + i * my;
-		u[ij - 1] = (float)(y_0_const * u[ij] + y_1_const * u[ij + 1]);
-		ij = ij_nw_corner + i * my;
-		u[ij + 1] = (float)(y_0_const * u[ij] + y_1_const * u[ij - 1]);
+	for (i = 0; i < C->nx; i ++) {
+		ij = C->ij_sw_corner + i * C->my;
+		C->u[ij - 1] = (float)(y_0_const * C->u[ij] + y_1_const * C->u[ij + 1]);
+		ij = C->ij_nw_corner + i * C->my;
+		C->u[ij + 1] = (float)(y_0_const * C->u[ij] + y_1_const * C->u[ij - 1]);
 	}
 
-	for (j = 0; j < ny; j ++) {
-		ij = ij_sw_corner + j;
-		u[ij - my] = (float)(x_1_const * u[ij + my] + x_0_const * u[ij]);
-		ij = ij_se_corner + j;
-		u[ij + my] = (float)(x_1_const * u[ij - my] + x_0_const * u[ij]);
+	for (j = 0; j < C->ny; j ++) {
+		ij = C->ij_sw_corner + j;
+		C->u[ij - C->my] = (float)(x_1_const * C->u[ij + C->my] + x_0_const * C->u[ij]);
+		ij = C->ij_se_corner + j;
+		C->u[ij + C->my] = (float)(x_1_const * C->u[ij - C->my] + x_0_const * C->u[ij]);
 	}
 
-	ij = ij_sw_corner;
-	u[ij - my - 1] = u[ij + my - 1] + u[ij - my + 1] - u[ij + my + 1];
-	ij = ij_nw_corner;
-	u[ij - my + 1] = u[ij + my + 1] + u[ij - my - 1] - u[ij + my - 1];
-	ij = ij_se_corner;
-	u[ij + my - 1] = u[ij - my - 1] + u[ij + my + 1] - u[ij - my + 1];
-	ij = ij_ne_corner;
-	u[ij + my + 1] = u[ij - my + 1] + u[ij + my - 1] - u[ij - my - 1];
+	ij = C->ij_sw_corner;
+	C->u[ij - C->my - 1] = C->u[ij + C->my - 1] + C->u[ij - C->my + 1] - C->u[ij + C->my + 1];
+	ij = C->ij_nw_corner;
+	C->u[ij - C->my + 1] = C->u[ij + C->my + 1] + C->u[ij - C->my - 1] - C->u[ij + C->my - 1];
+	ij = C->ij_se_corner;
+	C->u[ij + C->my - 1] = C->u[ij - C->my - 1] + C->u[ij + C->my + 1] - C->u[ij - C->my + 1];
+	ij = C->ij_ne_corner;
+	C->u[ij + C->my + 1] = C->u[ij - C->my + 1] + C->u[ij + C->my - 1] - C->u[ij - C->my - 1];
 
-	for (i = 0; i < nx; i ++) {
+	for (i = 0; i < C->nx; i ++) {
 				
-		ij = ij_sw_corner + i * my;
-		u[ij + move_over[11]] = 
-			(float)(u[ij + move_over[0]] + eps_m2*(u[ij + move_over[1]] + u[ij + move_over[3]]
-				- u[ij + move_over[8]] - u[ij + move_over[10]])
-				+ two_plus_em2 * (u[ij + move_over[9]] - u[ij + move_over[2]]) );
+		ij = C->ij_sw_corner + i * C->my;
+		C->u[ij + move_over[11]] = 
+			(float)(C->u[ij + move_over[0]] + C->eps_m2*(C->u[ij + move_over[1]] + C->u[ij + move_over[3]]
+				- C->u[ij + move_over[8]] - C->u[ij + move_over[10]])
+				+ C->two_plus_em2 * (C->u[ij + move_over[9]] - C->u[ij + move_over[2]]) );
 					
-		ij = ij_nw_corner + i * my;
-		u[ij + move_over[0]] = 
-			-(float)(-u[ij + move_over[11]] + eps_m2 * (u[ij + move_over[1]] + u[ij + move_over[3]]
-				- u[ij + move_over[8]] - u[ij + move_over[10]])
-				+ two_plus_em2 * (u[ij + move_over[9]] - u[ij + move_over[2]]) );
+		ij = C->ij_nw_corner + i * C->my;
+		C->u[ij + move_over[0]] = 
+			-(float)(-C->u[ij + move_over[11]] + C->eps_m2 * (C->u[ij + move_over[1]] + C->u[ij + move_over[3]]
+				- C->u[ij + move_over[8]] - C->u[ij + move_over[10]])
+				+ C->two_plus_em2 * (C->u[ij + move_over[9]] - C->u[ij + move_over[2]]) );
 	}
 		
-	for (j = 0; j < ny; j ++) {
+	for (j = 0; j < C->ny; j ++) {
 			
-		ij = ij_sw_corner + j;
-		u[ij+move_over[4]] = 
-			u[ij + move_over[7]] + (float)(eps_p2 * (u[ij + move_over[3]] + u[ij + move_over[10]]
-			-u[ij + move_over[1]] - u[ij + move_over[8]])
-			+ two_plus_ep2 * (u[ij + move_over[5]] - u[ij + move_over[6]]));
+		ij = C->ij_sw_corner + j;
+		C->u[ij+move_over[4]] = 
+			C->u[ij + move_over[7]] + (float)(C->eps_p2 * (C->u[ij + move_over[3]] + C->u[ij + move_over[10]]
+			-C->u[ij + move_over[1]] - C->u[ij + move_over[8]])
+			+ C->two_plus_ep2 * (C->u[ij + move_over[5]] - C->u[ij + move_over[6]]));
 				
-		ij = ij_se_corner + j;
-		u[ij + move_over[7]] = 
-			- (float)(-u[ij + move_over[4]] + eps_p2 * (u[ij + move_over[3]] + u[ij + move_over[10]]
-			- u[ij + move_over[1]] - u[ij + move_over[8]])
-			+ two_plus_ep2 * (u[ij + move_over[5]] - u[ij + move_over[6]]) );
+		ij = C->ij_se_corner + j;
+		C->u[ij + move_over[7]] = 
+			- (float)(-C->u[ij + move_over[4]] + C->eps_p2 * (C->u[ij + move_over[3]] + C->u[ij + move_over[10]]
+			- C->u[ij + move_over[1]] - C->u[ij + move_over[8]])
+			+ C->two_plus_ep2 * (C->u[ij + move_over[5]] - C->u[ij + move_over[6]]) );
 	}
 
 	/* That resets the boundary values.  Now we can test all data.  
 		Note that this loop checks all values, even though only nearest were used.  */
 	
-	for (k = 0; k < npoints; k++) {
-		i = data[k].index/ny;
-		j = data[k].index%ny;
-	 	ij = ij_sw_corner + i * my + j;
-	 	if ( iu[ij] == 5 ) continue;
-	 	x0 = x_min + i*xinc;
-	 	y0 = y_min + j*yinc;
-	 	dx = (data[k].x - x0)*r_xinc;
-	 	dy = (data[k].y - y0)*r_yinc;
+	for (k = 0; k < C->npoints; k++) {
+		i = C->data[k].index/C->ny;
+		j = C->data[k].index%C->ny;
+	 	ij = C->ij_sw_corner + i * C->my + j;
+	 	if ( C->iu[ij] == 5 ) continue;
+	 	x0 = C->x_min + i*C->xinc;
+	 	y0 = C->y_min + j*C->yinc;
+	 	dx = (C->data[k].x - x0)*C->r_xinc;
+	 	dy = (C->data[k].y - y0)*C->r_yinc;
  
-	 	du_dx = 0.5 * (u[ij + move_over[6]] - u[ij + move_over[5]]);
-	 	du_dy = 0.5 * (u[ij + move_over[2]] - u[ij + move_over[9]]);
-	 	d2u_dx2 = u[ij + move_over[6]] + u[ij + move_over[5]] - 2 * u[ij];
-	 	d2u_dy2 = u[ij + move_over[2]] + u[ij + move_over[9]] - 2 * u[ij];
-	 	d2u_dxdy = 0.25 * (u[ij + move_over[3]] - u[ij + move_over[1]]
-	 			- u[ij + move_over[10]] + u[ij + move_over[8]]);
-	 	d3u_dx3 = 0.5 * ( u[ij + move_over[7]] - 2 * u[ij + move_over[6]]
-	 				+ 2 * u[ij + move_over[5]] - u[ij + move_over[4]]);
-	 	d3u_dy3 = 0.5 * ( u[ij + move_over[0]] - 2 * u[ij + move_over[2]]
-	 				+ 2 * u[ij + move_over[9]] - u[ij + move_over[11]]);
-	 	d3u_dx2dy = 0.5 * ( ( u[ij + move_over[3]] + u[ij + move_over[1]] - 2 * u[ij + move_over[2]] )
-	 				- ( u[ij + move_over[10]] + u[ij + move_over[8]] - 2 * u[ij + move_over[9]] ) );
-	 	d3u_dxdy2 = 0.5 * ( ( u[ij + move_over[3]] + u[ij + move_over[10]] - 2 * u[ij + move_over[6]] )
-	 				- ( u[ij + move_over[1]] + u[ij + move_over[8]] - 2 * u[ij + move_over[5]] ) );
+	 	du_dx = 0.5 * (C->u[ij + move_over[6]] - C->u[ij + move_over[5]]);
+	 	du_dy = 0.5 * (C->u[ij + move_over[2]] - C->u[ij + move_over[9]]);
+	 	d2u_dx2 = C->u[ij + move_over[6]] + C->u[ij + move_over[5]] - 2 * C->u[ij];
+	 	d2u_dy2 = C->u[ij + move_over[2]] + C->u[ij + move_over[9]] - 2 * C->u[ij];
+	 	d2u_dxdy = 0.25 * (C->u[ij + move_over[3]] - C->u[ij + move_over[1]]
+	 			- C->u[ij + move_over[10]] + C->u[ij + move_over[8]]);
+	 	d3u_dx3 = 0.5 * ( C->u[ij + move_over[7]] - 2 * C->u[ij + move_over[6]]
+	 				+ 2 * C->u[ij + move_over[5]] - C->u[ij + move_over[4]]);
+	 	d3u_dy3 = 0.5 * ( C->u[ij + move_over[0]] - 2 * C->u[ij + move_over[2]]
+	 				+ 2 * C->u[ij + move_over[9]] - C->u[ij + move_over[11]]);
+	 	d3u_dx2dy = 0.5 * ( ( C->u[ij + move_over[3]] + C->u[ij + move_over[1]] - 2 * C->u[ij + move_over[2]] )
+	 				- ( C->u[ij + move_over[10]] + C->u[ij + move_over[8]] - 2 * C->u[ij + move_over[9]] ) );
+	 	d3u_dxdy2 = 0.5 * ( ( C->u[ij + move_over[3]] + C->u[ij + move_over[10]] - 2 * C->u[ij + move_over[6]] )
+	 				- ( C->u[ij + move_over[1]] + C->u[ij + move_over[8]] - 2 * C->u[ij + move_over[5]] ) );
 
 	 	/* 3rd order Taylor approx:  */
 	 		
-	 	z_est = u[ij] + dx * (du_dx +  dx * ( (0.5 * d2u_dx2) + dx * (d3u_dx3 / 6.0) ) )
+	 	z_est = C->u[ij] + dx * (du_dx +  dx * ( (0.5 * d2u_dx2) + dx * (d3u_dx3 / 6.0) ) )
 				+ dy * (du_dy +  dy * ( (0.5 * d2u_dy2) + dy * (d3u_dy3 / 6.0) ) )
 	 			+ dx * dy * (d2u_dxdy) + (0.5 * dx * d3u_dx2dy) + (0.5 * dy * d3u_dxdy2);
 	 		
-	 	z_err = z_est - data[k].z;
+	 	z_err = z_est - C->data[k].z;
 	 	mean_error += z_err;
 	 	mean_squared_error += (z_err * z_err);
 	 }
-	 mean_error /= npoints;
-	 mean_squared_error = sqrt( mean_squared_error / npoints);
+	 mean_error /= C->npoints;
+	 mean_squared_error = sqrt( mean_squared_error / C->npoints);
 	 
 	 curvature = 0.0;
-	 n_nodes = nx * ny;
+	 n_nodes = C->nx * C->ny;
 	 
-	 for (i = 0; i < nx; i++) {
-	 	for (j = 0; j < ny; j++) {
-	 		ij = ij_sw_corner + i * my + j;
-	 		c = u[ij + move_over[6]] + u[ij + move_over[5]]
-	 			+ u[ij + move_over[2]] + u[ij + move_over[9]] - 4.0 * u[ij + move_over[6]];
+	 for (i = 0; i < C->nx; i++) {
+	 	for (j = 0; j < C->ny; j++) {
+	 		ij = C->ij_sw_corner + i * C->my + j;
+	 		c = C->u[ij + move_over[6]] + C->u[ij + move_over[5]]
+	 			+ C->u[ij + move_over[2]] + C->u[ij + move_over[9]] - 4.0 * C->u[ij + move_over[6]];
 			curvature += (c * c);
 		}
 	}
 
 	 mexPrintf("Fit info: N data points  N nodes\tmean error\trms error\tcurvature\n");
-	 sprintf (format,"\t%%8d\t%%8d\t%s\t%s\t%s\n", gmtdefs.d_format, gmtdefs.d_format, gmtdefs.d_format);
-	 mexPrintf (format, npoints, n_nodes, mean_error, mean_squared_error, curvature);
+	 sprintf (C->format,"\t%%8d\t%%8d\t%s\t%s\t%s\n", gmtdefs.d_format, gmtdefs.d_format, gmtdefs.d_format);
+	 mexPrintf (C->format, C->npoints, n_nodes, mean_error, mean_squared_error, curvature);
  }
 
-void	remove_planar_trend(void) {
+void	remove_planar_trend(struct SURFACE_CTX *C) {
 	int	i;
 	double	a, b, c, d, xx, yy, zz;
 	double	sx, sy, sz, sxx, sxy, sxz, syy, syz;
 	
 	sx = sy = sz = sxx = sxy = sxz = syy = syz = 0.0;
 	
-	for (i = 0; i < npoints; i++) {
+	for (i = 0; i < C->npoints; i++) {
 
-		xx = (data[i].x - x_min) * r_xinc;
-		yy = (data[i].y - y_min) * r_yinc;
-		zz = data[i].z;
+		xx = (C->data[i].x - C->x_min) * C->r_xinc;
+		yy = (C->data[i].y - C->y_min) * C->r_yinc;
+		zz = C->data[i].z;
 		
 		sx += xx;
 		sy += yy;
@@ -1582,42 +2240,42 @@ void	remove_planar_trend(void) {
 		syz +=(yy * zz);
 	}
 	
-	d = npoints*sxx*syy + 2*sx*sy*sxy - npoints*sxy*sxy - sx*sx*syy - sy*sy*sxx;
+	d = C->npoints*sxx*syy + 2*sx*sy*sxy - C->npoints*sxy*sxy - sx*sx*syy - sy*sy*sxx;
 	
 	if (d == 0.0) {
-		plane_c0 = plane_c1 = plane_c2 = 0.0;
+		C->plane_c0 = C->plane_c1 = C->plane_c2 = 0.0;
 		return;
 	}
 	
 	a = sz*sxx*syy + sx*sxy*syz + sy*sxy*sxz - sz*sxy*sxy - sx*sxz*syy - sy*syz*sxx;
-	b = npoints*sxz*syy + sz*sy*sxy + sy*sx*syz - npoints*sxy*syz - sz*sx*syy - sy*sy*sxz;
-	c = npoints*sxx*syz + sx*sy*sxz + sz*sx*sxy - npoints*sxy*sxz - sx*sx*syz - sz*sy*sxx;
+	b = C->npoints*sxz*syy + sz*sy*sxy + sy*sx*syz - C->npoints*sxy*syz - sz*sx*syy - sy*sy*sxz;
+	c = C->npoints*sxx*syz + sx*sy*sxz + sz*sx*sxy - C->npoints*sxy*sxz - sx*sx*syz - sz*sy*sxx;
 
-	plane_c0 = a / d;
-	plane_c1 = b / d;
-	plane_c2 = c / d;
+	C->plane_c0 = a / d;
+	C->plane_c1 = b / d;
+	C->plane_c2 = c / d;
 
-	for (i = 0; i < npoints; i++) {
+	for (i = 0; i < C->npoints; i++) {
 
-		xx = (data[i].x - x_min) * r_xinc;
-		yy = (data[i].y - y_min) * r_yinc;
+		xx = (C->data[i].x - C->x_min) * C->r_xinc;
+		yy = (C->data[i].y - C->y_min) * C->r_yinc;
 		
-		data[i].z -= (float)(plane_c0 + plane_c1 * xx + plane_c2 * yy);
+		C->data[i].z -= (float)(C->plane_c0 + C->plane_c1 * xx + C->plane_c2 * yy);
 	}
 }
 
-void	replace_planar_trend(void) {
+void	replace_planar_trend(struct SURFACE_CTX *C) {
 	int	i, j, ij;
 
-	 for (i = 0; i < nx; i++) {
-	 	for (j = 0; j < ny; j++) {
-	 		ij = ij_sw_corner + i * my + j;
-	 		u[ij] = (float)((u[ij] * z_scale) + (plane_c0 + plane_c1 * i + plane_c2 * j));
+	 for (i = 0; i < C->nx; i++) {
+	 	for (j = 0; j < C->ny; j++) {
+	 		ij = C->ij_sw_corner + i * C->my + j;
+	 		C->u[ij] = (float)((C->u[ij] * C->z_scale) + (C->plane_c0 + C->plane_c1 * i + C->plane_c2 * j));
 		}
 	}
 }
 
-void	throw_away_unusables(void) {
+void	throw_away_unusables(struct SURFACE_CTX *C) {
 	/* This is a new routine to eliminate data which will become
 		unusable on the final iteration, when grid = 1.
 		It assumes grid = 1 and set_grid_parameters has been
@@ -1632,76 +2290,78 @@ void	throw_away_unusables(void) {
 	
 	/* Sort the data  */
 	
-	qsort ((void *)data, (size_t)npoints, sizeof (struct DATA), compare_points);
+	C_sort = C;
+	qsort ((void *)C->data, (size_t)C->npoints, sizeof (struct DATA), compare_points);
 	
 	/* If more than one datum is indexed to same node, only the first should be kept.
 		Mark the additional ones as OUTSIDE
 	*/
 	last_index = -1;
 	n_outside = 0;
-	for (k = 0; k < npoints; k++) {
-		if (data[k].index == last_index) {
-			data[k].index = OUTSIDE;
+	for (k = 0; k < C->npoints; k++) {
+		if (C->data[k].index == last_index) {
+			C->data[k].index = OUTSIDE;
 			n_outside++;
 		}
 		else {
-			last_index = data[k].index;
+			last_index = C->data[k].index;
 		}
 	}
 	/* Sort again; this time the OUTSIDE points will be thrown away  */
 	
-	qsort ((void *)data, (size_t)npoints, sizeof (struct DATA), compare_points);
-	npoints -= n_outside;
-	data = (struct DATA *) GMT_memory ((void *)data, (size_t)npoints, sizeof(struct DATA), GMT_program);
-	if (gmtdefs.verbose && (n_outside)) {
+	C_sort = C;
+	qsort ((void *)C->data, (size_t)C->npoints, sizeof (struct DATA), compare_points);
+	C->npoints -= n_outside;
+	C->data = (struct DATA *) GMT_memory ((void *)C->data, (size_t)C->npoints, sizeof(struct DATA), GMT_program);
+	if (C->verbose && (n_outside)) {
 		mexPrintf("%s: %d unusable points were supplied; these will be ignored.\n", GMT_program, n_outside);
 		mexPrintf("\tYou should have pre-processed the data with block-mean, -median, or -mode.\n");
 	}
 }
 
-void	rescale_z_values(void) {
+void	rescale_z_values(struct SURFACE_CTX *C) {
 	int	i;
 	double	ssz = 0.0;
 
-	for (i = 0; i < npoints; i++) ssz += (data[i].z * data[i].z);
+	for (i = 0; i < C->npoints; i++) ssz += (C->data[i].z * C->data[i].z);
 	
 	/* Set z_scale = rms(z):  */
 	
-	z_scale = sqrt (ssz / npoints);
+	C->z_scale = sqrt (ssz / C->npoints);
 	
-	if (z_scale == 0.0) {
+	if (C->z_scale == 0.0) {
 		mexPrintf("%s: WARNING: Input data lie exactly on a plane - no solution (aborting).\n", GMT_program);
-		r_z_scale = z_scale = 1.0;
+		C->r_z_scale = C->z_scale = 1.0;
 	}
 	else
-		r_z_scale = 1.0 / z_scale;
+		C->r_z_scale = 1.0 / C->z_scale;
 
-	for (i = 0; i < npoints; i++) data[i].z *= (float)r_z_scale;
+	for (i = 0; i < C->npoints; i++) C->data[i].z *= (float)C->r_z_scale;
 
-	if (converge_limit == 0.0) converge_limit = 0.001 * z_scale; /* i.e., 1 ppt of L2 scale */
+	if (C->converge_limit == 0.0) C->converge_limit = 0.001 * C->z_scale; /* i.e., 1 ppt of L2 scale */
 }
 
-void load_constraints (char *low, char *high) {
+void load_constraints (struct SURFACE_CTX *C, char *low, char *high) {
 	int i, j, ij;
 	double yy;
 	struct GRD_HEADER hdr;
 		
 	/* Load lower/upper limits, verify range, deplane, and rescale */
 	
-	if (set_low > 0) {
-		lower = (float *) GMT_memory (VNULL, (size_t)(nx * ny), sizeof (float), GMT_program);
-		if (set_low < 3)
-			for (i = 0; i < nx * ny; i++) lower[i] = (float)low_limit;
+	if (C->set_low > 0) {
+		C->lower = (float *) GMT_memory (VNULL, (size_t)(C->nx * C->ny), sizeof (float), GMT_program);
+		if (C->set_low < 3)
+			for (i = 0; i < C->nx * C->ny; i++) C->lower[i] = (float)C->low_limit;
 		else {
 			if (GMT_read_grd_info (low, &hdr)) {
 				mexPrintf ("%s: Error opening file %s\n", GMT_program, low);
 				exit (EXIT_FAILURE);
 			}
-			if (hdr.nx != nx || hdr.ny != ny) {
+			if (hdr.nx != C->nx || hdr.ny != C->ny) {
 				mexPrintf ("%s: lower limit file not of proper dimension!\n", GMT_program);
 				exit (EXIT_FAILURE);
 			}
-			if (GMT_read_grd (low, &hdr, lower, 0.0, 0.0, 0.0, 0.0, GMT_pad, FALSE)) {
+			if (GMT_read_grd (low, &hdr, C->lower, 0.0, 0.0, 0.0, 0.0, GMT_pad, FALSE)) {
 				mexPrintf ("%s: Error reading file %s\n", GMT_program, low);
 				exit (EXIT_FAILURE);
 			}
@@ -1714,30 +2374,30 @@ void load_constraints (char *low, char *high) {
 */
 		}
 			
-		for (j = ij = 0; j < ny; j++) {
-			yy = ny - j - 1;
-			for (i = 0; i < nx; i++, ij++) {
-				if (GMT_is_fnan (lower[ij])) continue;
-				lower[ij] -= (float)(plane_c0 + plane_c1 * i + plane_c2 * yy);
-				lower[ij] *= (float)r_z_scale;
+		for (j = ij = 0; j < C->ny; j++) {
+			yy = C->ny - j - 1;
+			for (i = 0; i < C->nx; i++, ij++) {
+				if (GMT_is_fnan (C->lower[ij])) continue;
+				C->lower[ij] -= (float)(C->plane_c0 + C->plane_c1 * i + C->plane_c2 * yy);
+				C->lower[ij] *= (float)C->r_z_scale;
 			}
 		}
-		constrained = TRUE;
+		C->constrained = TRUE;
 	}
-	if (set_high > 0) {
-		upper = (float *) GMT_memory (VNULL, (size_t)(nx * ny), sizeof (float), GMT_program);
-		if (set_high < 3)
-			for (i = 0; i < nx * ny; i++) upper[i] = (float)high_limit;
+	if (C->set_high > 0) {
+		C->upper = (float *) GMT_memory (VNULL, (size_t)(C->nx * C->ny), sizeof (float), GMT_program);
+		if (C->set_high < 3)
+			for (i = 0; i < C->nx * C->ny; i++) C->upper[i] = (float)C->high_limit;
 		else {
 			if (GMT_read_grd_info (high, &hdr)) {
 				mexPrintf ("%s: Error opening file %s\n", GMT_program, high);
 				exit (EXIT_FAILURE);
 			}
-			if (hdr.nx != nx || hdr.ny != ny) {
+			if (hdr.nx != C->nx || hdr.ny != C->ny) {
 				mexPrintf ("%s: upper limit file not of proper dimension!\n", GMT_program);
 				exit (EXIT_FAILURE);
 			}
-			if (GMT_read_grd (high, &hdr, upper, 0.0, 0.0, 0.0, 0.0, GMT_pad, FALSE)) {
+			if (GMT_read_grd (high, &hdr, C->upper, 0.0, 0.0, 0.0, 0.0, GMT_pad, FALSE)) {
 				mexPrintf ("%s: Error reading file %s\n", GMT_program, high);
 				exit (EXIT_FAILURE);
 			}
@@ -1749,15 +2409,15 @@ void load_constraints (char *low, char *high) {
 			if (n_trimmed) fprintf (stderr, "%s: %d upper limit values < max data, reset to max data!\n", GMT_program, n_trimmed);
 */
 		}
-		for (j = ij = 0; j < ny; j++) {
-			yy = ny - j - 1;
-			for (i = 0; i < nx; i++, ij++) {
-				if (GMT_is_fnan (upper[ij])) continue;
-				upper[ij] -= (float)(plane_c0 + plane_c1 * i + plane_c2 * yy);
-				upper[ij] *= (float)r_z_scale;
+		for (j = ij = 0; j < C->ny; j++) {
+			yy = C->ny - j - 1;
+			for (i = 0; i < C->nx; i++, ij++) {
+				if (GMT_is_fnan (C->upper[ij])) continue;
+				C->upper[ij] -= (float)(C->plane_c0 + C->plane_c1 * i + C->plane_c2 * yy);
+				C->upper[ij] *= (float)C->r_z_scale;
 			}
 		}
-		constrained = TRUE;
+		C->constrained = TRUE;
 	}
 }
 
@@ -1791,6 +2451,7 @@ double	guess_surface_time(int nx, int ny)
 	int	gcd;		/* Current value of the gcd  */
 	int	nxg, nyg;	/* Current value of the grid dimensions  */
 	int	nfactors;	/* Number of prime factors of current gcd  */
+	int	factors[32];	/* Array of common factors */
 	int	factor;		/* Currently used factor  */
 	/* Doubles are used below, even though the values will be integers,
 		because the multiplications might reach sizes of O(n**3)  */
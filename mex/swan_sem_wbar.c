@@ -34,6 +34,10 @@
 		03-01-2008	Added output to ANUGA and MOST formats (netCDF)
 		05-03-2008	Create empty (NaNs) global attribs to hold fault parameters in ANUGA format
 		12-05-2008	SWW stage comes out with/without land as controlled by -L option
+		17-10-2026	Globals moved to a struct swan_ctx, one per call, so that several runs can coexist.
+				Rows of uvh_ split among threads when compiled with -DHAVE_OPENMP (plus /Qopenmp
+				or -fopenmp). -DSINGLE_PRECISION stores the state arrays in floats (half the memory).
+				Both give the same results as the serial, double precision, build of their kind.
  *
  *	version WITHOUT waitbar
  */
@@ -92,6 +96,21 @@ struct srf_header {		/* Surfer file header structure */
 	double z_max;		/* Maximum z value */
 };
 
+#ifdef SINGLE_PRECISION		/* Type of the simulation state arrays (depths, heights, fluxes and velocities) */
+	typedef float  real;
+#else
+	typedef double real;
+#endif
+
+struct swan_ctx {		/* Run parameters and grid geometry. One per call */
+	int	ip, jp, ip1, jp1, ip2, jp2;
+	int	polar, indl, indb, indr, indt, iopt, grn, cumint;
+	double	dx, dy, dt, cf, cc, sfx, sfy, time_h, rough, m_per_deg;
+	double	pistal, pistbl, pistab, pistbb, pistar, pistbr, pistat, pistbt;
+	double	dangx, dangy, *anglt;
+	int	*wet_last;	/* uvh_ scratch. Last wet cell before each row */
+};
+
 void no_sys_mem (char *where, int n);
 int count_col (char *line);
 int read_grd_info_ascii (char *file, struct srf_header *hdr);
@@ -100,40 +119,32 @@ int write_grd_bin(char *name, double x_min, double y_min, double x_inc, double y
 		int j_start, int i_end, int j_end, int nX, float *work);
 int read_grd_ascii (char *file, struct srf_header *hdr, double *work);
 int read_grd_bin (char *file, struct srf_header *hdr, double *work);
-int read_params(char *file);
-int read_maregs(char *file);
+int read_params(char *file, struct swan_ctx *C);
+int read_maregs(char *file, struct srf_header *hdr, int *lcum_p);
 int count_n_maregs(char *file);
-int uvh_(double *dep, double *r, double *rn, double *u, double *un, double *v, double *vn, double *h, 
-		double *hn, double *dxp, double *cca, double m_per_deg);
-int bndy_(double *dep, double *r, double *rn, double *u, double *un, double *v, double *vn, double *h, 
-		double *hn, double *dxp);
-void max_z (double *zm, double *h_bak);
-void change (double *h, double *h_bak);
+int uvh_(struct swan_ctx *C, real *dep, real *r, real *rn, real *u, real *un, real *v, real *vn, real *h,
+		real *hn, double *dxp, double *cca);
+int bndy_(struct swan_ctx *C, real *dep, real *r, real *rn, real *u, real *un, real *v, real *vn, real *h,
+		real *hn, double *dxp);
+void bottom_stress(real *dep, real *u, real *v, real *h, double *cca, int ij, double *sb, double *sa);
+void max_z (real *zm, real *h_bak, int n);
+void change (real *h, real *h_bak, int n);
 int decode_R (char *item, double *w, double *e, double *s, double *n);
 int check_region (double w, double e, double s, double n);
 double ddmmss_to_degree (char *text);
 void err_trap(int status);
 void write_most_slice(int *ncid_most, int *ids_most, int i_start, int j_start, int i_end, int j_end,
-		int nX, float *work, double *h, double *dep, double *u, double *v, float *tmp,
+		int nX, float *work, real *h, real *dep, real *u, real *v, float *tmp,
 		size_t *start, size_t *count);
 int open_most_nc (char *basename, char *name_var, int *ids, int nx, int ny, 
 		double dtx, double dty, double xMinOut, double yMinOut);
 int open_anuga_sww (char *fname_sww, int *ids, int i_start, int j_start, int i_end, int j_end, 
-		int nX, double dtx, double dty, double *dep, double xMinOut, double yMinOut, 
+		int nX, double dtx, double dty, real *dep, double xMinOut, double yMinOut, 
 		float z_min, float z_max);
 void write_anuga_slice(int ncid, int z_id, int i_start, int j_start, int i_end, int j_end, int nX, 
-		float *work, double *h, double *dep, double *u, double *v, float *tmp,
+		float *work, real *h, real *dep, real *u, real *v, float *tmp,
 		size_t *start, size_t *count, float *slice_range, int idx, int with_land);
 
-int	ip, jp, polar, indl, indb, indr, indt, iopt;
-int	ip1, jp1, ip2, jp2, grn, cumint, *lcum_p;
-double	dx, dy, dt, cf, cc, sfx, sfy, time_h, rough;
-double	pistal, pistbl, pistab, pistbb, pistar, pistbr, pistat, pistbt;
-double	dangx, dangy, *anglt;
-int first_in_uvh = TRUE;
-struct	srf_header hdr_b;
-struct	srf_header hdr_f;
-
 /* --------------------------------------------------------------------------- */
 /* Matlab Gateway routine */
 
@@ -141,10 +152,11 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
 	float	*work, dz, *ptr_mov_32, *mov_32, *time_p;
 	float	work_min = FLT_MAX, work_max = -FLT_MAX;
-	double	*inicial, *r, *rn, *u, *un, *v, *vn, *h, *h_bak, *hn, *zm;
+	double	*inicial;
+	real	*r, *rn, *u, *un, *v, *vn, *h, *h_bak, *hn, *zm, *dep;
 	double	*dxp, *xpp, *cca, x, y, small = 1e-6, m_per_deg = 111317.1;
 	double	x_min, y_min, dminx, dminy, dtx, dty, *head, *tmp;
-	double	*dep, *dep1, *cum_p, cang, angltt, dumb;
+	double	*dep1, *cum_p, cang, angltt, dumb;
 	double	x_inc, y_inc, x_tmp, y_tmp;		/* Used in the maregs positiojn test */
 	double	*ptr, *ptr1, *h_bar, tmp_ptr[1];	/* Pointers to be used in the waitbar */
 	double	dfXmin = 0.0, dfYmin = 0.0, dfXmax = 0.0, dfYmax = 0.0, xMinOut, yMinOut;
@@ -174,7 +186,11 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 	size_t	start0 = 0, count0 = 1, start1_A[2] = {0,0}, count1_A[2], start1_M[3] = {0,0,0}, count1_M[3];
 	float	stage_range[2], xmom_range[2], ymom_range[2], *tmp_slice;
 	FILE	*fp;
+	struct	swan_ctx C;
+	struct	srf_header hdr_b, hdr_f;
+	int	*lcum_p = NULL;
 
+	memset (&C, 0, sizeof(struct swan_ctx));
 	movie_char = TRUE;	/* temporary */
 
 	bathy = "bathy.grd";
@@ -233,24 +249,24 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 			mexPrintf("Params input argument has a wrong (=%d) number of arguments (should be 22)\n", i);
 			return;
 		}
-		dt = tmp[0];		grn = (int)tmp[1];	cf = tmp[2];
-		cc = tmp[3];		sfx = tmp[4];		sfy = tmp[5];
-		polar = (int)tmp[6];	rough = tmp[7];		cumint = (int)tmp[8];
-		pistal = tmp[9];	pistbl = tmp[10];	pistab = tmp[11];
-		pistbb = tmp[12];	pistar = tmp[13];	pistbr = tmp[14];
-		pistat = tmp[15];	pistbt = tmp[16];	indl = (int)tmp[17];
-		indb = (int)tmp[18];	indr = (int)tmp[19];	indt = (int)tmp[20];
-		iopt = (int)tmp[21];
+		C.dt = tmp[0];		C.grn = (int)tmp[1];	C.cf = tmp[2];
+		C.cc = tmp[3];		C.sfx = tmp[4];		C.sfy = tmp[5];
+		C.polar = (int)tmp[6];	C.rough = tmp[7];		C.cumint = (int)tmp[8];
+		C.pistal = tmp[9];	C.pistbl = tmp[10];	C.pistab = tmp[11];
+		C.pistbb = tmp[12];	C.pistar = tmp[13];	C.pistbr = tmp[14];
+		C.pistat = tmp[15];	C.pistbt = tmp[16];	C.indl = (int)tmp[17];
+		C.indb = (int)tmp[18];	C.indr = (int)tmp[19];	C.indt = (int)tmp[20];
+		C.iopt = (int)tmp[21];
 		params_in_input = TRUE;
 	}
 	if(n_arg_no_char == 6) {		/* A maregraph vector was given as the sixth argument*/
 		tmp = mxGetPr(prhs[5]);
 		n_mareg = mxGetM(prhs[5]);
-		dx = head[7];		dy = head[8];
+		C.dx = head[7];		C.dy = head[8];
 		lcum_p = (int *) mxCalloc ((size_t)(n_mareg), sizeof(int));
 		for (i = 0; i < n_mareg; i++) {
 			x = tmp[i];		y = tmp[i+n_mareg];	/* Matlab vectors are stored by columns */
-			lcum_p[i] = (irint((y - hdr_b.y_min) / dy) ) * hdr_b.nx + irint((x - hdr_b.x_min) / dx);
+			lcum_p[i] = (irint((y - hdr_b.y_min) / C.dy) ) * hdr_b.nx + irint((x - hdr_b.x_min) / C.dx);
 		}
 		maregs_in_input = TRUE;
 		cumpt = TRUE;
@@ -354,7 +370,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 	if (error) return;
 
 	if (!params_in_input) 		/* If params where not given, read them from file */
-		read_params(params);
+		read_params(params, &C);
 
 	if (!bat_in_input) {			/* If bathymetry & source where not given as arguments, load them */
 		r_bin_b = read_grd_info_ascii (bathy, &hdr_b);	/* Para saber como alocar a memoria */
@@ -391,21 +407,21 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 	if (out_velocity && (out_sww || out_most)) out_velocity = FALSE;
 
 	/* dminx and dminy must be in minutes, but dx and dy in meters */
-	if (polar == 0) m_per_deg = 1.;
+	if (C.polar == 0) m_per_deg = 1.;
 	dminx = (hdr_b.x_max - hdr_b.x_min) / (hdr_b.nx - 1) * 60.;
 	dminy = (hdr_b.y_max - hdr_b.y_min) / (hdr_b.ny - 1) * 60.;
-	dx = (hdr_b.x_max - hdr_b.x_min) / (hdr_b.nx - 1) * m_per_deg;
-	dy = (hdr_b.y_max - hdr_b.y_min) / (hdr_b.ny - 1) * m_per_deg;
+	C.dx = (hdr_b.x_max - hdr_b.x_min) / (hdr_b.nx - 1) * m_per_deg;
+	C.dy = (hdr_b.y_max - hdr_b.y_min) / (hdr_b.ny - 1) * m_per_deg;
 	x_min = hdr_b.x_min;		y_min = hdr_b.y_min;
-	ip2 = hdr_b.nx;	jp2 = hdr_b.ny;
-	ip = ip2 - 2;	jp = jp2 - 2;	/* in original fortran version ip2 = ip + 2 */
-	ip1 = ip + 1;	jp1 = jp + 1;
-	ncl = ip2 * jp2;
+	C.ip2 = hdr_b.nx;	C.jp2 = hdr_b.ny;
+	C.ip = C.ip2 - 2;	C.jp = C.jp2 - 2;	/* in original fortran version ip2 = ip + 2 */
+	C.ip1 = C.ip + 1;	C.jp1 = C.jp + 1;
+	ncl = C.ip2 * C.jp2;
 	if (cumpt && !maregs_in_input)
 		n_mareg = count_n_maregs(maregs);	/* Count maragraphs number */
 
 	if (cumpt) {
-		n_ptmar = n_of_cycles / cumint + 1;
+		n_ptmar = n_of_cycles / C.cumint + 1;
 		if ((fp = fopen (hcum, "w")) == NULL) {
 			mexPrintf ("%s: Unable to create file %s - exiting\n", "swan", hcum);
 			return;
@@ -417,38 +433,40 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 		if ((inicial = (double *) mxMalloc ((size_t)(ncl) * sizeof(double)) ) == NULL) 
 			{no_sys_mem("swan --> (inicial)", ncl);	return;}
 	}
-	if ((dep = (double *) mxCalloc ((size_t)(ncl),	sizeof(double)) ) == NULL) 
+	if ((dep = (real *) mxCalloc ((size_t)(ncl),	sizeof(real)) ) == NULL) 
 		{no_sys_mem("swan --> (dep)", ncl);	return;}
 	if ((work = (float *) mxCalloc ((size_t)(ncl),	sizeof(float)) ) == NULL) 
 		{no_sys_mem("swan --> (work)", ncl);	return;}
-	if ((r = (double *) mxCalloc ((size_t)(ncl),	sizeof(double)) ) == NULL) 
+	if ((r = (real *) mxCalloc ((size_t)(ncl),	sizeof(real)) ) == NULL) 
 		{no_sys_mem("swan --> (r)", ncl);	return;}
-	if ((rn = (double *) mxCalloc ((size_t)(ncl),	sizeof(double)) ) == NULL) 
+	if ((rn = (real *) mxCalloc ((size_t)(ncl),	sizeof(real)) ) == NULL) 
 		{no_sys_mem("swan --> (rn)", ncl);	return;}
-	if ((u = (double *) mxCalloc ((size_t)(ncl),	sizeof(double)) ) == NULL) 
+	if ((u = (real *) mxCalloc ((size_t)(ncl),	sizeof(real)) ) == NULL) 
 		{no_sys_mem("swan --> (u)", ncl);	return;}
-	if ((un = (double *) mxCalloc ((size_t)(ncl),	sizeof(double)) ) == NULL) 
+	if ((un = (real *) mxCalloc ((size_t)(ncl),	sizeof(real)) ) == NULL) 
 		{no_sys_mem("swan --> (un)", ncl);	return;}
-	if ((v = (double *) mxCalloc ((size_t)(ncl),	sizeof(double)) ) == NULL) 
+	if ((v = (real *) mxCalloc ((size_t)(ncl),	sizeof(real)) ) == NULL) 
 		{no_sys_mem("swan --> (v)", ncl);	return;}
-	if ((vn = (double *) mxCalloc ((size_t)(ncl),	sizeof(double)) ) == NULL) 
+	if ((vn = (real *) mxCalloc ((size_t)(ncl),	sizeof(real)) ) == NULL) 
 		{no_sys_mem("swan --> (vn)", ncl);	return;}
-	if ((h = (double *) mxCalloc ((size_t)(ncl),	sizeof(double)) ) == NULL) 
+	if ((h = (real *) mxCalloc ((size_t)(ncl),	sizeof(real)) ) == NULL) 
 		{no_sys_mem("swan --> (h)", ncl);	return;}
-	if ((hn = (double *) mxCalloc ((size_t)(ncl),	sizeof(double)) ) == NULL) 
+	if ((hn = (real *) mxCalloc ((size_t)(ncl),	sizeof(real)) ) == NULL) 
 		{no_sys_mem("swan --> (hn)", ncl);	return;}
 	if ((dxp = (double *) mxCalloc ((size_t)(ncl+1),	sizeof(double)) ) == NULL) 
 		{no_sys_mem("swan --> (dxp)", ncl);	return;}
-	if ((anglt = (double *) mxCalloc ((size_t)(jp2),	sizeof(double)) ) == NULL) 
-		{no_sys_mem("swan --> (anglt)", jp2);	return;}
+	if ((C.anglt = (double *) mxCalloc ((size_t)(C.jp2),	sizeof(double)) ) == NULL) 
+		{no_sys_mem("swan --> (anglt)", C.jp2);	return;}
+	if ((C.wet_last = (int *) mxCalloc ((size_t)(C.jp2),	sizeof(int)) ) == NULL)
+		{no_sys_mem("swan --> (wet_last)", C.jp2);	return;}
 	/*if (polar != 0) {
 		if ((xpp = (double *) mxCalloc ((size_t)(ncl+1), sizeof(double)) ) == NULL) 
 			{no_sys_mem("swan --> (xpp)", ncl);	return;}
 	} */
 	if (max_level) {
-		if ((h_bak = (double *) mxCalloc ((size_t)(ncl), sizeof(double)) ) == NULL) 
+		if ((h_bak = (real *) mxCalloc ((size_t)(ncl), sizeof(real)) ) == NULL) 
 			{no_sys_mem("swan --> (h_bak)", ncl);	return;}
-		if ((zm = (double *) mxCalloc ((size_t)(ncl), sizeof(double)) ) == NULL) 
+		if ((zm = (real *) mxCalloc ((size_t)(ncl), sizeof(real)) ) == NULL) 
 			{no_sys_mem("swan --> (zm)", ncl);	return;}
 	}
 	if (cumpt && !maregs_in_input) {
@@ -466,12 +484,16 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 			{no_sys_mem("swan --> (time_p)", n_ptmar);	return;}
 	}
 
-	if (cumpt && !maregs_in_input) read_maregs(maregs);	/* Read maregraph locations */
+	if (cumpt && !maregs_in_input) read_maregs(maregs, &hdr_b, lcum_p);	/* Read maregraph locations */
 	if (!bat_in_input) {			/* If bathymetry & source where not given as arguments, load them */
+		if ((dep1 = (double *) mxMalloc ((size_t)(ncl) * sizeof(double)) ) == NULL)
+			{no_sys_mem("swan --> (dep1)", ncl);	return;}
 		if (!r_bin_b)					/* Read bathymetry */
-			read_grd_ascii (bathy, &hdr_b, dep);
+			read_grd_ascii (bathy, &hdr_b, dep1);
 		else
-			read_grd_bin (bathy, &hdr_b, dep);
+			read_grd_bin (bathy, &hdr_b, dep1);
+		for (i = 0; i < ncl; i++) dep[i] = (real)dep1[i];
+		mxFree ((void *) dep1);
 		if (r_bin_b)					/* Read source */
 			read_grd_bin (fonte, &hdr_f, inicial);
 		else
@@ -507,28 +529,28 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 		mexPrintf("%.4f\t%.4f\t%.4f\t%.4f\t%.1f\n",x,y,x_tmp,y_tmp,-dep[lcum_p[i]]);
 	}*/
 
-	dangx = dminx / 60.;	dangy = dminy / 60.;
+	C.dangx = dminx / 60.;	C.dangy = dminy / 60.;
 	/*     Polar option (If Polar is 2 then MERCATOR)*/
-	if (polar != 0) {
-		anglt[0] = y_min;
-		for (i = 0; i < jp1; i++) {
-			if (polar > 0) anglt[i+1] = anglt[i] + dangy;
-			if (polar < 0) anglt[i+1] = anglt[i] - dangy;
-			if (polar < 0 && anglt[i+1] < 0.) {
-				polar = 1;
-				anglt[i+1] = anglt[i] + dangy;
+	if (C.polar != 0) {
+		C.anglt[0] = y_min;
+		for (i = 0; i < C.jp1; i++) {
+			if (C.polar > 0) C.anglt[i+1] = C.anglt[i] + C.dangy;
+			if (C.polar < 0) C.anglt[i+1] = C.anglt[i] - C.dangy;
+			if (C.polar < 0 && C.anglt[i+1] < 0.) {
+				C.polar = 1;
+				C.anglt[i+1] = C.anglt[i] + C.dangy;
 			}
 			else {
-				angltt = anglt[i] * D2R;
+				angltt = C.anglt[i] * D2R;
 				cang = cos(angltt);
-				if (polar == 2) anglt[i+1] = anglt[i] + dangy * cang;
+				if (C.polar == 2) C.anglt[i+1] = C.anglt[i] + C.dangy * cang;
 			}
 		}
 		/*    make dxp array */
-		for (j = i = 0; j < jp2; j++) {
-			cang = cos(anglt[j] * D2R);
-			for (k = 0; k < ip2; k++) {
-				dxp[i+1] = dangx * m_per_deg * cang;
+		for (j = i = 0; j < C.jp2; j++) {
+			cang = cos(C.anglt[j] * D2R);
+			for (k = 0; k < C.ip2; k++) {
+				dxp[i+1] = C.dangx * m_per_deg * cang;
 				/*xpp[i+1] = xpp[i] + dxp[i+1];*/
 				i++;
 			}
@@ -539,31 +561,32 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 	}
 	else {
 		for (i = 0; i < ncl; i++)
-			dxp[i] = dx;		/* Do not set if polar */
+			dxp[i] = C.dx;		/* Do not set if polar */
 	}
 
-	if ( cc != 0.) {
+	if ( C.cc != 0.) {
 		if ((cca = (double *) mxCalloc ((size_t)(ncl),	sizeof(double)) ) == NULL) 
 			{no_sys_mem("swan --> (cca)", ncl);	return;}
 		for (i = 0; i < ncl; i++)
-			cca[i] = cc;
+			cca[i] = C.cc;
 	}
 
-	dtx = (polar == 0) ? dx : dangx;	/* If polar == 0 dx and dy are already in meters */
-	dty = (polar == 0) ? dy : dangy;	/* like they must be. Otherwise, they are in degrees */
-	lcum = 0;	cycle = 1;	time_h = 0.;
+	dtx = (C.polar == 0) ? C.dx : C.dangx;	/* If polar == 0 dx and dy are already in meters */
+	dty = (C.polar == 0) ? C.dy : C.dangy;	/* like they must be. Otherwise, they are in degrees */
+	lcum = 0;	cycle = 1;	C.time_h = 0.;
+	C.m_per_deg = m_per_deg;
 
 	/* ---------------- Declarations for the (if) movie option ------------------ */
 	if (movie && movie_char) {
 		mov_8 = mxCalloc(ncl, sizeof(char));
 		mov_8_tmp = mxCalloc(ncl, sizeof(char));
-		dims[0] = ny;	dims[1] = nx;	dims[2] = (int)(n_of_cycles / grn + 2);
+		dims[0] = ny;	dims[1] = nx;	dims[2] = (int)(n_of_cycles / C.grn + 2);
 		plhs[0] = mxCreateNumericArray(3, dims, mxUINT8_CLASS, mxREAL);
 		ptr_mov_8 = (unsigned char *)mxGetData(plhs[0]);
 	}
 	else if (movie && movie_float) {
 		mov_32 = (float *)mxCalloc(ncl, sizeof(float));
-		dims[0] = ny;	dims[1] = nx;	dims[2] = (int)(n_of_cycles / grn + 2);
+		dims[0] = ny;	dims[1] = nx;	dims[2] = (int)(n_of_cycles / C.grn + 2);
 		plhs[0] = mxCreateNumericArray(3, dims, mxSINGLE_CLASS, mxREAL);
 		ptr_mov_32 = (float *)mxGetData(plhs[0]);
 	}
@@ -571,8 +594,8 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 	/* ----------------- Compute vars to use if write grids --------------------- */
 	if (!got_R && (write_grids || out_velocity || out_momentum || out_sww || out_most) ) {	
 		/* Write grids over the whole region */
-		i_start = 0;		i_end = ip2;
-		j_start = 0;		j_end = jp2;
+		i_start = 0;		i_end = C.ip2;
+		j_start = 0;		j_end = C.jp2;
 		xMinOut = x_min;	yMinOut = y_min;
 	}
 	else if (got_R && (write_grids || out_velocity || out_momentum || out_sww || out_most) ) {	
@@ -588,7 +611,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
 	if (out_sww) {
 		/* ----------------- Open a ANUGA netCDF file for writing --------------- */
-		ncid = open_anuga_sww (fname_sww, ids, i_start, j_start, i_end, j_end, ip2,
+		ncid = open_anuga_sww (fname_sww, ids, i_start, j_start, i_end, j_end, C.ip2,
 		dtx, dty, dep, xMinOut, yMinOut, (float)hdr_b.z_min, (float)hdr_b.z_max);
 		if (ncid == -1)
 			mexErrMsgTxt ("SWAN: failure to create ANUGA SWW file.\n");
@@ -631,21 +654,21 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 		if (cycle % 10 == 0)
 			mexPrintf("SWAN: Computed %.2d %%\r",(int)((double)k/(double)n_of_cycles * 100));
 
-		uvh_(dep, r, rn, u, un, v, vn, h, hn, dxp, cca, m_per_deg);
+		uvh_(&C, dep, r, rn, u, un, v, vn, h, hn, dxp, cca);
 
 		if (max_level) {
-			change(h, h_bak);	max_z(zm, h_bak);
+			change(h, h_bak, ncl);	max_z(zm, h_bak, ncl);
 		}
 		if (cumpt) {			/* Want time series at maregraph positions */
-			if (cycle % cumint == 0) {	/* Save heights at cumint intervals */
+			if (cycle % C.cumint == 0) {	/* Save heights at cumint intervals */
 				for (i = 0; i < n_mareg; i++) {
 					cum_p[ijc(lcum,i)] = h[lcum_p[i]-1];
-					time_p[lcum] = (float)time_h;
+					time_p[lcum] = (float)C.time_h;
 				}
 				lcum++;
 			}
 		}
-		if ( time_h > time_jump && ( (k % grn) == 0 || k == n_of_cycles - 1) ) {
+		if ( C.time_h > time_jump && ( (k % C.grn) == 0 || k == n_of_cycles - 1) ) {
 			if (surf_level) {
 				for (i = 0; i < ncl; i++)
 					work[i] = (float) h[i];
@@ -688,29 +711,29 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 			}
 			if (write_grids) {
 				if (stem[0] == 0)
-					sprintf (prenome,"%.5d.grd\0", irint(time_h) );
+					sprintf (prenome,"%.5d.grd\0", irint(C.time_h) );
 				else
-					sprintf (prenome, "%s%.5d.grd", stem, irint(time_h) );
-				write_grd_bin( prenome, xMinOut, yMinOut, dtx, dty, i_start, j_start, i_end, j_end, ip2, work);
+					sprintf (prenome, "%s%.5d.grd", stem, irint(C.time_h) );
+				write_grd_bin( prenome, xMinOut, yMinOut, dtx, dty, i_start, j_start, i_end, j_end, C.ip2, work);
 			}
 			if (out_velocity) {
 				if (stem[0] == 0)
-					sprintf (prenome,"%.5d\0", irint(time_h) );
+					sprintf (prenome,"%.5d\0", irint(C.time_h) );
 				else
-					sprintf (prenome, "%s%.5d", stem, irint(time_h) );
+					sprintf (prenome, "%s%.5d", stem, irint(C.time_h) );
 				for (i = 0; i < ncl; i++) work[i] = (float) u[i];
 				write_grd_bin(strcat(prenome,"_U.grd"), xMinOut, yMinOut, dtx, dty, 
-						i_start, j_start, i_end, j_end, ip2, work);
+						i_start, j_start, i_end, j_end, C.ip2, work);
 				for (i = 0; i < ncl; i++) work[i] = (float) v[i];
 				prenome[strlen(prenome) - 6] = '\0';	/* Remove the _U.grd' so that we can add '_V.grd' */
 				write_grd_bin( strcat(prenome,"_V.grd"), xMinOut, yMinOut, dtx, dty, 
-						i_start, j_start, i_end, j_end, ip2, work);
+						i_start, j_start, i_end, j_end, C.ip2, work);
 			}
 			if (out_momentum) {
 				if (stem[0] == 0)
-					sprintf (prenome,"%.5d\0", irint(time_h) );
+					sprintf (prenome,"%.5d\0", irint(C.time_h) );
 				else
-					sprintf (prenome, "%s%.5d", stem, irint(time_h) );
+					sprintf (prenome, "%s%.5d", stem, irint(C.time_h) );
 
 				if (water_depth)	/* "work" is already the water depth */ 
 					for (i = 0; i < ncl; i++) work[i] = (float) (u[i] * work[i]);
@@ -721,7 +744,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 					}
 
 				write_grd_bin( strcat(prenome,"_Uh.grd"), xMinOut, yMinOut, dtx, dty, 
-						i_start, j_start, i_end, j_end, ip2, work);
+						i_start, j_start, i_end, j_end, C.ip2, work);
 
 				if (water_depth)
 					for (i = 0; i < ncl; i++) work[i] = (float) (v[i] * work[i]);
@@ -733,22 +756,22 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
 				prenome[strlen(prenome) - 7] = '\0';	/* Remove the _Uh.grd' so that we can add '_Vh.grd' */
 				write_grd_bin( strcat(prenome,"_Vh.grd"), xMinOut, yMinOut, dtx, dty, 
-						i_start, j_start, i_end, j_end, ip2, work);
+						i_start, j_start, i_end, j_end, C.ip2, work);
 			}
 
 			if (out_sww) {
 				if (first_anuga_time) {
-					time0 = time_h;
+					time0 = C.time_h;
 					first_anuga_time = FALSE;
 				}
-				time_for_anuga = time_h - time0;	/* I think ANUGA wants time starting at zero */
+				time_for_anuga = C.time_h - time0;	/* I think ANUGA wants time starting at zero */
 				err_trap (nc_put_vara_double (ncid, ids[6], &start0, &count0, &time_for_anuga));
 
-				write_anuga_slice(ncid, ids[7], i_start, j_start, i_end, j_end, ip2, work,
+				write_anuga_slice(ncid, ids[7], i_start, j_start, i_end, j_end, C.ip2, work,
 						h, dep, u, v, tmp_slice, start1_A, count1_A, stage_range, 1, with_land);
-				write_anuga_slice(ncid, ids[9], i_start, j_start, i_end, j_end, ip2, work,
+				write_anuga_slice(ncid, ids[9], i_start, j_start, i_end, j_end, C.ip2, work,
 						h, dep, u, v, tmp_slice, start1_A, count1_A, xmom_range, 2, with_land);
-				write_anuga_slice(ncid, ids[11],i_start, j_start, i_end, j_end, ip2, work,
+				write_anuga_slice(ncid, ids[11],i_start, j_start, i_end, j_end, C.ip2, work,
 						h, dep, u, v, tmp_slice, start1_A, count1_A, ymom_range, 3, with_land);
 
 				start1_A[0]++;		/* Increment for the next slice */
@@ -756,18 +779,18 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
 			if (out_most) {
 				/* Here we'll use the start0 computed above */
-				err_trap (nc_put_vara_double (ncid_most[0], ids_ha[4], &start0, &count0, &time_h));
-				err_trap (nc_put_vara_double (ncid_most[1], ids_ua[4], &start0, &count0, &time_h));
-				err_trap (nc_put_vara_double (ncid_most[2], ids_va[4], &start0, &count0, &time_h));
+				err_trap (nc_put_vara_double (ncid_most[0], ids_ha[4], &start0, &count0, &C.time_h));
+				err_trap (nc_put_vara_double (ncid_most[1], ids_ua[4], &start0, &count0, &C.time_h));
+				err_trap (nc_put_vara_double (ncid_most[2], ids_va[4], &start0, &count0, &C.time_h));
 
-				write_most_slice(ncid_most, ids_most, i_start, j_start, i_end, j_end, ip2, 
+				write_most_slice(ncid_most, ids_most, i_start, j_start, i_end, j_end, C.ip2, 
 					work, h, dep, u, v, tmp_slice, start1_M, count1_M);
 				start1_M[0]++;		/* Increment for the next slice */
 			}
 
 			start0++;			/* Only used with netCDF formats */
 		}
-		time_h += dt;
+		C.time_h += C.dt;
 		cycle++;
 	}
 
@@ -808,14 +831,14 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 	mxFree ((void *) work);	mxFree ((void *) dep);	mxFree ((void *) r);
 	mxFree ((void *) h);	mxFree ((void *) rn);	mxFree ((void *) u);
 	mxFree ((void *) un);	mxFree ((void *) vn);	mxFree ((void *) hn);
-	mxFree ((void *) dxp);	mxFree ((void *) anglt);
+	mxFree ((void *) dxp);	mxFree ((void *) C.anglt);	mxFree ((void *) C.wet_last);
 	if (max_level) {
 		mxFree ((void *) zm);	mxFree ((void *) h_bak); 
 	}
 	if (cumpt) {
 		mxFree ((void *) lcum_p);	mxFree((void *) cum_p);	mxFree ((void *) time_p);	 
 	}
-	if (cc != 0.) mxFree ((void *) cca);
+	if (C.cc != 0.) mxFree ((void *) cca);
 }
 
 /* --------------------------------------------------------------------------- */
@@ -825,10 +848,14 @@ void err_trap(int status) {
 }
 
 /* --------------------------------------------------------------------------- */
-int bndy_(double *dep, double *r, double *rn, double *u, double *un, double *v, double *vn,
-	  double *h, double *hn, double *dxp) {
-
-	double tmp, mul;
+int bndy_(struct swan_ctx *C, real *dep, real *r, real *rn, real *u, real *un, real *v, real *vn,
+	  real *h, real *hn, double *dxp) {
+
+	double tmp, mul, dx = C->dx, dy = C->dy, dt = C->dt, time_h = C->time_h;
+	double pistal = C->pistal, pistbl = C->pistbl, pistab = C->pistab, pistbb = C->pistbb;
+	double pistar = C->pistar, pistbr = C->pistbr, pistat = C->pistat, pistbt = C->pistbt;
+	int ip = C->ip, jp = C->jp, ip1 = C->ip1, jp1 = C->jp1, ip2 = C->ip2, jp2 = C->jp2, polar = C->polar;
+	int indl = C->indl, indb = C->indb, indr = C->indr, indt = C->indt, iopt = C->iopt;
 	int i, j, ij_0j, ij_1j, ij_2j, ij_i0, ij_i1, ij_i2;
 	int ij_ip21_j, ij_ip11_j, ij_i_jp21, ij_i_jp11;
 
@@ -1002,15 +1029,25 @@ int bndy_(double *dep, double *r, double *rn, double *u, double *un, double *v,
 
 /* --------------------------------------------------------------------------- */
 
-int uvh_(double *dep, double *r, double *rn, double *u, double *un, double *v, double *vn,
-	 double *h, double *hn, double *dxp, double *cca, double m_per_deg) {
+int uvh_(struct swan_ctx *C, real *dep, real *r, real *rn, real *u, real *un, real *v, real *vn,
+	 real *h, real *hn, double *dxp, double *cca) {
 
-	double cang, ck, sa, sb, sang, cang1, tmp, thu, thv;
+	/* The (double) casts keep the sums in doubles when the state arrays are floats (SINGLE_PRECISION).
+	   Rows are independent, so each loop may be split among threads. The exception is the bottom
+	   stress (sb, sa) of the dry cells, which is the one of the last wet cell before them. That cell
+	   is searched before the momentum loop (wet_last) so that every row can start on its own. */
+	double cang, sa, sb, sang, cang1, thu, thv, dx, dy, cf;
 	double td, tu, tv, angltt, td1, tu1, tv1, tu2, tv2, dph;
-	int	i, j, ij_ij, i1_j, i_j1, im1_j, i_jm1;
+	double dt = C->dt, cc = C->cc, sfx = C->sfx, sfy = C->sfy, rough = C->rough;
+	double dangx = C->dangx, m_per_deg = C->m_per_deg;
+	int	i, j, ij_ij, i1_j, i_j1, im1_j, i_jm1, last;
+	int	ip1 = C->ip1, jp1 = C->jp1, ip2 = C->ip2, polar = C->polar, *wet_last = C->wet_last;
 
-	sb = 0.;	sa = 0.;
+#if HAVE_OPENMP
+#pragma omp parallel for private(i, ij_ij, i1_j, i_j1, im1_j, i_jm1, dx, dy, cang, cang1, td, td1, tv, tv1)
+#endif
 	for (j = 1; j < jp1; j++) {
+		dx = C->dx;	dy = C->dy;
 		for (i = 1; i < ip1; i++) {
 			ij_ij = ij(i,j);	i1_j = ij(i+1,j);	i_j1 = ij(i,j+1);
 			im1_j = ij(i-1,j);	i_jm1 = ij(i,j-1);
@@ -1022,42 +1059,74 @@ int uvh_(double *dep, double *r, double *rn, double *u, double *un, double *v, d
 			if (polar != 0) cang1 = dxp[i_j1] / (dangx * m_per_deg);
 			/*     donor cell difference */
 			/*     will get diffusion if time step is too small */
-			td1 = dep[i1_j] + h[i1_j] - r[i1_j];
-			td = dep[ij_ij] + h[ij_ij] - r[ij_ij];
-			tv1 = dep[i_j1] + h[i_j1] - r[i_j1];
+			td1 = (double)dep[i1_j] + h[i1_j] - r[i1_j];
+			td = (double)dep[ij_ij] + h[ij_ij] - r[ij_ij];
+			tv1 = (double)dep[i_j1] + h[i_j1] - r[i_j1];
 			tv = td;
 			if (u[i1_j] > 0.)
-				td1 = dep[ij_ij] + h[ij_ij] - r[ij_ij];
+				td1 = (double)dep[ij_ij] + h[ij_ij] - r[ij_ij];
 			if (u[ij_ij] > 0.)
-				td  = dep[im1_j] + h[im1_j] - r[im1_j];
+				td  = (double)dep[im1_j] + h[im1_j] - r[im1_j];
 			if (v[i_j1] > 0.)
-				tv1 = dep[ij_ij] + h[ij_ij] - r[ij_ij];
+				tv1 = (double)dep[ij_ij] + h[ij_ij] - r[ij_ij];
 			if (v[ij_ij] > 0.)
-				tv  = dep[i_jm1] + h[i_jm1] - r[i_jm1];
+				tv  = (double)dep[i_jm1] + h[i_jm1] - r[i_jm1];
 			/*      Special for Flooding */
 			if (td1 < 0.) td1 = 0.;	if (td < 0.) td = 0.;
 			if (tv1 < 0.) tv1 = 0.;	if (tv < 0.) tv = 0.;
 			hn[ij_ij] = h[ij_ij] - dt * ((u[i1_j] * td1 - u[ij_ij] * td) / 
 				dx + (v[i_j1] * cang1 * tv1 - v[ij_ij] * cang * tv) /
-				(cang * dy)) + (rn[ij_ij] - r[ij_ij]);
+				(cang * dy)) + ((double)rn[ij_ij] - r[ij_ij]);
 			/*    ROUGH is factor for surface roughness = actual height/ideal height */
 			if (rough != 1. && dep[ij_ij] < 0.) 
 				hn[ij_ij] *= rough;
 		}
 	}
 
+#if HAVE_OPENMP
+#pragma omp parallel for private(i, ij_ij)
+#endif
 	for (j = 1; j < jp1; j++)
 		for (i = 1; i < ip1; i++) {
 			ij_ij = ij(i,j); 
 			h[ij_ij] = hn[ij_ij];
 		}
 
-	bndy_(dep, r, rn, u, un, v, vn, h, hn, dxp);
+	bndy_(C, dep, r, rn, u, un, v, vn, h, hn, dxp);
+
+	if (cc != 0.) {		/* Last wet cell of each row (0 if none) ... */
+#if HAVE_OPENMP
+#pragma omp parallel for private(i, ij_ij)
+#endif
+		for (j = 1; j < jp1; j++) {
+			wet_last[j] = 0;
+			for (i = ip1 - 1; i > 0; i--) {
+				ij_ij = ij(i,j);
+				if ((double)dep[ij_ij] + h[ij_ij] > .1) {
+					wet_last[j] = ij_ij;
+					break;
+				}
+			}
+		}
+		for (j = 1, last = 0; j < jp1; j++) {	/* ... and of all rows before it */
+			ij_ij = wet_last[j];
+			wet_last[j] = last;
+			if (ij_ij) last = ij_ij;
+		}
+	}
 
+#if HAVE_OPENMP
+#pragma omp parallel for private(i, ij_ij, i1_j, i_j1, im1_j, i_jm1, angltt, sang, cf, dx, dy, dph, sa, sb, \
+	tu, tu1, tu2, tv, tv1, tv2, thu, thv)
+#endif
 	for (j = 1; j < jp1; j++) {
-		angltt = anglt[j] * D2R;
+		angltt = C->anglt[j] * D2R;
 		sang = sin(angltt);
-		if (polar != 0) cf = sang * 1.454e-4;
+		cf = (polar != 0) ? sang * 1.454e-4 : C->cf;
+		dx = C->dx;	dy = C->dy;
+		sb = 0.;	sa = 0.;
+		if (cc != 0. && wet_last[j])
+			bottom_stress(dep, u, v, h, cca, wet_last[j], &sb, &sa);
 		for (i = 1; i < ip1; i++) {
 			ij_ij = ij(i,j);	i1_j = ij(i+1,j);	i_j1 = ij(i,j+1);
 			im1_j = ij(i-1,j);	i_jm1 = ij(i,j-1);
@@ -1066,28 +1135,23 @@ int uvh_(double *dep, double *r, double *rn, double *u, double *un, double *v, d
 			if (polar == 2) dy = dxp[ij_ij];	/* MERCATOR */
 			if (cc == 0.) goto L10;
 			/*       Special for Flooding */
-			dph = dep[ij_ij] + h[ij_ij];
+			dph = (double)dep[ij_ij] + h[ij_ij];
 			if (dph <= .1) goto L10;
-			ck = cca[ij_ij];
-			tmp = d_sqrt(u[ij_ij]*u[ij_ij] + v[ij_ij]*v[ij_ij]) / 
-			      (ck * ck * (dep[ij_ij] + h[ij_ij]));
-			sb = 9.8 * u[ij_ij] * tmp;
-			/*      CORRECTED ll/20/87 */
-			sa = 9.8 * v[ij_ij] * tmp;
+			bottom_stress(dep, u, v, h, cca, ij_ij, &sb, &sa);
 L10:
-			tu1 = u[i1_j] - u[ij_ij];
-			tu2 = u[i_j1] - u[ij_ij];
-			tv = (v[ij_ij] + v[i_j1] + v[ij(i-1,j+1)] + v[im1_j]) * .25;
-			if (u[ij_ij] > 0.) tu1 = u[ij_ij] - u[im1_j];
-			if (tv > 0.) tu2 = u[ij_ij] - u[i_jm1];
-			thu = h[ij_ij] - h[im1_j];
-			tv1 = v[i1_j] - v[ij_ij];
-			tv2 = v[i_j1] - v[ij_ij];
-			tu = (u[ij_ij] + u[i1_j] + u[i_jm1] + u[ij(i+1,j-1)]) * .25;
-			if (tu > 0.) tv1 = v[ij_ij] - v[im1_j];
-			if (v[ij_ij] > 0.) tv2 = v[ij_ij] - v[i_jm1];
+			tu1 = (double)u[i1_j] - u[ij_ij];
+			tu2 = (double)u[i_j1] - u[ij_ij];
+			tv = ((double)v[ij_ij] + v[i_j1] + v[ij(i-1,j+1)] + v[im1_j]) * .25;
+			if (u[ij_ij] > 0.) tu1 = (double)u[ij_ij] - u[im1_j];
+			if (tv > 0.) tu2 = (double)u[ij_ij] - u[i_jm1];
+			thu = (double)h[ij_ij] - h[im1_j];
+			tv1 = (double)v[i1_j] - v[ij_ij];
+			tv2 = (double)v[i_j1] - v[ij_ij];
+			tu = ((double)u[ij_ij] + u[i1_j] + u[i_jm1] + u[ij(i+1,j-1)]) * .25;
+			if (tu > 0.) tv1 = (double)v[ij_ij] - v[im1_j];
+			if (v[ij_ij] > 0.) tv2 = (double)v[ij_ij] - v[i_jm1];
 			/*      CORRECTED ll/20/87 */
-			thv = h[ij_ij] - h[ij(i,j-1)];
+			thv = (double)h[ij_ij] - h[ij(i,j-1)];
 			un[ij_ij] = u[ij_ij] - dt * (u[ij_ij] * tu1 / dx + tv * tu2 / dy) - 9.8 * 
 				dt * thu / dx - dt * (sb - cf * v[ij_ij] - sfx);
 			vn[ij_ij] = v[ij_ij] - dt * (tu * tv1 / dx + v[ij_ij] * tv2 / dy) - 9.8 * 
@@ -1096,6 +1160,9 @@ L10:
 		}
 	}
 
+#if HAVE_OPENMP
+#pragma omp parallel for private(i, ij_ij)
+#endif
 	for (j = 1; j < jp1; j++) {
 		for (i = 1; i < ip1; i++) {
 			ij_ij = ij(i,j);
@@ -1112,6 +1179,19 @@ L10:
 	return 0;
 }
 
+/* --------------------------------------------------------------------------- */
+void bottom_stress(real *dep, real *u, real *v, real *h, double *cca, int ij, double *sb, double *sa) {
+	/* de Chezy bottom stress of cell ij */
+	double ck, tmp;
+
+	ck = cca[ij];
+	tmp = d_sqrt((double)u[ij]*u[ij] + (double)v[ij]*v[ij]) /
+	      (ck * ck * ((double)dep[ij] + h[ij]));
+	*sb = 9.8 * u[ij] * tmp;
+	/*      CORRECTED ll/20/87 */
+	*sa = 9.8 * v[ij] * tmp;
+}
+
 
 /* --------------------------------------------------------------------------- */
 int write_grd_bin(char *name, double x_min, double y_min, double x_inc, double y_inc,
@@ -1285,7 +1365,7 @@ int read_grd_bin (char *file, struct srf_header *hdr, double *work) {
 }
 
 /* -------------------------------------------------------------------- */
-int read_params(char *file) {
+int read_params(char *file, struct swan_ctx *C) {
 	/* Read parameters that controls SWAN running */
 	char line[128];
 	FILE *fp;
@@ -1297,50 +1377,50 @@ int read_params(char *file) {
 
 	fgets (line, 128, fp);		/* Comment */
 	fgets (line, 128, fp);
-	sscanf (line, "%lf", &dt);
+	sscanf (line, "%lf", &C->dt);
 	fgets (line, 128, fp);
-	sscanf (line, "%d", &grn);
+	sscanf (line, "%d", &C->grn);
 	fgets (line, 128, fp);
-	sscanf (line, "%lf", &cf);
+	sscanf (line, "%lf", &C->cf);
 	fgets (line, 128, fp);
-	sscanf (line, "%lf", &cc);
+	sscanf (line, "%lf", &C->cc);
 	fgets (line, 128, fp);
-	sscanf (line, "%lf", &sfx);
+	sscanf (line, "%lf", &C->sfx);
 	fgets (line, 128, fp);
-	sscanf (line, "%lf", &sfy);
+	sscanf (line, "%lf", &C->sfy);
 	fgets (line, 128, fp);
-	sscanf (line, "%d", &polar);
+	sscanf (line, "%d", &C->polar);
 	fgets (line, 128, fp);
-	sscanf (line, "%lf", &rough);
+	sscanf (line, "%lf", &C->rough);
 	fgets (line, 128, fp);
-	sscanf (line, "%d", &cumint);
+	sscanf (line, "%d", &C->cumint);
 	fgets (line, 128, fp);
-	sscanf (line, "%lf", &pistal);
+	sscanf (line, "%lf", &C->pistal);
 	fgets (line, 128, fp);
-	sscanf (line, "%lf", &pistbl);
+	sscanf (line, "%lf", &C->pistbl);
 	fgets (line, 128, fp);
-	sscanf (line, "%lf", &pistab);
+	sscanf (line, "%lf", &C->pistab);
 	fgets (line, 128, fp);
-	sscanf (line, "%lf", &pistbb);
+	sscanf (line, "%lf", &C->pistbb);
 	fgets (line, 128, fp);
-	sscanf (line, "%lf", &pistar);
+	sscanf (line, "%lf", &C->pistar);
 	fgets (line, 128, fp);
-	sscanf (line, "%lf", &pistbr);
+	sscanf (line, "%lf", &C->pistbr);
 	fgets (line, 128, fp);
-	sscanf (line, "%lf", &pistat);
+	sscanf (line, "%lf", &C->pistat);
 	fgets (line, 128, fp);
-	sscanf (line, "%lf", &pistbt);
+	sscanf (line, "%lf", &C->pistbt);
 	fgets (line, 128, fp);		/* Comment */
 	fgets (line, 128, fp);
-	sscanf (line, "%d", &indl);
+	sscanf (line, "%d", &C->indl);
 	fgets (line, 128, fp);
-	sscanf (line, "%d", &indb);
+	sscanf (line, "%d", &C->indb);
 	fgets (line, 128, fp);
-	sscanf (line, "%d", &indr);
+	sscanf (line, "%d", &C->indr);
 	fgets (line, 128, fp);
-	sscanf (line, "%d", &indt);
+	sscanf (line, "%d", &C->indt);
 	fgets (line, 128, fp);
-	sscanf (line, "%d", &iopt);
+	sscanf (line, "%d", &C->iopt);
 	fclose (fp);
 	return (0);
 }
@@ -1365,15 +1445,15 @@ int count_n_maregs(char *file) {
 }
 
 /* -------------------------------------------------------------------- */
-int read_maregs(char *file) {
+int read_maregs(char *file, struct srf_header *hdr, int *lcum_p) {
 	/* Read maregraph positions and convert them to vector indices */
 	int	i = 0, ix, jy;
 	double	x, y, dx, dy;
 	char	line[512];
 	FILE	*fp;
 
-	dx = (hdr_b.x_max - hdr_b.x_min) / (hdr_b.nx - 1);
-	dy = (hdr_b.y_max - hdr_b.y_min) / (hdr_b.ny - 1);
+	dx = (hdr->x_max - hdr->x_min) / (hdr->nx - 1);
+	dy = (hdr->y_max - hdr->y_min) / (hdr->ny - 1);
 	if ((fp = fopen (file, "r")) == NULL) {
 		mexPrintf ("%s: Unable to open file %s - exiting\n", "swan", file);
 		return (-1);
@@ -1382,9 +1462,9 @@ int read_maregs(char *file) {
 	while (fgets (line, 512, fp) != NULL) {
 		if (line[0] == '#') continue;	/* Jump comment lines */
 		sscanf (line, "%f %f", &x, &y);
-		ix = irint((x - hdr_b.x_min) / dx);
-		jy = irint((y - hdr_b.y_min) / dy); 
-		lcum_p[i] = jy * ip2 + ix; 
+		ix = irint((x - hdr->x_min) / dx);
+		jy = irint((y - hdr->y_min) / dy); 
+		lcum_p[i] = jy * hdr->nx + ix; 
 		i++;
 	}
 	fclose (fp);
@@ -1397,20 +1477,18 @@ void	no_sys_mem (char *where, int n) {
 }
 
 /*     ********* CHECK OF MAXIMUM VALUE *********** */
-void max_z (double *zm, double *h_bak) {
-	int i, ij;
+void max_z (real *zm, real *h_bak, int n) {
+	int i;
 
-	ij = ip2 * jp2;
-	for (i = 0; i < ij; i++)
+	for (i = 0; i < n; i++)
 		if(zm[i] < h_bak[i]) zm[i] = h_bak[i];
 }
 
 /* -------------------------------------------------------------------- */
-void change (double *h, double *h_bak) {
-	int i, ij;
+void change (real *h, real *h_bak, int n) {
+	int i;
 
-	ij = ip2 * jp2;
-	for (i = 0; i < ij; i++)
+	for (i = 0; i < n; i++)
 		h_bak[i] = h[i];
 }
 
@@ -1553,7 +1631,7 @@ int open_most_nc (char *base, char *name_var, int *ids, int nx, int ny,
 
 /* --------------------------------------------------------------------------- */
 void write_most_slice(int *ncid_most, int *ids_most, int i_start, int j_start, int i_end, int j_end,
-		int nX, float *work, double *h, double *dep, double *u, double *v, float *tmp,
+		int nX, float *work, real *h, real *dep, real *u, real *v, float *tmp,
 		size_t *start, size_t *count) {
 	/* Write a slice of _ha.nc, _va.nc & _ua.nc MOST netCDF files */
 	int i, j, n, ij, k;
@@ -1588,7 +1666,7 @@ void write_most_slice(int *ncid_most, int *ids_most, int i_start, int j_start, i
 
 /* --------------------------------------------------------------------------- */
 void write_anuga_slice(int ncid, int z_id, int i_start, int j_start, int i_end, int j_end, int nX, 
-		float *work, double *h, double *dep, double *u, double *v, float *tmp,
+		float *work, real *h, real *dep, real *u, real *v, float *tmp,
 		size_t *start, size_t *count, float *slice_range, int idx, int with_land) {
 	/* Write a slice of either STAGE, XMOMENTUM or YMOMENTUM of a Anuga's .sww netCDF file */
 	int i, j, ij, k, ncl;
@@ -1635,7 +1713,7 @@ void write_anuga_slice(int ncid, int z_id, int i_start, int j_start, int i_end,
 
 /* -------------------------------------------------------------------- */
 int open_anuga_sww (char *fname_sww, int *ids, int i_start, int j_start, int i_end, int j_end, 
-		int nX, double dtx, double dty, double *dep, double xMinOut, double yMinOut, 
+		int nX, double dtx, double dty, real *dep, double xMinOut, double yMinOut, 
 		float z_min, float z_max) {
 
 	/* Open and initialize a ANUGA netCDF file for writing ---------------- */
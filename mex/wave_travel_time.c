@@ -26,12 +26,21 @@
  * Author:      Joaquim Luis
  * Date:        18-Feb-2003
  * Updated:	12-Mar-2011	
+ *		17-Oct-2026	-D option. Dijkstra front propagation on a 16 neighbors stencil. Each node is
+ *				finalized once (N log N). Several sources (t_loc with N rows) are computed
+ *				concurrently when compiled with -DHAVE_OPENMP (plus /Qopenmp or -fopenmp).
+ *				-M option. Earliest arrival from any of the sources in one single propagation (+ which
+ *				source it comes from). Optional r_loc receivers return only a N x M table of times.
  *
  * */
 
 #include "mex.h"
 #include <float.h>
 #include <math.h>	/* No f.. idea why it must be included to compile on OSX */
+#include <string.h>
+#if HAVE_OPENMP
+#include <omp.h>
+#endif
 
 /* Macro definition ij_data(i,j) finds the array index to an element
         containing the real data(i,j) in the padded complex array:  */
@@ -68,6 +77,26 @@ struct HEADER h;
 
 int     *rim, *rim1, *rim2, *rim8, *rim16, nx, ny;	/* Still uglly but will stay till a future revision */
 
+struct TT_GRID {		/* What the Dijkstra engine needs. Read only, so shared by all the sources */
+	int	nx, ny;
+	double	*speed;			/* Wave speed (m/s), 0 on land. Row 0 is the north one */
+	double	*dist;			/* Length (m) of the 16 stencil steps starting at each row (ny x 16) */
+	char	*rcv;			/* If not NULL, 1 on the receiver nodes. Stop once they are all final */
+	int	n_rcv;			/* Number of (different) receiver nodes */
+};
+
+struct TT_WORK {		/* Workspace of one source (i.e. of one thread) */
+	double	*tt;			/* Travel time (s) */
+	int	*heap;			/* Binary min heap of the front nodes, keyed by tt */
+	int	*pos;			/* Position of each node in heap. -1 not reached yet, -2 finalized */
+	int	*from;			/* If not NULL, index of the source that reached each node first */
+	int	n_heap;
+};
+
+/* The 16 neighbors stencil. The 8 first ones are the nearest neighbors, the others are the knight moves */
+static const int st_di[16] = {1, -1, 0, 0, 1, 1, -1, -1, 1, 1, -1, -1, 2, 2, -2, -2};
+static const int st_dj[16] = {0, 0, 1, -1, 1, -1, 1, -1, 2, -2, 2, -2, 1, -1, 1, -1};
+
 int	find_rim_points (double *Z, int i0, int j0, int k);
 int	check_in (int i, int j);
 void	n_to_ij (int n, int *i, int *j);
@@ -75,6 +104,11 @@ void	set_travel_time (double *Z, double *TT, int i0, int j0, int cp, int geo, in
 void	do_travel_time (double *Z, double *TT, int i_s, int j_s, double t0, int max_range, int ndatac, int geo);
 void	bat_to_speed(double *z_8, int ndatac);
 double	arc_dist (int i0, int j0, int ic, int jc, int geo);
+void	set_step_lengths (struct TT_GRID *G, struct HEADER *hdr, int geo);
+void	dijkstra_travel_time (struct TT_GRID *G, struct TT_WORK *W, int *src, int n_src);
+int	step_is_wet (struct TT_GRID *G, int i, int j, int k);
+void	heap_up (struct TT_WORK *W, int k);
+void	heap_down (struct TT_WORK *W, int k);
 
 /* Matlab Gateway routine */
 
@@ -83,21 +117,63 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 	int	error = FALSE, stop = FALSE, fill_voids = TRUE;
 	int	fonte = FALSE, hours = FALSE, wall = FALSE, geo = TRUE;
 	int	i, i2, j, k, n, i_source, j_source, ic, jc, is_double = 0, is_single = 0;
-	int	ndatac;
+	int	ndatac, dijkstra = FALSE, n_src = 1, n_work = 1, n_out = 0, s, dims[3];
+	int	nearest = FALSE, n_run, n_rcv = 0, *src, *rcv = NULL, *who = NULL;
 	double	*Z, *z_8, *TT;
-	double	lon_source, lat_source, tmp = DBL_MAX, *pdata, *geog;
+	double	lon_source, lat_source, tmp = DBL_MAX, *pdata, *geog, *r_loc = NULL;
 	double	west = 0.0, east = 0.0, south = 0.0, north = 0.0, x_inc, y_inc, m_NaN, *head, *t_loc;
 	float	*z_4, *tout, k_or_m = 1;
+	char	*opt;
+	struct	TT_GRID G;
+	struct	TT_WORK *W;
+#if HAVE_OPENMP
+	int	n_threads = 0;
+#endif
 
-	if (nlhs != 1 || nrhs == 0) {
+	for (k = 4; k < nrhs; k++) {		/* Receivers and options */
+		if (!mxIsChar(prhs[k])) {
+			if (k == 4 && !mxIsEmpty(prhs[k]) && (mxGetN(prhs[k]) == 2 || mxGetNumberOfElements(prhs[k]) == 2)) {
+				r_loc = mxGetPr(prhs[k]);
+				n_rcv = (mxGetN(prhs[k]) == 2) ? (int)mxGetM(prhs[k]) : 1;
+				dijkstra = TRUE;
+			}
+			else
+				error = TRUE;
+			continue;
+		}
+		opt = mxArrayToString(prhs[k]);
+		if (opt[0] == '-' && opt[1] == 'D')
+			dijkstra = TRUE;
+		else if (opt[0] == '-' && opt[1] == 'M')
+			dijkstra = nearest = TRUE;
+		else if (opt[0] == '-' && opt[1] == 'j') {
+#if HAVE_OPENMP
+			n_threads = atoi(&opt[2]);
+#endif
+		}
+		else
+			error = TRUE;
+		mxFree(opt);
+	}
+
+	if (nlhs < 1 || nlhs > 2 || (nlhs == 2 && !nearest) || nrhs < 4 || error) {
 		mexPrintf ("wave_travel_time - Compute the tsunami travel time (ATTENTION z positive up)\n");
-		mexPrintf ("usage: tt = wave_travel_time(Z,h_info,t_loc,geog)\n\n");
+		mexPrintf ("usage: tt = wave_travel_time(Z,h_info,t_loc,geog[,r_loc][,'-D'][,'-M'][,'-j<n_threads>'])\n");
+		mexPrintf ("       [tt,who] = wave_travel_time(Z,h_info,t_loc,geog[,r_loc],'-M')\n\n");
 		mexPrintf ("where: Z contains a bathymetric array (in Matlab orientation) with z in meters positive up\n");
 		mexPrintf ("       h_info is a vector with [x_min,x_max,y_min,y_max,x_inc,y_inc]\n");
-		mexPrintf ("       t_loc  is a vector with [source_lon,source_lat]\n");
+		mexPrintf ("       t_loc  is a vector with [source_lon,source_lat], or a Nx2 array with N sources\n");
 		mexPrintf ("       geog >= 1 if input array is in geogs, or = 0 if it is in crtesian coordinates\n");
-		mexPrintf ("NOTE1: Input Z can be single or double and Out tt is single\n");
+		mexPrintf ("       r_loc  Mx2 array with the [lon,lat] of M receivers (e.g. tide gauges). If given, tt is\n");
+		mexPrintf ("              a N x M table with the time from each source to each receiver (no grids).\n");
+		mexPrintf ("       -D Dijkstra front propagation on a 16 neighbors stencil instead of the rim expansion.\n");
+		mexPrintf ("          Each node is computed only once. Implied by N > 1 sources, r_loc or -M.\n");
+		mexPrintf ("       -M Earliest arrival from any of the N sources, all propagated at once. tt is then one\n");
+		mexPrintf ("          grid (or a 1 x M table) and the optional who (int32) has the index of that source.\n");
+		mexPrintf ("       -j<n> number of threads among which the N sources are split (OpenMP builds)\n");
+		mexPrintf ("NOTE1: Input Z can be single or double and Out tt is single (ny x nx x N with N sources)\n");
 		mexPrintf ("NOTE2: Input Z array cannot have NaNs\n");
+		mexPrintf ("NOTE3: Times are in hours. NaN (or who = 0) where the waves do not arrive\n");
 		return;
 	}
 
@@ -126,6 +202,11 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 	t_loc = mxGetPr(prhs[2]);	/* Where is the tsunami location? */
 	lon_source = t_loc[0];
 	lat_source = t_loc[1];
+	if (mxGetN(prhs[2]) == 2 && mxGetM(prhs[2]) > 1) {	/* A Nx2 array of sources. Lats are in the 2nd column */
+		n_src = (int)mxGetM(prhs[2]);
+		lat_source = t_loc[n_src];
+		dijkstra = TRUE;
+	}
 	geog = mxGetPr(prhs[3]);	/* Is the grid in geogs? If yes convert from degrees to meters. */
 	if (*geog == 0)
 		geo = FALSE;
@@ -135,12 +216,6 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 	ndatac = nx * ny;
 
 	Z = mxCalloc (nx*ny, sizeof (double));
-	TT = mxCalloc (nx*ny, sizeof (double));
-	rim = (int *) mxCalloc (2*(nx+ny), sizeof(int));
-	rim1 = (int *) mxCalloc (2*(nx+ny), sizeof(int));
-	rim2 = (int *) mxCalloc (8, sizeof(int));
-	rim8 = (int *) mxCalloc (8, sizeof(int));
-	rim16 = (int *) mxCalloc (16, sizeof(int));
 
 	/* Transpose from Matlab orientation to gmt grd orientation */
 	/* I have to do what comes next because the original code was written
@@ -154,12 +229,113 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 			for (j = 0; j < nx; j++) Z[i2*nx+j] = z_4[j*ny+i];
 	}
 
-	for (j = 0; j < ndatac; j++) TT[j] = 1000000;	/* Initialize TT */
-
-
 	/* Compute the velocity field from the bathymetry file (and store it on the same variable) */
 	bat_to_speed(Z, ndatac);
 
+	if (dijkstra) {		/* Everything from the same speed grid and step lengths */
+		G.nx = nx;	G.ny = ny;	G.speed = Z;	G.rcv = NULL;	G.n_rcv = 0;
+		G.dist = (double *) mxCalloc (16*ny, sizeof(double));
+		set_step_lengths (&G, &h, geo);
+
+		src = (int *) mxMalloc (n_src * sizeof(int));	/* Source nodes. -1 if outside the grid */
+		for (s = 0; s < n_src; s++) {
+			i_source = irint((t_loc[s] - west) / x_inc);
+			j_source = irint((north - t_loc[s + ((n_src > 1) ? n_src : 1)]) / y_inc);
+			src[s] = (i_source < 0 || i_source >= nx || j_source < 0 || j_source >= ny) ? -1 : j_source * nx + i_source;
+			if (src[s] < 0) n_out++;
+		}
+		if (n_out)
+			mexPrintf("WAVE_TRAVEL_TIME WARNING: %d source(s) outside the grid. Their times are all NaN\n", n_out);
+
+		if (n_rcv) {			/* Receiver nodes. Same thing, -1 if outside the grid */
+			rcv = (int *) mxMalloc (n_rcv * sizeof(int));
+			G.rcv = (char *) mxCalloc (ndatac, sizeof(char));
+			for (k = 0; k < n_rcv; k++) {
+				ic = irint((r_loc[k] - west) / x_inc);
+				jc = irint((north - r_loc[k + ((n_rcv > 1) ? n_rcv : 1)]) / y_inc);
+				rcv[k] = (ic < 0 || ic >= nx || jc < 0 || jc >= ny) ? -1 : jc * nx + ic;
+				if (rcv[k] >= 0 && !G.rcv[rcv[k]]) {
+					G.rcv[rcv[k]] = 1;
+					G.n_rcv++;
+				}
+			}
+		}
+
+		n_run = (nearest) ? 1 : n_src;		/* Number of front propagations */
+#if HAVE_OPENMP
+		n_work = MIN(((n_threads > 0) ? n_threads : omp_get_max_threads()), n_run);
+#endif
+		W = (struct TT_WORK *) mxCalloc (n_work, sizeof(struct TT_WORK));
+		for (k = 0; k < n_work; k++) {		/* One workspace per thread. Not per source */
+			W[k].tt   = (double *) mxMalloc (ndatac * sizeof(double));
+			W[k].heap = (int *) mxMalloc (ndatac * sizeof(int));
+			W[k].pos  = (int *) mxMalloc (ndatac * sizeof(int));
+			W[k].from = (nearest) ? (int *) mxMalloc (ndatac * sizeof(int)) : NULL;
+		}
+		if (n_rcv) {
+			plhs[0] = mxCreateNumericMatrix (n_run, n_rcv, mxSINGLE_CLASS, mxREAL);
+			if (nlhs == 2) plhs[1] = mxCreateNumericMatrix (1, n_rcv, mxINT32_CLASS, mxREAL);
+		}
+		else {
+			dims[0] = ny;	dims[1] = nx;	dims[2] = n_run;
+			plhs[0] = mxCreateNumericArray ((n_run > 1) ? 3 : 2, dims, mxSINGLE_CLASS, mxREAL);
+			if (nlhs == 2) plhs[1] = mxCreateNumericArray (2, dims, mxINT32_CLASS, mxREAL);
+		}
+		tout = (float *)mxGetData(plhs[0]);
+		if (nlhs == 2) who = (int *)mxGetData(plhs[1]);
+
+#if HAVE_OPENMP
+#pragma omp parallel for schedule(dynamic,1) num_threads(n_work) private(i, j, k)
+#endif
+		for (s = 0; s < n_run; s++) {
+			int	i_th = 0;
+			double	t;
+			float	*tt_s = &tout[(size_t)s * ndatac];
+#if HAVE_OPENMP
+			i_th = omp_get_thread_num();
+#endif
+			if (nearest)
+				dijkstra_travel_time (&G, &W[i_th], src, n_src);
+			else
+				dijkstra_travel_time (&G, &W[i_th], &src[s], 1);
+
+			if (n_rcv) {		/* Only the N x M table. Output is in hours */
+				for (k = 0; k < n_rcv; k++) {
+					t = (rcv[k] < 0) ? DBL_MAX : W[i_th].tt[rcv[k]];
+					tout[k*n_run + s] = (t == DBL_MAX) ? (float)m_NaN : (float)(t / 3600);
+					if (who) who[k] = (t == DBL_MAX) ? 0 : W[i_th].from[rcv[k]] + 1;
+				}
+				continue;
+			}
+			/* Transpose from gmt grd orientation to Matlab orientation. Output is in hours */
+			for (i = 0; i < ny; i++)
+				for (j = 0; j < nx; j++) {
+					t = W[i_th].tt[i*nx+j];
+					tt_s[j*ny+ny-i-1] = (t == DBL_MAX) ? (float)m_NaN : (float)(t / 3600);
+					if (who) who[j*ny+ny-i-1] = (t == DBL_MAX) ? 0 : W[i_th].from[i*nx+j] + 1;
+				}
+		}
+
+		for (k = 0; k < n_work; k++) {
+			mxFree(W[k].tt);	mxFree(W[k].heap);	mxFree(W[k].pos);
+			if (W[k].from) mxFree(W[k].from);
+		}
+		if (n_rcv) {
+			mxFree(rcv);	mxFree(G.rcv);
+		}
+		mxFree(W);	mxFree(src);	mxFree(G.dist);	mxFree(Z);
+		return;
+	}
+
+	TT = mxCalloc (nx*ny, sizeof (double));
+	rim = (int *) mxCalloc (2*(nx+ny), sizeof(int));
+	rim1 = (int *) mxCalloc (2*(nx+ny), sizeof(int));
+	rim2 = (int *) mxCalloc (8, sizeof(int));
+	rim8 = (int *) mxCalloc (8, sizeof(int));
+	rim16 = (int *) mxCalloc (16, sizeof(int));
+
+	for (j = 0; j < ndatac; j++) TT[j] = 1000000;	/* Initialize TT */
+
 	i_source = irint((lon_source - west) / x_inc);
 	j_source = irint((north - lat_source) / y_inc);
 
@@ -368,3 +544,124 @@ void	n_to_ij (int n, int *i, int *j) {
 	*j = n / h.nx;
 	*i = n - *j * h.nx;
 }
+
+/* -------------------------------------------------------------------------------------------- */
+void	set_step_lengths (struct TT_GRID *G, struct HEADER *hdr, int geo) {
+	/* Length in meters of the 16 stencil steps that start at each row. In geogs they only depend on the
+	   latitude of the two rows (haversine formula), so they are computed once for all the sources. */
+	int	j, jc, k;
+	double	lat1, lat2, dlon, a;
+
+	for (j = 0; j < G->ny; j++) {
+		for (k = 0; k < 16; k++) {
+			jc = j + st_dj[k];
+			if (jc < 0 || jc >= G->ny) continue;	/* Step would leave the grid. Never used */
+			if (geo) {
+				lat1 = (hdr->y_max - j * hdr->y_inc) * D2R;
+				lat2 = (hdr->y_max - jc * hdr->y_inc) * D2R;
+				dlon = st_di[k] * hdr->x_inc * D2R;
+				a = sin((lat2 - lat1) / 2) * sin((lat2 - lat1) / 2) +
+				    cos(lat1) * cos(lat2) * sin(dlon / 2) * sin(dlon / 2);
+				G->dist[j*16+k] = 2 * EARTH_RAD * asin(MIN(sqrt(a), 1.0));
+			}
+			else
+				G->dist[j*16+k] = sqrt((st_di[k] * hdr->x_inc) * (st_di[k] * hdr->x_inc) +
+				                       (st_dj[k] * hdr->y_inc) * (st_dj[k] * hdr->y_inc));
+		}
+	}
+}
+
+/* -------------------------------------------------------------------------------------------- */
+void	dijkstra_travel_time (struct TT_GRID *G, struct TT_WORK *W, int *src, int n_src) {
+	/* Dijkstra's shortest time from the src nodes (-1 if outside the grid) over the 16 neighbors stencil.
+	   With several sources they all start at t = 0, so the result is the earliest arrival from any of
+	   them (W->from tells which one). The time of a step is its length over the mean speed of its two
+	   ends (as in set_travel_time). The front node with the earliest time is final, so each node is
+	   expanded only once. Unreached nodes keep DBL_MAX. With receivers (G->rcv) it stops as soon as they
+	   are all final and only their times are meaningful.
+	   Everything lives in G (read only) and W, so several sources may run at the same time. */
+	int	i, j, k, ic, jc, n, ij, nx = G->nx, ny = G->ny, n_left = G->n_rcv;
+	double	t;
+
+	for (ij = 0; ij < nx * ny; ij++) {
+		W->tt[ij] = DBL_MAX;
+		W->pos[ij] = -1;
+	}
+	W->n_heap = 0;
+
+	for (k = 0; k < n_src; k++) {
+		if ((ij = src[k]) < 0 || W->pos[ij] != -1) continue;	/* Outside or repeated */
+		W->tt[ij] = 0;
+		if (W->from) W->from[ij] = k;
+		W->heap[W->n_heap] = ij;	W->pos[ij] = W->n_heap++;	/* All 0, so already a heap */
+	}
+	while (W->n_heap) {
+		ij = W->heap[0];
+		W->pos[ij] = -2;
+		if (G->rcv && G->rcv[ij] && --n_left == 0) break;	/* All receivers are known */
+		if (--W->n_heap) {
+			W->heap[0] = W->heap[W->n_heap];
+			heap_down (W, 0);
+		}
+		j = ij / nx;	i = ij - j * nx;
+		for (k = 0; k < 16; k++) {
+			ic = i + st_di[k];	jc = j + st_dj[k];
+			if (ic < 0 || ic >= nx || jc < 0 || jc >= ny) continue;
+			n = jc * nx + ic;
+			if (W->pos[n] == -2 || !step_is_wet (G, i, j, k)) continue;
+			t = W->tt[ij] + G->dist[j*16+k] / ((G->speed[ij] + G->speed[n]) / 2);
+			if (t >= W->tt[n]) continue;
+			W->tt[n] = t;
+			if (W->from) W->from[n] = W->from[ij];
+			if (W->pos[n] == -1) {		/* A new front node */
+				W->heap[W->n_heap] = n;
+				W->pos[n] = W->n_heap++;
+			}
+			heap_up (W, W->pos[n]);
+		}
+	}
+}
+
+/* -------------------------------------------------------------------------------------------- */
+int	step_is_wet (struct TT_GRID *G, int i, int j, int k) {
+	/* A step must end on water and cannot cross land. A diagonal one cannot go between two land
+	   nodes and a knight move needs the two nodes that it crosses to be water. */
+	int	di = st_di[k], dj = st_dj[k], nx = G->nx;
+	double	*s = G->speed;
+
+	if (s[(j+dj)*nx + i+di] <= 0) return (FALSE);
+	if (k < 4) return (TRUE);
+	if (k < 8) return (s[j*nx + i+di] > 0 || s[(j+dj)*nx + i] > 0);
+	if (dj == 2 || dj == -2) return (s[(j+dj/2)*nx + i] > 0 && s[(j+dj/2)*nx + i+di] > 0);
+	return (s[j*nx + i+di/2] > 0 && s[(j+dj)*nx + i+di/2] > 0);
+}
+
+/* -------------------------------------------------------------------------------------------- */
+void	heap_up (struct TT_WORK *W, int k) {
+	/* Move the heap element k up until its parent is not later than it */
+	int	n = W->heap[k], p;
+	double	t = W->tt[n];
+
+	while (k > 0) {
+		p = (k - 1) / 2;
+		if (W->tt[W->heap[p]] <= t) break;
+		W->heap[k] = W->heap[p];	W->pos[W->heap[k]] = k;
+		k = p;
+	}
+	W->heap[k] = n;		W->pos[n] = k;
+}
+
+/* -------------------------------------------------------------------------------------------- */
+void	heap_down (struct TT_WORK *W, int k) {
+	/* Move the heap element k down until its children are not earlier than it */
+	int	n = W->heap[k], c;
+	double	t = W->tt[n];
+
+	while ((c = 2 * k + 1) < W->n_heap) {
+		if (c + 1 < W->n_heap && W->tt[W->heap[c+1]] < W->tt[W->heap[c]]) c++;
+		if (t <= W->tt[W->heap[c]]) break;
+		W->heap[k] = W->heap[c];	W->pos[W->heap[k]] = k;
+		k = c;
+	}
+	W->heap[k] = n;		W->pos[n] = k;
+}